@@ -0,0 +1,265 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <unistd.h>
+#include "../src/filesystem.h"
+#include "../pc/pcstorage.h"
+
+using namespace File;
+
+// the same personalization workload for all the storage backends
+static const uint32_t PersonalizationRounds = 20;
+
+struct PersonalizationFile {
+    KeyID_t FileID;
+    FileType Type;
+    size_t Size;
+};
+
+static const PersonalizationFile PersonalizationFiles[] = {
+    {0x5b,   FileType::File,   9},   // name
+    {0x5f2d, FileType::File,   2},   // language
+    {0x5f35, FileType::File,   1},   // sex
+    {0x5f50, FileType::File,   32},  // url
+    {0x5e,   FileType::File,   8},   // login
+    {0xc7,   FileType::File,   20},  // fingerprints
+    {0xc8,   FileType::File,   20},
+    {0xc9,   FileType::File,   20},
+    {0xce,   FileType::File,   4},   // generation dates
+    {0xcf,   FileType::File,   4},
+    {0xd0,   FileType::File,   4},
+    {0xb6,   FileType::Secure, 600}, // keys
+    {0xb8,   FileType::Secure, 600},
+    {0xa4,   FileType::Secure, 600},
+};
+
+static void FillFile(std::vector<uint8_t> &data, uint32_t round, KeyID_t id) {
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (i + round * 7 + id) & 0xff;
+}
+
+static double Personalize(FileStorage &storage, const char *name, FileIOStatistic *ioStatistic = nullptr) {
+    FileSystem fs;
+    fs.SetStorage(&storage);
+
+    uint8_t _data[1024] = {0};
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t round = 0; round < PersonalizationRounds; round++) {
+        EXPECT_EQ(fs.BeginTransaction(), Util::Error::NoError);
+        for (auto &file : PersonalizationFiles) {
+            std::vector<uint8_t> vdata(file.Size);
+            FillFile(vdata, round, file.FileID);
+            bstr data(vdata.data(), vdata.size(), vdata.size());
+            EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, file.FileID, file.Type, data), Util::Error::NoError);
+        }
+        EXPECT_EQ(fs.CommitTransaction(), Util::Error::NoError);
+
+        for (auto &file : PersonalizationFiles) {
+            std::vector<uint8_t> vdata(file.Size);
+            FillFile(vdata, round, file.FileID);
+            bstr data(_data, 0, sizeof(_data));
+            EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, file.FileID, file.Type, data), Util::Error::NoError);
+            EXPECT_TRUE(data == bstr(vdata.data(), vdata.size()));
+        }
+    }
+
+    std::chrono::duration<double, std::micro> time = std::chrono::steady_clock::now() - start;
+    printf("%-16s %10.0f us  %8.1f us/round\n", name, time.count(), time.count() / PersonalizationRounds);
+    if (ioStatistic)
+        *ioStatistic = fs.getGenFiles().getIOStatistic();
+    return time.count();
+}
+
+TEST(filestorageTest, BenchmarkRAM) {
+    MemoryFileStorage storage;
+    ASSERT_EQ(storage.Init(2048 * 10), 0);
+    Personalize(storage, "ram");
+}
+
+TEST(filestorageTest, BenchmarkMmap) {
+    const char *fileName = "/tmp/opgptest_storage.mmap";
+    remove(fileName);
+    {
+        MemoryFileStorage storage;
+        ASSERT_EQ(storage.Init(fileName, 2048 * 10), 0);
+        Personalize(storage, "mmap");
+    }
+
+    // files persist in the file
+    MemoryFileStorage storage;
+    ASSERT_EQ(storage.Init(fileName, 2048 * 10), 0);
+    EXPECT_TRUE(storage.FileExist((char *)"2_91_0"));
+    remove(fileName);
+}
+
+// only the changed pages are synced. the mode says when.
+TEST(filestorageTest, RegionSync) {
+    const char *fileName = "/tmp/opgptest_region.mmap";
+    remove(fileName);
+    MemoryRegion region;
+    size_t page = sysconf(_SC_PAGESIZE);
+    ASSERT_NE(region.Map(fileName, page * 64, 0xff), nullptr);
+
+    region.Syncs = 0;
+    region.Sync(10, 20);
+    EXPECT_EQ(region.Syncs, 1U);
+
+    // dirty pages wait for the end of the command. the adjacent ones go with one msync.
+    region.SetSyncMode(SyncMode::Command);
+    region.Sync(page * 3, 10);
+    region.Sync(page * 4 - 5, 10);
+    region.Sync(page * 40, page * 2);
+    EXPECT_EQ(region.Syncs, 1U);
+    region.Flush();
+    EXPECT_EQ(region.Syncs, 3U);
+    region.Flush();
+    EXPECT_EQ(region.Syncs, 3U);
+
+    region.SetSyncMode(SyncMode::Periodic, 60000);
+    region.Sync(0, 10);
+    region.Idle();
+    EXPECT_EQ(region.Syncs, 3U);
+    region.SetSyncMode(SyncMode::Periodic, 0);
+    region.Idle();
+    EXPECT_EQ(region.Syncs, 4U);
+    region.Close();
+
+    // image bigger than the default one
+    MemoryFileStorage storage;
+    ASSERT_EQ(storage.Init(fileName, 1024 * 1024), 0);
+    storage.GetRegion().SetSyncMode(SyncMode::Command);
+    uint8_t data[100000] = {0};
+    EXPECT_EQ(storage.WriteFile((char *)"big", data, sizeof(data)), 0);
+    EXPECT_EQ(storage.Flush(), 0);
+    remove(fileName);
+}
+
+TEST(filestorageTest, BenchmarkDir) {
+    DirFileStorage storage("/tmp/opgptest_data/");
+    storage.DeleteFiles((char *)"*");
+    Personalize(storage, "dir");
+
+    // GET DATA is one file read: open, read and close
+    FileSystem fs;
+    fs.SetStorage(&storage);
+    uint8_t _data[1024] = {0};
+    const uint32_t Reads = 100;
+    uint32_t syscalls = storage.Syscalls;
+    for (uint32_t i = 0; i < Reads; i++) {
+        bstr data(_data, 0, sizeof(_data));
+        EXPECT_EQ(fs.getGenFiles().ReadFile(AppID::OpenPGP, 0xc7, FileType::File, data), Util::Error::NoError);
+        EXPECT_EQ(data.length(), 20U);
+    }
+    printf("dir syscalls per GET DATA %.1f\n", (double)(storage.Syscalls - syscalls) / Reads);
+    EXPECT_EQ(storage.Syscalls - syscalls, Reads * 3);
+
+    // write replaces the file at once and leaves no temp file
+    uint8_t wdata[4] = {1, 2, 3, 4};
+    EXPECT_EQ(storage.WriteFile((char *)"2_199_0", wdata, sizeof(wdata)), 0);
+    EXPECT_FALSE(storage.FileExist((char *)"2_199_0.tmp"));
+    size_t len = 0;
+    EXPECT_EQ(storage.ReadFile((char *)"2_199_0", _data, sizeof(_data), &len), 0);
+    EXPECT_EQ(len, sizeof(wdata));
+    EXPECT_EQ(storage.ReadFile((char *)"nofile", _data, sizeof(_data), &len), 1);
+
+    storage.DeleteFiles((char *)"*");
+    EXPECT_FALSE(storage.FileExist((char *)"2_199_0"));
+}
+
+TEST(filestorageTest, BenchmarkStm32fsRAM) {
+    Stm32fsImageStorage storage;
+    ASSERT_EQ(storage.Init(), 0);
+    FileIOStatistic ioStatistic;
+    Personalize(storage, "stm32fs ram", &ioStatistic);
+    printf("flash writes %u erases %u\n", storage.FlashWrites, storage.FlashErases);
+    ioStatistic.Print();
+
+    // keys take the most of flash. optimizations run on transaction begin.
+    auto &key = ioStatistic.GetCounter(AppID::OpenPGP, 0xb6, FileType::Secure);
+    auto &sex = ioStatistic.GetCounter(AppID::OpenPGP, 0x5f35, FileType::File);
+    EXPECT_EQ(key.Writes, PersonalizationRounds);
+    EXPECT_GE(key.FlashBytesWritten, key.BytesWritten);
+    EXPECT_GT(key.FlashBytesWritten, sex.FlashBytesWritten);
+    EXPECT_GT(ioStatistic.GetOther().Optimizations, 0U);
+    EXPECT_EQ(ioStatistic.GetOther().Optimizations, storage.GetFs()->GetIOCounters().Optimizations);
+}
+
+// layout of the device: one block, so the optimizations are made in place
+TEST(filestorageTest, BenchmarkStm32fsDevice) {
+    Stm32fsImageStorage storage;
+    storage.SetLayout(ImageLayout::Device);
+    ASSERT_EQ(storage.Init(), 0);
+    ASSERT_EQ(storage.GetRegion().Size(), 6 * BlockSize);
+    EXPECT_TRUE(storage.GetFs()->isCountersEnabled());
+    Personalize(storage, "stm32fs device");
+    printf("flash writes %u erases %u optimizations %u\n", storage.FlashWrites, storage.FlashErases,
+           storage.GetFs()->GetIOCounters().Optimizations);
+    EXPECT_GT(storage.GetFs()->GetIOCounters().Optimizations, 0U);
+}
+
+// bigger sectors: the same workload with less optimizations
+TEST(filestorageTest, BenchmarkStm32fs4K) {
+    uint32_t optimizations[2] = {0};
+    size_t sectors[2] = {BlockSize, 4096};
+    for (int i = 0; i < 2; i++) {
+        Stm32fsImageStorage storage;
+        ASSERT_EQ(storage.Init(sectors[i]), 0);
+        std::string name = "stm32fs " + std::to_string(sectors[i]);
+        Personalize(storage, name.c_str());
+        optimizations[i] = storage.GetFs()->GetIOCounters().Optimizations;
+        printf("flash writes %u erases %u optimizations %u\n", storage.FlashWrites, storage.FlashErases, optimizations[i]);
+    }
+    EXPECT_LT(optimizations[1], optimizations[0]);
+}
+
+TEST(filestorageTest, BenchmarkStm32fsMmap) {
+    const char *fileName = "/tmp/opgptest_stm32fs.img";
+    remove(fileName);
+    {
+        Stm32fsImageStorage storage;
+        ASSERT_EQ(storage.Init(fileName), 0);
+        Personalize(storage, "stm32fs mmap");
+        printf("flash writes %u erases %u\n", storage.FlashWrites, storage.FlashErases);
+    }
+
+    // image mounts again with the files from the last round
+    Stm32fsImageStorage storage;
+    ASSERT_EQ(storage.Init(fileName), 0);
+    uint8_t _data[1024] = {0};
+    size_t size = 0;
+    EXPECT_EQ(storage.ReadFile((char *)"2_91_0", _data, sizeof(_data), &size), 0);
+    EXPECT_EQ(size, 9U);
+    remove(fileName);
+}
+
+// reset of the application is one catalog record for all its files
+TEST(filestorageTest, Stm32fsFactoryReset) {
+    Stm32fsImageStorage storage;
+    ASSERT_EQ(storage.Init(), 0);
+    Personalize(storage, "stm32fs reset");
+
+    FileSystem fs;
+    fs.SetStorage(&storage);
+    uint8_t _data[16] = {1};
+    bstr test(_data, sizeof(_data), sizeof(_data));
+    EXPECT_EQ(fs.WriteFile(AppID::Test, 1, FileType::File, test), Util::Error::NoError);
+
+    EXPECT_EQ(fs.Flush(), Util::Error::NoError);
+    uint32_t writes = storage.FlashWrites;
+    EXPECT_EQ(fs.DeleteFiles(AppID::OpenPGP), Util::Error::NoError);
+    EXPECT_EQ(fs.Flush(), Util::Error::NoError);
+    EXPECT_EQ(storage.FlashWrites, writes + 1);
+
+    // config area and composite tags give defaults, so check the storage files
+    uint8_t _rdata[1024] = {0};
+    for (auto &file : PersonalizationFiles) {
+        bstr data(_rdata, 0, sizeof(_rdata));
+        EXPECT_EQ(fs.getGenFiles().ReadFile(AppID::OpenPGP, file.FileID, file.Type, data), Util::Error::FileNotFound);
+    }
+    bstr data(_rdata, 0, sizeof(_rdata));
+    EXPECT_EQ(fs.getGenFiles().ReadFile(AppID::Test, 1, FileType::File, data), Util::Error::NoError);
+}
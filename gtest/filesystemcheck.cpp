@@ -0,0 +1,415 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <map>
+#include <vector>
+#include <cstring>
+#include <fnmatch.h>
+#include "../src/filesystem.h"
+#include "../src/filestorage.h"
+#include "../pc/pcstorage.h"
+
+using namespace File;
+
+// generic file system storage over the std::map
+class MapFileStorage : public FileStorage {
+public:
+    std::map<std::string, std::vector<uint8_t>> files;
+    // storage state at the transaction begin
+    std::map<std::string, std::vector<uint8_t>> snapshot;
+    uint32_t lookups = 0;
+
+    bool FileExist(char* name) {
+        lookups++;
+        return files.count(name) > 0;
+    }
+
+    int ReadFile(char* name, uint8_t * buf, size_t max_size, size_t *size) {
+        lookups++;
+        auto it = files.find(name);
+        if (it == files.end() || it->second.size() > max_size)
+            return 1;
+
+        std::memcpy(buf, it->second.data(), it->second.size());
+        *size = it->second.size();
+        return 0;
+    }
+
+    int ReadFilePtr(char* name, uint8_t **ptr, size_t *size) {
+        lookups++;
+        auto it = files.find(name);
+        if (it == files.end())
+            return 1;
+
+        *ptr = it->second.data();
+        *size = it->second.size();
+        return 0;
+    }
+
+    int WriteFile(char* name, uint8_t * buf, size_t size) {
+        files[name] = std::vector<uint8_t>(buf, buf + size);
+        return 0;
+    }
+
+    int DeleteFile(char* name) {
+        return files.erase(name) ? 0 : 1;
+    }
+
+    int DeleteFiles(char* name) {
+        for (auto it = files.begin(); it != files.end();)
+            if (fnmatch(name, it->first.c_str(), 0) == 0)
+                it = files.erase(it);
+            else
+                ++it;
+        return 0;
+    }
+
+    int BeginTransaction() {
+        snapshot = files;
+        return 0;
+    }
+
+    int CommitTransaction() {
+        snapshot.clear();
+        return 0;
+    }
+
+    int AbortTransaction() {
+        files = snapshot;
+        return 0;
+    }
+};
+
+static MapFileStorage storage;
+
+static void ClearStorage(FileSystem &fs) {
+    storage.files.clear();
+    storage.lookups = 0;
+    fs.SetStorage(&storage);
+}
+
+TEST(filesystemTest, ReadDefaults) {
+    FileSystem fs;
+    ClearStorage(fs);
+
+    uint8_t _data[1024] = {0};
+    bstr data(_data, 0, sizeof(_data));
+
+    // first read goes to storage (read and the check that the file isn't there),
+    // the next ones are answered by cache
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x5f2d, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(storage.lookups, 2U);
+    for (int i = 0; i < 10; i++)
+        EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x5f2d, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(storage.lookups, 2U);
+
+    // not in storage and not in config
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x0101, FileType::File, data), Util::Error::FileNotFound);
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x0101, FileType::File, data), Util::Error::FileNotFound);
+    EXPECT_EQ(storage.lookups, 4U);
+
+    // file that doesn't fit into the buffer is not absent. FileSystem keeps the config fallback.
+    auto name = "Doe<<John"_bstr;
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x5b, FileType::File, name), Util::Error::NoError);
+    uint8_t _small[4] = {0};
+    bstr small(_small, 0, sizeof(_small));
+    EXPECT_EQ(fs.getGenFiles().ReadFile(AppID::OpenPGP, 0x5b, FileType::File, small), Util::Error::OutOfMemory);
+    EXPECT_TRUE(fs.getGenFiles().FileExist(AppID::OpenPGP, 0x5b, FileType::File));
+    small = bstr(_small, 0, sizeof(_small));
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x5b, FileType::File, small), Util::Error::NoError);
+    EXPECT_EQ(small.length(), 0U);
+    EXPECT_TRUE(fs.getGenFiles().FileExist(AppID::OpenPGP, 0x5b, FileType::File));
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x5b, FileType::File, data), Util::Error::NoError);
+    EXPECT_TRUE(data == name);
+}
+
+TEST(filesystemTest, WriteDelete) {
+    FileSystem fs;
+    ClearStorage(fs);
+
+    uint8_t _data[1024] = {0};
+    bstr data(_data, 0, sizeof(_data));
+
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x5b, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(data.length(), 0U);
+
+    auto name = "Doe<<John"_bstr;
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x5b, FileType::File, name), Util::Error::NoError);
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x5b, FileType::File, data), Util::Error::NoError);
+    EXPECT_TRUE(data == name);
+    EXPECT_TRUE(fs.getGenFiles().FileExist(AppID::OpenPGP, 0x5b, FileType::File));
+
+    EXPECT_EQ(fs.DeleteFile(AppID::OpenPGP, 0x5b, FileType::File), Util::Error::NoError);
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x5b, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(data.length(), 0U);
+    EXPECT_FALSE(fs.getGenFiles().FileExist(AppID::OpenPGP, 0x5b, FileType::File));
+
+    // cache must not hide the file that was written after delete of all the files
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x5b, FileType::File, name), Util::Error::NoError);
+    EXPECT_EQ(fs.WriteFile(AppID::Test, 0x5b, FileType::File, name), Util::Error::NoError);
+    EXPECT_EQ(fs.DeleteFiles(AppID::OpenPGP), Util::Error::NoError);
+    EXPECT_FALSE(fs.getGenFiles().FileExist(AppID::OpenPGP, 0x5b, FileType::File));
+    EXPECT_TRUE(fs.getGenFiles().FileExist(AppID::Test, 0x5b, FileType::File));
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x5b, FileType::File, name), Util::Error::NoError);
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x5b, FileType::File, data), Util::Error::NoError);
+    EXPECT_TRUE(data == name);
+}
+
+TEST(filesystemTest, CacheHitRatio) {
+    FileSystem fs;
+    ClearStorage(fs);
+    fs.getGenFiles().getCache().GetStatistic().Clear();
+
+    uint8_t _data[1024] = {0};
+    bstr data(_data, 0, sizeof(_data));
+
+    // gpg --card-status: cardholder and application related data several times
+    for (int i = 0; i < 10; i++) {
+        EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x65, FileType::File, data), Util::Error::NoError);
+        EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x6e, FileType::File, data), Util::Error::NoError);
+        EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x7a, FileType::File, data), Util::Error::NoError);
+        EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x5f50, FileType::File, data), Util::Error::NoError);
+    }
+
+    auto &stat = fs.getGenFiles().getCache().GetStatistic();
+    stat.Print();
+    // the files are not in the storage: read and the check on every miss
+    EXPECT_EQ(stat.Misses * 2, storage.lookups);
+    EXPECT_GT(stat.Hits, stat.Misses * 5);
+}
+
+TEST(filesystemTest, Transaction) {
+    FileSystem fs;
+    ClearStorage(fs);
+
+    uint8_t _data[1024] = {0};
+    bstr data(_data, 0, sizeof(_data));
+    auto name = "Doe<<John"_bstr;
+    auto lang = "en"_bstr;
+
+    EXPECT_EQ(fs.BeginTransaction(), Util::Error::NoError);
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x5b, FileType::File, name), Util::Error::NoError);
+    // nested
+    EXPECT_EQ(fs.BeginTransaction(), Util::Error::NoError);
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x5f2d, FileType::File, lang), Util::Error::NoError);
+    EXPECT_EQ(fs.CommitTransaction(), Util::Error::NoError);
+    EXPECT_TRUE(fs.isTransactionActive());
+    EXPECT_EQ(fs.CommitTransaction(), Util::Error::NoError);
+    EXPECT_FALSE(fs.isTransactionActive());
+    EXPECT_EQ(fs.CommitTransaction(), Util::Error::InternalError);
+
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x5f2d, FileType::File, data), Util::Error::NoError);
+    EXPECT_TRUE(data == lang);
+
+    // abort must roll back the storage and the presence cache
+    EXPECT_EQ(fs.BeginTransaction(), Util::Error::NoError);
+    EXPECT_EQ(fs.DeleteFile(AppID::OpenPGP, 0x5b, FileType::File), Util::Error::NoError);
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x5e, FileType::File, name), Util::Error::NoError);
+    fs.AbortTransaction();
+    EXPECT_FALSE(fs.isTransactionActive());
+
+    EXPECT_TRUE(fs.getGenFiles().FileExist(AppID::OpenPGP, 0x5b, FileType::File));
+    EXPECT_FALSE(fs.getGenFiles().FileExist(AppID::OpenPGP, 0x5e, FileType::File));
+
+    // abort of the nested level rolls back the outer one too
+    EXPECT_EQ(fs.BeginTransaction(), Util::Error::NoError);
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x5e, FileType::File, name), Util::Error::NoError);
+    EXPECT_EQ(fs.BeginTransaction(), Util::Error::NoError);
+    fs.AbortTransaction();
+    EXPECT_TRUE(fs.isTransactionActive());
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x5f2d, FileType::File, name), Util::Error::FileWriteError);
+    EXPECT_EQ(fs.CommitTransaction(), Util::Error::FileWriteError);
+    EXPECT_FALSE(fs.isTransactionActive());
+    EXPECT_FALSE(fs.getGenFiles().FileExist(AppID::OpenPGP, 0x5e, FileType::File));
+
+    // the next one works
+    EXPECT_EQ(fs.BeginTransaction(), Util::Error::NoError);
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x5e, FileType::File, name), Util::Error::NoError);
+    EXPECT_EQ(fs.CommitTransaction(), Util::Error::NoError);
+    EXPECT_TRUE(fs.getGenFiles().FileExist(AppID::OpenPGP, 0x5e, FileType::File));
+}
+
+TEST(filesystemTest, ReadFileView) {
+    FileSystem fs;
+    ClearStorage(fs);
+
+    uint8_t _data[64] = {0};
+    bstr data(_data, 0, sizeof(_data));
+
+    // big file doesn't need a big buffer
+    std::vector<uint8_t> cert(2048, 0x5a);
+    bstr scert(cert.data(), cert.size(), cert.size());
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x7f21, FileType::File, scert), Util::Error::NoError);
+    EXPECT_EQ(fs.ReadFileView(AppID::OpenPGP, 0x7f21, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(data.length(), 2048U);
+    EXPECT_EQ(data.uint8Data(), storage.files["2_32545_0"].data());
+
+    // defaults from config area go to the buffer
+    data = bstr(_data, 0, sizeof(_data));
+    EXPECT_EQ(fs.ReadFileView(AppID::OpenPGP, 0x5f35, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(data.uint8Data(), _data);
+    EXPECT_TRUE(data == "\x39"_bstr);
+
+    // composite file is built from views
+    auto name = "Doe<<John"_bstr;
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x5b, FileType::File, name), Util::Error::NoError);
+    data = bstr(_data, 0, sizeof(_data));
+    EXPECT_EQ(fs.ReadFileView(AppID::OpenPGP, 0x65, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(data.uint8Data(), _data);
+    EXPECT_TRUE(data == "\x5b\x09" "Doe<<John" "\x5f\x2d\x00\x5f\x35\x01\x39"_bstr);
+}
+
+TEST(filesystemTest, IOStatistic) {
+    FileSystem fs;
+    ClearStorage(fs);
+    auto &stat = fs.getGenFiles().getIOStatistic();
+    stat.Clear();
+
+    uint8_t _data[1024] = {0};
+    bstr data(_data, 0, sizeof(_data));
+    auto name = "Doe<<John"_bstr;
+
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x5b, FileType::File, name), Util::Error::NoError);
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x5b, FileType::File, name), Util::Error::NoError);
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x5b, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(fs.DeleteFile(AppID::OpenPGP, 0x5b, FileType::File), Util::Error::NoError);
+
+    auto &counter = stat.GetCounter(AppID::OpenPGP, 0x5b, FileType::File);
+    EXPECT_EQ(counter.Reads, 1U);
+    EXPECT_EQ(counter.Writes, 3U);
+    EXPECT_EQ(counter.BytesWritten, 18U);
+
+    // vendor DO: version, count, presence cache hits, negative hits, misses, `other` and the file
+    auto &presence = fs.getGenFiles().getCache().GetStatistic();
+    data = bstr(_data, 0, sizeof(_data));
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, VendorFileID::IOStatistic, FileType::File, data), Util::Error::NoError);
+    ASSERT_EQ(data.length(), 2U + 12U + 28U * 2);
+    EXPECT_EQ(data[0], 0x02);
+    EXPECT_EQ(data[1], 2);
+    EXPECT_EQ(data.get_uint_be(2, 4), presence.Hits);
+    EXPECT_EQ(data.get_uint_be(6, 4), presence.NegativeHits);
+    EXPECT_EQ(data.get_uint_be(10, 4), presence.Misses);
+    EXPECT_GT(presence.Hits + presence.Misses, 0U);
+    EXPECT_EQ(data.get_uint_be(14 + 28 + 1, 2), 0x5bU);
+    EXPECT_EQ(data.get_uint_be(14 + 28 + 8, 4), 3U);
+
+    // small buffer gets the files that fit
+    uint8_t _small[50] = {0};
+    bstr small(_small, 0, sizeof(_small));
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, VendorFileID::IOStatistic, FileType::File, small), Util::Error::NoError);
+    EXPECT_EQ(small.length(), 2U + 12U + 28U);
+    EXPECT_EQ(small[1], 1);
+}
+
+TEST(filesystemTest, CounterFiles) {
+    Stm32fsImageStorage stm32storage;
+    ASSERT_EQ(stm32storage.Init(), 0);
+    FileSystem fs;
+    fs.SetStorage(&stm32storage);
+    Stm32fs *stm32fs = stm32storage.GetFs();
+    ASSERT_TRUE(stm32fs->isCountersEnabled());
+
+    uint8_t _data[64] = {0};
+    bstr data(_data, 0, sizeof(_data));
+    uint8_t _cnt[] = {0x93, 0x03, 0x00, 0x00, 0x00};
+    bstr cnt(_cnt, sizeof(_cnt), sizeof(_cnt));
+
+    // the first write makes the file, the next ones change only the counter and don't read the file
+    for (uint32_t i = 1; i <= 300; i++) {
+        cnt.set_uint_be(2, 3, i);
+        uint32_t writes = stm32fs->GetIOCounters().Writes;
+        uint32_t reads = stm32fs->GetIOCounters().Reads;
+        EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x7a, FileType::File, cnt), Util::Error::NoError);
+        EXPECT_EQ(fs.Flush(), Util::Error::NoError);
+        if (i > 1 && i != 256) {
+            EXPECT_EQ(stm32fs->GetIOCounters().Writes, writes + 1);
+            EXPECT_EQ(stm32fs->GetIOCounters().Reads, reads);
+        }
+    }
+    EXPECT_EQ(stm32fs->GetIOCounters().Optimizations, 0U);
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x7a, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(data.get_uint_be(2, 3), 300U);
+    EXPECT_EQ(data[0], 0x93);
+
+    // view is built in the buffer
+    data = bstr(_data, 0, sizeof(_data));
+    EXPECT_EQ(fs.ReadFileView(AppID::OpenPGP, 0x7a, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(data.get_uint_be(2, 3), 300U);
+
+    // deleted file gives the default. the next write makes the file again.
+    EXPECT_EQ(fs.DeleteFile(AppID::OpenPGP, 0x7a, FileType::File), Util::Error::NoError);
+    data = bstr(_data, 0, sizeof(_data));
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x7a, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(data.get_uint_be(2, 3), 0U);
+    cnt.set_uint_be(2, 3, 1);
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0x7a, FileType::File, cnt), Util::Error::NoError);
+    data = bstr(_data, 0, sizeof(_data));
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0x7a, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(data.get_uint_be(2, 3), 1U);
+
+    // other part of the file changed: file and counter are written
+    uint8_t _pw[] = {0x01, 0x7f, 0x7f, 0x7f, 0x03, 0x00, 0x03};
+    bstr pw(_pw, sizeof(_pw), sizeof(_pw));
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0xc4, FileType::File, pw, true), Util::Error::NoError);
+    _pw[6] = 0x02;
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0xc4, FileType::File, pw, true), Util::Error::NoError);
+    _pw[0] = 0x00;
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0xc4, FileType::File, pw, true), Util::Error::NoError);
+    data = bstr(_data, 0, sizeof(_data));
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0xc4, FileType::File, data), Util::Error::NoError);
+    EXPECT_TRUE(data == pw);
+    EXPECT_EQ(stm32fs->FileLength("2_196_0"), 7);
+}
+
+// password and its counter are changed together (Security::SetPasswd)
+TEST(filesystemTest, CounterTransaction) {
+    Stm32fsImageStorage stm32storage;
+    ASSERT_EQ(stm32storage.Init(), 0);
+    FileSystem fs;
+    fs.SetStorage(&stm32storage);
+    ASSERT_TRUE(stm32storage.GetFs()->isCountersEnabled());
+
+    uint8_t _data[64] = {0};
+    bstr data(_data, 0, sizeof(_data));
+    uint8_t _pw[] = {0x01, 0x7f, 0x7f, 0x7f, 0x03, 0x00, 0x03};
+    bstr pw(_pw, sizeof(_pw), sizeof(_pw));
+    auto pw1 = "123456"_bstr;
+    auto newpw1 = "654321"_bstr;
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, SecureFileID::PW1, FileType::Secure, pw1), Util::Error::NoError);
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0xc4, FileType::File, pw, true), Util::Error::NoError);
+    // wrong PW1: only the counter is written
+    _pw[4] = 0x02;
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0xc4, FileType::File, pw, true), Util::Error::NoError);
+
+    // aborted password change keeps the retry counter
+    _pw[4] = 0x03;
+    EXPECT_EQ(fs.BeginTransaction(), Util::Error::NoError);
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, SecureFileID::PW1, FileType::Secure, newpw1), Util::Error::NoError);
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0xc4, FileType::File, pw, true), Util::Error::NoError);
+    // transaction reads its own counter
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0xc4, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(data[4], 0x03);
+    fs.AbortTransaction();
+
+    data = bstr(_data, 0, sizeof(_data));
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, 0xc4, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(data[4], 0x02);
+    data = bstr(_data, 0, sizeof(_data));
+    EXPECT_EQ(fs.ReadFile(AppID::OpenPGP, SecureFileID::PW1, FileType::Secure, data), Util::Error::NoError);
+    EXPECT_TRUE(data == pw1);
+
+    // commit writes both
+    EXPECT_EQ(fs.BeginTransaction(), Util::Error::NoError);
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, SecureFileID::PW1, FileType::Secure, newpw1), Util::Error::NoError);
+    EXPECT_EQ(fs.WriteFile(AppID::OpenPGP, 0xc4, FileType::File, pw, true), Util::Error::NoError);
+    EXPECT_EQ(fs.CommitTransaction(), Util::Error::NoError);
+
+    FileSystem fs2;
+    fs2.SetStorage(&stm32storage);
+    data = bstr(_data, 0, sizeof(_data));
+    EXPECT_EQ(fs2.ReadFile(AppID::OpenPGP, 0xc4, FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(data[4], 0x03);
+    data = bstr(_data, 0, sizeof(_data));
+    EXPECT_EQ(fs2.ReadFile(AppID::OpenPGP, SecureFileID::PW1, FileType::Secure, data), Util::Error::NoError);
+    EXPECT_TRUE(data == newpw1);
+}
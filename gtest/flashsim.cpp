@@ -0,0 +1,85 @@
+#include "flashsim.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+FlashSim::FlashSim(size_t sectors, size_t sector, FlashSimTiming simTiming) {
+    sectorSize = sector;
+    timing = simTiming;
+    mem.assign(sectors * sectorSize, 0xff);
+    programmed.assign(mem.size() / WordSize, false);
+    erases.assign(sectors, 0);
+}
+
+void FlashSim::Attach(Stm32fsConfig_t &cfg) {
+    cfg.BaseBlockAddress = (size_t)mem.data();
+    cfg.SectorSize = sectorSize;
+    cfg.fnEraseFlashBlock = [this](uint16_t sector){return Erase(sector);};
+    cfg.fnWriteFlash = [this](uint32_t address, uint8_t *data, size_t len){return Write(address, data, len);};
+    cfg.fnReadFlash = [this](uint32_t address, uint8_t *data, size_t len){return Read(address, data, len);};
+}
+
+bool FlashSim::Erase(uint16_t sector) {
+    if (sector >= erases.size())
+        return false;
+
+    time += timing.EraseTime;
+    erases[sector]++;
+    std::memset(&mem[sector * sectorSize], 0xff, sectorSize);
+    std::fill(programmed.begin() + sector * sectorSize / WordSize,
+              programmed.begin() + (sector + 1) * sectorSize / WordSize, false);
+    return true;
+}
+
+// the rest of a partly written double word stays 0xff, but it can't be programmed again
+bool FlashSim::Write(uint32_t address, uint8_t *data, size_t len) {
+    if (len == 0)
+        return true;
+    if (address + len > mem.size())
+        return false;
+
+    size_t first = address / WordSize;
+    size_t last = (address + len - 1) / WordSize;
+    for (size_t i = first; i <= last; i++)
+        if (programmed[i]) {
+            programErrors++;
+            return false;
+        }
+
+    programs++;
+    time += (last - first + 1) * timing.ProgramTime;
+    std::memcpy(&mem[address], data, len);
+    std::fill(programmed.begin() + first, programmed.begin() + last + 1, true);
+    return true;
+}
+
+bool FlashSim::Read(uint32_t address, uint8_t *data, size_t len) {
+    if (address + len > mem.size())
+        return false;
+
+    std::memcpy(data, &mem[address], len);
+    return true;
+}
+
+uint32_t FlashSim::GetEraseCount(uint16_t sector) {
+    if (sector >= erases.size())
+        return 0;
+    return erases[sector];
+}
+
+uint32_t FlashSim::GetMaxEraseCount() {
+    return *std::max_element(erases.begin(), erases.end());
+}
+
+uint32_t FlashSim::GetTotalErases() {
+    uint32_t total = 0;
+    for (auto count : erases)
+        total += count;
+    return total;
+}
+
+void FlashSim::Print() {
+    printf("flash sim: time %.1f ms programs %u errors %u erases %u max per sector %u\n",
+           time / 1000.0, programs, programErrors, GetTotalErases(), GetMaxEraseCount());
+}
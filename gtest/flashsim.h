@@ -0,0 +1,55 @@
+#ifndef GTEST_FLASHSIM_H_
+#define GTEST_FLASHSIM_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "../libs/stm32fs/stm32fs.h"
+
+// STM32L432 by default: page erase 22 ms, double word program 82 us. reads are memory-mapped.
+struct FlashSimTiming {
+    uint32_t EraseTime = 22000;   // us per sector
+    uint32_t ProgramTime = 82;    // us per double word
+};
+
+// simulated NOR flash for Stm32fs. it is programmed by double words and a double word can be
+// programmed only once after the erase. wrong program is refused and counted like PROGERR of STM32.
+class FlashSim {
+private:
+    static const size_t WordSize = 8;
+
+    std::vector<uint8_t> mem;
+    std::vector<bool> programmed;   // by double word
+    std::vector<uint32_t> erases;   // by sector
+    size_t sectorSize;
+    FlashSimTiming timing;
+
+    uint64_t time = 0;
+    uint32_t programs = 0;
+    uint32_t programErrors = 0;
+public:
+    FlashSim(size_t sectors, size_t sector = BlockSize, FlashSimTiming simTiming = {});
+
+    // base address, sector size and the callbacks of the config
+    void Attach(Stm32fsConfig_t &cfg);
+
+    bool Erase(uint16_t sector);
+    bool Write(uint32_t address, uint8_t *data, size_t len);
+    bool Read(uint32_t address, uint8_t *data, size_t len);
+
+    uint8_t *Data() {return mem.data();};
+    size_t Size() {return mem.size();};
+
+    // simulated time in us since the start or the reset
+    uint64_t GetTime() {return time;};
+    void ResetTime() {time = 0;};
+
+    uint32_t GetPrograms() {return programs;};
+    uint32_t GetProgramErrors() {return programErrors;};
+    uint32_t GetEraseCount(uint16_t sector);
+    uint32_t GetMaxEraseCount();
+    uint32_t GetTotalErases();
+    void Print();
+};
+
+#endif  // GTEST_FLASHSIM_H_
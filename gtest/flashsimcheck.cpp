@@ -0,0 +1,182 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include "../libs/stm32fs/stm32fs.h"
+#include "flashsim.h"
+
+TEST(flashsimTest, WriteOnce) {
+    FlashSim flash(2);
+    uint8_t data[16];
+    std::memset(data, 0x00, sizeof(data));
+
+    ASSERT_TRUE(flash.Write(0, data, 16));
+    ASSERT_EQ(flash.GetTime(), 2U * FlashSimTiming().ProgramTime);
+
+    // double word is programmed once. even with 0xff left in it.
+    ASSERT_FALSE(flash.Write(8, data, 1));
+    ASSERT_TRUE(flash.Write(16, data, 3));
+    ASSERT_EQ(flash.Data()[19], 0xff);
+    ASSERT_FALSE(flash.Write(19, data, 1));
+    ASSERT_EQ(flash.GetProgramErrors(), 2U);
+    ASSERT_EQ(flash.GetPrograms(), 2U);
+
+    flash.ResetTime();
+    ASSERT_TRUE(flash.Erase(0));
+    ASSERT_EQ(flash.GetTime(), FlashSimTiming().EraseTime);
+    ASSERT_EQ(flash.GetEraseCount(0), 1U);
+    ASSERT_EQ(flash.GetEraseCount(1), 0U);
+    ASSERT_EQ(flash.Data()[0], 0xff);
+    ASSERT_TRUE(flash.Write(8, data, 1));
+
+    // out of the flash
+    ASSERT_FALSE(flash.Write(BlockSize * 2 - 4, data, 8));
+    ASSERT_FALSE(flash.Erase(2));
+}
+
+// all kinds of the fs writes: data, records, transactions, optimizations, counters and checkpoints
+static void FsWorkload(Stm32fs &fs, int rounds, bool flush = false) {
+    uint8_t data[700] = {0};
+    for (int round = 0; round < rounds; round++) {
+        std::memset(data, round, sizeof(data));
+        EXPECT_TRUE(fs.BeginTransaction());
+        for (int i = 0; i < 6; i++)
+            EXPECT_TRUE(fs.WriteFile("f" + std::to_string(i), data, 1 + (i * 37 + round) % 60));
+        EXPECT_TRUE(fs.CommitTransaction());
+        EXPECT_TRUE(fs.WriteFile("key", data, 600));
+        EXPECT_TRUE(fs.DeleteFile("f" + std::to_string(round % 6)));
+        if (fs.isCountersEnabled()) {
+            EXPECT_TRUE(fs.WriteCounter(1, round));
+        }
+
+        if (fs.GetFreeMemory() < BlockSize || fs.GetFreeFileDescriptors() < TxMaxRecords * 2 + 2) {
+            EXPECT_TRUE(fs.Optimize());
+        }
+        fs.PrepareCheckpoint();
+        fs.PrepareCounters();
+        if (flush) {
+            EXPECT_TRUE(fs.Flush());
+        }
+    }
+}
+
+TEST(flashsimTest, Stm32fsProgramsOnce) {
+    FlashSim flash(12);
+    Stm32fsConfig_t cfg;
+    cfg.Blocks = {{{0,1}, {2,3,4}}, {{5,6}, {7,8,9}}};
+    cfg.CounterSectors = {10, 11};
+    flash.Attach(cfg);
+    Stm32fs fs{cfg};
+    ASSERT_TRUE(fs.isValid());
+    FsWorkload(fs, 100);
+    flash.Print();
+    ASSERT_EQ(flash.GetProgramErrors(), 0U);
+
+    // single block
+    FlashSim flash1(5);
+    Stm32fsConfig_t cfg1;
+    cfg1.Blocks = {{{0,1}, {2,3,4}}};
+    flash1.Attach(cfg1);
+    Stm32fs fs1{cfg1};
+    FsWorkload(fs1, 100);
+    ASSERT_EQ(flash1.GetProgramErrors(), 0U);
+}
+
+// writes of one command: data, records and the counter go with one program each
+TEST(flashsimTest, Stm32fsWriteCombining) {
+    FlashSim flash(12);
+    Stm32fsConfig_t cfg;
+    cfg.Blocks = {{{0,1}, {2,3,4}}, {{5,6}, {7,8,9}}};
+    cfg.CounterSectors = {10, 11};
+    flash.Attach(cfg);
+    Stm32fs fs{cfg};
+    ASSERT_TRUE(fs.isValid());
+    fs.EnableWriteCombining(true);
+
+    uint8_t data[32] = {0};
+    uint8_t rdata[32] = {0};
+    size_t len = 0;
+    for (int round = 0; round < 2; round++) {
+        std::memset(data, round + 1, sizeof(data));
+        uint32_t programs = flash.GetPrograms();
+        for (int i = 0; i < 6; i++)
+            EXPECT_TRUE(fs.WriteFile("f" + std::to_string(i), data, (i % 2) ? 4 : 20));
+        EXPECT_TRUE(fs.WriteCounter(1, round));
+        EXPECT_EQ(flash.GetPrograms(), programs);
+
+        // reads see the pending writes
+        for (int i = 0; i < 6; i++) {
+            EXPECT_TRUE(fs.ReadFile("f" + std::to_string(i), rdata, &len, sizeof(rdata)));
+            EXPECT_EQ(len, (i % 2) ? 4U : 20U);
+            EXPECT_EQ(std::memcmp(data, rdata, len), 0);
+        }
+
+        EXPECT_TRUE(fs.Flush());
+        EXPECT_EQ(flash.GetPrograms(), programs + 3);
+    }
+
+    // pointer read flushes the file data
+    EXPECT_TRUE(fs.WriteFile("f0", data, 20));
+    uint8_t *ptr = nullptr;
+    EXPECT_TRUE(fs.GetFilePtr("f0", &ptr, &len));
+    EXPECT_EQ(std::memcmp(ptr, data, 20), 0);
+
+    FsWorkload(fs, 100, true);
+    ASSERT_EQ(flash.GetProgramErrors(), 0U);
+
+    Stm32fs fs2{cfg};
+    ASSERT_TRUE(fs2.isValid());
+    EXPECT_EQ(fs2.FileLength("key"), 600);
+    uint32_t value = 0;
+    EXPECT_TRUE(fs2.ReadCounter(1, value));
+    EXPECT_EQ(value, 99U);
+}
+
+// personalization rounds: latency of the writes and wear of the sectors
+TEST(flashsimTest, BenchmarkWearAndLatency) {
+    struct Layout {
+        const char *Name;
+        size_t Sectors;
+        std::vector<Stm32fsConfigBlock_t> Blocks;
+    };
+    Layout layouts[] = {
+        {"1 block", 5, {{{0,1}, {2,3,4}}}},
+        {"2 blocks", 10, {{{0,1}, {2,3,4}}, {{5,6}, {7,8,9}}}},
+    };
+
+    const int Rounds = 50;
+    for (auto &layout : layouts) {
+        FlashSim flash(layout.Sectors);
+        Stm32fsConfig_t cfg;
+        cfg.Blocks = layout.Blocks;
+        flash.Attach(cfg);
+        Stm32fs fs{cfg};
+        ASSERT_TRUE(fs.isValid());
+
+        uint64_t maxTime = 0;
+        uint64_t totalTime = 0;
+        uint32_t writes = 0;
+        uint8_t data[600] = {0};
+        for (int round = 0; round < Rounds; round++) {
+            for (size_t size : {9, 20, 20, 4, 600}) {
+                std::string name = "f" + std::to_string(writes % 5);
+                flash.ResetTime();
+                bool res = fs.WriteFile(name, data, size);
+                if (!res && fs.isNeedsOptimization() && fs.Optimize())
+                    res = fs.WriteFile(name, data, size);
+                ASSERT_TRUE(res);
+                maxTime = std::max(maxTime, flash.GetTime());
+                totalTime += flash.GetTime();
+                writes++;
+            }
+        }
+
+        // 10k erase cycles of STM32L4 flash
+        printf("%-8s write avg %.0f us max %.1f ms, erases %u max per sector %u, %u rounds till wear out\n",
+               layout.Name, (double)totalTime / writes, maxTime / 1000.0, flash.GetTotalErases(),
+               flash.GetMaxEraseCount(), 10000U * Rounds / std::max(flash.GetMaxEraseCount(), 1U));
+        ASSERT_EQ(flash.GetProgramErrors(), 0U);
+        ASSERT_GT(flash.GetTotalErases(), 0U);
+    }
+}
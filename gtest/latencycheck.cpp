@@ -0,0 +1,106 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include "../src/latency.h"
+#include "../src/filesystem.h"
+#include "../pc/pcstorage.h"
+
+using namespace Util;
+
+// 10 ticks per us. every read of the clock moves it by the step.
+static uint64_t fakeTicks = 0;
+static uint64_t fakeStep = 0;
+static uint64_t FakeClock() {
+    fakeTicks += fakeStep;
+    return fakeTicks;
+}
+
+TEST(latencyTest, Buckets) {
+    EXPECT_EQ(LatencyStatistic::Bucket(0), 0U);
+    EXPECT_EQ(LatencyStatistic::Bucket(1), 0U);
+    EXPECT_EQ(LatencyStatistic::Bucket(2), 1U);
+    EXPECT_EQ(LatencyStatistic::Bucket(3), 1U);
+    EXPECT_EQ(LatencyStatistic::Bucket(1000), 9U);
+    EXPECT_EQ(LatencyStatistic::Bucket(0xffffffff), 23U);
+
+    LatencyStatistic stat;
+    for (int i = 0; i < 98; i++)
+        stat.AddUs(LatencyKind::Command, 0xca, 100);
+    stat.AddUs(LatencyKind::Command, 0xca, 5000);
+    stat.AddUs(LatencyKind::Command, 0xca, 5000);
+    EXPECT_EQ(stat.GetCount(LatencyKind::Command, 0xca), 100U);
+    EXPECT_EQ(stat.Percentile(LatencyKind::Command, 0xca, 50), 127U);
+    EXPECT_EQ(stat.Percentile(LatencyKind::Command, 0xca, 99), 8191U);
+    EXPECT_EQ(stat.Percentile(LatencyKind::Command, 0xda, 50), 0U);
+
+    // the scope is not timed without the clock
+    LatencyStatistic &global = LatencyStatistic::GetLatencyStatistic();
+    global.Clear();
+    {
+        LatencyScope scope(LatencyCrypto::RSASign);
+    }
+    EXPECT_EQ(global.GetCount(LatencyKind::Crypto, (uint16_t)LatencyCrypto::RSASign), 0U);
+
+    global.SetClock(FakeClock, 10);
+    fakeStep = 30000;
+    {
+        LatencyScope scope(LatencyCrypto::RSASign);
+    }
+    EXPECT_EQ(global.GetCount(LatencyKind::Crypto, (uint16_t)LatencyCrypto::RSASign), 1U);
+    EXPECT_EQ(global.Percentile(LatencyKind::Crypto, (uint16_t)LatencyCrypto::RSASign, 50), 4095U);
+    global.SetClock(nullptr, 1);
+    global.Clear();
+}
+
+// file system I/O goes to the histograms. vendor DO reads them and the write resets them.
+TEST(latencyTest, VendorDO) {
+    File::MemoryFileStorage storage;
+    ASSERT_EQ(storage.Init(2048 * 10), 0);
+    File::FileSystem fs;
+    fs.SetStorage(&storage);
+
+    LatencyStatistic &stat = LatencyStatistic::GetLatencyStatistic();
+    stat.Clear();
+    stat.SetClock(FakeClock, 10);
+    fakeStep = 10;
+
+    auto name = "Doe<<John"_bstr;
+    uint8_t _data[1024] = {0};
+    bstr data(_data, 0, sizeof(_data));
+    EXPECT_EQ(fs.WriteFile(File::AppID::OpenPGP, 0x5b, File::FileType::File, name), Util::Error::NoError);
+    EXPECT_EQ(fs.ReadFile(File::AppID::OpenPGP, 0x5b, File::FileType::File, data), Util::Error::NoError);
+    EXPECT_EQ(stat.GetCount(LatencyKind::File, (uint16_t)LatencyFile::Write), 1U);
+    EXPECT_EQ(stat.GetCount(LatencyKind::File, (uint16_t)LatencyFile::Read), 1U);
+
+    // version, buckets, count, overflows and the series: kind, code, buckets and (bucket, count)
+    data = bstr(_data, 0, sizeof(_data));
+    EXPECT_EQ(fs.ReadFile(File::AppID::OpenPGP, File::VendorFileID::LatencyStatistic, File::FileType::File, data),
+              Util::Error::NoError);
+    ASSERT_EQ(data.length(), 5U + 7U * 2);
+    EXPECT_EQ(data[0], 0x01);
+    EXPECT_EQ(data[1], 24);
+    EXPECT_EQ(data[2], 2);
+    EXPECT_EQ(data[5], (uint8_t)LatencyKind::File);
+    EXPECT_EQ(data.get_uint_be(6, 2), (uint32_t)LatencyFile::Write);
+    EXPECT_EQ(data[8], 1);
+    EXPECT_EQ(data[9], 0);
+    EXPECT_EQ(data.get_uint_be(10, 2), 1U);
+
+    // small buffer gets the series that fit
+    uint8_t _small[14] = {0};
+    bstr small(_small, 0, sizeof(_small));
+    EXPECT_EQ(fs.ReadFile(File::AppID::OpenPGP, File::VendorFileID::LatencyStatistic, File::FileType::File, small),
+              Util::Error::NoError);
+    EXPECT_EQ(small.length(), 5U + 7U);
+    EXPECT_EQ(small[2], 1);
+
+    stat.SetClock(nullptr, 1);
+    bstr empty(_data, 0, sizeof(_data));
+    // reset without PW3 is rejected
+    EXPECT_EQ(fs.WriteFile(File::AppID::OpenPGP, File::VendorFileID::LatencyStatistic, File::FileType::File, empty),
+              Util::Error::AccessDenied);
+    EXPECT_EQ(stat.GetCount(LatencyKind::File, (uint16_t)LatencyFile::Write), 1U);
+    EXPECT_EQ(fs.WriteFile(File::AppID::OpenPGP, File::VendorFileID::LatencyStatistic, File::FileType::File, empty, true),
+              Util::Error::NoError);
+    EXPECT_EQ(stat.GetCount(LatencyKind::File, (uint16_t)LatencyFile::Write), 0U);
+}
@@ -3,7 +3,9 @@
 #include <string>
 #include <cstring>
 #include <array>
+#include <chrono>
 #include "../libs/stm32fs/stm32fs.h"
+#include "flashsim.h"
 
 #define SECTOR_SIZE 2048
 
@@ -17,7 +19,7 @@ void InitFS(Stm32fsConfig_t &cfg, uint8_t defaultVal) {
     cfg.BaseBlockAddress = (size_t)&vmem;
     cfg.SectorSize = SECTOR_SIZE;
     cfg.Blocks = {{{0,1}, {2,3,4}}};
-    cfg.fnEraseFlashBlock = [](uint8_t blockNo){std::memset(&vmem[SECTOR_SIZE * blockNo], 0xff, SECTOR_SIZE);return true;};
+    cfg.fnEraseFlashBlock = [](uint16_t blockNo){std::memset(&vmem[SECTOR_SIZE * blockNo], 0xff, SECTOR_SIZE);return true;};
     cfg.fnWriteFlash = [](uint32_t address, uint8_t *data, size_t len){std::memcpy(&vmem[address], data, len);return true;};
     cfg.fnReadFlash = [](uint32_t address, uint8_t *data, size_t len){std::memcpy(data, &vmem[address], len);return true;};
 }
@@ -28,7 +30,7 @@ void InitFS2(Stm32fsConfig_t &cfg, uint8_t defaultVal) {
     cfg.BaseBlockAddress = (size_t)&vmem;
     cfg.SectorSize = SECTOR_SIZE;
     cfg.Blocks = {{{0,1}, {2,3,4}}, {{5,6}, {7,8,9}}};
-    cfg.fnEraseFlashBlock = [](uint8_t blockNo){std::memset(&vmem[SECTOR_SIZE * blockNo], 0xff, SECTOR_SIZE);return true;};
+    cfg.fnEraseFlashBlock = [](uint16_t blockNo){std::memset(&vmem[SECTOR_SIZE * blockNo], 0xff, SECTOR_SIZE);return true;};
     cfg.fnWriteFlash = [](uint32_t address, uint8_t *data, size_t len){std::memcpy(&vmem[address], data, len);return true;};
     cfg.fnReadFlash = [](uint32_t address, uint8_t *data, size_t len){std::memcpy(data, &vmem[address], len);return true;};
 }
@@ -39,11 +41,30 @@ void InitFS3(Stm32fsConfig_t &cfg, uint8_t defaultVal) {
     cfg.BaseBlockAddress = (size_t)&vmem;
     cfg.SectorSize = SECTOR_SIZE;
     cfg.Blocks = {{{0}, {1,2}}, {{3}, {4,5}}, {{6}, {7,8}}};
-    cfg.fnEraseFlashBlock = [](uint8_t blockNo){std::memset(&vmem[SECTOR_SIZE * blockNo], 0xff, SECTOR_SIZE);return true;};
+    cfg.fnEraseFlashBlock = [](uint16_t blockNo){std::memset(&vmem[SECTOR_SIZE * blockNo], 0xff, SECTOR_SIZE);return true;};
     cfg.fnWriteFlash = [](uint32_t address, uint8_t *data, size_t len){std::memcpy(&vmem[address], data, len);return true;};
     cfg.fnReadFlash = [](uint32_t address, uint8_t *data, size_t len){std::memcpy(data, &vmem[address], len);return true;};
 }
 
+// sectors of any size. numbers can be over 255.
+void InitFSSectors(Stm32fsConfig_t &cfg, uint32_t sectorSize, std::vector<Stm32fsConfigBlock_t> blocks) {
+    std::memset(vmem, 0xff, sizeof(vmem));
+    
+    cfg.BaseBlockAddress = (size_t)&vmem;
+    cfg.SectorSize = sectorSize;
+    cfg.Blocks = blocks;
+    cfg.fnEraseFlashBlock = [sectorSize](uint16_t blockNo){std::memset(&vmem[sectorSize * blockNo], 0xff, sectorSize);return true;};
+    cfg.fnWriteFlash = [](uint32_t address, uint8_t *data, size_t len){std::memcpy(&vmem[address], data, len);return true;};
+    cfg.fnReadFlash = [](uint32_t address, uint8_t *data, size_t len){std::memcpy(data, &vmem[address], len);return true;};
+}
+
+static UVector SectorRange(uint16_t first, size_t count) {
+    UVector sectors;
+    for (size_t i = 0; i < count; i++)
+        sectors.push_back(first + i);
+    return sectors;
+}
+
 void AssertArrayEQ(uint8_t *data1, uint8_t *data2, uint32_t size) {
     for (uint32_t i = 0; i < size; i++) {
         SCOPED_TRACE(i);
@@ -134,7 +155,7 @@ TEST(stm32fsTest, CreateFarFromBeginning) {
     cfg.BaseBlockAddress = (size_t)&vmem;
     cfg.SectorSize = SECTOR_SIZE;
     cfg.Blocks = {{{25}, {27,28,29}}};
-    cfg.fnEraseFlashBlock = [](uint8_t blockNo){std::memset(&vmem[SECTOR_SIZE * blockNo], 0xff, SECTOR_SIZE);return true;};
+    cfg.fnEraseFlashBlock = [](uint16_t blockNo){std::memset(&vmem[SECTOR_SIZE * blockNo], 0xff, SECTOR_SIZE);return true;};
     cfg.fnWriteFlash = [](uint32_t address, uint8_t *data, size_t len){std::memcpy(&vmem[address], data, len);return true;};
     cfg.fnReadFlash = [](uint32_t address, uint8_t *data, size_t len){std::memcpy(data, &vmem[address], len);return true;};
     
@@ -341,6 +362,7 @@ TEST(stm32fsTest, WriteFileBadFS) {
     Stm32fsConfig_t cfg;
     InitFS(cfg, 0xff);
     Stm32fs fs{cfg};
+    fs.EnableInline(false); // small files in the data area
     
     uint8_t testmem[SECTOR_SIZE] = {0};
     std::memset(testmem, 0x00, sizeof(testmem));
@@ -398,6 +420,7 @@ TEST(stm32fsTest, NeedsOptimize) {
     Stm32fsConfig_t cfg;
     InitFS(cfg, 0xff);
     Stm32fs fs{cfg};
+    fs.EnableInline(false); // small files in the data area
     
     uint8_t testmem[SECTOR_SIZE * 4] = {0};
     std::memset(testmem, 0xab, sizeof(testmem));
@@ -425,6 +448,7 @@ TEST(stm32fsTest, FindFirst) {
     Stm32fsConfig_t cfg;
     InitFS(cfg, 0xff);
     Stm32fs fs{cfg};
+    fs.EnableInline(false); // small files in the data area
     
     ASSERT_TRUE(fs.WriteFile("file1", StdData, 1));
     ASSERT_TRUE(fs.WriteFile("file2", StdData, 1));
@@ -557,6 +581,7 @@ TEST(stm32fsTest, OptimizeEmpty) {
     Stm32fsConfig_t cfg;
     InitFS(cfg, 0xff);
     Stm32fs fs{cfg};
+    fs.EnableInline(false); // small files in the data area
     
     ASSERT_TRUE(fs.WriteFile("file1", StdData, 1));
     ASSERT_TRUE(fs.WriteFile("file2", StdData, 2));
@@ -588,6 +613,7 @@ TEST(stm32fsTest, OptimizeSimple) {
     Stm32fsConfig_t cfg;
     InitFS(cfg, 0xff);
     Stm32fs fs{cfg};
+    fs.EnableInline(false); // small files in the data area
     
     uint32_t startmem = fs.GetFreeMemory();
     
@@ -617,6 +643,35 @@ TEST(stm32fsTest, OptimizeSimple) {
     ASSERT_EQ(startmem - 8, fs.GetFreeMemory());
 }
 
+TEST(stm32fsTest, OptimizeEmptyFiles) {
+    Stm32fsConfig_t cfg;
+    InitFS(cfg, 0xff);
+    Stm32fs fs{cfg};
+    fs.EnableInline(false);
+
+    ASSERT_TRUE(fs.WriteFile("file1", StdData, 0));
+    ASSERT_TRUE(fs.WriteFile("file2", StdData, 0));
+    ASSERT_TRUE(fs.Optimize());
+    ASSERT_EQ(fs.FileLength("file1"), 0);
+    ASSERT_EQ(fs.FileLength("file2"), 0);
+
+    // empty files between the data
+    ASSERT_TRUE(fs.WriteFile("file3", StdData, 4));
+    ASSERT_TRUE(fs.WriteFile("file4", StdData, 0));
+    ASSERT_TRUE(fs.WriteFile("file5", StdData, 8));
+    ASSERT_TRUE(fs.DeleteFile("file3"));
+    ASSERT_TRUE(fs.Optimize());
+
+    uint8_t data[16] = {0};
+    size_t length = 0;
+    ASSERT_TRUE(fs.ReadFile("file5", data, &length, sizeof(data)));
+    ASSERT_EQ(length, 8U);
+    AssertArrayEQ(data, StdData, 8);
+    ASSERT_EQ(fs.FileLength("file1"), 0);
+    ASSERT_EQ(fs.FileLength("file4"), 0);
+    ASSERT_FALSE(fs.FileExist("file3"));
+}
+
 TEST(stm32fsTest, OptimizeBigFiles) {
     Stm32fsConfig_t cfg;
     InitFS(cfg, 0xff);
@@ -666,10 +721,183 @@ TEST(stm32fsTest, OptimizeBigFiles) {
     ASSERT_EQ(startmem - (3100 + 2500), fs.GetFreeMemory());
 }
 
+// more files than the old RAM file list had and a file over the sector size in one block
+TEST(stm32fsTest, OptimizeManyFiles) {
+    Stm32fsConfig_t cfg;
+    InitFS(cfg, 0xff);
+    Stm32fs fs{cfg};
+    fs.EnableInline(false); // small files in the data area
+
+    uint8_t testmem[SECTOR_SIZE * 2] = {0};
+    FillMem(testmem, sizeof(testmem));
+    uint8_t data[16] = {0};
+    const int files = 115;
+    for (int i = 0; i < files; i++) {
+        data[0] = i;
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), data, 12));
+        if (i == 50) {
+            ASSERT_TRUE(fs.WriteFile("big", testmem, 3000));
+        }
+    }
+    for (int i = 0; i < 5; i++)
+        ASSERT_TRUE(fs.DeleteFile("f" + std::to_string(i * 10)));
+    data[1] = 0x77;
+    for (int i = 100; i < 110; i++) {
+        data[0] = i;
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), data, 12));
+    }
+    size_t descriptors = fs.GetFreeFileDescriptors();
+
+    ASSERT_TRUE(fs.Optimize());
+    ASSERT_EQ(fs.GetCurrentFsBlockSerial(), 2);
+    // and the checkpoint of the index with all the files and the catalog stat
+    ASSERT_EQ(fs.GetFreeFileDescriptors(), descriptors + 5 + 10 + 5 * 2 - 1);
+    ASSERT_EQ(fs.GetFreeMemory(), 3 * SECTOR_SIZE - (files - 5) * 12 - 3000 - (files - 5 + 2) * sizeof(Stm32fsIndexEntry));
+
+    uint8_t testmemr[SECTOR_SIZE * 2] = {0};
+    size_t rxlength = 0;
+    ASSERT_TRUE(fs.ReadFile("big", testmemr, &rxlength, sizeof(testmemr)));
+    ASSERT_EQ(rxlength, 3000);
+    AssertArrayEQ(testmem, testmemr, rxlength);
+
+    for (int i = 0; i < files; i++) {
+        std::string name = "f" + std::to_string(i);
+        if (i % 10 == 0 && i < 50) {
+            ASSERT_FALSE(fs.FileExist(name));
+            continue;
+        }
+        rxlength = 0;
+        ASSERT_TRUE(fs.ReadFile(name, testmemr, &rxlength, sizeof(testmemr)));
+        ASSERT_EQ(rxlength, 12);
+        ASSERT_EQ(testmemr[0], i);
+        ASSERT_EQ(testmemr[1], (i >= 100 && i < 110) ? 0x77 : 0);
+    }
+
+    // the same files after the mount
+    Stm32fs fs2{cfg};
+    ASSERT_TRUE(fs2.isValid());
+    ASSERT_EQ(fs2.GetFreeMemory(), fs.GetFreeMemory());
+    ASSERT_TRUE(fs2.WriteFile("f0", data, 12));
+    ASSERT_TRUE(fs2.FileExist("f114"));
+
+    // compaction builds the index for itself
+    fs2.EnableIndex(false);
+    ASSERT_TRUE(fs2.Optimize());
+    ASSERT_FALSE(fs2.isIndexValid());
+    ASSERT_TRUE(fs2.FileExist("f0"));
+    ASSERT_TRUE(fs2.FileExist("big"));
+}
+
+static void CheckSectorFiles(Stm32fs &fs, uint8_t *testmem, int files) {
+    uint8_t testmemr[SECTOR_SIZE * 3] = {0};
+    size_t rxlength = 0;
+    ASSERT_TRUE(fs.ReadFile("big", testmemr, &rxlength, sizeof(testmemr)));
+    ASSERT_EQ(rxlength, 5000);
+    AssertArrayEQ(testmem, testmemr, rxlength);
+
+    for (int i = 0; i < files; i++) {
+        rxlength = 0;
+        ASSERT_TRUE(fs.ReadFile("f" + std::to_string(i), testmemr, &rxlength, sizeof(testmemr)));
+        ASSERT_EQ(rxlength, 20);
+        AssertArrayEQ(&testmem[i], testmemr, rxlength);
+    }
+}
+
+TEST(stm32fsTest, SectorSize4K) {
+    Stm32fsConfig_t cfg;
+    InitFSSectors(cfg, 4096, {{{0}, {1,2}}, {{3}, {4,5}}});
+    Stm32fs fs{cfg};
+    ASSERT_TRUE(fs.isValid());
+    ASSERT_EQ(fs.GetSize(), 4096 * 2);
+    ASSERT_EQ(fs.GetFreeMemory(), 4096 * 2);
+    ASSERT_EQ(fs.GetFreeFileDescriptors(), (4096 / 16) - 1);
+
+    uint8_t testmem[SECTOR_SIZE * 3] = {0};
+    FillMem(testmem, sizeof(testmem));
+    ASSERT_TRUE(fs.WriteFile("big", testmem, 5000));
+    for (int i = 0; i < 100; i++)
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), &testmem[i], 20));
+    CheckSectorFiles(fs, testmem, 100);
+
+    ASSERT_TRUE(fs.Optimize());
+    ASSERT_EQ(fs.GetCurrentFsBlockSerial(), 2);
+    CheckSectorFiles(fs, testmem, 100);
+
+    // by steps: 4K sectors are erased and filled the same way
+    for (int i = 0; i < 10; i++)
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), &testmem[i], 20));
+    ASSERT_TRUE(fs.OptimizeStart());
+    while (fs.isOptimizeActive())
+        ASSERT_TRUE(fs.OptimizeStep());
+    ASSERT_EQ(fs.GetCurrentFsBlockSerial(), 3);
+    CheckSectorFiles(fs, testmem, 100);
+
+    Stm32fs fs2{cfg};
+    ASSERT_TRUE(fs2.isValid());
+    CheckSectorFiles(fs2, testmem, 100);
+    ASSERT_EQ(fs2.GetFreeMemory(), fs.GetFreeMemory());
+
+    // single block is compacted in place by sectors of 4K too
+    Stm32fsConfig_t cfg1;
+    InitFSSectors(cfg1, 4096, {{{0, 1}, {2,3,4}}});
+    Stm32fs fs1{cfg1};
+    ASSERT_TRUE(fs1.WriteFile("big", testmem, 5000));
+    for (int i = 0; i < 200; i++)
+        ASSERT_TRUE(fs1.WriteFile("f" + std::to_string(i % 100), &testmem[i % 100], 20));
+    ASSERT_TRUE(fs1.Optimize());
+    CheckSectorFiles(fs1, testmem, 100);
+    ASSERT_EQ(fs1.GetFreeMemory(), 4096 * 3 - 5000 - 100 * 20 - 102 * sizeof(Stm32fsIndexEntry));
+}
+
+// small sectors with numbers over 255: 8 KB catalog in 128 sectors
+TEST(stm32fsTest, ManySectors) {
+    Stm32fsConfig_t cfg;
+    InitFSSectors(cfg, 64, {{SectorRange(300, 128), SectorRange(500, 200)}});
+    cfg.CounterSectors = {800, 801};
+    Stm32fs fs{cfg};
+    ASSERT_TRUE(fs.isValid());
+    ASSERT_EQ(fs.GetSize(), 64 * 200);
+    ASSERT_EQ(fs.GetFreeFileDescriptors(), (64 * 128 / 16) - 1);
+
+    uint8_t testmem[SECTOR_SIZE * 3] = {0};
+    FillMem(testmem, sizeof(testmem));
+    ASSERT_TRUE(fs.WriteFile("big", testmem, 5000));
+    for (int i = 0; i < 150; i++)
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), &testmem[i], 20));
+    CheckSectorFiles(fs, testmem, 150);
+    for (int i = 0; i < 100; i++)
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), &testmem[i], 20));
+
+    ASSERT_TRUE(fs.Optimize());
+    CheckSectorFiles(fs, testmem, 150);
+    ASSERT_EQ(fs.GetFreeMemory(), 64 * 200 - 5000 - 150 * 20 - 152 * sizeof(Stm32fsIndexEntry));
+
+    // counter sector holds 7 records, so the values roll up often
+    for (uint32_t i = 0; i < 20; i++)
+        ASSERT_TRUE(fs.WriteCounter(1, i));
+    uint32_t value = 0;
+    ASSERT_TRUE(fs.ReadCounter(1, value));
+    ASSERT_EQ(value, 19U);
+
+    Stm32fs fs2{cfg};
+    ASSERT_TRUE(fs2.isValid());
+    CheckSectorFiles(fs2, testmem, 150);
+    value = 0;
+    ASSERT_TRUE(fs2.ReadCounter(1, value));
+    ASSERT_EQ(value, 19U);
+
+    // records can't cross the sectors
+    Stm32fsConfig_t cfgbad;
+    InitFSSectors(cfgbad, 100, {{{0}, {1,2}}});
+    Stm32fs fsbad{cfgbad};
+    ASSERT_FALSE(fsbad.isValid());
+}
+
 TEST(stm32fsTest, Optimize2BlocksEmpty) {
     Stm32fsConfig_t cfg;
     InitFS2(cfg, 0xff);
     Stm32fs fs{cfg};
+    fs.EnableInline(false); // small files in the data area
     
     ASSERT_TRUE(fs.WriteFile("file1", StdData, 1));
     ASSERT_TRUE(fs.WriteFile("file2", StdData, 2));
@@ -756,6 +984,1169 @@ TEST(stm32fsTest, Optimize2Blocks) {
     ASSERT_EQ(startmem - (3104 + 2504), fs.GetFreeMemory());
 } 
 
+TEST(stm32fsTest, Transaction) {
+    Stm32fsConfig_t cfg;
+    InitFS(cfg, 0xff);
+    Stm32fs fs{cfg};
+    
+    ASSERT_TRUE(fs.WriteFile("file1", StdData, 1));
+    ASSERT_TRUE(fs.WriteFile("file2", StdData, 2));
+    
+    ASSERT_TRUE(fs.BeginTransaction());
+    ASSERT_TRUE(fs.isTransactionActive());
+    ASSERT_TRUE(fs.WriteFile("file1", StdData, 3));
+    ASSERT_TRUE(fs.WriteFile("file3", StdData, 4));
+    ASSERT_TRUE(fs.DeleteFile("file2"));
+    
+    // own writes are visible
+    ASSERT_EQ(fs.FileLength("file1"), 3);
+    ASSERT_EQ(fs.FileLength("file3"), 4);
+    ASSERT_FALSE(fs.FileExist("file2"));
+    
+    // optimization in the middle of transaction keeps the own writes
+    ASSERT_TRUE(fs.Optimize());
+    ASSERT_TRUE(fs.isTransactionActive());
+    ASSERT_EQ(fs.FileLength("file1"), 3);
+    ASSERT_EQ(fs.FileLength("file3"), 4);
+    ASSERT_FALSE(fs.FileExist("file2"));
+    ASSERT_TRUE(fs.CommitTransaction());
+    ASSERT_FALSE(fs.isTransactionActive());
+    
+    ASSERT_EQ(fs.FileLength("file1"), 3);
+    ASSERT_EQ(fs.FileLength("file3"), 4);
+    ASSERT_FALSE(fs.FileExist("file2"));
+    
+    // the same flash after remount
+    Stm32fs fs2{cfg};
+    ASSERT_EQ(fs2.FileLength("file1"), 3);
+    ASSERT_EQ(fs2.FileLength("file3"), 4);
+    ASSERT_FALSE(fs2.FileExist("file2"));
+    
+    ASSERT_TRUE(fs2.Optimize());
+    ASSERT_EQ(fs2.FileLength("file1"), 3);
+    ASSERT_EQ(fs2.FileLength("file3"), 4);
+    ASSERT_FALSE(fs2.FileExist("file2"));
+}
+
+TEST(stm32fsTest, TransactionAbort) {
+    Stm32fsConfig_t cfg;
+    InitFS(cfg, 0xff);
+    Stm32fs fs{cfg};
+    
+    ASSERT_TRUE(fs.WriteFile("file1", StdData, 1));
+    
+    ASSERT_TRUE(fs.BeginTransaction());
+    ASSERT_TRUE(fs.WriteFile("file1", StdData, 3));
+    ASSERT_TRUE(fs.WriteFile("file2", StdData, 4));
+    fs.AbortTransaction();
+    
+    ASSERT_EQ(fs.FileLength("file1"), 1);
+    ASSERT_FALSE(fs.FileExist("file2"));
+    
+    // data of aborted transaction is not overwritten
+    ASSERT_TRUE(fs.WriteFile("file2", StdData, 5));
+    uint8_t data[16] = {0};
+    size_t len = 0;
+    ASSERT_TRUE(fs.ReadFile("file2", data, &len, sizeof(data)));
+    ASSERT_EQ(len, 5);
+    AssertArrayEQ(data, StdData, 5);
+}
+
+// group that doesn't fit into the catalog leaves the transaction open. optimization moves its data.
+TEST(stm32fsTest, TransactionCommitOptimize) {
+    for (int blocks = 1; blocks <= 2; blocks++) {
+        Stm32fsConfig_t cfg;
+        if (blocks == 1) {
+            InitFS(cfg, 0xff);
+        } else {
+            InitFS2(cfg, 0xff);
+        }
+        Stm32fs fs{cfg};
+        fs.EnableInline(false);
+        fs.EnableCheckpoint(false);
+
+        ASSERT_TRUE(fs.WriteFile("file1", StdData, 1));
+        ASSERT_TRUE(fs.WriteFile("file2", StdData, 2));
+        while (fs.GetFreeFileDescriptors() > 5)
+            ASSERT_TRUE(fs.WriteFile("file1", StdData, 1));
+
+        ASSERT_TRUE(fs.BeginTransaction());
+        ASSERT_TRUE(fs.WriteFile("file1", StdData + 1, 15));
+        ASSERT_TRUE(fs.WriteFile("file3", StdData + 2, 14));
+        ASSERT_TRUE(fs.WriteFile("file4", StdData + 3, 13));
+        ASSERT_TRUE(fs.DeleteFile("file2"));
+
+        ASSERT_FALSE(fs.CommitTransaction());
+        ASSERT_TRUE(fs.isTransactionActive());
+        ASSERT_TRUE(fs.isNeedsOptimization());
+        ASSERT_TRUE(fs.Optimize());
+        ASSERT_TRUE(fs.CommitTransaction());
+        ASSERT_FALSE(fs.isTransactionActive());
+
+        Stm32fs fs2{cfg};
+        for (Stm32fs *xfs : {&fs, &fs2}) {
+            uint8_t data[16] = {0};
+            size_t len = 0;
+            ASSERT_TRUE(xfs->ReadFile("file1", data, &len, sizeof(data)));
+            ASSERT_EQ(len, 15);
+            AssertArrayEQ(data, StdData + 1, len);
+            ASSERT_TRUE(xfs->ReadFile("file3", data, &len, sizeof(data)));
+            ASSERT_EQ(len, 14);
+            AssertArrayEQ(data, StdData + 2, len);
+            ASSERT_TRUE(xfs->ReadFile("file4", data, &len, sizeof(data)));
+            ASSERT_EQ(len, 13);
+            AssertArrayEQ(data, StdData + 3, len);
+            ASSERT_FALSE(xfs->FileExist("file2"));
+        }
+    }
+}
+
+TEST(stm32fsTest, TransactionPowerLoss) {
+    Stm32fsConfig_t cfg;
+    InitFS(cfg, 0xff);
+    
+    {
+        Stm32fs fs{cfg};
+        ASSERT_TRUE(fs.WriteFile("file1", StdData, 1));
+        ASSERT_TRUE(fs.BeginTransaction());
+        ASSERT_TRUE(fs.WriteFile("file1", StdData, 3));
+        ASSERT_TRUE(fs.WriteFile("file2", StdData, 4));
+        ASSERT_TRUE(fs.CommitTransaction());
+    }
+    
+    // header, file1 header, file1 version, file2 header, tx begin, 2 versions, tx commit
+    Stm32FSTransaction *commit = (Stm32FSTransaction *)&vmem[16 * 7];
+    ASSERT_EQ(commit->FileState, fsTxCommit);
+    ASSERT_EQ(commit->RecordCount, 2);
+    
+    // commit record was not written
+    std::memset(&vmem[16 * 7], 0xff, 16);
+    {
+        Stm32fs fs{cfg};
+        ASSERT_EQ(fs.FileLength("file1"), 1);
+        ASSERT_FALSE(fs.FileExist("file2"));
+        
+        // the next writes go after broken group and work
+        ASSERT_TRUE(fs.WriteFile("file2", StdData, 5));
+        ASSERT_TRUE(fs.WriteFile("file1", StdData, 6));
+        ASSERT_EQ(fs.FileLength("file1"), 6);
+        ASSERT_EQ(fs.FileLength("file2"), 5);
+    }
+}
+
+static size_t FlashWriteCount = 0;
+
+static void Personalize(Stm32fs &fs, bool transactions) {
+    uint8_t key[400];
+    FillMem(key, sizeof(key));
+    
+    // key import and then host puts fingerprint, date and attributes of the key
+    for (int i = 0; i < 3; i++) {
+        std::string sfx = std::to_string(i);
+        if (transactions) {
+            ASSERT_TRUE(fs.BeginTransaction());
+        }
+        if (i == 0)
+            fs.DeleteFile("2_122_0");
+        ASSERT_TRUE(fs.WriteFile("2_18" + sfx + "_2", key, sizeof(key)));
+        ASSERT_TRUE(fs.WriteFile("2_19" + sfx + "_0", key, 20));
+        ASSERT_TRUE(fs.WriteFile("2_20" + sfx + "_0", key, 4));
+        ASSERT_TRUE(fs.WriteFile("2_19" + sfx + "_0", key, 6));
+        if (transactions) {
+            ASSERT_TRUE(fs.CommitTransaction());
+        }
+    }
+    
+    // cardholder data
+    if (transactions) {
+        ASSERT_TRUE(fs.BeginTransaction());
+    }
+    ASSERT_TRUE(fs.WriteFile("2_91_0", key, 10));
+    ASSERT_TRUE(fs.WriteFile("2_24365_0", key, 2));
+    ASSERT_TRUE(fs.WriteFile("2_24373_0", key, 1));
+    ASSERT_TRUE(fs.WriteFile("2_24400_0", key, 40));
+    if (transactions) {
+        ASSERT_TRUE(fs.CommitTransaction());
+    }
+    
+    // passwords and status bytes
+    for (int i = 0; i < 2; i++) {
+        if (transactions) {
+            ASSERT_TRUE(fs.BeginTransaction());
+        }
+        ASSERT_TRUE(fs.WriteFile("2_" + std::to_string(128 + i) + "_2", key, 8));
+        ASSERT_TRUE(fs.WriteFile("2_196_0", key, 7));
+        if (transactions) {
+            ASSERT_TRUE(fs.CommitTransaction());
+        }
+    }
+}
+
+TEST(stm32fsTest, TransactionFlashWrites) {
+    size_t writes[2] = {0};
+    for (int i = 0; i < 2; i++) {
+        Stm32fsConfig_t cfg;
+        InitFS(cfg, 0xff);
+        cfg.fnWriteFlash = [](uint32_t address, uint8_t *data, size_t len){FlashWriteCount++; std::memcpy(&vmem[address], data, len);return true;};
+        Stm32fs fs{cfg};
+        
+        FlashWriteCount = 0;
+        Personalize(fs, i == 1);
+        writes[i] = FlashWriteCount;
+        
+        ASSERT_EQ(fs.FileLength("2_180_2"), 400);
+        ASSERT_EQ(fs.FileLength("2_191_0"), 6);
+        ASSERT_EQ(fs.FileLength("2_196_0"), 7);
+    }
+    
+    printf("flash writes per personalization: single writes %zu transactions %zu\n", writes[0], writes[1]);
+    ASSERT_LT(writes[1], writes[0]);
+}
+
+static const int IndexFiles = 120;
+
+static void CheckIndexFiles(Stm32fs &fs, int deleted) {
+    uint8_t data[SECTOR_SIZE] = {0};
+    for (int i = 0; i < IndexFiles; i++) {
+        SCOPED_TRACE(i);
+        std::string name = "f" + std::to_string(i);
+        size_t len = 0;
+        if (i < deleted) {
+            ASSERT_FALSE(fs.FileExist(name));
+            ASSERT_FALSE(fs.ReadFile(name, data, &len, sizeof(data)));
+            continue;
+        }
+        ASSERT_TRUE(fs.FileExist(name));
+        ASSERT_TRUE(fs.ReadFile(name, data, &len, sizeof(data)));
+        ASSERT_EQ(len, 8 + i % 8);
+        ASSERT_EQ(data[0], i & 0xff);
+    }
+    ASSERT_FALSE(fs.FileExist("nofile"));
+}
+
+static double IndexLookups(Stm32fs &fs, uint32_t &reads) {
+    fs.GetIOCounters().Clear();
+    auto start = std::chrono::steady_clock::now();
+    
+    uint8_t data[SECTOR_SIZE] = {0};
+    for (int round = 0; round < 10; round++)
+        for (int i = 0; i < IndexFiles; i++) {
+            size_t len = 0;
+            fs.ReadFile("f" + std::to_string(i), data, &len, sizeof(data));
+        }
+
+    std::chrono::duration<double, std::micro> time = std::chrono::steady_clock::now() - start;
+    reads = fs.GetIOCounters().Reads;
+    return time.count();
+}
+
+// id lookup goes through its own table: the probe is short whatever the name hashes are
+TEST(stm32fsTest, IndexFindByID) {
+    Stm32fsIndex index;
+    index.Init(200);
+    // table of 256 slots is full
+    for (uint16_t id = 1; id <= 256; id++)
+        ASSERT_TRUE(index.Append(id, "f" + std::to_string(id % 7), id * 16));
+    ASSERT_FALSE(index.Append(257, "f", 257 * 16));
+
+    for (uint16_t id = 1; id <= 256; id++) {
+        Stm32fsIndexEntry *entry = index.FindByID(id);
+        ASSERT_NE(entry, nullptr);
+        ASSERT_EQ(entry->FileID, id);
+        ASSERT_EQ(entry->HeaderAddress, id * 16U);
+    }
+    ASSERT_EQ(index.FindByID(0), nullptr);
+    ASSERT_EQ(index.FindByID(257), nullptr);
+
+    index.Clear();
+    ASSERT_EQ(index.FindByID(1), nullptr);
+}
+
+TEST(stm32fsTest, IndexLookup) {
+    Stm32fsConfig_t cfg;
+    InitFS2(cfg, 0xff);
+    Stm32fs fs{cfg};
+    ASSERT_TRUE(fs.isValid());
+    ASSERT_TRUE(fs.isIndexValid());
+
+    uint8_t data[16] = {0};
+    for (int i = 0; i < IndexFiles; i++) {
+        data[0] = i & 0xff;
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), data, 8 + i % 8));
+    }
+    ASSERT_TRUE(fs.isIndexValid());
+    CheckIndexFiles(fs, 0);
+
+    // the same answers with the flash scans
+    uint32_t reads[2] = {0};
+    double time[2] = {0};
+    time[0] = IndexLookups(fs, reads[0]);
+    fs.EnableIndex(false);
+    ASSERT_FALSE(fs.isIndexValid());
+    CheckIndexFiles(fs, 0);
+    time[1] = IndexLookups(fs, reads[1]);
+    fs.EnableIndex(true);
+    ASSERT_TRUE(fs.isIndexValid());
+
+    printf("%d files lookups: index %u reads %.0f us, scan %u reads %.0f us\n",
+           IndexFiles, reads[0], time[0], reads[1], time[1]);
+    ASSERT_LT(reads[0] * 10, reads[1]);
+
+    // index follows deletes, transactions and optimization
+    for (int i = 0; i < 5; i++)
+        ASSERT_TRUE(fs.DeleteFile("f" + std::to_string(i)));
+    CheckIndexFiles(fs, 5);
+
+    ASSERT_TRUE(fs.BeginTransaction());
+    data[0] = 200;
+    ASSERT_TRUE(fs.WriteFile("f200", data, 8));
+    ASSERT_TRUE(fs.DeleteFile("f5"));
+    ASSERT_TRUE(fs.FileExist("f200"));
+    ASSERT_FALSE(fs.FileExist("f5"));
+    ASSERT_TRUE(fs.CommitTransaction());
+    CheckIndexFiles(fs, 6);
+    ASSERT_EQ(fs.FileLength("f200"), 8);
+
+    ASSERT_TRUE(fs.Optimize());
+    ASSERT_TRUE(fs.isIndexValid());
+    CheckIndexFiles(fs, 6);
+    ASSERT_EQ(fs.FileLength("f200"), 8);
+
+    // mount builds the index from the flash
+    Stm32fs fs2{cfg};
+    ASSERT_TRUE(fs2.isIndexValid());
+    CheckIndexFiles(fs2, 6);
+    ASSERT_EQ(fs2.FileLength("f200"), 8);
+}
+
+static uint32_t WriteFlashAccesses(Stm32fs &fs, std::string name) {
+    fs.GetIOCounters().Clear();
+    EXPECT_TRUE(fs.WriteFile(name, StdData, sizeof(StdData)));
+    return fs.GetIOCounters().Reads + fs.GetIOCounters().Writes;
+}
+
+static void CheckSameFiles(Stm32fs &fs1, Stm32fs &fs2, int files) {
+    uint8_t data1[64] = {0};
+    uint8_t data2[64] = {0};
+    for (int i = 0; i < files; i++) {
+        std::string name = "f" + std::to_string(i);
+        ASSERT_EQ(fs1.FileExist(name), fs2.FileExist(name));
+        if (!fs1.FileExist(name))
+            continue;
+        size_t len1 = 0, len2 = 0;
+        ASSERT_TRUE(fs1.ReadFile(name, data1, &len1, sizeof(data1)));
+        ASSERT_TRUE(fs2.ReadFile(name, data2, &len2, sizeof(data2)));
+        ASSERT_EQ(len1, len2);
+        AssertArrayEQ(data1, data2, len1);
+    }
+}
+
+TEST(stm32fsTest, Checkpoint) {
+    Stm32fsConfig_t cfg;
+    InitFS(cfg, 0xff);
+    Stm32fs fs{cfg};
+    fs.EnableInline(false); // small files in the data area
+
+    uint8_t data[16] = {0};
+    for (int i = 0; i < 30; i++) {
+        data[0] = i;
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), data, 12));
+    }
+    ASSERT_FALSE(fs.PrepareCheckpoint());
+    for (int i = 0; i < 5; i++)
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), data, 12));
+    uint32_t freemem = fs.GetFreeMemory();
+    ASSERT_TRUE(fs.PrepareCheckpoint());
+    ASSERT_FALSE(fs.PrepareCheckpoint());
+    ASSERT_EQ(fs.GetFreeMemory(), freemem - 31 * sizeof(Stm32fsIndexEntry));
+
+    // records after the checkpoint are replayed
+    data[1] = 0x55;
+    for (int i = 10; i < 15; i++)
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), data, 12));
+    ASSERT_TRUE(fs.DeleteFile("f20"));
+    ASSERT_TRUE(fs.BeginTransaction());
+    ASSERT_TRUE(fs.WriteFile("f21", data, 20));
+    ASSERT_TRUE(fs.WriteFile("f30", data, 12));
+    ASSERT_TRUE(fs.DeleteFile("f22"));
+    ASSERT_TRUE(fs.CommitTransaction());
+    ASSERT_TRUE(fs.WriteFile("f31", data, 12));
+
+    Stm32fs fs2{cfg};
+    ASSERT_TRUE(fs2.isValid());
+    ASSERT_TRUE(fs2.isIndexValid());
+    ASSERT_FALSE(fs2.FileExist("f20"));
+    ASSERT_FALSE(fs2.FileExist("f22"));
+    ASSERT_EQ(fs2.FileLength("f21"), 20);
+    CheckSameFiles(fs, fs2, 35);
+    ASSERT_EQ(fs2.GetFreeMemory(), fs.GetFreeMemory());
+    ASSERT_EQ(fs2.GetFreeFileDescriptors(), fs.GetFreeFileDescriptors());
+
+    // the same as the catalog scan
+    fs2.EnableCheckpoint(false);
+    fs2.EnableIndex(false);
+    fs2.EnableIndex(true);
+    CheckSameFiles(fs, fs2, 35);
+
+    // new file gets a new id
+    ASSERT_TRUE(fs2.WriteFile("f32", data, 12));
+    CheckSameFiles(fs, fs2, 32);
+    ASSERT_EQ(fs2.FileLength("f32"), 12);
+
+    // optimization drops the checkpoint. it is small, so it doesn't get a new one.
+    ASSERT_TRUE(fs2.Optimize());
+    Stm32fs fs3{cfg};
+    CheckSameFiles(fs2, fs3, 35);
+    // free space starts at the next flash double word
+    ASSERT_EQ(fs3.GetFreeMemory(), 3 * SECTOR_SIZE - (30 * 12 + 20 + 4));
+}
+
+TEST(stm32fsTest, CheckpointInterval) {
+    Stm32fsConfig_t cfg;
+    InitFS(cfg, 0xff);
+    Stm32fs fs{cfg};
+
+    uint8_t data[16] = {0};
+    for (int i = 0; i < 70; i++)
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), data, 4));
+    ASSERT_TRUE(fs.PrepareCheckpoint());
+
+    // 70 entries: the next checkpoint waits for 70 records, not for CheckpointRecords
+    for (int i = 0; i < 65; i++)
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), data, 4));
+    ASSERT_FALSE(fs.PrepareCheckpoint());
+    for (int i = 0; i < 5; i++)
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), data, 4));
+    uint32_t freemem = fs.GetFreeMemory();
+    ASSERT_TRUE(fs.PrepareCheckpoint());
+    ASSERT_EQ(fs.GetFreeMemory(), freemem - 71 * sizeof(Stm32fsIndexEntry));
+
+    Stm32fs fs2{cfg};
+    ASSERT_TRUE(fs2.isIndexValid());
+    CheckSameFiles(fs, fs2, 70);
+}
+
+static void CheckSameStatistic(Stm32fsStatistic stat1, Stm32fsStatistic stat2) {
+    ASSERT_TRUE(stat1.Valid);
+    ASSERT_TRUE(stat2.Valid);
+    ASSERT_EQ(stat1.HeaderFreeDescriptors, stat2.HeaderFreeDescriptors);
+    ASSERT_EQ(stat1.HeaderSystemDescriptors, stat2.HeaderSystemDescriptors);
+    ASSERT_EQ(stat1.HeaderFileDescriptors, stat2.HeaderFileDescriptors);
+    ASSERT_EQ(stat1.HeaderVersionDescriptors, stat2.HeaderVersionDescriptors);
+    ASSERT_EQ(stat1.HeaderDeletedFileDescriptors, stat2.HeaderDeletedFileDescriptors);
+    ASSERT_EQ(stat1.HeaderDeletedVersionDescriptors, stat2.HeaderDeletedVersionDescriptors);
+    ASSERT_EQ(stat1.DataFreeSize, stat2.DataFreeSize);
+    ASSERT_EQ(stat1.DataOccupiedSize, stat2.DataOccupiedSize);
+    ASSERT_EQ(stat1.DataDeletedSize, stat2.DataDeletedSize);
+    ASSERT_EQ(stat1.OptimizationNeeded(), stat2.OptimizationNeeded());
+}
+
+// the statistic kept by the writes is the same as the scan of the catalog, also after the mount
+static void CheckStatistic(Stm32fs &fs, Stm32fsConfig_t &cfg) {
+    fs.GetIOCounters().Clear();
+    Stm32fsStatistic stat = fs.GetStatistic();
+    ASSERT_EQ(fs.GetIOCounters().Reads, 0U);
+
+    Stm32fs scan{cfg};
+    scan.EnableIndex(false);
+    CheckSameStatistic(stat, scan.GetStatistic());
+    Stm32fs mounted{cfg};
+    CheckSameStatistic(stat, mounted.GetStatistic());
+}
+
+TEST(stm32fsTest, Statistic) {
+    Stm32fsConfig_t cfg;
+    InitFS(cfg, 0xff);
+    Stm32fs fs{cfg};
+    Stm32fsStatistic stat = fs.GetStatistic();
+    ASSERT_TRUE(stat.Valid);
+    ASSERT_EQ(stat.HeaderSystemDescriptors, 1U);
+    ASSERT_EQ(stat.HeaderFreeDescriptors, 2 * SECTOR_SIZE / 16 - 1);
+    ASSERT_FALSE(stat.OptimizationNeeded());
+
+    uint8_t data[100] = {0};
+    for (int i = 0; i < 10; i++)
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), data, 4 + i * 10));
+    stat = fs.GetStatistic();
+    ASSERT_EQ(stat.HeaderFileDescriptors, 10U);
+    ASSERT_EQ(stat.HeaderVersionDescriptors, 10U);
+    ASSERT_EQ(stat.DataOccupiedSize, 16U + 24 + 40 + 48 + 56 + 64 + 80 + 88 + 96);
+    ASSERT_EQ(stat.DataDeletedSize, 0U);
+    CheckStatistic(fs, cfg);
+
+    // rewrites, deletes, inline files and a transaction
+    ASSERT_TRUE(fs.WriteFile("f1", data, 30));
+    ASSERT_TRUE(fs.WriteFile("f2", data, 5));
+    ASSERT_TRUE(fs.DeleteFile("f3"));
+    ASSERT_TRUE(fs.DeleteFile("f0"));
+    ASSERT_TRUE(fs.BeginTransaction());
+    ASSERT_TRUE(fs.WriteFile("f4", data, 70));
+    ASSERT_TRUE(fs.WriteFile("f10", data, 20));
+    ASSERT_TRUE(fs.DeleteFile("f5"));
+    ASSERT_TRUE(fs.CommitTransaction());
+    stat = fs.GetStatistic();
+    ASSERT_EQ(stat.HeaderFileDescriptors, 8U);
+    ASSERT_EQ(stat.HeaderDeletedFileDescriptors, 3U);
+    ASSERT_EQ(stat.HeaderDeletedVersionDescriptors, 6U + 3U);
+    ASSERT_EQ(stat.DataDeletedSize, 16U + 24 + 40 + 48 + 56);
+    ASSERT_TRUE(stat.OptimizationNeeded());
+    CheckStatistic(fs, cfg);
+
+    // deleted file is written again
+    ASSERT_TRUE(fs.WriteFile("f3", data, 50));
+    CheckStatistic(fs, cfg);
+
+    // the checkpoint and the records after it
+    ASSERT_TRUE(fs.WriteCheckpoint());
+    ASSERT_TRUE(fs.WriteFile("f6", data, 8));
+    ASSERT_TRUE(fs.DeleteFile("f7"));
+    CheckStatistic(fs, cfg);
+
+    ASSERT_TRUE(fs.Optimize());
+    stat = fs.GetStatistic();
+    ASSERT_EQ(stat.HeaderDeletedFileDescriptors + stat.HeaderDeletedVersionDescriptors, 0U);
+    ASSERT_FALSE(stat.OptimizationNeeded());
+    CheckStatistic(fs, cfg);
+}
+
+
+TEST(stm32fsTest, Layouts) {
+    Stm32fsConfig_t cfg;
+    ASSERT_TRUE(Stm32fsLayoutDevice(cfg, 10, 6));
+    ASSERT_EQ(cfg.Blocks.size(), 1U);
+    EXPECT_EQ(cfg.Blocks[0].HeaderSectors, UVector({10}));
+    EXPECT_EQ(cfg.Blocks[0].DataSectors, UVector({11, 12, 13}));
+    EXPECT_EQ(cfg.CounterSectors, UVector({14, 15}));
+
+    // no place for the counters
+    ASSERT_TRUE(Stm32fsLayoutDevice(cfg, 10, 5));
+    EXPECT_TRUE(cfg.CounterSectors.empty());
+    EXPECT_FALSE(Stm32fsLayoutDevice(cfg, 10, 3));
+
+    ASSERT_TRUE(Stm32fsLayoutPC(cfg, 0, 12));
+    ASSERT_EQ(cfg.Blocks.size(), 2U);
+    EXPECT_EQ(cfg.Blocks[1].HeaderSectors, UVector({5, 6}));
+    EXPECT_EQ(cfg.Blocks[1].DataSectors, UVector({7, 8, 9}));
+    EXPECT_EQ(cfg.CounterSectors, UVector({10, 11}));
+    EXPECT_FALSE(Stm32fsLayoutPC(cfg, 0, 9));
+}
+
+TEST(stm32fsTest, ReadCatalog) {
+    Stm32fsConfig_t cfg;
+    InitFS(cfg, 0xff);
+    Stm32fs fs{cfg};
+    ASSERT_TRUE(fs.WriteFile("f1", StdData, sizeof(StdData)));
+    ASSERT_TRUE(fs.WriteFile("f1", StdData, 4));
+    ASSERT_TRUE(fs.DeleteFile("f1"));
+
+    std::vector<uint8_t> states;
+    std::vector<uint32_t> addrs;
+    ASSERT_TRUE(fs.ReadCatalog([&](Stm32FSFileRecord &rec, uint32_t addr) {
+        states.push_back(rec.header.FileState);
+        addrs.push_back(addr);
+        return true;
+    }));
+    ASSERT_EQ(states, std::vector<uint8_t>({fsFileHeader, fsFileVersion, fsFileInline, fsDeleted}));
+    ASSERT_EQ(addrs[0] + 48, addrs[3]);
+
+    // stops by the callback
+    size_t count = 0;
+    ASSERT_TRUE(fs.ReadCatalog([&](Stm32FSFileRecord &, uint32_t) {return ++count < 2;}));
+    ASSERT_EQ(count, 2U);
+}
+
+
+static void WriteNamespaces(Stm32fs &fs) {
+    uint8_t data[32] = {0};
+    for (int i = 0; i < 40; i++)
+        ASSERT_TRUE(fs.WriteFile("1_" + std::to_string(i), data, 4 + i % 20));
+    for (int i = 0; i < 10; i++)
+        ASSERT_TRUE(fs.WriteFile("2_" + std::to_string(i), data, 12));
+    // other namespaces with the same start
+    ASSERT_TRUE(fs.WriteFile("10_1", data, 12));
+    ASSERT_TRUE(fs.WriteFile("1", data, 12));
+}
+
+static void CheckNamespaces(Stm32fs &fs, bool ns1, bool ns2) {
+    for (int i = 0; i < 40; i++)
+        ASSERT_EQ(fs.FileExist("1_" + std::to_string(i)), ns1);
+    for (int i = 0; i < 10; i++)
+        ASSERT_EQ(fs.FileExist("2_" + std::to_string(i)), ns2);
+    ASSERT_TRUE(fs.FileExist("10_1"));
+    ASSERT_TRUE(fs.FileExist("1"));
+}
+
+TEST(stm32fsTest, DeletePrefix) {
+    Stm32fsConfig_t cfg;
+    InitFS(cfg, 0xff);
+    Stm32fs fs{cfg};
+    WriteNamespaces(fs);
+
+    // namespace search reads only its headers
+    fs.GetIOCounters().Clear();
+    Stm32File_t srec;
+    Stm32File_t *rc = fs.FindFirst("2_*", &srec);
+    for (int i = 0; i < 10; i++) {
+        ASSERT_NE(rc, nullptr);
+        ASSERT_TRUE(rc->FileName == "2_" + std::to_string(i));
+        rc = fs.FindNext(rc);
+    }
+    ASSERT_EQ(rc, nullptr);
+    // hash is 8 bits. a few other namespaces can share it.
+    ASSERT_LE(fs.GetIOCounters().Reads, 10U + 2);
+
+    // the whole namespace is one record
+    fs.GetIOCounters().Clear();
+    ASSERT_TRUE(fs.DeleteFiles("1_*"));
+    ASSERT_EQ(fs.GetIOCounters().Writes, 1U);
+    CheckNamespaces(fs, false, true);
+    ASSERT_EQ(fs.FindFirst("1_*", &srec), nullptr);
+    // nothing to delete
+    fs.GetIOCounters().Clear();
+    ASSERT_TRUE(fs.DeleteFiles("1_*"));
+    ASSERT_EQ(fs.GetIOCounters().Writes, 0U);
+
+    // file written after the delete is there
+    uint8_t data[16] = {0};
+    ASSERT_TRUE(fs.WriteFile("1_5", data, 16));
+    ASSERT_TRUE(fs.FileExist("1_5"));
+    CheckStatistic(fs, cfg);
+
+    Stm32fs fs2{cfg};
+    ASSERT_TRUE(fs2.FileExist("1_5"));
+    fs2.EnableIndex(false);
+    ASSERT_TRUE(fs2.FileExist("1_5"));
+    ASSERT_FALSE(fs2.FileExist("1_6"));
+    ASSERT_TRUE(fs2.DeleteFiles("1_*"));
+    CheckNamespaces(fs2, false, true);
+
+    // delete after the checkpoint is replayed by the mount
+    Stm32fs fs3{cfg};
+    ASSERT_TRUE(fs3.WriteCheckpoint());
+    ASSERT_TRUE(fs3.DeleteFiles("2_*"));
+    Stm32fs fs4{cfg};
+    CheckNamespaces(fs4, false, false);
+    CheckStatistic(fs4, cfg);
+
+    // optimization drops the records
+    ASSERT_TRUE(fs4.Optimize());
+    CheckNamespaces(fs4, false, false);
+    Stm32fs fs5{cfg};
+    CheckNamespaces(fs5, false, false);
+    ASSERT_EQ(fs5.GetStatistic().HeaderFileDescriptors, 2U);
+}
+
+TEST(stm32fsTest, DeletePrefixOptimizeSteps) {
+    Stm32fsConfig_t cfg;
+    InitFS2(cfg, 0xff);
+    Stm32fs fs{cfg};
+    WriteNamespaces(fs);
+
+    ASSERT_TRUE(fs.OptimizeStart());
+    for (int i = 0; i < 8; i++)
+        ASSERT_TRUE(fs.OptimizeStep());
+    ASSERT_TRUE(fs.isOptimizeActive());
+    ASSERT_TRUE(fs.DeleteFiles("1_*"));
+    uint8_t data[16] = {0};
+    ASSERT_TRUE(fs.WriteFile("1_7", data, 16));
+    while (fs.isOptimizeActive())
+        ASSERT_TRUE(fs.OptimizeStep());
+
+    ASSERT_EQ(fs.GetCurrentFsBlockSerial(), 2U);
+    Stm32fs fs2{cfg};
+    for (int i = 0; i < 40; i++)
+        ASSERT_EQ(fs2.FileExist("1_" + std::to_string(i)), i == 7);
+    ASSERT_EQ(fs2.FileLength("1_7"), 16);
+    ASSERT_TRUE(fs2.FileExist("2_3"));
+    ASSERT_TRUE(fs2.FileExist("10_1"));
+}
+
+
+// catalog of small files: records only. mount reads all the catalog without the checkpoint.
+TEST(stm32fsTest, BenchmarkMount) {
+    Stm32fsConfig_t cfg;
+    InitFSSectors(cfg, 4096, {{{0, 1}, {2,3,4}}});
+
+    const int Mounts = 20;
+    uint32_t reads[2] = {0};
+    for (int records : {64, 128, 256, 480}) {
+        double time[2] = {0};
+        for (int checkpoint = 0; checkpoint < 2; checkpoint++) {
+            InitFSSectors(cfg, 4096, {{{0, 1}, {2,3,4}}});
+            {
+                Stm32fs fs{cfg};
+                fs.EnableCheckpoint(checkpoint != 0);
+                uint8_t data[8] = {0};
+                for (int i = 0; i < records - 20; i++) {
+                    data[0] = i;
+                    ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i % 20), data, sizeof(data)));
+                }
+                if (checkpoint) {
+                    ASSERT_TRUE(fs.WriteCheckpoint());
+                }
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < Mounts; i++) {
+                Stm32fs fs{cfg};
+                ASSERT_TRUE(fs.isIndexValid());
+                reads[checkpoint] = fs.GetIOCounters().Reads;
+            }
+            std::chrono::duration<double, std::micro> dtime = std::chrono::steady_clock::now() - start;
+            time[checkpoint] = dtime.count() / Mounts;
+        }
+        printf("%3d records mount: scan %u reads %.1f us, checkpoint %u reads %.1f us\n",
+               records, reads[0], time[0], reads[1], time[1]);
+    }
+    ASSERT_LT(reads[1] * 10, reads[0]);
+}
+
+TEST(stm32fsTest, TailWrites) {
+    Stm32fsConfig_t cfg;
+    InitFS2(cfg, 0xff);
+    Stm32fs fs{cfg};
+    ASSERT_TRUE(fs.isValid());
+
+    for (int i = 0; i < 10; i++)
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), StdData, sizeof(StdData)));
+    uint32_t accessesNew = WriteFlashAccesses(fs, "new1");
+    uint32_t accessesUpdate = WriteFlashAccesses(fs, "f1");
+
+    for (int i = 10; i < 100; i++)
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i), StdData, sizeof(StdData)));
+
+    // the same count of flash accesses for a full filesystem
+    ASSERT_EQ(WriteFlashAccesses(fs, "new2"), accessesNew);
+    ASSERT_EQ(WriteFlashAccesses(fs, "f1"), accessesUpdate);
+    ASSERT_EQ(fs.GetFreeFileDescriptors(), (SECTOR_SIZE / 16) * 2 - 1 - 100 * 2 - 6);
+    ASSERT_EQ(fs.GetFreeMemory(), SECTOR_SIZE * 3 - 104 * sizeof(StdData));
+
+    // data of the aborted transaction is skipped after mount
+    ASSERT_TRUE(fs.BeginTransaction());
+    ASSERT_TRUE(fs.WriteFile("f1", StdData, 11));
+    fs.AbortTransaction();
+
+    Stm32fs fs2{cfg};
+    ASSERT_TRUE(fs2.isValid());
+    ASSERT_EQ(fs2.GetFreeFileDescriptors(), fs.GetFreeFileDescriptors());
+    ASSERT_EQ(fs2.GetFreeMemory(), SECTOR_SIZE * 3 - 104 * sizeof(StdData) - 16); // aborted data with padding
+    ASSERT_TRUE(fs2.WriteFile("new3", StdData, sizeof(StdData)));
+    ASSERT_EQ(fs2.FileLength("f1"), sizeof(StdData));
+    ASSERT_EQ(fs2.FileLength("new3"), sizeof(StdData));
+
+    uint8_t data[SECTOR_SIZE] = {0};
+    size_t len = 0;
+    ASSERT_TRUE(fs2.ReadFile("new3", data, &len, sizeof(data)));
+    AssertArrayEQ(data, StdData, sizeof(StdData));
+}
+
+static const uint32_t SimEraseTime = FlashSimTiming().EraseTime;
+static const uint32_t SimWriteTime = FlashSimTiming().ProgramTime;
+
+// writes like Stm32fsFileStorage: optimize and try again if fs is full
+static uint32_t TimedWrite(Stm32fs &fs, FlashSim &flash, std::string name, uint8_t *data, size_t len) {
+    flash.ResetTime();
+    bool res = fs.WriteFile(name, data, len);
+    if (!res && fs.isNeedsOptimization() && fs.Optimize())
+        res = fs.WriteFile(name, data, len);
+    EXPECT_TRUE(res);
+    return flash.GetTime();
+}
+
+// rewrites of the files with check of all of them after every write.
+// returns the worst write time. idle - optimization by steps between the writes.
+static uint32_t RewriteFiles(bool idle, uint32_t &maxIdleTime) {
+    FlashSim flash(10);
+    Stm32fsConfig_t cfg;
+    cfg.Blocks = {{{0,1}, {2,3,4}}, {{5,6}, {7,8,9}}};
+    flash.Attach(cfg);
+    Stm32fs fs{cfg};
+    EXPECT_TRUE(fs.isValid());
+
+    const int files = 12;
+    uint8_t data[300] = {0};
+    int value[files];
+    std::fill(value, value + files, -1);
+    uint32_t maxTime = 0;
+    maxIdleTime = 0;
+    for (int round = 0; round < 40; round++) {
+        for (int i = 0; i < files; i++) {
+            std::string name = "f" + std::to_string(i);
+            if (round > 0 && (round + i) % 3 == 0) {
+                EXPECT_TRUE(fs.DeleteFile(name));
+                value[i] = -1;
+            } else {
+                std::memset(data, round + i, sizeof(data));
+                maxTime = std::max(maxTime, TimedWrite(fs, flash, name, data, 100 + (i * 17) % 200));
+                value[i] = (round + i) & 0xff;
+            }
+
+            if (idle) {
+                flash.ResetTime();
+                if (!fs.isOptimizeActive() && fs.GetFreeMemory() < SECTOR_SIZE) {
+                    EXPECT_TRUE(fs.OptimizeStart());
+                }
+                EXPECT_TRUE(fs.OptimizeStep());
+                maxIdleTime = std::max(maxIdleTime, (uint32_t)flash.GetTime());
+            }
+
+            // reads see the last writes in the middle of optimization
+            for (int j = 0; j < files; j++) {
+                SCOPED_TRACE(round * 100 + j);
+                std::string xname = "f" + std::to_string(j);
+                if (value[j] < 0) {
+                    EXPECT_FALSE(fs.FileExist(xname));
+                    continue;
+                }
+                uint8_t rdata[SECTOR_SIZE] = {0};
+                size_t rlen = 0;
+                EXPECT_TRUE(fs.ReadFile(xname, rdata, &rlen, sizeof(rdata)));
+                EXPECT_EQ(rlen, 100 + (j * 17) % 200);
+                EXPECT_EQ(rdata[0], value[j]);
+            }
+        }
+    }
+
+    EXPECT_EQ(flash.GetProgramErrors(), 0U);
+    return maxTime;
+}
+
+TEST(stm32fsTest, OptimizeSteps) {
+    uint32_t maxIdleTime = 0;
+    uint32_t maxTime = RewriteFiles(false, maxIdleTime);
+    uint32_t maxTimeIdle = RewriteFiles(true, maxIdleTime);
+
+    printf("worst write latency: optimize at once %u us, optimize by steps %u us (worst step %u us)\n",
+           maxTime, maxTimeIdle, maxIdleTime);
+    ASSERT_GT(maxTime, SimEraseTime * 3);
+    ASSERT_LT(maxTimeIdle, SimEraseTime);
+    ASSERT_LE(maxIdleTime, SimEraseTime + SimWriteTime * 8 * 40);
+}
+
+TEST(stm32fsTest, OptimizeStepsTransaction) {
+    Stm32fsConfig_t cfg;
+    InitFS2(cfg, 0xff);
+    Stm32fs fs{cfg};
+    ASSERT_TRUE(fs.WriteFile("f1", StdData, sizeof(StdData)));
+    ASSERT_TRUE(fs.WriteFile("f2", StdData, sizeof(StdData)));
+
+    ASSERT_TRUE(fs.OptimizeStart());
+    ASSERT_TRUE(fs.isOptimizeActive());
+    ASSERT_TRUE(fs.BeginTransaction());
+    ASSERT_TRUE(fs.WriteFile("f3", StdData, 5));
+    ASSERT_TRUE(fs.DeleteFile("f1"));
+
+    // data of the open transaction is in the current block. so it waits for commit.
+    for (int i = 0; i < 20; i++)
+        ASSERT_TRUE(fs.OptimizeStep());
+    ASSERT_TRUE(fs.isOptimizeActive());
+    ASSERT_EQ(fs.GetCurrentFsBlockSerial(), 1U);
+
+    ASSERT_TRUE(fs.CommitTransaction());
+    ASSERT_TRUE(fs.OptimizeStep());
+    ASSERT_FALSE(fs.isOptimizeActive());
+    ASSERT_EQ(fs.GetCurrentFsBlockSerial(), 2U);
+
+    ASSERT_FALSE(fs.FileExist("f1"));
+    ASSERT_EQ(fs.FileLength("f2"), sizeof(StdData));
+    ASSERT_EQ(fs.FileLength("f3"), 5);
+
+    Stm32fs fs2{cfg};
+    ASSERT_EQ(fs2.GetCurrentFsBlockSerial(), 2U);
+    ASSERT_FALSE(fs2.FileExist("f1"));
+    ASSERT_EQ(fs2.FileLength("f3"), 5);
+}
+
+static void CheckInlineFile(Stm32fs &fs, std::string_view name, size_t length) {
+    uint8_t data[SECTOR_SIZE] = {0};
+    size_t len = 0;
+    ASSERT_TRUE(fs.ReadFile(name, data, &len, sizeof(data)));
+    ASSERT_EQ(len, length);
+    ASSERT_EQ(std::memcmp(data, StdData, length), 0);
+
+    uint8_t *ptr = nullptr;
+    ASSERT_TRUE(fs.GetFilePtr(name, &ptr, &len));
+    ASSERT_EQ(len, length);
+    ASSERT_EQ(std::memcmp(ptr, StdData, length), 0);
+}
+
+TEST(stm32fsTest, InlineFiles) {
+    for (int multiblock = 0; multiblock < 2; multiblock++) {
+        SCOPED_TRACE(multiblock);
+        Stm32fsConfig_t cfg;
+        if (multiblock)
+            InitFS2(cfg, 0xff);
+        else
+            InitFS(cfg, 0xff);
+        Stm32fs fs{cfg};
+        size_t freemem = fs.GetFreeMemory();
+
+        // tiny files don't take the data area
+        ASSERT_TRUE(fs.WriteFile("i1", StdData, 1));
+        ASSERT_TRUE(fs.WriteFile("i8", StdData, InlineMaxSize));
+        ASSERT_TRUE(fs.WriteFile("i0", StdData, 0));
+        ASSERT_EQ(fs.GetFreeMemory(), freemem);
+        ASSERT_TRUE(fs.WriteFile("d9", StdData, InlineMaxSize + 1));
+        ASSERT_EQ(fs.GetFreeMemory(), freemem - 16);
+        CheckInlineFile(fs, "i1", 1);
+        CheckInlineFile(fs, "i8", InlineMaxSize);
+        ASSERT_EQ(fs.FileLength("i0"), 0);
+
+        // open transaction serves the inline data from the RAM
+        ASSERT_TRUE(fs.BeginTransaction());
+        ASSERT_TRUE(fs.WriteFile("i1", StdData, 3));
+        ASSERT_TRUE(fs.WriteFile("t5", StdData, 5));
+        CheckInlineFile(fs, "i1", 3);
+        CheckInlineFile(fs, "t5", 5);
+        ASSERT_TRUE(fs.CommitTransaction());
+        CheckInlineFile(fs, "i1", 3);
+        CheckInlineFile(fs, "t5", 5);
+
+        ASSERT_TRUE(fs.BeginTransaction());
+        ASSERT_TRUE(fs.WriteFile("i8", StdData, 2));
+        fs.AbortTransaction();
+        CheckInlineFile(fs, "i8", InlineMaxSize);
+
+        // inline data is moved by the optimizer
+        ASSERT_TRUE(fs.DeleteFile("t5"));
+        ASSERT_TRUE(fs.Optimize());
+        ASSERT_FALSE(fs.FileExist("t5"));
+        CheckInlineFile(fs, "i1", 3);
+        CheckInlineFile(fs, "i8", InlineMaxSize);
+        ASSERT_EQ(fs.FileLength("d9"), InlineMaxSize + 1);
+
+        Stm32fs fs2{cfg};
+        ASSERT_TRUE(fs2.isValid());
+        CheckInlineFile(fs2, "i1", 3);
+        CheckInlineFile(fs2, "i8", InlineMaxSize);
+        ASSERT_EQ(fs2.FileLength("i0"), 0);
+        ASSERT_FALSE(fs2.FileExist("t5"));
+        ASSERT_EQ(fs2.GetFreeMemory(), fs.GetFreeMemory());
+    }
+}
+
+TEST(stm32fsTest, InlineFilesOptimizeSteps) {
+    Stm32fsConfig_t cfg;
+    InitFS2(cfg, 0xff);
+    Stm32fs fs{cfg};
+    ASSERT_TRUE(fs.WriteFile("i1", StdData, 4));
+    ASSERT_TRUE(fs.WriteFile("d1", StdData, sizeof(StdData)));
+    ASSERT_TRUE(fs.WriteFile("i1", StdData, 6));
+
+    ASSERT_TRUE(fs.OptimizeStart());
+    while (fs.isOptimizeActive())
+        ASSERT_TRUE(fs.OptimizeStep());
+    ASSERT_EQ(fs.GetCurrentFsBlockSerial(), 2U);
+    CheckInlineFile(fs, "i1", 6);
+
+    Stm32fs fs2{cfg};
+    CheckInlineFile(fs2, "i1", 6);
+    ASSERT_EQ(fs2.FileLength("d1"), sizeof(StdData));
+}
+
+TEST(stm32fsTest, InlinePersonalization) {
+    Stm32fsIOCounters io[2];
+    size_t freemem[2] = {0};
+    for (int i = 0; i < 2; i++) {
+        Stm32fsConfig_t cfg;
+        InitFS(cfg, 0xff);
+        Stm32fs fs{cfg};
+        fs.EnableInline(i == 1);
+        size_t startmem = fs.GetFreeMemory();
+
+        Personalize(fs, true);
+        io[i] = fs.GetIOCounters();
+        freemem[i] = startmem - fs.GetFreeMemory();
+
+        ASSERT_EQ(fs.FileLength("2_24373_0"), 1);
+        ASSERT_EQ(fs.FileLength("2_196_0"), 7);
+    }
+
+    printf("personalization data area: %zu -> %zu bytes, flash writes: %u -> %u (%u -> %u bytes)\n",
+           freemem[0], freemem[1], io[0].Writes, io[1].Writes, io[0].BytesWritten, io[1].BytesWritten);
+    ASSERT_LT(freemem[1], freemem[0]);
+    ASSERT_LT(io[1].Writes, io[0].Writes);
+    ASSERT_LT(io[1].BytesWritten, io[0].BytesWritten);
+}
+
+TEST(stm32fsTest, Counters) {
+    Stm32fsConfig_t cfg;
+    InitFS(cfg, 0xff);
+    cfg.CounterSectors = {10, 11};
+    Stm32fs fs{cfg};
+    ASSERT_TRUE(fs.isCountersEnabled());
+
+    uint32_t value = 0;
+    ASSERT_FALSE(fs.ReadCounter(1, value));
+    ASSERT_TRUE(fs.WriteCounter(2, 100));
+
+    // one flash write per change. full sector rolls up to the other one.
+    fs.GetIOCounters().Clear();
+    const uint32_t changes = 1000;
+    for (uint32_t i = 1; i <= changes; i++)
+        ASSERT_TRUE(fs.WriteCounter(1, i));
+    ASSERT_TRUE(fs.ReadCounter(1, value));
+    ASSERT_EQ(value, changes);
+    ASSERT_TRUE(fs.ReadCounter(2, value));
+    ASSERT_EQ(value, 100U);
+    auto &io = fs.GetIOCounters();
+    printf("counter changes %u: flash writes %u erases %u\n", changes, io.Writes, io.Erases);
+    ASSERT_GE(io.Erases, 2U);
+    ASSERT_LE(io.Writes, changes + (changes / (SECTOR_SIZE / 8 - 1) + 1) * 3);
+    ASSERT_EQ(io.Optimizations, 0U);
+
+    // the same value is not written
+    ASSERT_TRUE(fs.WriteCounter(1, changes));
+    ASSERT_EQ(fs.GetIOCounters().Writes, io.Writes);
+
+    // old sector can be erased in the idle time
+    ASSERT_TRUE(fs.PrepareCounters());
+    ASSERT_FALSE(fs.PrepareCounters());
+
+    Stm32fs fs2{cfg};
+    ASSERT_TRUE(fs2.ReadCounter(1, value));
+    ASSERT_EQ(value, changes);
+    ASSERT_TRUE(fs2.ReadCounter(2, value));
+    ASSERT_EQ(value, 100U);
+
+    // broken record is skipped
+    ASSERT_TRUE(fs2.WriteCounter(1, changes + 1));
+    ASSERT_TRUE(fs2.WriteCounter(1, changes + 2));
+    for (uint32_t addr = 10 * SECTOR_SIZE; addr < 12 * SECTOR_SIZE; addr += 8) {
+        Stm32FSCounterRecord *rec = (Stm32FSCounterRecord *)&vmem[addr];
+        if (rec->CounterID == 1 && rec->Value == changes + 2)
+            rec->CounterIDInv = 0;
+    }
+    Stm32fs fs3{cfg};
+    ASSERT_TRUE(fs3.ReadCounter(1, value));
+    ASSERT_EQ(value, changes + 1);
+
+    // failed program: the value stays, the half-written record is skipped by the next write
+    int failWrites = 1;
+    bool halfWrite = false;
+    Stm32fsConfig_t cfgf = cfg;
+    cfgf.fnWriteFlash = [&failWrites, &halfWrite](uint32_t address, uint8_t *data, size_t len) {
+        // flash is programmed once after the erase
+        for (size_t i = 0; i < len; i++)
+            if (vmem[address + i] != 0xff)
+                return false;
+        if (failWrites > 0) {
+            failWrites--;
+            if (halfWrite)
+                std::memcpy(&vmem[address], data, len / 2);
+            return false;
+        }
+        std::memcpy(&vmem[address], data, len);
+        return true;
+    };
+    Stm32fs fs5{cfgf};
+    ASSERT_FALSE(fs5.WriteCounter(1, changes + 3));
+    ASSERT_TRUE(fs5.ReadCounter(1, value));
+    ASSERT_EQ(value, changes + 1);
+    failWrites = 1;
+    halfWrite = true;
+    ASSERT_FALSE(fs5.WriteCounter(1, changes + 3));
+    ASSERT_TRUE(fs5.WriteCounter(1, changes + 4));
+    ASSERT_TRUE(fs5.WriteCounter(2, 200));
+    Stm32fs fs6{cfg};
+    ASSERT_TRUE(fs6.ReadCounter(1, value));
+    ASSERT_EQ(value, changes + 4);
+    ASSERT_TRUE(fs6.ReadCounter(2, value));
+    ASSERT_EQ(value, 200U);
+
+    // no counter sectors
+    Stm32fsConfig_t cfg4;
+    InitFS(cfg4, 0xff);
+    Stm32fs fs4{cfg4};
+    ASSERT_FALSE(fs4.isCountersEnabled());
+    ASSERT_FALSE(fs4.WriteCounter(1, 1));
+}
+
+TEST(stm32fsTest, PrepareSectors) {
+    Stm32fsConfig_t cfg;
+    InitFS2(cfg, 0xff);
+    Stm32fs fs{cfg};
+    for (int i = 0; i < 20; i++)
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i % 5), StdData, sizeof(StdData)));
+
+    // the old block is erased by the idle calls. optimization doesn't wait for the erase then.
+    for (int round = 0; round < 3; round++) {
+        SCOPED_TRACE(round);
+        ASSERT_TRUE(fs.Optimize());
+        for (int i = 0; i < 20; i++)
+            ASSERT_TRUE(fs.WriteFile("f" + std::to_string(i % 5), StdData, sizeof(StdData)));
+
+        int erases = 0;
+        while (fs.PrepareSectors())
+            erases++;
+        ASSERT_GT(erases, 0);
+
+        uint32_t startErases = fs.GetIOCounters().Erases;
+        ASSERT_TRUE(fs.Optimize());
+        ASSERT_EQ(fs.GetIOCounters().Erases, startErases);
+        ASSERT_EQ(fs.FileLength("f4"), sizeof(StdData));
+    }
+
+    // header sector of the block is erased every time
+    ASSERT_EQ(fs.GetFlash().GetEraseCount(0), fs.GetFlash().GetEraseCount(5) + 1);
+    ASSERT_EQ(fs.GetFlash().GetEraseCount(20), 0U);
+    fs.GetFlash().PrintEraseCounts();
+
+    // the output block of the optimization by steps is not touched
+    ASSERT_TRUE(fs.WriteFile("f0", StdData, 3));
+    ASSERT_TRUE(fs.OptimizeStart());
+    ASSERT_FALSE(fs.PrepareSectors());
+    while (fs.isOptimizeActive())
+        ASSERT_TRUE(fs.OptimizeStep());
+    ASSERT_TRUE(fs.PrepareSectors());
+    ASSERT_EQ(fs.FileLength("f0"), 3);
+}
+
+template <typename F>
+static double BenchmarkCalls(int count, F fn) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++)
+        fn();
+    std::chrono::duration<double, std::nano> time = std::chrono::steady_clock::now() - start;
+    return time.count() / count;
+}
+
+TEST(stm32fsTest, BenchmarkFlashScan) {
+    Stm32fsConfig_t cfg;
+    InitFS(cfg, 0xff);
+    Stm32fs fs{cfg};
+    fs.EnableInline(false);
+    auto &flash = fs.GetFlash();
+    uint32_t dataStart = flash.GetBlockAddress(2);
+
+    // empty data area is the longest scan
+    volatile bool empty = false;
+    double emptyScan = BenchmarkCalls(2000, [&]{empty = flash.isFlashEmpty(dataStart, SECTOR_SIZE * 3, true, nullptr);});
+    ASSERT_TRUE(empty);
+    double addrCheck = BenchmarkCalls(100000, [&]{empty = flash.AddressInFlash(dataStart + 100, SECTOR_SIZE * 2, true);});
+    ASSERT_TRUE(empty);
+
+    // nearly full image
+    int files = 0;
+    while (fs.GetFreeMemory() > 64 && fs.GetFreeFileDescriptors() > 2) {
+        ASSERT_TRUE(fs.WriteFile("f" + std::to_string(files % 50), StdData, 1 + (files + 1) % 16));
+        files++;
+    }
+    volatile uint32_t freemem = 0;
+    double freeMemory = BenchmarkCalls(100000, [&]{freemem = fs.GetFreeMemory();});
+    double mount = BenchmarkCalls(200, [&]{Stm32fs fs2{cfg}; freemem = fs2.GetFreeMemory();});
+    ASSERT_EQ(freemem, fs.GetFreeMemory());
+
+    uint32_t except = 0;
+    ASSERT_FALSE(flash.isFlashEmpty(dataStart + 1, SECTOR_SIZE, false, &except));
+    ASSERT_EQ(except, dataStart);
+    ASSERT_FALSE(flash.isFlashEmpty(dataStart, SECTOR_SIZE * 3, true, &except));
+    ASSERT_EQ((except + 1 + 7) / 8 * 8, dataStart + SECTOR_SIZE * 3 - fs.GetFreeMemory());
+
+    printf("empty scan %.0f ns, address check %.1f ns, GetFreeMemory %.1f ns, mount %.0f ns (%d writes)\n",
+           emptyScan, addrCheck, freeMemory, mount, files);
+}
+
 /*
 TEST(stm32fsTest, Create3Blocks) {
     Stm32fsConfig_t cfg;
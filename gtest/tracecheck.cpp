@@ -0,0 +1,94 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <cstdio>
+#include "../src/trace.h"
+#include "../src/latency.h"
+#include "../pc/pcstorage.h"
+
+using namespace Util;
+
+static uint64_t fakeTicks = 0;
+static uint64_t FakeClock() {
+    fakeTicks += 5;
+    return fakeTicks;
+}
+
+static std::string ReadText(const char *fileName) {
+    std::string text;
+    FILE *f = fopen(fileName, "r");
+    if (!f)
+        return text;
+    char buf[256];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+        text.append(buf, len);
+    fclose(f);
+    return text;
+}
+
+// spans of the fs write nest the flash programs. they get to the file as Chrome trace events.
+TEST(traceTest, Spans) {
+    const char *fileName = "/tmp/opgptest_trace.json";
+    Tracer &tracer = Tracer::GetTracer();
+    tracer.Clear();
+
+    // nothing without the clock
+    {
+        TRACE_SPAN("nothing");
+    }
+    EXPECT_EQ(tracer.Count(), 0U);
+
+    LatencyStatistic::GetLatencyStatistic().SetClock(FakeClock, 5);
+    ASSERT_TRUE(tracer.Open(fileName));
+
+    File::Stm32fsImageStorage storage;
+    ASSERT_EQ(storage.Init(), 0);
+    tracer.Drain();
+    {
+        TRACE_SPAN_ARG("APDUExecutor::Execute", 0xda);
+        uint8_t data[20] = {0};
+        EXPECT_EQ(storage.WriteFile((char *)"2_91_0", data, sizeof(data)), 0);
+        EXPECT_EQ(storage.Flush(), 0);
+    }
+    EXPECT_GE(tracer.Count(), 4U);
+    tracer.Close();
+    LatencyStatistic::GetLatencyStatistic().SetClock(nullptr, 1);
+
+    std::string text = ReadText(fileName);
+    EXPECT_EQ(text.substr(0, 2), "[\n");
+    size_t write = text.find("\"name\":\"Stm32fs::WriteFile\"");
+    size_t program = text.find("\"name\":\"Stm32fsFlash::ProgramFlash\"");
+    size_t execute = text.find("\"name\":\"APDUExecutor::Execute\"");
+    EXPECT_NE(write, std::string::npos);
+    EXPECT_NE(program, std::string::npos);
+    ASSERT_NE(execute, std::string::npos);
+    // children end first
+    EXPECT_LT(write, execute);
+    EXPECT_LT(program, execute);
+    EXPECT_NE(text.find("\"args\":{\"arg\":\"0xda\"}", execute), std::string::npos);
+    remove(fileName);
+}
+
+TEST(traceTest, RingBuffer) {
+    Tracer &tracer = Tracer::GetTracer();
+    tracer.Clear();
+    LatencyStatistic::GetLatencyStatistic().SetClock(FakeClock, 5);
+    for (int i = 0; i < 1100; i++) {
+        TRACE_SPAN_ARG("span", i);
+    }
+    LatencyStatistic::GetLatencyStatistic().SetClock(nullptr, 1);
+    EXPECT_EQ(tracer.Count(), 1024U);
+    EXPECT_EQ(tracer.Dropped(), 76U);
+
+    // the newest ones are kept
+    FILE *f = tmpfile();
+    ASSERT_NE(f, nullptr);
+    tracer.WriteEvents(f);
+    rewind(f);
+    char line[256] = {0};
+    ASSERT_NE(fgets(line, sizeof(line), f), nullptr);
+    EXPECT_NE(std::string(line).find("\"arg\":\"0x4c\""), std::string::npos);
+    fclose(f);
+    tracer.Clear();
+}
@@ -11,9 +11,12 @@
 
 #include <algorithm>
 #include <cstring>
+#include <cstddef>
+#include <cstdint>
 
 static const size_t FileHeaderSize = 16;
 static const uint8_t FlashPadding = 8;
+static const uint16_t CounterStartSeq = 0xc33c;
 
 #ifndef OPTIMIZATION_O2
 #define OPTIMIZATION_O2 __attribute__((optimize("O2")))
@@ -23,6 +26,43 @@ static const uint8_t FlashPadding = 8;
 #define OPTIMIZATION_O0 __attribute__((optimize("O0")))
 #endif
 
+// spans of the application tracer when it is built in. the fs doesn't depend on it.
+#if defined(OPGP_TRACE) && __has_include("trace.h")
+#include "trace.h"
+#else
+#define TRACE_SPAN(name) do {} while (0)
+#endif
+
+/*
+ * --- layouts ---
+ */
+
+bool Stm32fsLayoutDevice(Stm32fsConfig_t &cfg, uint16_t first, size_t sectors) {
+    if (sectors < 4)
+        return false;
+
+    cfg.Blocks = {{{first}, {(uint16_t)(first + 1), (uint16_t)(first + 2), (uint16_t)(first + 3)}}};
+    cfg.CounterSectors.clear();
+    // DS counter and PW error counters without the file rewrites
+    if (sectors >= 6)
+        cfg.CounterSectors = {(uint16_t)(first + 4), (uint16_t)(first + 5)};
+    return true;
+}
+
+bool Stm32fsLayoutPC(Stm32fsConfig_t &cfg, uint16_t first, size_t sectors) {
+    if (sectors < 10)
+        return false;
+
+    cfg.Blocks.clear();
+    for (uint16_t block = first; block < first + 10; block += 5)
+        cfg.Blocks.push_back({{block, (uint16_t)(block + 1)},
+                              {(uint16_t)(block + 2), (uint16_t)(block + 3), (uint16_t)(block + 4)}});
+    cfg.CounterSectors.clear();
+    if (sectors >= 12)
+        cfg.CounterSectors = {(uint16_t)(first + 10), (uint16_t)(first + 11)};
+    return true;
+}
+
 /*
  * --- Stm32fsFlash ---
  */
@@ -41,10 +81,39 @@ Stm32fsConfigBlock_t *Stm32fsFlash::Init(Stm32fsConfig_t *config) {
     if (FsConfig->Blocks.size() == 0)
         return nullptr;
 
+    if (FsConfig->Blocks.size() >= SectorCounter)
+        return nullptr;
+
+    SectorSize = (FsConfig->SectorSize != 0) ? FsConfig->SectorSize : BlockSize;
+    if (SectorSize % FileHeaderSize != 0)
+        return nullptr;
+
+    size_t sectors = 0;
     for(auto &block: FsConfig->Blocks) {
         if (block.HeaderSectors.size() == 0 || block.DataSectors.size() == 0)
             return nullptr;
+        for (auto sector: block.HeaderSectors)
+            sectors = std::max(sectors, (size_t)sector + 1);
+        for (auto sector: block.DataSectors)
+            sectors = std::max(sectors, (size_t)sector + 1);
+    }
+    for (auto sector: FsConfig->CounterSectors)
+        sectors = std::max(sectors, (size_t)sector + 1);
+    // addresses are 32 bit
+    if ((uint64_t)sectors * SectorSize > UINT32_MAX)
+        return nullptr;
+    SectorStates.assign(sectors, Stm32fsSectorState::Unknown);
+    EraseCounts.assign(sectors, 0);
+
+    SectorBlocks.assign(sectors, SectorNone);
+    for (size_t i = 0; i < FsConfig->Blocks.size(); i++) {
+        for (auto sector: FsConfig->Blocks[i].HeaderSectors)
+            SectorBlocks[sector] = i;
+        for (auto sector: FsConfig->Blocks[i].DataSectors)
+            SectorBlocks[sector] = i;
     }
+    for (auto sector: FsConfig->CounterSectors)
+        SectorBlocks[sector] = SectorCounter;
 
     auto blk = SearchLastFsBlockInFlash();
 
@@ -66,6 +135,9 @@ bool Stm32fsFlash::SetCurrentFsBlock(Stm32fsConfigBlock_t *block) {
         return  false;
     
     CurrentFsBlock = block;
+    CurrentBlockID = SectorNone;
+    if (FsConfig != nullptr && block >= FsConfig->Blocks.data() && block < FsConfig->Blocks.data() + FsConfig->Blocks.size())
+        CurrentBlockID = block - FsConfig->Blocks.data();
     return true;
 }
 
@@ -77,15 +149,15 @@ size_t Stm32fsFlash::GetBaseAddress() {
     return FsConfig->BaseBlockAddress;
 }
 
-uint32_t Stm32fsFlash::GetBlockAddress(uint8_t blockNum) {
-    return blockNum * BlockSize;
+uint32_t Stm32fsFlash::GetBlockAddress(uint16_t blockNum) {
+    return blockNum * SectorSize;
 }
 
 uint32_t Stm32fsFlash::GetBlockFromAddress(uint32_t address) {
-    return address / BlockSize;
+    return address / SectorSize;
 }
 
-bool Stm32fsFlash::FindBlockInConfigBlock(Stm32fsConfigBlock_t &block, uint32_t sectorNo) {
+bool Stm32fsFlash::FindBlockInConfigBlock(const Stm32fsConfigBlock_t &block, uint32_t sectorNo) {
     if (std::find(block.HeaderSectors.begin(), block.HeaderSectors.end(), sectorNo) != block.HeaderSectors.end())
         return true;
 
@@ -95,7 +167,7 @@ bool Stm32fsFlash::FindBlockInConfigBlock(Stm32fsConfigBlock_t &block, uint32_t
     return false;
 }
 
-bool Stm32fsFlash::FindBlockInCfg(std::vector<Stm32fsConfigBlock_t> blocks, uint32_t sectorNo) {
+bool Stm32fsFlash::FindBlockInCfg(const std::vector<Stm32fsConfigBlock_t> &blocks, uint32_t sectorNo) {
     for (auto &block : blocks) {
         if (FindBlockInConfigBlock(block, sectorNo))
             return true;
@@ -103,43 +175,47 @@ bool Stm32fsFlash::FindBlockInCfg(std::vector<Stm32fsConfigBlock_t> blocks, uint
     return false;
 }
 
+// sectors are checked by the map. range must be in the current block or in the fs sectors if `searchAllBlocks`.
 bool OPTIMIZATION_O2 Stm32fsFlash::AddressInFlash(uint32_t address, size_t length, bool searchAllBlocks) {
-    if (CurrentFsBlock != nullptr) {
-        uint32_t curAddress = address;
-        
-        while (true) {
-            uint32_t blockNo = GetBlockFromAddress(curAddress);
-            if (!FindBlockInConfigBlock(*CurrentFsBlock, blockNo))
-                break;
-                
-            curAddress = GetBlockAddress(blockNo) + BlockSize;
-            if (curAddress > address + length - 1)
-                return true;
-        }
-    }
-    
-    if (searchAllBlocks && FsConfig != nullptr) {
-        uint32_t curAddress = address;
-        
-        while (true) {
-            uint32_t blockNo = GetBlockFromAddress(curAddress);
-            if (!FindBlockInCfg(FsConfig->Blocks, blockNo))
-                break;
-                
-            curAddress = GetBlockAddress(blockNo) + BlockSize;
-            if (curAddress > address + length - 1)
-                return true;
-        }
-        
+    uint32_t firstSector = GetBlockFromAddress(address);
+    uint32_t lastSector = (length > 0) ? GetBlockFromAddress(address + length - 1) : firstSector;
+
+    bool inCurrent = (CurrentBlockID != SectorNone);
+    bool inFs = true;
+    for (uint32_t sector = firstSector; sector <= lastSector; sector++) {
+        uint8_t block = (sector < SectorBlocks.size()) ? SectorBlocks[sector] : SectorNone;
+        if (block != CurrentBlockID)
+            inCurrent = false;
+        if (block == SectorNone)
+            inFs = false;
     }
+
+    if (inCurrent || (searchAllBlocks && inFs))
+        return true;
     
     printf("out of memory!!! adr=%ld len=%zd\n", address, length);
     return false;
 }
 
-bool OPTIMIZATION_O0 Stm32fsFlash::EraseFlashBlock(uint8_t blockNo) {
+void Stm32fsFlash::SetSectorState(uint32_t sectorNo, Stm32fsSectorState state) {
+    if (sectorNo < SectorStates.size())
+        SectorStates[sectorNo] = state;
+}
+
+bool OPTIMIZATION_O0 Stm32fsFlash::EraseFlashBlock(uint16_t blockNo) {
+    TRACE_SPAN("Stm32fsFlash::EraseFlashBlock");
+    // pending writes may be in the sector
+    if (!Flush())
+        return false;
+
     //printf("--erase  flash %d\n", blockNo);
-    return FsConfig->fnEraseFlashBlock(blockNo);
+    IOCounters.Erases++;
+    if (blockNo < EraseCounts.size())
+        EraseCounts[blockNo]++;
+
+    bool res = FsConfig->fnEraseFlashBlock(blockNo);
+    SetSectorState(blockNo, res ? Stm32fsSectorState::Erased : Stm32fsSectorState::Unknown);
+    return res;
 }
 
 bool OPTIMIZATION_O2 Stm32fsFlash::isFlashEmpty(uint32_t address, size_t length, bool reverse, uint32_t *exceptAddr) {
@@ -151,50 +227,195 @@ bool OPTIMIZATION_O2 Stm32fsFlash::isFlashEmpty(uint32_t address, size_t length,
     
     // length - length of flash block
     size_t len = ((length + (address - addr)) / FlashPadding) * FlashPadding;
-    if (len != length)
+    if (len != length + (address - addr))
         len += FlashPadding;
     
     if (!AddressInFlash(addr, len, true))
         return false;
 
+    // word by word. addr and len are aligned to FlashPadding.
     uint8_t *data = (uint8_t *)(FsConfig->BaseBlockAddress + addr);
+    size_t words = len / sizeof(uint64_t);
+    uint64_t word;
     
     if (!reverse) {
-        for (uint32_t i = 0; i < len; i++)
-            if (data[i] != 0xffU) {
-                if (exceptAddr)
-                    *exceptAddr = addr + i;
-                return false;
-            }
+        for (size_t w = 0; w < words; w++) {
+            memcpy(&word, data + w * sizeof(word), sizeof(word));
+            if (word == UINT64_MAX)
+                continue;
+            
+            for (size_t i = w * sizeof(word); ; i++)
+                if (data[i] != 0xffU)
+                    return CombineEmpty(addr, len, reverse, false, addr + i, exceptAddr);
+        }
     } else {
-        for (int i = len - 1; i >= 0; i--)
-            if (data[i] != 0xffU) {
-                if (exceptAddr != nullptr)
-                    *exceptAddr = addr + i;
-                return false;
-            }
+        for (size_t w = words; w > 0; w--) {
+            memcpy(&word, data + (w - 1) * sizeof(word), sizeof(word));
+            if (word == UINT64_MAX)
+                continue;
+            
+            for (size_t i = w * sizeof(word) - 1; ; i--)
+                if (data[i] != 0xffU)
+                    return CombineEmpty(addr, len, reverse, false, addr + i, exceptAddr);
+        }
     }
     
-    return true;
+    return CombineEmpty(addr, len, reverse, true, 0, exceptAddr);
+}
+
+bool Stm32fsFlash::isFlashBlockEmpty(uint16_t blockNo) {
+    if (blockNo < SectorStates.size() && SectorStates[blockNo] != Stm32fsSectorState::Unknown)
+        return SectorStates[blockNo] == Stm32fsSectorState::Erased;
+
+    bool empty = isFlashEmpty(GetBlockAddress(blockNo), SectorSize, false, nullptr);
+    SetSectorState(blockNo, empty ? Stm32fsSectorState::Erased : Stm32fsSectorState::Written);
+    return empty;
 }
 
-bool Stm32fsFlash::isFlashBlockEmpty(uint8_t blockNo) {
-    return isFlashEmpty(GetBlockAddress(blockNo), BlockSize, false, nullptr);
+bool OPTIMIZATION_O0 Stm32fsFlash::ProgramFlash(uint32_t address, uint8_t *data, size_t length) {
+    TRACE_SPAN("Stm32fsFlash::ProgramFlash");
+    //printf("--write flash %d %d\n", address, length);
+    IOCounters.Writes++;
+    IOCounters.BytesWritten += length;
+    return FsConfig->fnWriteFlash(address, data, length);
 }
 
 bool OPTIMIZATION_O0 Stm32fsFlash::WriteFlash(uint32_t address, uint8_t *data, size_t length) {
     if (!AddressInFlash(address, length, true))
         return false;
 
-    //printf("--write flash %d %d\n", address, length);
-    return FsConfig->fnWriteFlash(address, data, length);
+    if (length > 0)
+        for (uint32_t sector = GetBlockFromAddress(address); sector <= GetBlockFromAddress(address + length - 1); sector++)
+            SetSectorState(sector, Stm32fsSectorState::Written);
+
+    // big write goes directly. pending ones go before it to keep the order.
+    if (CombineRunsPending.empty() || CombineSuspended || length == 0 || length > CombineRunSize) {
+        if (!Flush())
+            return false;
+        return ProgramFlash(address, data, length);
+    }
+
+    Stm32fsCombineRun *run = CombineSearch(address, length);
+    if (run == nullptr) {
+        for (auto &prun : CombineRunsPending)
+            if (prun.Length == 0) {
+                run = &prun;
+                break;
+            }
+
+        // all the runs are busy
+        if (run == nullptr) {
+            if (!Flush())
+                return false;
+            run = &CombineRunsPending[0];
+        }
+        run->Address = address;
+        run->Length = 0;
+    }
+
+    // padding of the last double word stays erased
+    uint32_t offset = address - run->Address;
+    std::memset(&run->Data[run->Length], 0xff, offset - run->Length);
+    std::memcpy(&run->Data[offset], data, length);
+    run->Length = offset + length;
+    run->LastWrite = ++CombineSequence;
+    IOCounters.CombinedWrites++;
+    return true;
 }
 
 bool OPTIMIZATION_O0 Stm32fsFlash::ReadFlash(uint32_t address, uint8_t *data, size_t length) {
     if (!AddressInFlash(address, length, true))
         return false;
     //printf("--read flash %d %d\n", address, length);
-    return FsConfig->fnReadFlash(address, data, length);
+    IOCounters.Reads++;
+    IOCounters.BytesRead += length;
+    if (!FsConfig->fnReadFlash(address, data, length))
+        return false;
+
+    for (auto &run : CombineRunsPending) {
+        uint32_t start = std::max(address, run.Address);
+        uint32_t end = std::min((uint32_t)(address + length), run.Address + run.Length);
+        if (run.Length > 0 && start < end)
+            std::memcpy(&data[start - address], &run.Data[start - run.Address], end - start);
+    }
+    return true;
+}
+
+// run that ends right before the address (with the padding) and has the place for the write
+Stm32fsCombineRun *Stm32fsFlash::CombineSearch(uint32_t address, size_t length) {
+    for (auto &run : CombineRunsPending) {
+        if (run.Length == 0)
+            continue;
+
+        uint32_t end = run.Address + run.Length;
+        end = ((end + FlashPadding - 1) / FlashPadding) * FlashPadding;
+        if (address == end && address - run.Address + length <= CombineRunSize)
+            return &run;
+    }
+    return nullptr;
+}
+
+// result of isFlashEmpty with the pending data. `found` - the first (or the last if reverse)
+// written byte in the flash.
+bool Stm32fsFlash::CombineEmpty(uint32_t address, size_t length, bool reverse, bool empty, uint32_t found, uint32_t *exceptAddr) {
+    for (auto &run : CombineRunsPending) {
+        uint32_t start = std::max(address, run.Address);
+        uint32_t end = std::min((uint32_t)(address + length), run.Address + run.Length);
+        if (run.Length == 0 || start >= end)
+            continue;
+
+        for (uint32_t i = 0; i < end - start; i++) {
+            uint32_t addr = reverse ? end - 1 - i : start + i;
+            if (run.Data[addr - run.Address] == 0xffU)
+                continue;
+
+            if (empty || (reverse ? addr > found : addr < found))
+                found = addr;
+            empty = false;
+            break;
+        }
+    }
+
+    if (exceptAddr != nullptr)
+        *exceptAddr = empty ? 0 : found;
+    return empty;
+}
+
+void Stm32fsFlash::EnableCombining(bool enable) {
+    Flush();
+    CombineRunsPending.assign(enable ? CombineRuns : 0, Stm32fsCombineRun());
+}
+
+void Stm32fsFlash::SuspendCombining(bool suspend) {
+    if (suspend)
+        Flush();
+    CombineSuspended = suspend;
+}
+
+bool Stm32fsFlash::Flush() {
+    while (true) {
+        Stm32fsCombineRun *run = nullptr;
+        for (auto &prun : CombineRunsPending)
+            if (prun.Length > 0 && (run == nullptr || prun.LastWrite < run->LastWrite))
+                run = &prun;
+        if (run == nullptr)
+            return true;
+
+        uint32_t length = run->Length;
+        run->Length = 0;
+        if (!ProgramFlash(run->Address, run->Data, length)) {
+            for (auto &prun : CombineRunsPending)
+                prun.Length = 0;
+            return false;
+        }
+    }
+}
+
+bool Stm32fsFlash::FlushRange(uint32_t address, size_t length) {
+    for (auto &run : CombineRunsPending)
+        if (run.Length > 0 && address < run.Address + run.Length && run.Address < address + length)
+            return Flush();
+    return true;
 }
 
 bool Stm32fsFlash::EraseSectors(UVector &sectors) {
@@ -263,6 +484,37 @@ bool Stm32fsFlash::CreateFsBlock(Stm32fsConfigBlock_t &blockCfg, uint32_t serial
     return WriteFlash(GetBlockAddress(blockCfg.HeaderSectors[0]), (uint8_t *)&header, sizeof(header));
 }
 
+bool Stm32fsFlash::EraseSpareSector(Stm32fsConfigBlock_t *currentBlock, Stm32fsConfigBlock_t *keepBlock) {
+    if (FsConfig == nullptr || currentBlock == nullptr)
+        return false;
+
+    for (auto &block: FsConfig->Blocks) {
+        if (&block == currentBlock || &block == keepBlock)
+            continue;
+
+        for (auto sector: block.HeaderSectors)
+            if (!isFlashBlockEmpty(sector))
+                return EraseFlashBlock(sector);
+        for (auto sector: block.DataSectors)
+            if (!isFlashBlockEmpty(sector))
+                return EraseFlashBlock(sector);
+    }
+    return false;
+}
+
+uint32_t Stm32fsFlash::GetEraseCount(uint16_t sectorNo) {
+    if (sectorNo >= EraseCounts.size())
+        return 0;
+    return EraseCounts[sectorNo];
+}
+
+void Stm32fsFlash::PrintEraseCounts() {
+    printf("---- stm32fs erases by sector ----\n");
+    for (size_t i = 0; i < EraseCounts.size(); i++)
+        if (EraseCounts[i] > 0)
+            printf("[%zu] %u\n", i, EraseCounts[i]);
+}
+
 Stm32fsConfigBlock_t *Stm32fsFlash::SearchLastFsBlockInFlash() {
     uint32_t lastSerial = 0;
     Stm32fsConfigBlock_t *xblock = nullptr;
@@ -303,16 +555,244 @@ Stm32fsConfigBlock_t *Stm32fsFlash::SearchNextFsBlockInFlash() {
     return nextBlk;
 }
 
+/*
+ * --- Stm32fsIndex ---
+ */
+
+static uint32_t PaddedSize(uint32_t size) {
+    return ((size + FlashPadding - 1) / FlashPadding) * FlashPadding;
+}
+
+uint8_t Stm32fsIndex::NameHash(std::string_view fileName) {
+    // FNV-1a folded to 8 bits
+    uint32_t hash = 2166136261U;
+    for (auto c : fileName) {
+        hash ^= (uint8_t)c;
+        hash *= 16777619U;
+    }
+    return (hash ^ (hash >> 8) ^ (hash >> 16) ^ (hash >> 24)) & 0xffU;
+}
+
+uint8_t Stm32fsIndex::PrefixHash(std::string_view fileName) {
+    uint8_t hash = NameHash(fileName.substr(0, fileName.find('_') + 1));
+    return (hash != 0) ? hash : 1;
+}
+
+uint8_t Stm32fsIndex::FilterPrefixHash(std::string_view prefix) {
+    size_t pos = prefix.find('_');
+    if (pos == std::string_view::npos)
+        return 0;
+    return PrefixHash(prefix.substr(0, pos + 1));
+}
+
+void Stm32fsIndex::Init(size_t headerRecords) {
+    size_t size = 8;
+    while (size < headerRecords)
+        size *= 2;
+
+    entries.assign(size, Stm32fsIndexEntry{});
+    prefixes.assign(size, 0);
+    idSlots.assign(size, NoSlot);
+    Valid = false;
+    Generation++;
+    EntryCount = 0;
+    LiveFiles = 0;
+    LiveDataSize = 0;
+}
+
+void Stm32fsIndex::Clear() {
+    std::fill(entries.begin(), entries.end(), Stm32fsIndexEntry{});
+    std::fill(prefixes.begin(), prefixes.end(), 0);
+    std::fill(idSlots.begin(), idSlots.end(), NoSlot);
+    Valid = false;
+    Generation++;
+    EntryCount = 0;
+    LiveFiles = 0;
+    LiveDataSize = 0;
+}
+
+void Stm32fsIndex::Account(const Stm32fsIndexEntry &entry, bool add) {
+    if (entry.VersionState != fsFileVersion && entry.VersionState != fsFileInline)
+        return;
+
+    uint32_t size = (entry.VersionState == fsFileVersion) ? PaddedSize(entry.FileSize) : 0;
+    if (add) {
+        LiveFiles++;
+        LiveDataSize += size;
+    } else {
+        LiveFiles--;
+        LiveDataSize -= size;
+    }
+}
+
+Stm32fsIndexEntry *Stm32fsIndex::FirstSlot(uint8_t nameHash, size_t &slot) {
+    if (entries.empty())
+        return nullptr;
+
+    slot = nameHash & (entries.size() - 1);
+    return (entries[slot].FileID != 0) ? &entries[slot] : nullptr;
+}
+
+Stm32fsIndexEntry *Stm32fsIndex::NextSlot(size_t &slot) {
+    slot = (slot + 1) & (entries.size() - 1);
+    return (entries[slot].FileID != 0) ? &entries[slot] : nullptr;
+}
+
+Stm32fsIndexEntry *Stm32fsIndex::FindByID(uint16_t fileID) {
+    if (idSlots.empty() || fileID == 0)
+        return nullptr;
+
+    size_t pos = fileID & (idSlots.size() - 1);
+    for (size_t i = 0; i < idSlots.size() && idSlots[pos] != NoSlot; i++) {
+        if (entries[idSlots[pos]].FileID == fileID)
+            return &entries[idSlots[pos]];
+        pos = (pos + 1) & (idSlots.size() - 1);
+    }
+
+    return nullptr;
+}
+
+bool Stm32fsIndex::Insert(const Stm32fsIndexEntry &entry, uint8_t prefixHash) {
+    if (entries.empty() || entry.FileID == 0)
+        return false;
+
+    size_t slot = entry.NameHash & (entries.size() - 1);
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[slot].FileID == 0)
+            break;
+        slot = (slot + 1) & (entries.size() - 1);
+    }
+    if (entries[slot].FileID != 0 || slot == NoSlot)
+        return false;
+
+    // entries are not removed, so both tables have a free place
+    size_t pos = entry.FileID & (idSlots.size() - 1);
+    while (idSlots[pos] != NoSlot)
+        pos = (pos + 1) & (idSlots.size() - 1);
+
+    entries[slot] = entry;
+    prefixes[slot] = prefixHash;
+    idSlots[pos] = slot;
+    Generation++;
+    EntryCount++;
+    Account(entry, true);
+    return true;
+}
+
+bool Stm32fsIndex::Append(uint16_t fileID, std::string_view fileName, uint32_t headerAddress) {
+    Stm32fsIndexEntry entry = {};
+    entry.FileID = fileID;
+    entry.NameHash = NameHash(fileName);
+    entry.VersionState = fsEmpty;
+    entry.HeaderAddress = headerAddress;
+    return Insert(entry, PrefixHash(fileName));
+}
+
+bool Stm32fsIndex::SetVersion(Stm32FSFileVersion &version) {
+    Stm32fsIndexEntry *entry = FindByID(version.FileID);
+    if (entry == nullptr)
+        return false;
+
+    SetEntryVersion(*entry, version);
+    return true;
+}
+
+void Stm32fsIndex::SetEntryVersion(Stm32fsIndexEntry &entry, Stm32FSFileVersion &version) {
+    Account(entry, false);
+    entry.VersionState = (version.Flags & fvInline) ? fsFileInline : version.FileState;
+    entry.FileAddress = version.FileAddress;
+    entry.FileSize = version.FileSize;
+    Account(entry, true);
+}
+
 /*
  * --- Stm32fs ---
  */
 
+static const size_t InlineDataOffset = offsetof(Stm32FSFileInline, Data);
+static_assert(sizeof(Stm32FSCheckpoint) == FileHeaderSize, "checkpoint is one catalog record");
+static_assert(sizeof(Stm32fsIndexEntry) == 16, "checkpoint entries are written as they are in RAM");
+static_assert(sizeof(Stm32fsCatalogStat) == sizeof(Stm32fsIndexEntry), "catalog stat is one more checkpoint entry");
+
+// version in force from the version record at recordAddress. inline file becomes usual version
+// that points into the record. record of the open transaction doesn't have the address yet.
+static Stm32FSFileVersion ResolveVersion(Stm32FSFileVersion &version, uint32_t recordAddress) {
+    if (version.FileState != fsFileInline)
+        return version;
+
+    Stm32FSFileVersion ver = {};
+    ver.FileState = fsFileVersion;
+    ver.FileID = version.FileID;
+    ver.Flags = fvInline;
+    ver.FileAddress = (recordAddress != 0) ? recordAddress + InlineDataOffset : 0;
+    ver.FileSize = version.FileSize;
+    return ver;
+}
+
+// inline record of the version in force. data is copied from the memory-mapped flash.
+static Stm32FSFileInline InlineRecord(Stm32FSFileVersion &version, uint8_t *data) {
+    Stm32FSFileInline rec;
+    std::memset((void *)&rec, 0x00, sizeof(rec));
+    rec.FileState = fsFileInline;
+    rec.FileID = version.FileID;
+    rec.FileSize = version.FileSize;
+    std::memcpy(rec.Data, data, std::min((size_t)version.FileSize, InlineMaxSize));
+    return rec;
+}
+
+static Stm32FSFileVersion IndexEntryVersion(Stm32fsIndexEntry &entry) {
+    Stm32FSFileVersion ver = {};
+    ver.FileState = entry.VersionState;
+    if (entry.VersionState == fsFileInline) {
+        ver.FileState = fsFileVersion;
+        ver.Flags = fvInline;
+    }
+    ver.FileID = entry.FileID;
+    ver.FileAddress = entry.FileAddress;
+    ver.FileSize = entry.FileSize;
+    return ver;
+}
+
+bool fnmatch(std::string_view &pattern, std::string_view &name){
+    if (pattern == name)
+        return true;
+
+    if (pattern == "*")
+        return true;
+    
+    size_t xlen = std::min(pattern.size(), name.size());
+    for (size_t i = 0; i < xlen; i++) {
+        if (pattern[i] == '*')
+            return true;
+        if (pattern[i] != '?' &&
+            pattern[i] != name[i])
+            return false;
+    }
+    
+    // exact match with length
+    return (pattern.size() == name.size());
+}
+
+static bool HasPrefix(std::string_view name, std::string_view prefix) {
+    return name.substr(0, prefix.size()) == prefix;
+}
+
+static bool VersionLive(uint8_t versionState) {
+    return versionState == fsFileVersion || versionState == fsFileInline;
+}
+
+static std::string_view HeaderFileName(Stm32FSFileHeader &header) {
+    return {header.FileName, strnlen(header.FileName, FileNameMaxLen)};
+}
+
 bool Stm32fs::SetCurrentFsBlock(Stm32fsConfigBlock_t *block) {
     if (block == nullptr)
         return false;
     
     CurrentFsBlock = block;
     flash.SetCurrentFsBlock(CurrentFsBlock);
+    StepReset();
+    LoadCatalog();
     return true;
 }
 
@@ -382,6 +862,11 @@ Stm32FSFileHeader Stm32fs::SearchFileHeader(std::string_view fileName) {
     
     if (fileName.size() > FileNameMaxLen)
         return header;
+
+    if (Index.isValid()) {
+        IndexSearch(fileName, &header);
+        return header;
+    }
     
     Stm32FSFileRecord filerec;
     uint32_t addr = GetFirstHeader(filerec);
@@ -409,6 +894,13 @@ Stm32FSFileHeader Stm32fs::SearchFileHeaderByID(uint16_t fileId) {
     if (fileId == 0)
         return header;
 
+    if (Index.isValid()) {
+        Stm32fsIndexEntry *entry = Index.FindByID(fileId);
+        if (entry != nullptr && !flash.ReadFlash(entry->HeaderAddress, (uint8_t *)&header, sizeof(header)))
+            header.FileState = fsEmpty;
+        return header;
+    }
+
     Stm32FSFileRecord filerec;
     uint32_t addr = GetFirstHeader(filerec);
 
@@ -426,66 +918,434 @@ Stm32FSFileHeader Stm32fs::SearchFileHeaderByID(uint16_t fileId) {
     return header;
 }
 
-Stm32FSFileVersion Stm32fs::SearchFileVersion(uint16_t fileID) {
-    Stm32FSFileVersion fver = {};
-    fver.FileState = fsEmpty;
-    
-    if (fileID == 0)
-        return fver;
-    
+// walks the catalog in order and gives the file headers and the versions that are in force.
+// versions of the transaction group are given at its commit record. group without commit
+// (power was lost) and versions that lost their begin record are skipped. delete by the prefix
+// is given as the prefix. it deletes the files of the headers before it.
+bool Stm32fs::ReplayCatalog(std::function<void (Stm32FSFileHeader&, uint32_t)> fnHeader,
+                            std::function<void (Stm32FSFileVersion&)> fnVersion, uint32_t startAfter,
+                            std::function<void (std::string_view)> fnPrefix) {
+    Stm32FSFileVersion group[TxMaxRecords];
+    size_t groupCount = 0;
+    bool inTx = false;
+    uint16_t txCount = 0;
+
     Stm32FSFileRecord filerec;
-    uint32_t addr = GetFirstHeader(filerec);
+    uint32_t addr = (startAfter != 0) ? GetNextHeader(startAfter, filerec) : GetFirstHeader(filerec);
     
     while(true) {
         if (addr == 0)
             break;
 
-        if ((filerec.version.FileState == fsFileVersion || filerec.version.FileState == fsDeleted) && filerec.version.FileID == fileID) {
-            fver = filerec.version;            
+        uint8_t state = filerec.version.FileState;
+        bool isVersion = (state == fsFileVersion || state == fsFileInline || state == fsDeleted);
+        if (state == fsTxBegin) {
+            inTx = true;
+            txCount = 0;
+            groupCount = 0;
+        } else if (state == fsTxCommit) {
+            if (inTx && txCount == filerec.transaction.RecordCount && fnVersion) {
+                for (size_t i = 0; i < groupCount; i++) {
+                    group[i].Flags &= ~fvTransaction;
+                    fnVersion(group[i]);
+                }
+            }
+            inTx = false;
+        } else if (isVersion && (filerec.version.Flags & fvTransaction)) {
+            txCount++;
+            if (inTx && groupCount < TxMaxRecords)
+                group[groupCount++] = ResolveVersion(filerec.version, addr);
+        } else {
+            // transaction without commit. power was lost.
+            inTx = false;
+
+            if (state == fsFileHeader && fnHeader)
+                fnHeader(filerec.header, addr);
+            if (isVersion && fnVersion) {
+                Stm32FSFileVersion ver = ResolveVersion(filerec.version, addr);
+                fnVersion(ver);
+            }
+            if (state == fsDeletePrefix && fnPrefix) {
+                Stm32FSDeletePrefix &del = filerec.deletePrefix;
+                fnPrefix({del.Prefix, std::min((size_t)del.PrefixLength, sizeof(del.Prefix))});
+            }
         }
         
         addr = GetNextHeader(addr, filerec);
     }
-    
-    return fver;
+
+    return true;
 }
 
-Stm32FSFileHeader Stm32fs::AppendFileHeader(std::string_view fileName) {
-    Stm32FSFileHeader header = SearchFileHeader(fileName);
-    if(header.FileState == fsFileHeader)
-        return header;
+Stm32FSFileVersion Stm32fs::SearchFileVersion(uint16_t fileID) {
+    Stm32FSFileVersion fver = {};
+    fver.FileState = fsEmpty;
     
-    uint16_t fileID = 0;
-    uint32_t addr = GetFirstHeaderAddress();
+    if (fileID == 0)
+        return fver;
 
-    Stm32FSFileRecord filerec;
-    while(true) {
-        if (addr == 0)
-            break;
+    if (Index.isValid()) {
+        Stm32fsIndexEntry *entry = Index.FindByID(fileID);
+        if (entry != nullptr)
+            fver = IndexEntryVersion(*entry);
+    } else {
+        ReplayCatalog(nullptr, [&fver, fileID](Stm32FSFileVersion &ver) {
+                if (ver.FileID == fileID)
+                    fver = ver;
+            }, 0,
+            [this, &fver, fileID](std::string_view prefix) {
+                if (fver.FileState != fsFileVersion)
+                    return;
+                Stm32FSFileHeader header = SearchFileHeaderByID(fileID);
+                if (header.FileState == fsFileHeader && HasPrefix(HeaderFileName(header), prefix)) {
+                    fver = {};
+                    fver.FileState = fsDeleted;
+                    fver.FileID = fileID;
+                }
+            });
+    }
 
-        if(!flash.ReadFlash(addr, (uint8_t *)&filerec, sizeof(filerec)))
-            return header;
-        
-        // end of catalog
-        if (filerec.header.FileState == fsEmpty)
-            break;
-        
-        if (filerec.header.FileID > fileID)
-            fileID = filerec.header.FileID;
-        
-        addr = GetNextHeaderAddress(addr);
+    // our own not committed writes
+    if (TxActive) {
+        Stm32FSFileVersion *ver = TxSearchVersion(fileID);
+        if (ver != nullptr)
+            fver = ResolveVersion(*ver, 0);
     }
+    
+    return fver;
+}
 
-    if (addr != 0) {
+void Stm32fs::BuildIndex() {
+    Index.Clear();
+    if (!IndexEnabled || !CheckValid())
+        return;
+
+    Index.Init(CurrentFsBlock->HeaderSectors.size() * flash.GetSectorSize() / FileHeaderSize);
+    bool res = true;
+    ReplayCatalog([this, &res](Stm32FSFileHeader &header, uint32_t addr) {
+            res = res && Index.Append(header.FileID, HeaderFileName(header), addr);
+        },
+        [this](Stm32FSFileVersion &ver) {
+            Index.SetVersion(ver);
+        }, 0,
+        [this](std::string_view prefix) {
+            IndexDeletePrefix(prefix);
+        });
+    Index.SetValid(res);
+}
+
+// the last checkpoint. catalog is read back from its end, so only the records after the checkpoint are read.
+uint32_t Stm32fs::FindCheckpoint() {
+    if (!CheckValid())
+        return 0;
+
+    UVector &sectors = CurrentFsBlock->HeaderSectors;
+    uint32_t sectorSize = flash.GetSectorSize();
+    bool tailFound = false;
+    for (size_t i = sectors.size(); i > 0; i--) {
+        uint32_t start = flash.GetBlockAddress(sectors[i - 1]);
+        uint32_t first = (i == 1) ? start + sizeof(Stm32FSHeader_t) : start;
+        uint32_t end = start + sectorSize;
+
+        // end of the catalog is the last written byte
+        if (!tailFound) {
+            uint32_t waddress = 0;
+            if (flash.isFlashEmpty(first, end - first, true, &waddress))
+                continue;
+            if (waddress < first)
+                return 0;
+            end = first + ((waddress - first) / FileHeaderSize + 1) * FileHeaderSize;
+            tailFound = true;
+        }
+
+        // by record number: the sector can start at the address 0
+        for (uint32_t n = (end - first) / FileHeaderSize; n > 0; n--) {
+            uint32_t addr = first + (n - 1) * FileHeaderSize;
+            uint8_t state = fsEmpty;
+            if (!flash.ReadFlash(addr, &state, sizeof(state)))
+                return 0;
+            if (state == fsCheckpoint)
+                return addr;
+        }
+    }
+
+    return 0;
+}
+
+bool Stm32fs::LoadCheckpoint(uint32_t checkpointAddr) {
+    Index.Clear();
+    if (!IndexEnabled || !CheckValid())
+        return false;
+
+    Stm32FSCheckpoint cp;
+    if (!flash.ReadFlash(checkpointAddr, (uint8_t *)&cp, sizeof(cp)) || cp.FileState != fsCheckpoint)
+        return false;
+    if (!flash.AddressInFlash(cp.Address, (cp.EntryCount + 1) * sizeof(Stm32fsIndexEntry)))
+        return false;
+
+    Index.Init(CurrentFsBlock->HeaderSectors.size() * flash.GetSectorSize() / FileHeaderSize);
+    for (size_t i = 0; i < cp.EntryCount; i++) {
+        Stm32fsIndexEntry entry;
+        if (!flash.ReadFlash(cp.Address + i * sizeof(entry), (uint8_t *)&entry, sizeof(entry)))
+            return false;
+        if (!Index.Insert(entry))
+            return false;
+    }
+
+    bool res = true;
+    ReplayCatalog([this, &res](Stm32FSFileHeader &header, uint32_t addr) {
+            res = res && Index.Append(header.FileID, HeaderFileName(header), addr);
+        },
+        [this](Stm32FSFileVersion &ver) {
+            Index.SetVersion(ver);
+        },
+        checkpointAddr,
+        [this](std::string_view prefix) {
+            IndexDeletePrefix(prefix);
+        });
+    Index.SetValid(res);
+    return res;
+}
+
+bool Stm32fs::WriteCheckpoint() {
+    if (!CheckValid() || !CheckpointEnabled || !Index.isValid() || TxActive || isOptimizeActive())
+        return false;
+
+    if (!TailValid && !LoadTail())
+        return false;
+
+    if (CatalogTail == 0) {
+        NeedsOptimization = true;
+        return false;
+    }
+
+    std::vector<Stm32fsIndexEntry> entries;
+    for (auto &entry : Index.Entries())
+        if (entry.FileID != 0)
+            entries.push_back(entry);
+    if (entries.empty())
+        return false;
+
+    Stm32fsIndexEntry stat;
+    std::memcpy((void *)&stat, &CatalogStat, sizeof(stat));
+    entries.push_back(stat);
+
+    size_t length = entries.size() * sizeof(Stm32fsIndexEntry);
+    uint32_t addr = FindEmptyDataArea(length);
+    if (addr == 0) {
+        NeedsOptimization = true;
+        return false;
+    }
+
+    // 1st - entries and the catalog stat, 2nd - record
+    DataEnd = addr + length;
+    if (!flash.WriteFlash(addr, (uint8_t *)entries.data(), length))
+        return false;
+
+    Stm32FSCheckpoint cp;
+    std::memset((void *)&cp, 0x00, sizeof(cp));
+    cp.FileState = fsCheckpoint;
+    cp.EntryCount = entries.size() - 1;
+    cp.NextFileID = NextFileID;
+    cp.DataEnd = DataEnd;
+    cp.Address = addr;
+    if (!flash.WriteFlash(CatalogTail, (uint8_t *)&cp, sizeof(cp))) {
+        LoadCatalog();
+        return false;
+    }
+
+    AdvanceTail(1);
+    CheckpointTail = CatalogRecords;
+    Stm32FSFileRecord rec;
+    rec.checkpoint = cp;
+    CountRecord(rec);
+    return true;
+}
+
+bool Stm32fs::PrepareCheckpoint() {
+    if (!CheckValid() || !CheckpointEnabled || TxActive || isOptimizeActive() || !TailValid)
+        return false;
+
+    // the checkpoint is the whole index in the data area. with the interval growing with the index
+    // checkpoints take at most one entry of data per catalog record they save from the replay.
+    if (CatalogRecords - CheckpointTail < std::max(CheckpointRecords, Index.GetEntryCount()))
+        return false;
+
+    return WriteCheckpoint();
+}
+
+Stm32fsIndexEntry *Stm32fs::IndexSearch(std::string_view fileName, Stm32FSFileHeader *header) {
+    uint8_t hash = Stm32fsIndex::NameHash(fileName);
+    size_t slot = 0;
+    
+    Stm32fsIndexEntry *entry = Index.FirstSlot(hash, slot);
+    while (entry != nullptr) {
+        if (entry->NameHash == hash) {
+            Stm32FSFileHeader xheader;
+            if (!flash.ReadFlash(entry->HeaderAddress, (uint8_t *)&xheader, sizeof(xheader)))
+                return nullptr;
+
+            if (HeaderFileName(xheader) == fileName) {
+                if (header != nullptr)
+                    *header = xheader;
+                return entry;
+            }
+        }
+        entry = Index.NextSlot(slot);
+    }
+
+    return nullptr;
+}
+
+bool Stm32fs::IndexSlotMatch(size_t slot, std::string_view prefix, uint8_t prefixHash, Stm32FSFileHeader &header) {
+    uint8_t &slotPrefix = Index.SlotPrefix(slot);
+    if (prefixHash != 0 && slotPrefix != 0 && slotPrefix != prefixHash)
+        return false;
+
+    if (!flash.ReadFlash(Index.Entries()[slot].HeaderAddress, (uint8_t *)&header, sizeof(header)))
+        return false;
+    if (slotPrefix == 0)
+        slotPrefix = Stm32fsIndex::PrefixHash(HeaderFileName(header));
+
+    return HasPrefix(HeaderFileName(header), prefix);
+}
+
+void Stm32fs::IndexDeletePrefix(std::string_view prefix) {
+    uint8_t prefixHash = Stm32fsIndex::FilterPrefixHash(prefix);
+    auto &entries = Index.Entries();
+    for (size_t slot = 0; slot < entries.size(); slot++) {
+        Stm32FSFileHeader header;
+        if (entries[slot].FileID == 0 || !VersionLive(entries[slot].VersionState) ||
+            !IndexSlotMatch(slot, prefix, prefixHash, header))
+            continue;
+
+        Stm32FSFileVersion ver = {};
+        ver.FileState = fsDeleted;
+        ver.FileID = entries[slot].FileID;
+        Index.SetEntryVersion(entries[slot], ver);
+    }
+}
+
+// slots of the namespace sorted by the header record. entries are not removed from the index, so
+// the list is good until a new entry or a rebuild. deleted files are skipped by the state at the search.
+void Stm32fs::IndexFindSlots(uint8_t prefixHash) {
+    if (FindSlotsValid && FindPrefixHash == prefixHash && FindGeneration == Index.GetGeneration())
+        return;
+
+    auto &entries = Index.Entries();
+    FindSlots.clear();
+    for (size_t slot = 0; slot < entries.size(); slot++) {
+        uint8_t slotPrefix = Index.SlotPrefix(slot);
+        if (entries[slot].FileID == 0 || (prefixHash != 0 && slotPrefix != 0 && slotPrefix != prefixHash))
+            continue;
+        FindSlots.push_back(slot);
+    }
+    std::sort(FindSlots.begin(), FindSlots.end(), [this, &entries](uint16_t a, uint16_t b) {
+        return RecordNumber(entries[a].HeaderAddress) < RecordNumber(entries[b].HeaderAddress);
+    });
+
+    FindPrefixHash = prefixHash;
+    FindGeneration = Index.GetGeneration();
+    FindSlotsValid = true;
+}
+
+// the next file in the catalog order is the live entry with the next header record. the prefix
+// index skips the other namespaces, so only the headers of the filter namespace are read.
+Stm32File_t *Stm32fs::IndexFindNext(Stm32File_t *filePtr) {
+    std::string_view prefix = filePtr->FileFilter.substr(0, filePtr->FileFilter.find_first_of("*?"));
+    uint8_t prefixHash = Stm32fsIndex::FilterPrefixHash(prefix);
+    auto &entries = Index.Entries();
+
+    IndexFindSlots(prefixHash);
+    auto it = FindSlots.begin();
+    if (filePtr->HeaderAddress != 0)
+        it = std::upper_bound(FindSlots.begin(), FindSlots.end(), RecordNumber(filePtr->HeaderAddress),
+                              [this, &entries](uint32_t record, uint16_t slot) {
+                                  return record < RecordNumber(entries[slot].HeaderAddress);
+                              });
+
+    for (; it != FindSlots.end(); ++it) {
+        size_t next = *it;
+        if (!VersionLive(entries[next].VersionState))
+            continue;
+
+        Stm32FSFileHeader header;
+        if (!IndexSlotMatch(next, prefix, prefixHash, header))
+            continue;
+        std::string_view name = HeaderFileName(header);
+        if (!fnmatch(filePtr->FileFilter, name))
+            continue;
+
+        Stm32FSFileVersion ver = IndexEntryVersion(entries[next]);
+        std::memset(filePtr->FileNameChr, 0, sizeof(filePtr->FileNameChr));
+        std::memcpy(filePtr->FileNameChr, name.data(), name.size());
+        filePtr->FileName = std::string_view(filePtr->FileNameChr, name.size());
+        filePtr->FileID = header.FileID;
+        filePtr->FileAddress = ver.FileAddress;
+        filePtr->FileSize = ver.FileSize;
+        filePtr->HeaderAddress = entries[next].HeaderAddress;
+        return filePtr;
+    }
+
+    return nullptr;
+}
+
+// header and version in force of the file. with the index it is one flash read.
+bool Stm32fs::SearchFile(std::string_view fileName, Stm32FSFileHeader &header, Stm32FSFileVersion &version) {
+    version = {};
+    version.FileState = fsEmpty;
+
+    if (!Index.isValid() || fileName.size() > FileNameMaxLen) {
+        header = SearchFileHeader(fileName);
+        if (header.FileState != fsFileHeader)
+            return false;
+
+        version = SearchFileVersion(header.FileID);
+        return true;
+    }
+
+    header.FileState = fsEmpty;
+    Stm32fsIndexEntry *entry = IndexSearch(fileName, &header);
+    if (entry == nullptr || header.FileState != fsFileHeader)
+        return false;
+
+    version = IndexEntryVersion(*entry);
+    if (TxActive) {
+        Stm32FSFileVersion *ver = TxSearchVersion(header.FileID);
+        if (ver != nullptr)
+            version = ResolveVersion(*ver, 0);
+    }
+    return true;
+}
+
+Stm32FSFileHeader Stm32fs::AppendFileHeader(std::string_view fileName) {
+    Stm32FSFileHeader header = SearchFileHeader(fileName);
+    if(header.FileState == fsFileHeader)
+        return header;
+    
+    if (!TailValid && !LoadTail())
+        return header;
+
+    uint32_t addr = CatalogTail;
+    if (addr != 0) {
         header.FileState = fsFileHeader;
-        header.FileID = fileID + 1;
+        header.FileID = NextFileID;
         std::memset(header.FileName, 0x00, FileNameMaxLen);
         std::memcpy(header.FileName, fileName.data(), std::min(fileName.size(), FileNameMaxLen));
         
         if (!flash.WriteFlash(addr, (uint8_t *)&header, sizeof(header))) {
             header.FileState = fsError;
+            LoadCatalog();
             return header;
         }
+
+        NextFileID++;
+        AdvanceTail(1);
+        Stm32FSFileRecord rec;
+        rec.header = header;
+        CountRecord(rec);
+        if (Index.isValid() && !Index.Append(header.FileID, HeaderFileName(header), addr))
+            Index.SetValid(false);
     } else {
         NeedsOptimization = true;
     }
@@ -494,33 +1354,58 @@ Stm32FSFileHeader Stm32fs::AppendFileHeader(std::string_view fileName) {
 }
 
 bool Stm32fs::AppendFileVersion(Stm32FSFileVersion &version) {
+    if (!TailValid && !LoadTail())
+        return false;
 
-    uint32_t addr = GetFirstHeaderAddress();
-    if (!flash.AddressInFlash(addr, FileHeaderSize))
+    if (CatalogTail == 0) {
+        NeedsOptimization = true;
         return false;
-    
-    Stm32FSFileRecord filerec;
-    while(true) {
-        if (addr == 0)
-            break;
+    }
 
-        if (!flash.ReadFlash(addr, (uint8_t *)&filerec, sizeof(filerec)))
-            break;
-        
-        // end of catalog
-        if (filerec.header.FileState == fsEmpty)
-            return flash.WriteFlash(addr, (uint8_t *)&version, sizeof(Stm32FSFileVersion));
-        
-        addr = GetNextHeaderAddress(addr);
+    uint32_t addr = CatalogTail;
+    if (!flash.WriteFlash(addr, (uint8_t *)&version, sizeof(Stm32FSFileVersion))) {
+        LoadCatalog();
+        return false;
     }
-    NeedsOptimization = true;
-    
-    return false;
+
+    AdvanceTail(1);
+    Stm32FSFileRecord rec;
+    rec.version = version;
+    CountRecord(rec);
+    if (Index.isValid()) {
+        Stm32FSFileVersion ver = ResolveVersion(version, addr);
+        Index.SetVersion(ver);
+    }
+    return true;
 }
 
-uint32_t Stm32fs::FindEmptyDataArea(size_t length) {
+// one scan of the catalog and of the data area after the last file
+bool Stm32fs::LoadTail(uint32_t checkpointAddr) {
+    TailValid = false;
+    CatalogTail = 0;
+    CatalogRecords = 0;
+    CheckpointTail = 0;
+    NextFileID = 1;
+    DataEnd = 0;
+    CatalogStat = {};
+    if (CurrentFsBlock == nullptr)
+        return false;
+
     uint32_t daddr = flash.GetBlockAddress(CurrentFsBlock->DataSectors[0]);
+    uint16_t fileID = 0;
     uint32_t addr = GetFirstHeaderAddress();
+    if (checkpointAddr != 0) {
+        Stm32FSCheckpoint cp;
+        if (!flash.ReadFlash(checkpointAddr, (uint8_t *)&cp, sizeof(cp)) || cp.FileState != fsCheckpoint)
+            return false;
+        uint32_t statAddr = cp.Address + cp.EntryCount * sizeof(Stm32fsIndexEntry);
+        if (!flash.AddressInFlash(statAddr, sizeof(CatalogStat)) ||
+            !flash.ReadFlash(statAddr, (uint8_t *)&CatalogStat, sizeof(CatalogStat)))
+            return false;
+
+        CatalogRecords = RecordNumber(checkpointAddr);
+        addr = checkpointAddr;
+    }
     
     Stm32FSFileRecord filerec;
     while(true) {
@@ -528,19 +1413,102 @@ uint32_t Stm32fs::FindEmptyDataArea(size_t length) {
             break;
 
         if (!flash.ReadFlash(addr, (uint8_t *)&filerec, sizeof(filerec)))
-            break;
+            return false;
         
         // end of catalog
         if (filerec.version.FileState == fsEmpty)
             break;
         
-       if (filerec.version.FileState == fsFileVersion && filerec.version.FileID != 0) {         
+        if (filerec.header.FileID > fileID)
+            fileID = filerec.header.FileID;
+
+        if (filerec.version.FileState == fsFileVersion && filerec.version.FileID != 0) {         
             if (filerec.version.FileAddress + filerec.version.FileSize > daddr)
                 daddr = filerec.version.FileAddress + filerec.version.FileSize;
-       }
+        }
+
+        if (filerec.checkpoint.FileState == fsCheckpoint) {
+            fileID = std::max(fileID, (uint16_t)(filerec.checkpoint.NextFileID - 1));
+            daddr = std::max(daddr, filerec.checkpoint.DataEnd);
+            CheckpointTail = CatalogRecords + 1;
+        }
         
+        CountRecord(filerec);
+        CatalogRecords++;
         addr = GetNextHeaderAddress(addr);
     }
+
+    // data without records (power lost before commit) lies after the last file
+    uint32_t dataAreaEnd = flash.GetBlockAddress(CurrentFsBlock->DataSectors[0]) + 
+                           CurrentFsBlock->DataSectors.size() * flash.GetSectorSize();
+    uint32_t waddress = 0;
+    if (daddr < dataAreaEnd && !flash.isFlashEmpty(daddr, dataAreaEnd - daddr, true, &waddress) && waddress != 0) {
+        daddr = waddress + 1;
+        uint32_t aladdr = (daddr / FlashPadding) * FlashPadding;
+        if (daddr != aladdr)
+            daddr = aladdr + FlashPadding;
+    }
+
+    CatalogTail = addr;
+    NextFileID = fileID + 1;
+    DataEnd = daddr;
+    TailValid = true;
+    return true;
+}
+
+void Stm32fs::AdvanceTail(size_t records) {
+    for (size_t i = 0; i < records && CatalogTail != 0; i++)
+        CatalogTail = GetNextHeaderAddress(CatalogTail);
+    CatalogRecords += records;
+}
+
+// transaction records are not counted. statistic gets them from CatalogRecords.
+void Stm32fs::CountRecord(Stm32FSFileRecord &filerec) {
+    switch (filerec.header.FileState) {
+    case fsFileHeader:
+        CatalogStat.HeaderRecords++;
+        break;
+    case fsFileVersion:
+        CatalogStat.VersionRecords++;
+        CatalogStat.VersionDataSize += PaddedSize(filerec.version.FileSize);
+        break;
+    case fsFileInline:
+    case fsDeleted:
+        CatalogStat.VersionRecords++;
+        break;
+    case fsCheckpoint:
+        CatalogStat.CheckpointDataSize += (filerec.checkpoint.EntryCount + 1) * sizeof(Stm32fsIndexEntry);
+        break;
+    default:
+        break;
+    }
+}
+
+// everything that is kept in RAM about the catalog. from the last checkpoint if it is there.
+void Stm32fs::LoadCatalog() {
+    uint32_t checkpointAddr = (CheckpointEnabled && IndexEnabled) ? FindCheckpoint() : 0;
+    if (checkpointAddr != 0 && LoadTail(checkpointAddr) && LoadCheckpoint(checkpointAddr))
+        return;
+
+    LoadTail();
+    BuildIndex();
+}
+
+// number of the record in the catalog. fs header is not counted.
+uint32_t Stm32fs::RecordNumber(uint32_t addr) {
+    UVector &sectors = CurrentFsBlock->HeaderSectors;
+    uint32_t sector = flash.GetBlockFromAddress(addr);
+    for (size_t i = 0; i < sectors.size(); i++)
+        if (sectors[i] == sector)
+            return (i * flash.GetSectorSize() + addr - flash.GetBlockAddress(sector) - sizeof(Stm32FSHeader_t)) / FileHeaderSize;
+    return 0;
+}
+
+uint32_t Stm32fs::FindEmptyDataArea(size_t length) {
+    if (!TailValid && !LoadTail())
+        return 0;
+
+    uint32_t daddr = DataEnd;
     
     // check for empty. because data writes before it writes a record to a header.
     uint32_t waddress = 0;
@@ -564,20 +1532,45 @@ uint32_t Stm32fs::FindEmptyDataArea(size_t length) {
 Stm32fs::Stm32fs(Stm32fsConfig_t config) {
     Valid = false;
     NeedsOptimization = false;
+    TxActive = false;
+    TxCount = 0;
+    TailValid = false;
+    CheckpointTail = 0;
     CurrentFsBlock = nullptr;
     FsConfig = config;
 
+    IndexEnabled = true;
+    CheckpointEnabled = true;
+    InlineEnabled = true;
+    CounterSector = -1;
+    CounterNextFailed = false;
+
     CurrentFsBlock = flash.Init(&FsConfig);
     if (CurrentFsBlock == nullptr)
         return;
     
     Valid = true;
+    LoadCatalog();
+    LoadCounters();
 }
 
 Stm32fs::Stm32fs() {
     Valid = false;
     NeedsOptimization = false;
+    TxActive = false;
+    TxCount = 0;
+    TailValid = false;
+    CheckpointTail = 0;
     CurrentFsBlock = nullptr;
+    IndexEnabled = true;
+    CheckpointEnabled = true;
+    InlineEnabled = true;
+    CounterSector = -1;
+    CounterNextFailed = false;
+}
+
+Stm32fs::~Stm32fs() {
+    flash.Flush();
 }
 
 bool Stm32fs::isValid() {
@@ -592,7 +1585,7 @@ uint32_t Stm32fs::GetSize() {
     if (!CheckValid())
         return 0;
     
-    return CurrentFsBlock->DataSectors.size() * BlockSize;
+    return CurrentFsBlock->DataSectors.size() * flash.GetSectorSize();
 }
 
 uint32_t Stm32fs::GetFreeMemory() {
@@ -600,7 +1593,7 @@ uint32_t Stm32fs::GetFreeMemory() {
         return 0;
 
     int size = FindEmptyDataArea(8) - flash.GetBlockAddress(CurrentFsBlock->DataSectors[0]);
-    int freesize = CurrentFsBlock->DataSectors.size() * BlockSize - size;
+    int freesize = CurrentFsBlock->DataSectors.size() * flash.GetSectorSize() - size;
 
     if (freesize > 0)
         return freesize;
@@ -612,27 +1605,11 @@ uint32_t Stm32fs::GetFreeFileDescriptors() {
     if (!CheckValid())
         return 0;
 
-    uint32_t addr = GetFirstHeaderAddress();
-    
-    uint32_t size = sizeof(Stm32FSHeader_t);
-    Stm32FSFileRecord filerec;
-    while(true) {
-        if (addr == 0)
-            break;
-
-        if (!flash.ReadFlash(addr, (uint8_t *)&filerec, sizeof(filerec)))
-            break;
-        
-        // end of catalog
-        if (filerec.version.FileState == fsEmpty)
-            break;
-        
-        size += FileHeaderSize;
-        
-        addr = GetNextHeaderAddress(addr);
-    }
+    if (!TailValid && !LoadTail())
+        return 0;
 
-    return (CurrentFsBlock->HeaderSectors.size() * BlockSize - size) / 16;
+    uint32_t size = sizeof(Stm32FSHeader_t) + CatalogRecords * FileHeaderSize;
+    return (CurrentFsBlock->HeaderSectors.size() * flash.GetSectorSize() - size) / 16;
 }
 
 Stm32fsStatistic Stm32fs::GetStatistic() {
@@ -642,8 +1619,38 @@ Stm32fsStatistic Stm32fs::GetStatistic() {
     if (!CheckValid())
         return stat;
 
-    stat.HeaderSize = block->HeaderSectors.size() * BlockSize;
-    stat.DataSize = block->DataSectors.size() * BlockSize;
+    if (!Index.isValid() || (!TailValid && !LoadTail()))
+        return ScanStatistic();
+
+    // every file has one header record. the version in force of the live file is its only valid version.
+    size_t liveFiles = Index.GetLiveFiles();
+    stat.SectorSize = flash.GetSectorSize();
+    stat.HeaderSize = block->HeaderSectors.size() * flash.GetSectorSize();
+    stat.HeaderFreeDescriptors = GetFreeFileDescriptors();
+    stat.HeaderFileDescriptors = liveFiles;
+    stat.HeaderVersionDescriptors = liveFiles;
+    stat.HeaderDeletedFileDescriptors = CatalogStat.HeaderRecords - liveFiles;
+    stat.HeaderDeletedVersionDescriptors = CatalogStat.VersionRecords - liveFiles;
+    stat.HeaderSystemDescriptors = 1 + CatalogRecords - CatalogStat.HeaderRecords - CatalogStat.VersionRecords;
+    stat.HeaderFreeSize = stat.HeaderFreeDescriptors * FileHeaderSize;
+
+    stat.DataSize = block->DataSectors.size() * flash.GetSectorSize();
+    stat.DataFreeSize = GetFreeMemory();
+    stat.DataOccupiedSize = Index.GetLiveDataSize();
+    stat.DataDeletedSize = CatalogStat.VersionDataSize - Index.GetLiveDataSize() + CatalogStat.CheckpointDataSize;
+
+    stat.Valid = true;
+    return stat;
+}
+
+Stm32fsStatistic Stm32fs::ScanStatistic() {
+    Stm32fsConfigBlock_t *block = CurrentFsBlock;
+    Stm32fsStatistic stat = {};
+    stat.Valid = false;
+
+    stat.SectorSize = flash.GetSectorSize();
+    stat.HeaderSize = block->HeaderSectors.size() * flash.GetSectorSize();
+    stat.DataSize = block->DataSectors.size() * flash.GetSectorSize();
     stat.DataFreeSize = GetFreeMemory();
 
     Stm32fsStatFileState StatIndex[stat.HeaderSize / 16];
@@ -677,14 +1684,23 @@ Stm32fsStatistic Stm32fs::GetStatistic() {
                 StatIndex[StatIndexId] = Stm32fsStatFileState::DeletedFileName;
         }
 
+        if (filerec.version.FileState == fsFileInline) {
+            Stm32FSFileVersion ver = SearchFileVersion(filerec.header.FileID);
+            if (ver.FileState == fsFileVersion && ver.FileAddress == addr + InlineDataOffset)
+                StatIndex[StatIndexId] = Stm32fsStatFileState::FileVersion;
+            else
+                StatIndex[StatIndexId] = Stm32fsStatFileState::DeletedFileVersion;
+        }
+
+        // optimization drops the checkpoints
+        if (filerec.checkpoint.FileState == fsCheckpoint)
+            stat.DataDeletedSize += (filerec.checkpoint.EntryCount + 1) * sizeof(Stm32fsIndexEntry);
+
         if (filerec.version.FileState == fsFileVersion) {
             Stm32FSFileVersion ver = SearchFileVersion(filerec.header.FileID);
 
-            size_t sz = ver.FileSize;
-            // if address is aligned - maybe the size of file should be aligned too
-            if (ver.FileAddress % FlashPadding == 0)
-                if (sz % FlashPadding != 0)
-                    sz = sz + (FlashPadding - sz % FlashPadding);
+            // data of this record. the next one is written after the padding.
+            size_t sz = PaddedSize(filerec.version.FileSize);
 
             if (ver.FileState == fsFileVersion && ver.FileAddress == filerec.version.FileAddress) {
                 StatIndex[StatIndexId] = Stm32fsStatFileState::FileVersion;
@@ -731,12 +1747,9 @@ bool Stm32fs::FileExist(std::string_view fileName) {
     if (!CheckValid())
         return false;
 
-    Stm32FSFileHeader header = SearchFileHeader(fileName);
-    if (header.FileState != fsFileHeader)
-        return false;
-    
-    Stm32FSFileVersion ver = SearchFileVersion(header.FileID);
-    if (ver.FileState != fsFileVersion)
+    Stm32FSFileHeader header;
+    Stm32FSFileVersion ver;
+    if (!SearchFile(fileName, header, ver) || ver.FileState != fsFileVersion)
         return false;
      
     return true;
@@ -746,11 +1759,11 @@ int Stm32fs::FileLength(std::string_view fileName) {
     if (!CheckValid())
         return false;
 
-    Stm32FSFileHeader header = SearchFileHeader(fileName);
-    if (header.FileState != fsFileHeader)
+    Stm32FSFileHeader header;
+    Stm32FSFileVersion ver;
+    if (!SearchFile(fileName, header, ver))
         return -1;
     
-    Stm32FSFileVersion ver = SearchFileVersion(header.FileID);
     if (ver.FileState != fsFileVersion)
         return -2;
      
@@ -758,22 +1771,23 @@ int Stm32fs::FileLength(std::string_view fileName) {
 }
 
 bool Stm32fs::ReadFile(std::string_view fileName, uint8_t *data, size_t *length, size_t maxlength) {
+    TRACE_SPAN("Stm32fs::ReadFile");
     if (!CheckValid())
         return false;
 
     if (length != nullptr)
         *length = 0;
 
-    Stm32FSFileHeader header = SearchFileHeader(fileName);
-    if (header.FileState != fsFileHeader)
-        return false;
-
-    Stm32FSFileVersion ver = SearchFileVersion(header.FileID);
-    if (ver.FileState != fsFileVersion)
+    Stm32FSFileHeader header;
+    Stm32FSFileVersion ver;
+    if (!SearchFile(fileName, header, ver) || ver.FileState != fsFileVersion)
         return false;
 
     size_t len = std::min((size_t)ver.FileSize, maxlength);
-    if (!flash.ReadFlash(ver.FileAddress, data, len))
+    Stm32FSFileInline *txinline = TxSearchInline(header.FileID);
+    if (txinline != nullptr)
+        std::memcpy(data, txinline->Data, len);
+    else if (!flash.ReadFlash(ver.FileAddress, data, len))
         return false;
     
     if (length != nullptr)
@@ -783,24 +1797,29 @@ bool Stm32fs::ReadFile(std::string_view fileName, uint8_t *data, size_t *length,
 }
 
 bool Stm32fs::GetFilePtr(std::string_view fileName, uint8_t **ptr, size_t *length) {
+    TRACE_SPAN("Stm32fs::GetFilePtr");
     if (!CheckValid())
         return false;
 
-    Stm32FSFileHeader header = SearchFileHeader(fileName);
-    if (header.FileState != fsFileHeader)
+    Stm32FSFileHeader header;
+    Stm32FSFileVersion ver;
+    if (!SearchFile(fileName, header, ver) || ver.FileState != fsFileVersion)
         return false;
     
-    Stm32FSFileVersion ver = SearchFileVersion(header.FileID);
-    if (ver.FileState != fsFileVersion)
+    Stm32FSFileInline *txinline = TxSearchInline(header.FileID);
+    if (txinline != nullptr)
+        *ptr = txinline->Data;
+    else if (flash.FlushRange(ver.FileAddress, ver.FileSize))
+        *ptr = (uint8_t *)(FsConfig.BaseBlockAddress + ver.FileAddress);
+    else
         return false;
-    
-    *ptr = (uint8_t *)(FsConfig.BaseBlockAddress + ver.FileAddress);
     *length = ver.FileSize;
 
     return true;
 }
 
 bool Stm32fs::WriteFile(std::string_view fileName, uint8_t *data, size_t length) {
+    TRACE_SPAN("Stm32fs::WriteFile");
     if (!CheckValid())
         return false;
 
@@ -810,6 +1829,20 @@ bool Stm32fs::WriteFile(std::string_view fileName, uint8_t *data, size_t length)
         if (header.FileState == fsEmpty)
             return false;
     }
+
+    // small file goes into the version record. one flash write.
+    if (InlineEnabled && length <= InlineMaxSize) {
+        Stm32FSFileRecord rec;
+        std::memset((void *)&rec, 0x00, sizeof(rec));
+        rec.inlineVersion.FileState = fsFileInline;
+        rec.inlineVersion.FileID = header.FileID;
+        rec.inlineVersion.FileSize = length;
+        std::memcpy(rec.inlineVersion.Data, data, length);
+
+        if (TxActive)
+            return TxAppendVersion(rec.version);
+        return AppendFileVersion(rec.version);
+    }
     
     uint32_t addr = FindEmptyDataArea(length);
     if (addr == 0) {
@@ -817,6 +1850,8 @@ bool Stm32fs::WriteFile(std::string_view fileName, uint8_t *data, size_t length)
         return false;
     }
     
+    // failed write can leave a part of the data
+    DataEnd = addr + length;
     if (!flash.WriteFlash(addr, data, length))
         return false;
     
@@ -825,6 +1860,9 @@ bool Stm32fs::WriteFile(std::string_view fileName, uint8_t *data, size_t length)
     ver.FileID = header.FileID;
     ver.FileAddress = addr;
     ver.FileSize = length;
+
+    if (TxActive)
+        return TxAppendVersion(ver);
     
     if (!AppendFileVersion(ver))
         return false;
@@ -833,47 +1871,33 @@ bool Stm32fs::WriteFile(std::string_view fileName, uint8_t *data, size_t length)
 }
 
 bool Stm32fs::DeleteFile(std::string_view fileName) {
+    TRACE_SPAN("Stm32fs::DeleteFile");
     if (!CheckValid())
         return false;
 
-    Stm32FSFileHeader header = SearchFileHeader(fileName);
-    if (header.FileState != fsFileHeader)
+    Stm32FSFileHeader header;
+    Stm32FSFileVersion ver;
+    if (!SearchFile(fileName, header, ver))
         return false;
     
     // version not found or allready deleted - file deleted...
-    Stm32FSFileVersion ver = SearchFileVersion(header.FileID);
     if (ver.FileState != fsFileVersion)
         return true;
     
     ver.FileState = fsDeleted;
+    ver.Flags = 0;
     ver.FileAddress = 0;
     ver.FileSize = 0;
+
+    if (TxActive)
+        return TxAppendVersion(ver);
+
     if (!AppendFileVersion(ver))
         return false;
 
     return true;
 }
 
-bool fnmatch(std::string_view &pattern, std::string_view &name){
-    if (pattern == name)
-        return true;
-
-    if (pattern == "*")
-        return true;
-    
-    size_t xlen = std::min(pattern.size(), name.size());
-    for (size_t i = 0; i < xlen; i++) {
-        if (pattern[i] == '*')
-            return true;
-        if (pattern[i] != '?' &&
-            pattern[i] != name[i])
-            return false;
-    }
-    
-    // exact match with length
-    return (pattern.size() == name.size());
-}
-
 Stm32File_t *Stm32fs::FindFirst(std::string_view fileFilter, Stm32File_t *filePtr) {
     if (!CheckValid() || filePtr == nullptr)
         return nullptr;
@@ -896,6 +1920,9 @@ Stm32File_t *Stm32fs::FindFirst(std::string_view fileFilter, Stm32File_t *filePt
 Stm32File_t *Stm32fs::FindNext(Stm32File_t *filePtr) {
     if (!CheckValid() || filePtr == nullptr)
         return nullptr;
+
+    if (Index.isValid() && !TxActive)
+        return IndexFindNext(filePtr);
     
     if (filePtr->HeaderAddress == 0)
         filePtr->HeaderAddress = GetFirstHeaderAddress();
@@ -939,14 +1966,69 @@ Stm32File_t *Stm32fs::FindNext(Stm32File_t *filePtr) {
     return nullptr;
 }
 
+bool Stm32fs::AppendDeletePrefix(std::string_view prefix) {
+    if (!TailValid && !LoadTail())
+        return false;
+
+    if (CatalogTail == 0) {
+        NeedsOptimization = true;
+        return false;
+    }
+
+    Stm32FSFileRecord rec;
+    std::memset((void *)&rec, 0x00, sizeof(rec));
+    rec.deletePrefix.FileState = fsDeletePrefix;
+    rec.deletePrefix.PrefixLength = prefix.size();
+    std::memcpy(rec.deletePrefix.Prefix, prefix.data(), prefix.size());
+    if (!flash.WriteFlash(CatalogTail, (uint8_t *)&rec, sizeof(rec))) {
+        LoadCatalog();
+        return false;
+    }
+
+    AdvanceTail(1);
+    CountRecord(rec);
+    if (Index.isValid())
+        IndexDeletePrefix(prefix);
+    return true;
+}
+
+bool Stm32fs::ReadCatalog(std::function<bool (Stm32FSFileRecord &, uint32_t)> fnRecord) {
+    if (!CheckValid())
+        return false;
+
+    Stm32FSFileRecord filerec;
+    uint32_t addr = GetFirstHeader(filerec);
+    while (addr != 0) {
+        if (!fnRecord(filerec, addr))
+            break;
+        addr = GetNextHeader(addr, filerec);
+    }
+
+    return true;
+}
+
 bool Stm32fs::DeleteFiles(std::string_view fileFilter) {
+    TRACE_SPAN("Stm32fs::DeleteFiles");
     if (!CheckValid())
         return false;
 
+    // one record deletes all the prefix. no header reads before it: the index only tells if the
+    // namespace has live files, a hash collision costs one extra record.
+    std::string_view prefix = fileFilter.substr(0, fileFilter.size() - 1);
+    if (!TxActive && !fileFilter.empty() && fileFilter.back() == '*' &&
+        prefix.find_first_of("*?") == std::string_view::npos && prefix.size() <= sizeof(Stm32FSDeletePrefix::Prefix)) {
+        if (Index.isValid()) {
+            IndexFindSlots(Stm32fsIndex::FilterPrefixHash(prefix));
+            auto &entries = Index.Entries();
+            if (std::none_of(FindSlots.begin(), FindSlots.end(),
+                             [&entries](uint16_t slot) {return VersionLive(entries[slot].VersionState);}))
+                return true;
+        }
+        return AppendDeletePrefix(prefix);
+    }
+
     Stm32File_t srecm;
-    Stm32File_t *rc = nullptr;
-    
-    rc = FindFirst(fileFilter, &srecm);
+    Stm32File_t *rc = FindFirst(fileFilter, &srecm);
     while (rc != nullptr) {
         if (!DeleteFile(rc->FileName))
             return false;
@@ -957,10 +2039,188 @@ bool Stm32fs::DeleteFiles(std::string_view fileFilter) {
     return true;
 }
 
+bool Stm32fs::TxAppendVersion(Stm32FSFileVersion &version) {
+    // the last write of the file wins
+    Stm32FSFileVersion *ver = TxSearchVersion(version.FileID);
+    if (ver != nullptr) {
+        *ver = version;
+        return true;
+    }
+
+    if (TxCount >= TxMaxRecords)
+        return false;
+
+    TxRecords[TxCount] = version;
+    TxCount++;
+    return true;
+}
+
+// inline file written in the open transaction. its data is only in RAM.
+Stm32FSFileInline *Stm32fs::TxSearchInline(uint16_t fileID) {
+    if (!TxActive)
+        return nullptr;
+
+    Stm32FSFileVersion *ver = TxSearchVersion(fileID);
+    if (ver == nullptr || ver->FileState != fsFileInline)
+        return nullptr;
+
+    return (Stm32FSFileInline *)ver;
+}
+
+Stm32FSFileVersion *Stm32fs::TxSearchVersion(uint16_t fileID) {
+    for (size_t i = 0; i < TxCount; i++)
+        if (TxRecords[i].FileID == fileID)
+            return &TxRecords[i];
+
+    return nullptr;
+}
+
+bool Stm32fs::BeginTransaction() {
+    if (!CheckValid() || TxActive)
+        return false;
+
+    TxActive = true;
+    TxCount = 0;
+    return true;
+}
+
+// writes begin record, versions and commit record with as few flash writes as possible.
+// commit record goes last, so the group without it is ignored by readers.
+bool Stm32fs::CommitTransaction() {
+    TRACE_SPAN("Stm32fs::CommitTransaction");
+    if (!CheckValid() || !TxActive)
+        return false;
+
+    if (TxCount == 0) {
+        TxActive = false;
+        return true;
+    }
+
+    Stm32FSFileRecord records[TxMaxRecords + 2];
+    std::memset((void *)records, 0x00, sizeof(records));
+    size_t reccount = TxCount + 2;
+
+    records[0].transaction.FileState = fsTxBegin;
+    records[0].transaction.RecordCount = TxCount;
+    for (size_t i = 0; i < TxCount; i++) {
+        records[i + 1].version = TxRecords[i];
+        records[i + 1].version.Flags = fvTransaction;
+    }
+    records[TxCount + 1].transaction.FileState = fsTxCommit;
+    records[TxCount + 1].transaction.RecordCount = TxCount;
+
+    // transaction stays open till here: optimization makes place and commit goes again
+    if (!TailValid && !LoadTail())
+        return false;
+
+    // end of catalog
+    uint32_t addr = CatalogTail;
+
+    // check that the whole group fits
+    uint32_t xaddr = addr;
+    for (size_t i = 0; i < reccount; i++) {
+        if (xaddr == 0) {
+            NeedsOptimization = true;
+            return false;
+        }
+        if (i < reccount - 1)
+            xaddr = GetNextHeaderAddress(xaddr);
+    }
+    TxActive = false;
+    TxCount = 0;
+
+    // write by the continuous pieces. header sectors may be not adjacent.
+    uint32_t recaddr[TxMaxRecords + 2];
+    size_t recid = 0;
+    while (recid < reccount) {
+        uint32_t startAddr = addr;
+        size_t cnt = 1;
+        recaddr[recid] = addr;
+        addr = GetNextHeaderAddress(addr);
+        while (recid + cnt < reccount && addr == startAddr + cnt * FileHeaderSize) {
+            recaddr[recid + cnt] = addr;
+            cnt++;
+            addr = GetNextHeaderAddress(addr);
+        }
+
+        if (!flash.WriteFlash(startAddr, (uint8_t *)&records[recid], cnt * FileHeaderSize)) {
+            LoadCatalog();
+            return false;
+        }
+        recid += cnt;
+    }
+    CatalogTail = addr;
+    CatalogRecords += reccount;
+    for (size_t i = 0; i < reccount; i++)
+        CountRecord(records[i]);
+
+    if (Index.isValid()) {
+        for (size_t i = 1; i < reccount - 1; i++) {
+            records[i].version.Flags = 0;
+            Stm32FSFileVersion ver = ResolveVersion(records[i].version, recaddr[i]);
+            Index.SetVersion(ver);
+        }
+    }
+
+    return true;
+}
+
+// data that was written stays in the flash without records. optimization frees it.
+void Stm32fs::AbortTransaction() {
+    TxActive = false;
+    TxCount = 0;
+}
+
+bool Stm32fs::isTransactionActive() {
+    return TxActive;
+}
+
+void Stm32fs::EnableWriteCombining(bool enable) {
+    if (!enable)
+        Flush();
+    flash.EnableCombining(enable);
+}
+
+// failed flush drops the pending writes. so RAM state is loaded again from the flash.
+bool Stm32fs::Flush() {
+    TRACE_SPAN("Stm32fs::Flush");
+    if (flash.Flush())
+        return true;
+
+    LoadCatalog();
+    LoadCounters();
+    return false;
+}
+
 bool Stm32fs::Optimize() {
+    TRACE_SPAN("Stm32fs::Optimize");
     if (!CheckValid())
         return false;
 
+    // optimization by steps is already counted. finish it. steps don't move the data of
+    // the open transaction, so then it starts again.
+    while (isOptimizeActive() && !TxActive) {
+        if (!OptimizeStep(SIZE_MAX))
+            break;
+        if (!isOptimizeActive())
+            return true;
+    }
+    StepReset();
+
+    flash.GetIOCounters().Optimizations++;
+
+    // versions of the open transaction are not in force for the optimizer. it moves their data
+    // and keeps their file headers, versions stay in RAM with the new addresses.
+    bool txActive = TxActive;
+    TxActive = false;
+    bool res = OptimizeBlock();
+    TxActive = txActive;
+    if (res && !TxActive)
+        PrepareCheckpoint();
+    return res;
+}
+
+bool Stm32fs::OptimizeBlock() {
     Stm32fsOptimizer optimizer(*this);
     if (FsConfig.Blocks.size() > 1) {
         Stm32fsConfigBlock_t *nextBlock = flash.SearchNextFsBlockInFlash();
@@ -968,117 +2228,280 @@ bool Stm32fs::Optimize() {
             bool res = optimizer.OptimizeMultiblock(*CurrentFsBlock, *nextBlock);
             if (res)
                 CurrentFsBlock = nextBlock;
+            LoadCatalog();
             return res;
         }
     }
 
-    return optimizer.OptimizeViaRam(*CurrentFsBlock);
+    // compaction takes the versions in force from the index. it is built even if it is off.
+    bool indexEnabled = IndexEnabled;
+    if (!Index.isValid()) {
+        IndexEnabled = true;
+        BuildIndex();
+    }
+    bool res = optimizer.OptimizeInPlace(*CurrentFsBlock);
+    IndexEnabled = indexEnabled;
+    LoadCatalog();
+    return res;
 }
 
-/*
- * --- Stm32fsFileList ---
- */
+bool Stm32fs::OptimizeStart() {
+    if (!CheckValid() || FsConfig.Blocks.size() < 2)
+        return false;
+
+    if (isOptimizeActive())
+        return true;
+
+    // copy takes the versions in force from the index
+    if (!Index.isValid())
+        return false;
 
-Stm32fsFileList::Stm32fsFileList() {
-    Clear();
+    Stm32fsConfigBlock_t *nextBlock = flash.SearchNextFsBlockInFlash();
+    if (nextBlock == nullptr)
+        return false;
+
+    flash.GetIOCounters().Optimizations++;
+    Stm32fsOptimizer optimizer(*this);
+    return optimizer.StepStart(*nextBlock);
 }
 
-int Stm32fsFileList::FindEmptyID() {
-    for (size_t i = 0; i < FileListLength; i++)
-        if (FileList[i].isEmpty())
-            return i;
-    return -1;
+bool Stm32fs::OptimizeStep(size_t maxRecords) {
+    TRACE_SPAN("Stm32fs::OptimizeStep");
+    if (!isOptimizeActive())
+        return true;
+
+    Stm32fsOptimizer optimizer(*this);
+    if (!optimizer.Step(maxRecords)) {
+        StepReset();
+        return false;
+    }
+
+    if (!isOptimizeActive())
+        PrepareCheckpoint();
+    return true;
 }
 
-void Stm32fsFileList::Clear() {
-    std::memset((void *)FileList, 0x00, sizeof(FileList));
+bool Stm32fs::isOptimizeActive() {
+    return StepState.Phase != Stm32fsStepPhase::Idle;
 }
 
-bool Stm32fsFileList::Empty() {
-    return FileList[0].isEmpty();
+void Stm32fs::StepReset() {
+    StepState.Phase = Stm32fsStepPhase::Idle;
+    StepState.OutputBlock = nullptr;
+    StepState.CopiedHeaders.clear();
 }
 
-int Stm32fsFileList::Size() {
-    int id = FindEmptyID();
-    if (id > 0)
-        return id;
-    
-    return 0;        
+void Stm32fs::EnableIndex(bool enable) {
+    IndexEnabled = enable;
+    BuildIndex();
 }
 
-bool Stm32fsFileList::Append(Stm32FSFileHeader &header, Stm32FSFileVersion &version) {
-    if (header.FileName[0] == 0x00)
-        return true;
-    
-    int id = FindEmptyID();
-    if (id < 0)
-        return false;
-    
-    std::memcpy(FileList[id].FileName, header.FileName, FileNameMaxLen);
-    FileList[id].FileAddress = version.FileAddress;
-    FileList[id].FileSize = version.FileSize;
-    
-    return true;
+bool Stm32fs::isIndexValid() {
+    return Index.isValid();
 }
 
-bool Stm32fsFileList::Sort() {
-    for (size_t i = 0; i < FileListLength; i++) {
-        if (FileList[i].isEmpty())
-            break;
+static bool CounterRecordValid(Stm32FSCounterRecord &rec) {
+    return rec.CounterID == (uint16_t)~rec.CounterIDInv && rec.CounterID != 0xffff;
+}
 
-        for (size_t j = i + 1; i < FileListLength; j++) {
-            if (FileList[j].isEmpty())
-                break;
-            
-            if (FileList[i].FileAddress > FileList[j].FileAddress) {
-                Stm32OptimizedFile_t t = FileList[i];
-                FileList[i] = FileList[j];
-                FileList[j] = t;            
-            }
+static bool CounterRecordEmpty(Stm32FSCounterRecord &rec) {
+    return rec.CounterID == 0xffff && rec.CounterIDInv == 0xffff && rec.Value == 0xffffffff;
+}
+
+void Stm32fs::LoadCounters() {
+    CounterSector = -1;
+    CounterSerial = 0;
+    CounterNext = 0;
+    CounterNextFailed = false;
+    CounterSpareEmpty = false;
+    CounterValues.clear();
+
+    auto &sectors = FsConfig.CounterSectors;
+    if (sectors.size() != 2)
+        return;
+
+    for (size_t i = 0; i < sectors.size(); i++) {
+        Stm32FSCounterHeader header;
+        if (!flash.ReadFlash(flash.GetBlockAddress(sectors[i]), (uint8_t *)&header, sizeof(header)))
+            return;
+        if (header.StartSeq == CounterStartSeq && header.Serial != 0 && header.Serial != 0xffffffff &&
+            header.Serial > CounterSerial) {
+            CounterSector = i;
+            CounterSerial = header.Serial;
         }
     }
-    
+
+    // first start
+    if (CounterSector < 0) {
+        if (!flash.EraseSectors(sectors))
+            return;
+
+        Stm32FSCounterHeader header = {CounterStartSeq, 0xffff, 1};
+        if (!flash.WriteFlash(flash.GetBlockAddress(sectors[0]), (uint8_t *)&header, sizeof(header)))
+            return;
+        CounterSector = 0;
+        CounterSerial = 1;
+    }
+
+    // broken records (power loss) are skipped. log ends at the first empty one.
+    uint32_t addr = flash.GetBlockAddress(sectors[CounterSector]) + sizeof(Stm32FSCounterHeader);
+    uint32_t end = flash.GetBlockAddress(sectors[CounterSector]) + flash.GetSectorSize();
+    for (; addr < end; addr += sizeof(Stm32FSCounterRecord)) {
+        Stm32FSCounterRecord rec;
+        if (!flash.ReadFlash(addr, (uint8_t *)&rec, sizeof(rec))) {
+            CounterSector = -1;
+            return;
+        }
+        if (CounterRecordEmpty(rec))
+            break;
+        if (!CounterRecordValid(rec))
+            continue;
+
+        Stm32FSCounterRecord *value = CounterSearch(rec.CounterID);
+        if (value)
+            *value = rec;
+        else
+            CounterValues.push_back(rec);
+    }
+    CounterNext = addr;
+    CounterSpareEmpty = flash.isFlashBlockEmpty(sectors[CounterSector ^ 1]);
+}
+
+Stm32FSCounterRecord *Stm32fs::CounterSearch(uint16_t counterID) {
+    for (auto &rec: CounterValues)
+        if (rec.CounterID == counterID)
+            return &rec;
+    return nullptr;
+}
+
+// values go to the spare sector first, its header is the last write. so power loss keeps the old sector in force.
+bool Stm32fs::CounterRollUp() {
+    auto &sectors = FsConfig.CounterSectors;
+    uint16_t spare = sectors[CounterSector ^ 1];
+
+    if (!CounterSpareEmpty && !flash.isFlashBlockEmpty(spare) && !flash.EraseFlashBlock(spare))
+        return false;
+    CounterSpareEmpty = false;
+
+    uint32_t addr = flash.GetBlockAddress(spare) + sizeof(Stm32FSCounterHeader);
+    for (auto &rec: CounterValues) {
+        if (!flash.WriteFlash(addr, (uint8_t *)&rec, sizeof(rec)))
+            return false;
+        addr += sizeof(rec);
+    }
+
+    Stm32FSCounterHeader header = {CounterStartSeq, 0xffff, CounterSerial + 1};
+    if (!flash.WriteFlash(flash.GetBlockAddress(spare), (uint8_t *)&header, sizeof(header)))
+        return false;
+
+    CounterSector ^= 1;
+    CounterSerial++;
+    CounterNext = addr;
+    CounterNextFailed = false;
     return true;
 }
 
-bool Stm32fsFileList::Write(Stm32fsWriteCache &cache) {
-    uint16_t fileID = 1;
-    
-    for (size_t i = 0; i < FileListLength; i++) {
-        if (FileList[i].isEmpty())
-            break;
+bool Stm32fs::isCountersEnabled() {
+    return CounterSector >= 0;
+}
+
+bool Stm32fs::ReadCounter(uint16_t counterID, uint32_t &value) {
+    if (!isCountersEnabled())
+        return false;
+
+    Stm32FSCounterRecord *rec = CounterSearch(counterID);
+    if (!rec)
+        return false;
+
+    value = rec->Value;
+    return true;
+}
+
+bool Stm32fs::WriteCounter(uint16_t counterID, uint32_t value) {
+    TRACE_SPAN("Stm32fs::WriteCounter");
+    if (!isCountersEnabled() || counterID == 0xffff)
+        return false;
+
+    Stm32FSCounterRecord *rec = CounterSearch(counterID);
+    if (rec && rec->Value == value)
+        return true;
+    if (!rec && CounterValues.size() >= CounterMaxCount)
+        return false;
 
-        if (!cache.WriteFileHeader(FileList[i], fileID))
+    Stm32FSCounterRecord newrec = {counterID, (uint16_t)~counterID, value};
+    uint32_t end = flash.GetBlockAddress(FsConfig.CounterSectors[CounterSector]) + flash.GetSectorSize();
+    if (CounterNextFailed && CounterNext + sizeof(newrec) <= end) {
+        // half-written record can't be programmed again. it is skipped the same as at mount.
+        Stm32FSCounterRecord oldrec;
+        if (!flash.ReadFlash(CounterNext, (uint8_t *)&oldrec, sizeof(oldrec)))
             return false;
+        if (!CounterRecordEmpty(oldrec))
+            CounterNext += sizeof(newrec);
     }
-    
-    return cache.Flush();
+    CounterNextFailed = false;
+    if (CounterNext + sizeof(newrec) > end && !CounterRollUp())
+        return false;
+
+    if (!flash.WriteFlash(CounterNext, (uint8_t *)&newrec, sizeof(newrec))) {
+        CounterNextFailed = true;
+        return false;
+    }
+    CounterNext += sizeof(newrec);
+
+    if (rec)
+        *rec = newrec;
+    else
+        CounterValues.push_back(newrec);
+    return true;
 }
 
-Stm32OptimizedFile_t &Stm32fsFileList::GetFileByID(size_t id) {
-    if (id >= FileListLength)
-        return FileList[0];
+bool Stm32fs::PrepareSectors() {
+    if (!CheckValid())
+        return false;
+
+    return flash.EraseSpareSector(CurrentFsBlock, StepState.OutputBlock);
+}
+
+bool Stm32fs::PrepareCounters() {
+    if (!isCountersEnabled() || CounterSpareEmpty)
+        return false;
 
-    return FileList[id];
+    uint16_t spare = FsConfig.CounterSectors[CounterSector ^ 1];
+    if (!flash.isFlashBlockEmpty(spare) && !flash.EraseFlashBlock(spare))
+        return false;
+
+    CounterSpareEmpty = true;
+    return true;
 }
 
 /*
  * --- Stm32fsWriter ---
  */
 
-bool Stm32fsWriter::Init(uint32_t offset) {
+bool Stm32fsWriter::Init(uint32_t offset, bool erase) {
     if (sectors.size() == 0)
         return false;
     
-    CurrentSectorID = 0;
-    CurrentAddress = offset;
+    CurrentSectorID = offset / flash.GetSectorSize();
+    CurrentAddress = offset % flash.GetSectorSize();
+    if (CurrentSectorID >= (int)sectors.size()) {
+        CurrentSectorID = -1;
+        CurrentAddress = 0;
+    }
     
-    if (!flash.EraseSectors(sectors))
+    if (erase && !flash.EraseSectors(sectors))
         return false;
     
     return true;
 }
 
+uint32_t Stm32fsWriter::GetOffset() {
+    if (CurrentSectorID < 0)
+        return sectors.size() * flash.GetSectorSize();
+
+    return CurrentSectorID * flash.GetSectorSize() + CurrentAddress;
+}
+
 bool Stm32fsWriter::Write(uint8_t *data, size_t len, uint32_t *newaddr) {
     if (CurrentSectorID < 0)
         return false;
@@ -1093,8 +2516,8 @@ bool Stm32fsWriter::Write(uint8_t *data, size_t len, uint32_t *newaddr) {
             return false;
         
         size_t blen = len;
-        if (blen > BlockSize - CurrentAddress)
-            blen = BlockSize - CurrentAddress;
+        if (blen > flash.GetSectorSize() - CurrentAddress)
+            blen = flash.GetSectorSize() - CurrentAddress;
 
         if (!flash.WriteFlash(flash.GetBlockAddress(sectors[CurrentSectorID]) + CurrentAddress, &data[totalwrlen], blen))
             return false;
@@ -1108,7 +2531,7 @@ bool Stm32fsWriter::Write(uint8_t *data, size_t len, uint32_t *newaddr) {
         len -= blen;
         totalwrlen += blen;
         
-        if (CurrentAddress >= BlockSize) {
+        if (CurrentAddress >= flash.GetSectorSize()) {
             CurrentSectorID++;
             if (CurrentSectorID >= (int)sectors.size()) {
                 CurrentSectorID = -1;
@@ -1169,21 +2592,22 @@ bool Stm32fsWriter::Finish() {
  */
 
 void Stm32fsWriteCache::ClearCache() {
-    std::memset(cache, 0xffU, sizeof(cache));
+    cache.assign(flash.GetSectorSize(), 0xffU);
 }
 
-bool Stm32fsWriteCache::WriteToFlash(uint8_t sectorNum) {
+bool Stm32fsWriteCache::WriteToFlash(uint16_t sectorNum, size_t length) {
     
     size_t addr = flash.GetBaseAddress() + flash.GetBlockAddress(sectorNum);
     
-    if (std::memcmp(cache, (void *)addr, BlockSize) == 0)
+    if (std::memcmp(cache.data(), (void *)addr, cache.size()) == 0)
         return true;
     
     if (!flash.isFlashBlockEmpty(sectorNum))
         if (!flash.EraseFlashBlock(sectorNum))
             return false;
     
-    return flash.WriteFlash(flash.GetBlockAddress(sectorNum), cache, BlockSize);
+    length = std::min(((length + FlashPadding - 1) / FlashPadding) * FlashPadding, cache.size());
+    return flash.WriteFlash(flash.GetBlockAddress(sectorNum), cache.data(), length);
 }
 
 bool Stm32fsWriteCache::Init() {
@@ -1207,8 +2631,8 @@ bool Stm32fsWriteCache::Write(uint8_t *data, size_t len) {
             return false;
         
         size_t blen = len;
-        if (blen > BlockSize - CurrentAddress)
-            blen = BlockSize - CurrentAddress;
+        if (blen > cache.size() - CurrentAddress)
+            blen = cache.size() - CurrentAddress;
 
         std::memcpy(&cache[CurrentAddress], &data[totalwrlen], blen);
         CurrentAddress += blen;                            // flash align not needs because we write it in single block...
@@ -1216,8 +2640,8 @@ bool Stm32fsWriteCache::Write(uint8_t *data, size_t len) {
         len -= blen;
         totalwrlen += blen;
         
-        if (CurrentAddress >= BlockSize) {
-            if (!WriteToFlash(sectors[CurrentSectorID]))
+        if (CurrentAddress >= cache.size()) {
+            if (!WriteToFlash(sectors[CurrentSectorID], cache.size()))
                 return false;
 
             CurrentSectorID++;
@@ -1242,24 +2666,6 @@ bool Stm32fsWriteCache::WriteFsHeader(uint32_t serial) {
     return Write((uint8_t *)&header, sizeof(header));
 }
 
-bool Stm32fsWriteCache::WriteFileHeader(Stm32OptimizedFile_t &fileHeader, uint16_t &fileID) {
-    if (CurrentSectorID < 0)
-        return false;
-    
-    Stm32FSFullFileRecord fullFile = {0};
-    fullFile.header.FileState = fsFileHeader;
-    fullFile.header.FileID = fileID;
-    std::memcpy(fullFile.header.FileName, fileHeader.FileName, FileNameMaxLen);
-
-    fullFile.version.FileState = fsFileVersion;
-    fullFile.version.FileID = fileID;
-    fullFile.version.FileAddress = fileHeader.FileAddress;
-    fullFile.version.FileSize = fileHeader.FileSize;
-    
-    fileID++;
-    return Write((uint8_t *)&fullFile, sizeof(fullFile));
-}
-
 bool Stm32fsWriteCache::Flush() {
     if (CurrentSectorID < 0)
         return false;
@@ -1267,18 +2673,30 @@ bool Stm32fsWriteCache::Flush() {
     bool res = true;
     // if we have something to write
     if (CurrentAddress > 0)
-        res = WriteToFlash(sectors[CurrentSectorID]);
+        res = WriteToFlash(sectors[CurrentSectorID], CurrentAddress);
     CurrentSectorID = -1;
     CurrentAddress = 0;
     return res;
 }
 
+bool Stm32fsWriteCache::EraseRest(size_t length) {
+    size_t sectorSize = flash.GetSectorSize();
+    for (size_t i = (length + sectorSize - 1) / sectorSize; i < sectors.size(); i++)
+        if (!flash.isFlashBlockEmpty(sectors[i]) && !flash.EraseFlashBlock(sectors[i]))
+            return false;
+    return true;
+}
+
 /*
  * --- Stm32fsOptimizer ---
  */
 
 Stm32fsOptimizer::Stm32fsOptimizer(Stm32fs &stm32fs) : fs{stm32fs} {
-    
+    fs.flash.SuspendCombining(true);
+}
+
+Stm32fsOptimizer::~Stm32fsOptimizer() {
+    fs.flash.SuspendCombining(false);
 }
 
 // multiblock optimization. from flash region to flash region.
@@ -1300,7 +2718,12 @@ bool OPTIMIZATION_O2 Stm32fsOptimizer::OptimizeMultiblock(Stm32fsConfigBlock_t &
 
         if (filerec.header.FileState == fsFileHeader) {
             Stm32FSFileVersion ver = fs.SearchFileVersion(filerec.header.FileID);
-            if (ver.FileState == fsFileVersion) {
+            if (ver.FileState == fsFileVersion && (ver.Flags & fvInline)) {
+                Stm32FSFileRecord rec;
+                rec.inlineVersion = InlineRecord(ver, (uint8_t *)(fs.flash.GetBaseAddress() + ver.FileAddress));
+                if (!fhdrdata.AppendFileDesc(filerec.header, rec.version))
+                    return false;
+            } else if (ver.FileState == fsFileVersion) {
                 uint32_t newAddr = 0;
                 // 1st - data
                 if (!fdata.Write((uint8_t *)(fs.flash.GetBaseAddress() + ver.FileAddress), ver.FileSize, &newAddr))
@@ -1310,6 +2733,19 @@ bool OPTIMIZATION_O2 Stm32fsOptimizer::OptimizeMultiblock(Stm32fsConfigBlock_t &
                 if (!fhdrdata.AppendFileDesc(filerec.header, ver))
                     return false;
             }
+
+            // file of the open transaction
+            Stm32FSFileVersion *txver = fs.TxSearchVersion(filerec.header.FileID);
+            if (txver != nullptr) {
+                if (ver.FileState != fsFileVersion && !fhdrdata.WriteFileHeader(filerec.header))
+                    return false;
+                if (txver->FileState == fsFileVersion) {
+                    uint32_t newAddr = 0;
+                    if (!fdata.Write((uint8_t *)(fs.flash.GetBaseAddress() + txver->FileAddress), txver->FileSize, &newAddr))
+                        return false;
+                    txver->FileAddress = newAddr;
+                }
+            }
         }        
         addr = fs.GetNextHeader(addr, filerec);
     }
@@ -1331,68 +2767,298 @@ bool OPTIMIZATION_O2 Stm32fsOptimizer::OptimizeMultiblock(Stm32fsConfigBlock_t &
     return true;
 }
 
-bool OPTIMIZATION_O2 Stm32fsOptimizer::OptimizeViaRam(Stm32fsConfigBlock_t &block) {
-    
-    Stm32fsFileList fileList;
+bool Stm32fsOptimizer::StepStart(Stm32fsConfigBlock_t &outputBlock) {
+    Stm32fsStepState &st = fs.StepState;
+    st.Phase = Stm32fsStepPhase::Erase;
+    st.OutputBlock = &outputBlock;
+    st.EraseID = 0;
+    st.Cursor = 0;
+    st.HeaderOffset = sizeof(Stm32FSHeader_t);
+    st.DataOffset = 0;
+    st.CopiedHeaders.clear();
+    return true;
+}
 
-    Stm32FSFileRecord filerec;
-    uint32_t addr = fs.GetFirstHeader(filerec);
-    
-    while(true) {
-        if (addr == 0)
-            break;
+bool Stm32fsOptimizer::Step(size_t maxRecords) {
+    Stm32fsStepState &st = fs.StepState;
+    if (st.OutputBlock == nullptr)
+        return false;
 
-        if (filerec.header.FileState == fsFileHeader) {
-            Stm32FSFileVersion ver = fs.SearchFileVersion(filerec.header.FileID);
-            if (ver.FileState == fsFileVersion)
-                if (!fileList.Append(filerec.header, ver))
-                    return false;
+    if (st.Phase == Stm32fsStepPhase::Erase)
+        return StepErase();
+    
+    for (size_t i = 0; i < maxRecords; i++) {
+        // end of catalog. new records of the current block will be here.
+        Stm32FSFileRecord filerec;
+        if (st.Cursor != 0) {
+            if (!fs.flash.ReadFlash(st.Cursor, (uint8_t *)&filerec, sizeof(filerec)))
+                return false;
         }
-        
-        addr = fs.GetNextHeader(addr, filerec);
+        if (st.Cursor == 0 || filerec.version.FileState == fsEmpty) {
+            // data of the open transaction doesn't have records yet
+            if (fs.TxActive)
+                return true;
+            return StepFinish();
+        }
+
+        if (!StepCopyRecord(filerec))
+            return false;
+        st.Cursor = fs.GetNextHeaderAddress(st.Cursor);
     }
+
+    return true;
+}
+
+// erase of the output block. power loss leaves a block without fs header, it is erased again.
+bool Stm32fsOptimizer::StepErase() {
+    Stm32fsStepState &st = fs.StepState;
+    UVector &hsectors = st.OutputBlock->HeaderSectors;
+    UVector &dsectors = st.OutputBlock->DataSectors;
     
-    uint32_t serial = fs.GetCurrentFsBlockSerial();
+    while (st.EraseID < hsectors.size() + dsectors.size()) {
+        uint16_t sector = (st.EraseID < hsectors.size()) ? hsectors[st.EraseID] : dsectors[st.EraseID - hsectors.size()];
+        st.EraseID++;
+        if (!fs.flash.isFlashBlockEmpty(sector))
+            return fs.flash.EraseFlashBlock(sector);
+    }
     
-    if (fileList.Empty()) {
-        return fs.flash.CreateFsBlock(block, serial + 1);
+    st.Phase = Stm32fsStepPhase::Copy;
+    st.Cursor = fs.GetFirstHeaderAddress();
+    return true;
+}
+
+// copies the version if it is still in force. record that is replaced later is skipped, the
+// newer one is copied when the cursor gets to it. so the output gets all the writes between steps.
+bool Stm32fsOptimizer::StepCopyRecord(Stm32FSFileRecord &filerec) {
+    Stm32fsStepState &st = fs.StepState;
+    Stm32FSFileVersion ver = filerec.version;
+
+    // delete by the prefix keeps its place between the copied versions
+    if (ver.FileState == fsDeletePrefix) {
+        Stm32fsWriter fhdrdata(fs.flash, st.OutputBlock->HeaderSectors);
+        if (!fhdrdata.Init(st.HeaderOffset, false) || !fhdrdata.Write((uint8_t *)&filerec, sizeof(filerec)))
+            return false;
+        st.HeaderOffset = fhdrdata.GetOffset();
+        return true;
     }
     
-    fileList.Sort();
+    // file headers are copied with the first version. transaction records aren't needed.
+    if (ver.FileState != fsFileVersion && ver.FileState != fsFileInline && ver.FileState != fsDeleted)
+        return true;
+    
+    Stm32fsIndexEntry *entry = fs.Index.FindByID(ver.FileID);
+    Stm32FSFileVersion xver = ResolveVersion(ver, st.Cursor);
+    if (entry == nullptr || entry->VersionState != ver.FileState ||
+        entry->FileAddress != xver.FileAddress || entry->FileSize != xver.FileSize)
+        return true;
 
-    // optimize data sections
-    if (true) {
-        Stm32fsWriteCache cdata(fs.flash, block.DataSectors);
-        
-        if (!cdata.Init())
+    if (st.CopiedHeaders.size() <= ver.FileID)
+        st.CopiedHeaders.resize(ver.FileID + 1, false);
+    bool headerCopied = st.CopiedHeaders[ver.FileID];
+    if (ver.FileState == fsDeleted && !headerCopied)
+        return true;
+
+    Stm32fsWriter fhdrdata(fs.flash, st.OutputBlock->HeaderSectors);
+    if (!fhdrdata.Init(st.HeaderOffset, false))
+        return false;
+
+    if (!headerCopied) {
+        Stm32FSFileHeader header;
+        if (!fs.flash.ReadFlash(entry->HeaderAddress, (uint8_t *)&header, sizeof(header)))
             return false;
-        
-        int fsize = fileList.Size();
-        uint32_t curAddr = fs.flash.GetBlockAddress(block.DataSectors[0]);
-        for (int i = 0; i < fsize; i++) {
-            auto &file = fileList.GetFileByID(i);
-            if (!cdata.Write((uint8_t *)(fs.flash.GetBaseAddress() + file.FileAddress), file.FileSize))
+        if (!fhdrdata.WriteFileHeader(header))
+            return false;
+        st.CopiedHeaders[ver.FileID] = true;
+    }
+
+    if (ver.FileState == fsFileVersion) {
+        Stm32fsWriter fdata(fs.flash, st.OutputBlock->DataSectors);
+        if (!fdata.Init(st.DataOffset, false))
+            return false;
+
+        // 1st - data
+        uint32_t newAddr = 0;
+        if (!fdata.Write((uint8_t *)(fs.flash.GetBaseAddress() + ver.FileAddress), ver.FileSize, &newAddr))
+            return false;
+        st.DataOffset = fdata.GetOffset();
+        ver.FileAddress = newAddr;
+    }
+
+    // 2nd - version
+    ver.Flags = 0;
+    if (!fhdrdata.WriteFileVersion(ver))
+        return false;
+    st.HeaderOffset = fhdrdata.GetOffset();
+
+    return true;
+}
+
+bool Stm32fsOptimizer::StepFinish() {
+    Stm32fsStepState &st = fs.StepState;
+    uint32_t serial = fs.GetCurrentFsBlockSerial();
+    
+    Stm32fsWriter fhdrdata(fs.flash, st.OutputBlock->HeaderSectors);
+    if (!fhdrdata.Init(0, false))
+        return false;
+
+    if (!fhdrdata.WriteFsHeaderToTop(serial + 1))
+        return false;
+
+    // switching to the new filesystem
+    auto blk = fs.GetFlash().SearchLastFsBlockInFlash();
+    if (blk == nullptr)
+        return false;
+    
+    return fs.SetCurrentFsBlock(blk);
+}
+
+static const size_t CompactBatch = 8;
+
+// data order of the compaction. files of size 0 may have the same address.
+static bool DataBefore(Stm32fsIndexEntry &a, Stm32fsIndexEntry &b) {
+    return a.FileAddress < b.FileAddress || (a.FileAddress == b.FileAddress && a.FileID < b.FileID);
+}
+
+// data of the live files in the address order, by batches of the next CompactBatch files.
+// destination is never after the source, so the one sector cache doesn't overwrite the data it needs.
+// new addresses go to CompactedAddresses for the catalog pass.
+bool Stm32fsOptimizer::CompactData(Stm32fsConfigBlock_t &block) {
+    Stm32fsWriteCache cdata(fs.flash, block.DataSectors);
+    if (!cdata.Init())
+        return false;
+
+    auto &entries = fs.Index.Entries();
+    CompactedAddresses.assign(entries.size(), 0);
+    uint32_t dataStart = fs.flash.GetBlockAddress(block.DataSectors[0]);
+
+    Stm32fsIndexEntry *batch[CompactBatch];
+    Stm32fsIndexEntry *last = nullptr;
+    size_t length = 0;
+    while (true) {
+        size_t count = 0;
+        for (auto &entry : entries) {
+            if (entry.FileID == 0 || entry.VersionState != fsFileVersion)
+                continue;
+            if (last != nullptr && !DataBefore(*last, entry))
+                continue;
+
+            size_t pos = count;
+            while (pos > 0 && DataBefore(entry, *batch[pos - 1]))
+                pos--;
+            if (pos >= CompactBatch)
+                continue;
+            if (count < CompactBatch)
+                count++;
+            for (size_t i = count - 1; i > pos; i--)
+                batch[i] = batch[i - 1];
+            batch[pos] = &entry;
+        }
+        if (count == 0)
+            break;
+
+        // files of size 0 don't write anything and get the address of the next data
+        for (size_t i = 0; i < count; i++) {
+            if (!cdata.Write((uint8_t *)(fs.flash.GetBaseAddress() + batch[i]->FileAddress), batch[i]->FileSize))
                 return false;
-            file.FileAddress = curAddr;
-            curAddr += file.FileSize;
+            CompactedAddresses[batch[i] - entries.data()] = dataStart + length;
+            length += batch[i]->FileSize;
         }
-        
-        if (!cdata.Flush())
+        last = batch[count - 1];
+    }
+
+    // data of the open transaction lies after all the files. it goes after them in the same order.
+    Stm32FSFileVersion *txdata[TxMaxRecords];
+    size_t txcount = 0;
+    for (size_t i = 0; i < fs.TxCount; i++) {
+        if (fs.TxRecords[i].FileState != fsFileVersion)
+            continue;
+        size_t pos = txcount++;
+        while (pos > 0 && fs.TxRecords[i].FileAddress < txdata[pos - 1]->FileAddress) {
+            txdata[pos] = txdata[pos - 1];
+            pos--;
+        }
+        txdata[pos] = &fs.TxRecords[i];
+    }
+
+    for (size_t i = 0; i < txcount; i++) {
+        if (!cdata.Write((uint8_t *)(fs.flash.GetBaseAddress() + txdata[i]->FileAddress), txdata[i]->FileSize))
             return false;
-        
-    };
-    
+        txdata[i]->FileAddress = dataStart + length;
+        length += txdata[i]->FileSize;
+    }
+
+    // nothing is cached if all the files are empty, then all the data sectors are erased
+    if (!cdata.Flush())
+        return false;
+
+    return cdata.EraseRest(length);
+}
+
+// catalog is filtered: headers of the live files and their versions in force stay in the same order.
+// so the record written is never after the record read.
+bool Stm32fsOptimizer::CompactCatalog(Stm32fsConfigBlock_t &block, uint32_t serial) {
     Stm32fsWriteCache cache(fs.flash, block.HeaderSectors);
     if (!cache.Init())
         return false;
 
     if (!cache.WriteFsHeader(serial + 1))
         return false;
+    size_t length = sizeof(Stm32FSHeader_t);
+
+    Stm32FSFileRecord filerec;
+    uint32_t addr = fs.GetFirstHeader(filerec);
+    while (addr != 0) {
+        uint8_t state = filerec.version.FileState;
+        Stm32fsIndexEntry *entry = fs.Index.FindByID(filerec.version.FileID);
+        bool live = (entry != nullptr && (entry->VersionState == fsFileVersion || entry->VersionState == fsFileInline));
 
-    if (!fileList.Write(cache))
+        // header of the file that has only the version of the open transaction
+        bool txFile = (state == fsFileHeader && !live && fs.TxSearchVersion(filerec.header.FileID) != nullptr &&
+                       (entry == nullptr || entry->HeaderAddress == addr));
+
+        if ((state == fsFileHeader && live && entry->HeaderAddress == addr) || txFile) {
+            if (!cache.Write((uint8_t *)&filerec, sizeof(filerec)))
+                return false;
+            length += sizeof(filerec);
+        }
+
+        if ((state == fsFileVersion || state == fsFileInline) && live && entry->HeaderAddress != 0) {
+            Stm32FSFileVersion ver = ResolveVersion(filerec.version, addr);
+            Stm32FSFileVersion iver = IndexEntryVersion(*entry);
+            if (ver.FileAddress == iver.FileAddress && ver.FileSize == iver.FileSize &&
+                (ver.Flags & fvInline) == (iver.Flags & fvInline)) {
+                filerec.version.Flags &= ~fvTransaction;
+                if (state == fsFileVersion)
+                    filerec.version.FileAddress = CompactedAddresses[entry - fs.Index.Entries().data()];
+                if (!cache.Write((uint8_t *)&filerec, sizeof(filerec)))
+                    return false;
+                length += sizeof(filerec);
+
+                // version is written. index is built again after the optimization.
+                entry->HeaderAddress = 0;
+            }
+        }
+
+        addr = fs.GetNextHeader(addr, filerec);
+    }
+
+    if (!cache.Flush())
         return false;
 
-    return true;
+    return cache.EraseRest(length);
+}
+
+bool OPTIMIZATION_O2 Stm32fsOptimizer::OptimizeInPlace(Stm32fsConfigBlock_t &block) {
+    if (!fs.Index.isValid())
+        return false;
+
+    uint32_t serial = fs.GetCurrentFsBlockSerial();
+
+    // data first: the catalog keeps the old addresses till the end
+    if (!CompactData(block))
+        return false;
+
+    return CompactCatalog(block, serial);
 }
 
 void Stm32fsStatistic::Print() {
@@ -1406,3 +3072,13 @@ void Stm32fsStatistic::Print() {
            DataSize, DataFreeSize, DataOccupiedSize, DataDeletedSize,
            (int)DataSize - DataFreeSize - DataOccupiedSize - DataDeletedSize);
 }
+
+void Stm32fsIOCounters::Clear() {
+    *this = Stm32fsIOCounters();
+}
+
+void Stm32fsIOCounters::Print() {
+    printf("---- stm32fs I/O ----\n");
+    printf("Reads: %u (%u bytes) writes: %u (%u bytes) erases: %u optimizations: %u combined: %u\n",
+           Reads, BytesRead, Writes, BytesWritten, Erases, Optimizations, CombinedWrites);
+}
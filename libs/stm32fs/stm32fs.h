@@ -13,13 +13,23 @@
 #include <vector>
 #include <string>
 #include <functional>
+#include <string_view>
 
 #define PACKED __attribute__((packed))
 
+// default sector size. Stm32fsConfig_t::SectorSize sets the real one.
 static const size_t BlockSize = 2048;
 static const size_t FileNameMaxLen = 13;
+static const size_t TxMaxRecords = 16;
+static const size_t OptimizeStepRecords = 8;
+static const size_t InlineMaxSize = 8;
+static const size_t CounterMaxCount = 16;
+static const size_t CheckpointRecords = 64;
+static const size_t CombineRunSize = 256;
+static const size_t CombineRuns = 3;
 
-using UVector = std::vector<uint8_t>;
+// sector numbers
+using UVector = std::vector<uint16_t>;
 
 struct PACKED Stm32FSHeaderStart_t {
     uint16_t StartSeq;
@@ -39,11 +49,18 @@ struct PACKED Stm32FSHeader_t {
     Stm32FSHeaderEnd_t HeaderEnd;
 };
 
-// 0xff - empty block, 0x01 - file header, 0x80 - file, 0x00 - deleted
+// 0xff - empty block, 0x01 - file header, 0x80 - file, 0x81 - file inside the record, 0x00 - deleted
+// 0x02/0x03 - transaction begin/commit. versions between them are valid only if commit exists.
+// 0x04 - index checkpoint. 0x05 - delete of the files by the name prefix.
 enum Stm32FileState_e {
     fsDeleted = 0x00,
     fsFileHeader = 0x01,
+    fsTxBegin = 0x02,
+    fsTxCommit = 0x03,
+    fsCheckpoint = 0x04,
+    fsDeletePrefix = 0x05,
     fsFileVersion = 0x80,
+    fsFileInline = 0x81,
     fsError = 0xf0,
     fsEmpty = 0xff
 };
@@ -54,18 +71,89 @@ struct PACKED Stm32FSFileHeader {
     char FileName[FileNameMaxLen];
 };
 
+// version flags
+enum Stm32FileVersionFlags_e {
+    fvTransaction = 0x01, // version is a part of transaction group
+    fvInline = 0x02       // only in RAM: fsFileVersion made from fsFileInline, address points into the record
+};
+
 struct PACKED Stm32FSFileVersion {
     uint8_t FileState;
     uint16_t FileID;
-    uint8_t none;
+    uint8_t Flags;
     uint32_t none2;
     uint32_t FileAddress;
     uint32_t FileSize;
 };
 
+// small file without data area. one record write instead of data and version.
+struct PACKED Stm32FSFileInline {
+    uint8_t FileState;
+    uint16_t FileID;
+    uint8_t Flags;
+    uint8_t Data[InlineMaxSize];
+    uint32_t FileSize;
+};
+
+// FileID field is always 0 here. it is not a file.
+struct PACKED Stm32FSTransaction {
+    uint8_t FileState;
+    uint16_t FileID;
+    uint16_t RecordCount;
+    uint8_t none[11];
+};
+
+// RAM index as it was at this record. entries lie in the data area, mount replays only the records after it.
+// FileID field is always 0 here. it is not a file.
+struct PACKED Stm32FSCheckpoint {
+    uint8_t FileState;
+    uint16_t FileID;
+    uint16_t EntryCount;
+    uint16_t NextFileID;
+    uint8_t none;
+    uint32_t DataEnd;
+    uint32_t Address;   // Stm32fsIndexEntry[EntryCount], then Stm32fsCatalogStat
+};
+
+// all the files with the name prefix are deleted at this record. it is DeleteFiles("prefix*") in one write.
+// FileID field is always 0 here. it is not a file.
+struct PACKED Stm32FSDeletePrefix {
+    uint8_t FileState;
+    uint16_t FileID;
+    uint8_t PrefixLength;
+    char Prefix[FileNameMaxLen - 1];
+};
+
+// catalog records by kind. kept by the writes, so the statistic doesn't scan the catalog.
+// the checkpoint stores it as it was before its own record.
+struct Stm32fsCatalogStat {
+    uint32_t HeaderRecords;
+    uint32_t VersionRecords;        // versions, inline versions and deletes
+    uint32_t VersionDataSize;       // data of all the version records, padded
+    uint32_t CheckpointDataSize;
+};
+
+// 8b start of the counter sector. the sector with the biggest serial is in force.
+struct PACKED Stm32FSCounterHeader {
+    uint16_t StartSeq;
+    uint16_t none;
+    uint32_t Serial;
+};
+
+// counter value. one flash double word, so a change is one program. the last record of the counter wins.
+struct PACKED Stm32FSCounterRecord {
+    uint16_t CounterID;
+    uint16_t CounterIDInv;  // ~CounterID. broken record doesn't match
+    uint32_t Value;
+};
+
 union PACKED Stm32FSFileRecord {
     Stm32FSFileHeader header;
     Stm32FSFileVersion version;
+    Stm32FSFileInline inlineVersion;
+    Stm32FSTransaction transaction;
+    Stm32FSCheckpoint checkpoint;
+    Stm32FSDeletePrefix deletePrefix;
 };
 
 struct PACKED Stm32FSFullFileRecord {
@@ -85,19 +173,27 @@ struct Stm32File_t {
 };
 
 struct Stm32fsConfigBlock_t {
-    std::vector<uint8_t> HeaderSectors;
-    std::vector<uint8_t> DataSectors;
+    UVector HeaderSectors;
+    UVector DataSectors;
 };
 
 struct Stm32fsConfig_t {
     std::vector<Stm32fsConfigBlock_t> Blocks;
+    UVector CounterSectors; // 2 sectors out of the blocks or empty
     size_t BaseBlockAddress;
-    uint32_t SectorSize; //  2048
-    std::function<bool (uint8_t)> fnEraseFlashBlock;
+    uint32_t SectorSize; // multiple of 16. 0 - BlockSize
+    std::function<bool (uint16_t)> fnEraseFlashBlock;
     std::function<bool (uint32_t, uint8_t*, size_t)> fnWriteFlash; // address, data, length
     std::function<bool (uint32_t, uint8_t*, size_t)> fnReadFlash;  // address, data, length
 };
 
+// sector layouts from the `first` sector. counters are set if `sectors` have place for them.
+// false if the blocks don't fit.
+// device: 1 block of 1 header and 3 data sectors, counters in the next 2. 4 or 6 sectors.
+bool Stm32fsLayoutDevice(Stm32fsConfig_t &cfg, uint16_t first, size_t sectors);
+// pc image: 2 blocks of 2 header and 3 data sectors, counters in the next 2. 10 or 12 sectors.
+bool Stm32fsLayoutPC(Stm32fsConfig_t &cfg, uint16_t first, size_t sectors);
+
 enum class Stm32fsStatFileState {
     None = 0,
     Header,
@@ -111,6 +207,7 @@ enum class Stm32fsStatFileState {
 struct Stm32fsStatistic {
     bool Valid = false;
 
+    size_t SectorSize;
     size_t HeaderSize;
     size_t HeaderFreeSize;
     size_t HeaderSystemDescriptors;
@@ -129,7 +226,7 @@ struct Stm32fsStatistic {
         if (!Valid)
             return false;
         if (HeaderDeletedFileDescriptors + HeaderDeletedVersionDescriptors > 0) {
-            if (HeaderDeletedFileDescriptors + HeaderDeletedVersionDescriptors > HeaderSize / BlockSize / 2)
+            if (HeaderDeletedFileDescriptors + HeaderDeletedVersionDescriptors > HeaderSize / SectorSize / 2)
                 return true;
             if (HeaderFreeSize < HeaderSize * 0.4)
                 return true;
@@ -139,12 +236,65 @@ struct Stm32fsStatistic {
     void Print();
 };
 
+// flash I/O since the start. reads via memory-mapped pointers are not counted.
+struct Stm32fsIOCounters {
+    uint32_t Reads = 0;
+    uint32_t BytesRead = 0;
+    uint32_t Writes = 0;
+    uint32_t BytesWritten = 0;
+    uint32_t Erases = 0;
+    uint32_t Optimizations = 0;
+    uint32_t CombinedWrites = 0;    // writes that went into a pending run of the combiner
+
+    void Clear();
+    void Print();
+};
+
+enum class Stm32fsSectorState : uint8_t {
+    Unknown = 0,    // not checked since the start
+    Erased,
+    Written,
+};
+
+// pending flash write of the combiner: the writes that go one after another in the flash
+struct Stm32fsCombineRun {
+    uint32_t Address = 0;
+    uint32_t Length = 0;        // 0 - free
+    uint32_t LastWrite = 0;     // sequence number of the last write into the run
+    uint8_t Data[CombineRunSize];
+};
+
 class Stm32fsFlash {
 private:
     Stm32fsConfig_t *FsConfig;
     Stm32fsConfigBlock_t *CurrentFsBlock;
+    Stm32fsIOCounters IOCounters;
+    uint32_t SectorSize = BlockSize;
+
+    // by sector number. all the writes and erases go through this class, so the state is exact.
+    std::vector<Stm32fsSectorState> SectorStates;
+    std::vector<uint32_t> EraseCounts;  // since the start
+    // block of the sector: its number in the config, SectorCounter or SectorNone. built at Init.
+    static constexpr uint8_t SectorNone = 0xff;
+    static constexpr uint8_t SectorCounter = 0xfe;
+    std::vector<uint8_t> SectorBlocks;
+    uint8_t CurrentBlockID = SectorNone;
+
+    // write combining. small writes that continue a pending run (after the padding of its last
+    // double word) stay in RAM till the flush, so several records and file data go to the flash
+    // with one program. reads and the empty checks see the pending data. empty - it is off.
+    std::vector<Stm32fsCombineRun> CombineRunsPending;
+    uint32_t CombineSequence = 0;
+    bool CombineSuspended = false;
+
+    void SetSectorState(uint32_t sectorNo, Stm32fsSectorState state);
+    bool ProgramFlash(uint32_t address, uint8_t *data, size_t length);
+    Stm32fsCombineRun *CombineSearch(uint32_t address, size_t length);
+    bool CombineEmpty(uint32_t address, size_t length, bool reverse, bool empty, uint32_t found, uint32_t *exceptAddr);
 public:
     Stm32fsFlash();
+
+    Stm32fsIOCounters &GetIOCounters(){return IOCounters;};
     
     Stm32fsConfigBlock_t *Init(Stm32fsConfig_t *config);
     bool SetCurrentFsBlock(Stm32fsConfigBlock_t *block);
@@ -153,17 +303,27 @@ public:
     void SetFlashBlocksCountByCfg(Stm32fsConfigBlock_t *cfg);
     
     size_t GetBaseAddress();
-    uint32_t GetBlockAddress(uint8_t blockNum);
+    uint32_t GetSectorSize() {return SectorSize;};
+    uint32_t GetBlockAddress(uint16_t blockNum);
     uint32_t GetBlockFromAddress(uint32_t address);
-    bool FindBlockInCfg(std::vector<Stm32fsConfigBlock_t> blocks, uint32_t sectorNo);
-    bool FindBlockInConfigBlock(Stm32fsConfigBlock_t &block, uint32_t sectorNo);
+    bool FindBlockInCfg(const std::vector<Stm32fsConfigBlock_t> &blocks, uint32_t sectorNo);
+    bool FindBlockInConfigBlock(const Stm32fsConfigBlock_t &block, uint32_t sectorNo);
     bool AddressInFlash(uint32_t address, size_t length, bool searchAllBlocks = false);
-    bool EraseFlashBlock(uint8_t blockNo);
+    bool EraseFlashBlock(uint16_t blockNo);
     bool isFlashEmpty(uint32_t address, size_t length, bool reverse, uint32_t *exceptAddr);
-    bool isFlashBlockEmpty(uint8_t blockNo);
+    bool isFlashBlockEmpty(uint16_t blockNo);
     bool WriteFlash(uint32_t address, uint8_t *data, size_t length);
     bool ReadFlash(uint32_t address, uint8_t *data, size_t length);
 
+    void EnableCombining(bool enable);
+    // optimizer reads the flash by pointers. pending writes are flushed and new ones go directly.
+    void SuspendCombining(bool suspend);
+    // pending runs go to the flash in the order of their last writes. so file data goes before
+    // the record that points to it. runs are dropped if it fails.
+    bool Flush();
+    // before the read by the pointer
+    bool FlushRange(uint32_t address, size_t length);
+
     bool CheckFsHeader(Stm32FSHeader_t &header);
     void FillFsHeader(Stm32FSHeader_t &header, uint32_t serial);
     bool GetFsHeader(Stm32fsConfigBlock_t &config, Stm32FSHeader_t &header);
@@ -171,11 +331,93 @@ public:
     bool EraseSectors(UVector &sectors);
     bool EraseFs(Stm32fsConfigBlock_t &config);
     bool CreateFsBlock(Stm32fsConfigBlock_t &blockCfg, uint32_t serial);
+
+    // erases one written sector of the blocks out of use. so optimization finds them erased.
+    // returns true if it erased.
+    bool EraseSpareSector(Stm32fsConfigBlock_t *currentBlock, Stm32fsConfigBlock_t *keepBlock);
+    uint32_t GetEraseCount(uint16_t sectorNo);
+    void PrintEraseCounts();
     
     Stm32fsConfigBlock_t *SearchLastFsBlockInFlash();
     Stm32fsConfigBlock_t *SearchNextFsBlockInFlash();
 };
 
+// RAM index of the catalog: file name -> file header and the version in force.
+struct Stm32fsIndexEntry {
+    uint16_t FileID;        // 0 - empty slot
+    uint8_t NameHash;
+    uint8_t VersionState;   // fsFileVersion, fsFileInline, fsDeleted or fsEmpty if file doesn't have versions
+    uint32_t HeaderAddress; // file name is checked there
+    uint32_t FileAddress;
+    uint32_t FileSize;
+};
+
+// Open addressing table built at mount and kept in sync by writes. Size is the power of 2 not less
+// than count of header records, so it can't overflow. Name is not stored, lookup reads the file
+// header record of the matched entry.
+// Prefix index: namespace hash of the name by slot ("1_" of "1_2_3"). The searches by the name prefix
+// skip the other namespaces without the reads of the header records.
+class Stm32fsIndex {
+private:
+    std::vector<Stm32fsIndexEntry> entries;
+    std::vector<uint8_t> prefixes;  // 0 - not known yet. entries from the checkpoint get it at the first search.
+    // second open addressing table: FileID -> slot of the entry. ids go one by one, so the id is the hash.
+    std::vector<uint16_t> idSlots;
+    static constexpr uint16_t NoSlot = 0xffff;
+    bool Valid = false;
+    uint32_t Generation = 0;  // changes when the slots of the entries change
+    size_t EntryCount = 0;
+
+    // files with the version in force and their data. changed with the entries.
+    size_t LiveFiles = 0;
+    uint32_t LiveDataSize = 0;
+    void Account(const Stm32fsIndexEntry &entry, bool add);
+public:
+    static uint8_t NameHash(std::string_view fileName);
+    // hash of the name up to the first '_' with it. never 0.
+    static uint8_t PrefixHash(std::string_view fileName);
+    // namespace hash of all the names with this prefix. 0 - any, prefix doesn't have '_'.
+    static uint8_t FilterPrefixHash(std::string_view prefix);
+
+    void Init(size_t headerRecords);
+    void Clear();
+    bool isValid() {return Valid;};
+    void SetValid(bool valid) {Valid = valid;};
+
+    // first slot for the name and the next slots of the same chain. nullptr at the chain end.
+    Stm32fsIndexEntry *FirstSlot(uint8_t nameHash, size_t &slot);
+    Stm32fsIndexEntry *NextSlot(size_t &slot);
+    Stm32fsIndexEntry *FindByID(uint16_t fileID);
+    // entry from the checkpoint goes to the chain of its hash
+    bool Insert(const Stm32fsIndexEntry &entry, uint8_t prefixHash = 0);
+    bool Append(uint16_t fileID, std::string_view fileName, uint32_t headerAddress);
+    bool SetVersion(Stm32FSFileVersion &version);
+    void SetEntryVersion(Stm32fsIndexEntry &entry, Stm32FSFileVersion &version);
+    std::vector<Stm32fsIndexEntry> &Entries() {return entries;};
+    uint8_t &SlotPrefix(size_t slot) {return prefixes[slot];};
+    uint32_t GetGeneration() {return Generation;};
+    size_t GetEntryCount() {return EntryCount;};
+    size_t GetLiveFiles() {return LiveFiles;};
+    uint32_t GetLiveDataSize() {return LiveDataSize;};
+};
+
+enum class Stm32fsStepPhase {
+    Idle,
+    Erase,  // output block, one sector per step
+    Copy,   // records of the current block in the catalog order
+};
+
+// state of the optimization by steps. it lives in Stm32fs between the steps.
+struct Stm32fsStepState {
+    Stm32fsStepPhase Phase = Stm32fsStepPhase::Idle;
+    Stm32fsConfigBlock_t *OutputBlock = nullptr;
+    size_t EraseID = 0;
+    uint32_t Cursor = 0;        // next record of the current catalog to copy
+    uint32_t HeaderOffset = 0;  // write positions in the output block
+    uint32_t DataOffset = 0;
+    std::vector<bool> CopiedHeaders;
+};
+
 class Stm32fs {
 private:
     friend class Stm32fsOptimizer;
@@ -187,6 +429,74 @@ private:
     
     Stm32fsFlash flash;
 
+    // transaction. data writes to flash immediately, versions wait for commit in ram.
+    bool TxActive;
+    size_t TxCount;
+    Stm32FSFileVersion TxRecords[TxMaxRecords];
+
+    // end of catalog and of data. found at mount and moved by the writes.
+    bool TailValid;
+    uint32_t CatalogTail;     // first empty record. 0 - catalog is full
+    uint32_t CatalogRecords;
+    uint16_t NextFileID;
+    uint32_t DataEnd;         // data of the open transaction is here too
+
+    uint32_t CheckpointTail;  // CatalogRecords at the last checkpoint. 0 - no checkpoint
+    Stm32fsCatalogStat CatalogStat;
+
+    // scan starts from the checkpoint if it is set
+    bool LoadTail(uint32_t checkpointAddr = 0);
+    void AdvanceTail(size_t records);
+    void CountRecord(Stm32FSFileRecord &filerec);
+    void LoadCatalog();
+    uint32_t RecordNumber(uint32_t addr);
+
+    Stm32fsStepState StepState;
+    void StepReset();
+    bool OptimizeBlock();
+
+    Stm32fsIndex Index;
+    bool IndexEnabled;
+    bool CheckpointEnabled;
+
+    // slots of a namespace in the catalog order for FindFirst/FindNext. built once per index generation.
+    std::vector<uint16_t> FindSlots;
+    uint8_t FindPrefixHash = 0;
+    uint32_t FindGeneration = 0;
+    bool FindSlotsValid = false;
+
+    void BuildIndex();
+    uint32_t FindCheckpoint();
+    bool LoadCheckpoint(uint32_t checkpointAddr);
+    Stm32fsIndexEntry *IndexSearch(std::string_view fileName, Stm32FSFileHeader *header);
+    // file of the index slot has the name prefix. reads the header if the prefix index doesn't skip it.
+    bool IndexSlotMatch(size_t slot, std::string_view prefix, uint8_t prefixHash, Stm32FSFileHeader &header);
+    void IndexDeletePrefix(std::string_view prefix);
+    void IndexFindSlots(uint8_t prefixHash);
+    Stm32File_t *IndexFindNext(Stm32File_t *filePtr);
+    bool ReplayCatalog(std::function<void (Stm32FSFileHeader&, uint32_t)> fnHeader,
+                       std::function<void (Stm32FSFileVersion&)> fnVersion, uint32_t startAfter = 0,
+                       std::function<void (std::string_view)> fnPrefix = nullptr);
+    bool SearchFile(std::string_view fileName, Stm32FSFileHeader &header, Stm32FSFileVersion &version);
+
+    bool TxAppendVersion(Stm32FSFileVersion &version);
+    Stm32FSFileVersion *TxSearchVersion(uint16_t fileID);
+    Stm32FSFileInline *TxSearchInline(uint16_t fileID);
+
+    bool InlineEnabled;
+
+    // counters. values are in RAM, the active sector has the log of their changes.
+    int CounterSector;          // active one in FsConfig.CounterSectors. -1 - no counters
+    uint32_t CounterSerial;
+    uint32_t CounterNext;       // first empty record
+    bool CounterNextFailed;     // program of CounterNext failed, the record may be half-written
+    bool CounterSpareEmpty;
+    std::vector<Stm32FSCounterRecord> CounterValues;
+
+    void LoadCounters();
+    bool CounterRollUp();
+    Stm32FSCounterRecord *CounterSearch(uint16_t counterID);
+
     bool CheckValid();
     uint32_t GetFirstHeaderAddress();
     uint32_t GetNextHeaderAddress(uint32_t previousAddress);
@@ -198,24 +508,33 @@ private:
     Stm32FSFileVersion SearchFileVersion(uint16_t fileID);
     Stm32FSFileHeader AppendFileHeader(std::string_view fileName);
     bool AppendFileVersion(Stm32FSFileVersion &version);
+    bool AppendDeletePrefix(std::string_view prefix);
     uint32_t FindEmptyDataArea(size_t length);
+    Stm32fsStatistic ScanStatistic();
 public:
     Stm32fs(Stm32fsConfig_t config);
     Stm32fs();
+    ~Stm32fs();
 
     bool isValid();
     bool isNeedsOptimization();
 
     bool SetCurrentFsBlock(Stm32fsConfigBlock_t *block);
     uint32_t GetCurrentFsBlockSerial();
+    Stm32fsConfigBlock_t *GetCurrentFsBlock(){return CurrentFsBlock;};
     Stm32fsFlash &GetFlash(){return flash;};
     uint32_t GetSize();
     uint32_t GetFreeMemory();
     uint32_t GetFreeFileDescriptors();
+    // from the counters kept by the writes and the index. without the index it scans the catalog.
+    // versions of the open transaction are counted after the commit.
     Stm32fsStatistic GetStatistic();
+    Stm32fsIOCounters &GetIOCounters(){return flash.GetIOCounters();};
 
     Stm32File_t *FindFirst(std::string_view fileFilter, Stm32File_t *filePtr);
     Stm32File_t *FindNext(Stm32File_t *filePtr);
+    // all the records of the catalog in the order of the writes. stops if fnRecord returns false.
+    bool ReadCatalog(std::function<bool (Stm32FSFileRecord &, uint32_t)> fnRecord);
 
 	bool FileExist(std::string_view fileName);
     int FileLength(std::string_view fileName);
@@ -224,16 +543,57 @@ public:
 	bool WriteFile(std::string_view fileName, uint8_t *data, size_t length);
 
     bool DeleteFile(std::string_view fileName);
+    // "prefix*" out of the transaction is one record for all the files. other filters delete file by file.
     bool DeleteFiles(std::string_view fileFilter);
+
+    // all the writes and deletes between begin and commit appear in the catalog at once
+    bool BeginTransaction();
+    // if the group doesn't fit into the catalog the transaction stays open: optimize and commit again
+    bool CommitTransaction();
+    void AbortTransaction();
+    bool isTransactionActive();
     
+    // works with the open transaction too: its data is moved and the commit can go after it
     bool Optimize();
-};
 
-struct PACKED Stm32OptimizedFile_t {
-    char FileName[FileNameMaxLen];
-    uint32_t FileAddress;
-    uint16_t FileSize;
-    bool isEmpty() {return (FileName[0] == 0 && FileAddress == 0 && FileSize == 0);}
+    // optimization by the steps: one sector erase or copy of several records per step. so it can
+    // run between the commands. reads and writes work as usual in the middle of it.
+    // needs 2 blocks in the config and the index. finishes when there is no open transaction.
+    bool OptimizeStart();
+    bool OptimizeStep(size_t maxRecords = OptimizeStepRecords);
+    bool isOptimizeActive();
+
+    // index is on by default. without it every search scans the catalog in flash.
+    void EnableIndex(bool enable);
+    bool isIndexValid();
+
+    // checkpoint of the index is written after the optimization and every CheckpointRecords catalog
+    // records, but not more often than one index entry of data per catalog record.
+    // mount loads it and replays only the records after it. on by default.
+    void EnableCheckpoint(bool enable) {CheckpointEnabled = enable;};
+    bool WriteCheckpoint();
+    // writes it if the catalog got max(CheckpointRecords, index entries) records after the last one. true if it did.
+    bool PrepareCheckpoint();
+
+    // files up to InlineMaxSize are written into the version record. on by default.
+    void EnableInline(bool enable) {InlineEnabled = enable;};
+
+    // small writes out of the optimizer are combined in RAM till Flush: data of the file with the
+    // next ones and the records one after another. they are lost if the power goes before it.
+    // off by default. storage flushes at the end of the command.
+    void EnableWriteCombining(bool enable);
+    bool Flush();
+
+    // counters live in their own 2 sectors (CounterSectors), out of the catalog and the transactions.
+    // a change is one 8-byte write. full sector rolls up the last values to the other one.
+    bool isCountersEnabled();
+    bool ReadCounter(uint16_t counterID, uint32_t &value);
+    bool WriteCounter(uint16_t counterID, uint32_t value);
+    // erases the old sector after the roll-up, so it doesn't wait for the write. true if it did.
+    bool PrepareCounters();
+    // erases one sector of the old blocks per call, so the next optimization doesn't wait for it.
+    // single block fs has nothing to erase ahead. true if it did.
+    bool PrepareSectors();
 };
 
 class Stm32fsWriter {
@@ -245,7 +605,9 @@ private:
 public:
     Stm32fsWriter(Stm32fsFlash &fsFlash, UVector &sec) :flash{fsFlash}, sectors{sec}{};
     
-    bool Init(uint32_t offset = 0);
+    // offset from the beginning of the first sector. sectors are erased if `erase` set.
+    bool Init(uint32_t offset = 0, bool erase = true);
+    uint32_t GetOffset();
     bool Write(uint8_t *data, size_t len, uint32_t *newaddr = nullptr);
     bool WriteFsHeaderToTop(uint32_t serial);
     bool WriteFileHeader(Stm32FSFileHeader &header);
@@ -260,46 +622,45 @@ private:
     UVector &sectors;
     int CurrentSectorID = -1;
     size_t CurrentAddress = 0;
-    uint8_t cache[BlockSize] = {0};
+    std::vector<uint8_t> cache;  // one sector
     
     void ClearCache();
-    bool WriteToFlash(uint8_t sectorNum);
+    // the rest of the sector stays erased, so it can be programmed later
+    bool WriteToFlash(uint16_t sectorNum, size_t length);
 public:
     Stm32fsWriteCache(Stm32fsFlash &fsFlash, UVector &sec) :flash{fsFlash}, sectors{sec}{};
     
     bool Init();
     bool Write(uint8_t *data, size_t len);
     bool WriteFsHeader(uint32_t serial);
-    bool WriteFileHeader(Stm32OptimizedFile_t &fileHeader, uint16_t &fileID);
     bool Flush();
-};
-    
-class Stm32fsFileList {
-private:
-    static const size_t FileListLength = 110;
-    Stm32OptimizedFile_t FileList[FileListLength] = {0};
-    
-    int FindEmptyID();
-public:
-    Stm32fsFileList();
-    
-    void Clear();
-    bool Empty();
-    int Size();
-    bool Append(Stm32FSFileHeader &header, Stm32FSFileVersion &version);
-    bool Sort();
-    bool Write(Stm32fsWriteCache &cache);
-    Stm32OptimizedFile_t &GetFileByID(size_t id);
+    // sectors after the written data
+    bool EraseRest(size_t length);
 };
 
 class Stm32fsOptimizer {
 private:
     Stm32fs &fs;
+    // data address of the live files after CompactData, by the index slot
+    std::vector<uint32_t> CompactedAddresses;
 public:
     Stm32fsOptimizer(Stm32fs &stm32fs);
+    ~Stm32fsOptimizer();
     
-    bool OptimizeViaRam(Stm32fsConfigBlock_t &block);
+    // single block. the block is compacted in place by the streaming passes over the index.
+    // RAM use is one new data address per index slot.
+    bool OptimizeInPlace(Stm32fsConfigBlock_t &block);
     bool OptimizeMultiblock(Stm32fsConfigBlock_t &inputBlock, Stm32fsConfigBlock_t &outputBlock);
+
+    bool StepStart(Stm32fsConfigBlock_t &outputBlock);
+    bool Step(size_t maxRecords);
+private:
+    bool CompactData(Stm32fsConfigBlock_t &block);
+    bool CompactCatalog(Stm32fsConfigBlock_t &block, uint32_t serial);
+
+    bool StepErase();
+    bool StepCopyRecord(Stm32FSFileRecord &filerec);
+    bool StepFinish();
 };
 
 template<typename T>
@@ -10,13 +10,16 @@
 #include <opgpdevice.h>
 #include <stdio.h>
 #include <cstdlib>
+#include <cstring>
 #include <chrono>
 #include <thread>
 
 #include "solofactory.h"
 #include "opgputil.h"
+#include "pcstorage.h"
 #include "applications/apduconst.h"
 #include "ccid.h"
+#include "trace.h"
 
 #define USBIP_MODE
 
@@ -32,6 +35,9 @@ void exchangeFunc(uint8_t *datain, size_t datainlen, uint8_t *dataout, size_t *o
 	printf_device("a>> "); dump_hex(apdu);
     fexecutor->Execute(apdu, resstr);
     printf_device("a<< "); dump_hex(resstr);
+#ifdef OPGP_TRACE
+    Util::Tracer::GetTracer().Drain();
+#endif
 
     *outlen = resstr.length();
     memcpy(dataout, apdu_result, *outlen);
@@ -44,6 +50,57 @@ int main(int argc, char * argv[])
     printf("------------------\n");
     printf("OpenPGP Starting...\n");
 
+    // --storage=spiffs|dir|ram|mmap|stm32fs --image=<file> --image-size=<bytes>
+    // --sync=write|command|periodic[:<ms>] --layout=pc|device (stm32fs)
+    // --trace=<file> - Chrome trace-event JSON of the commands (OPGP_TRACE build)
+    const char *storage = "spiffs";
+    const char *image = nullptr;
+    const char *sync = "write";
+    const char *layout = "pc";
+    const char *trace = nullptr;
+    size_t imageSize = 0;
+    for (int i = 1; i < argc; i++) {
+    	if (strncmp(argv[i], "--storage=", 10) == 0)
+    		storage = argv[i] + 10;
+    	else if (strncmp(argv[i], "--image=", 8) == 0)
+    		image = argv[i] + 8;
+    	else if (strncmp(argv[i], "--image-size=", 13) == 0)
+    		imageSize = strtoul(argv[i] + 13, nullptr, 0);
+    	else if (strncmp(argv[i], "--sync=", 7) == 0)
+    		sync = argv[i] + 7;
+    	else if (strncmp(argv[i], "--layout=", 9) == 0)
+    		layout = argv[i] + 9;
+    	else if (strncmp(argv[i], "--trace=", 8) == 0)
+    		trace = argv[i] + 8;
+    }
+    if (pc_select_storage(storage, image) != 0) {
+    	printf("wrong storage: %s\n", storage);
+    	return 1;
+    }
+    if (pc_set_image_size(imageSize) != 0) {
+    	printf("wrong image size: %zu\n", imageSize);
+    	return 1;
+    }
+    if (pc_select_sync(sync) != 0) {
+    	printf("wrong sync mode: %s\n", sync);
+    	return 1;
+    }
+    if (pc_select_layout(layout) != 0) {
+    	printf("wrong layout: %s\n", layout);
+    	return 1;
+    }
+    if (trace) {
+#ifdef OPGP_TRACE
+    	if (!Util::Tracer::GetTracer().Open(trace)) {
+    		printf("can't open trace file: %s\n", trace);
+    		return 1;
+    	}
+#else
+    	printf("trace is not built in. build with OPGP_TRACE.\n");
+    	return 1;
+#endif
+    }
+
     hwinit();
     printf("Init hardware ok\n");
 
@@ -89,6 +146,9 @@ int main(int argc, char * argv[])
             printf(">> "); dump_hex(apdu);
 
             executor.Execute(apdu, resstr);
+#ifdef OPGP_TRACE
+            Util::Tracer::GetTracer().Drain();
+#endif
 
             printf("<< "); dump_hex(resstr);
 
@@ -107,6 +167,9 @@ int main(int argc, char * argv[])
 
             ccid_send(result, rlen + 10);
 
+        } else {
+        	// storage optimization by steps between the commands
+        	factory.GetFileSystem().Idle();
         }
     }
 
@@ -23,49 +23,92 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <fnmatch.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include "opgpdevice.h"
+#include "pcstorage.h"
+#include "latency.h"
 
-#define SPIFFS_MODE
-
-#ifdef SPIFFS_MODE
 #include <spiffs.h>
-static spiffs fs;
-static uint8_t fsbuf[2048*10] = {0};
-static char *SpiffsFileName = (char *)"filesystem.spiffs";
-#endif
+
+using namespace File;
 
 #define LOG_PAGE_SIZE 64
 
-bool ifileexist(char* name);
-int ireadfile(char* name, uint8_t * buf, size_t max_size, size_t *size);
-int iwritefile(char* name, uint8_t * buf, size_t size);
-int sprintfs();
+static const size_t SpiffsBlockSize = 2048;
+static const size_t DefaultImageSize = 2048*10;
+
+static spiffs fs;
+static MemoryRegion spiffsRegion;
+static const char *SpiffsFileName = "./data/filesystem.spiffs";
 
 static u8_t spiffs_work_buf[LOG_PAGE_SIZE * 2];
 static u8_t spiffs_fds[32 * 4];
 static u8_t spiffs_cache_buf[(LOG_PAGE_SIZE + 32) * 4];
 
+// spiffs image in the mmap'd file (./data/filesystem.spiffs by default). only the changed pages
+// are synced, when the sync mode says so.
+class SpiffsFileStorage : public FileStorage {
+private:
+	bool transaction = false;
+	std::vector<uint8_t> snapshot;
+public:
+	int Load(const char *fileName, size_t size);
+	void Mount();
+	void Print();
+
+	virtual bool FileExist(char *name);
+	virtual int ReadFile(char *name, uint8_t *buf, size_t max_size, size_t *size);
+	virtual int WriteFile(char *name, uint8_t *buf, size_t size);
+	virtual int DeleteFile(char *name);
+	virtual int DeleteFiles(char *name);
+
+	// image is synced only on commit. rollback is made from the memory copy.
+	virtual int BeginTransaction();
+	virtual int CommitTransaction();
+	virtual int AbortTransaction();
+
+	virtual int Flush();
+	virtual int Idle();
+};
+
+static SpiffsFileStorage spiffsStorage;
+static DirFileStorage dirStorage;
+static MemoryFileStorage memoryStorage;
+static Stm32fsImageStorage stm32fsStorage;
+static FileStorage *storage = &spiffsStorage;
+
+static const char *storageName = "spiffs";
+static const char *storageImage = nullptr;
+static size_t imageSize = DefaultImageSize;
+static SyncMode syncMode = SyncMode::Write;
+static uint32_t syncPeriodMs = 1000;
+
+// the writes are synced at the end of the storage operation
 static s32_t hw_spiffs_read(u32_t addr, u32_t size, u8_t *dst) {
-	memcpy(dst, fsbuf + addr, size);
+	memcpy(dst, spiffsRegion.Data() + addr, size);
 	return SPIFFS_OK;
 }
 
 static s32_t hw_spiffs_write(u32_t addr, u32_t size, u8_t *src) {
-	memcpy(fsbuf + addr, src, size);
+	memcpy(spiffsRegion.Data() + addr, src, size);
+	spiffsRegion.MarkDirty(addr, size);
 	return SPIFFS_OK;
 }
 
 static s32_t hw_spiffs_erase(u32_t addr, u32_t size) {
-	memset(fsbuf + addr, 0xff, size);
+	memset(spiffsRegion.Data() + addr, 0xff, size);
+	spiffsRegion.MarkDirty(addr, size);
 	return SPIFFS_OK;
 }
 
-void hw_spiffs_mount() {
+void SpiffsFileStorage::Mount() {
 	spiffs_config cfg;
-	cfg.phys_size = 10*2048; // use all spi flash
+	cfg.phys_size = spiffsRegion.Size(); // use all spi flash
 	cfg.phys_addr = 0;       // start spiffs at start of spi flash
-	cfg.phys_erase_block = 2048; // according to datasheet
-	cfg.log_block_size = 2048;   // let us not complicate things
+	cfg.phys_erase_block = SpiffsBlockSize; // according to datasheet
+	cfg.log_block_size = SpiffsBlockSize;   // let us not complicate things
 	cfg.log_page_size = LOG_PAGE_SIZE; // as we said
 
 	cfg.hal_read_f = hw_spiffs_read;
@@ -91,30 +134,261 @@ void hw_spiffs_mount() {
 	uint32_t used = 0;
 	SPIFFS_info(&fs, &total, &used);
 	printf("Mounted OK. Memory total: %d used: %d\n", total, used);
-	sprintfs();
+	Print();
 }
 
-int hwinit() {
-#ifdef SPIFFS_MODE
-	memset(fsbuf, 0xff, sizeof(fsbuf));
+// image of the other size is formatted
+int SpiffsFileStorage::Load(const char *fileName, size_t size) {
+	if (access("./data/", F_OK) != 0)
+		mkdir("./data/", 0777);
+
+	size = (size / SpiffsBlockSize) * SpiffsBlockSize;
+	if (!spiffsRegion.Map(fileName, size, 0xff))
+		return 1;
+	spiffsRegion.SetSyncMode(syncMode, syncPeriodMs);
 
-	if (ifileexist(SpiffsFileName)) {
-		size_t size = 0;
-		ireadfile(SpiffsFileName, fsbuf, sizeof(fsbuf), &size);
-		if (size != sizeof(fsbuf))
-			memset(fsbuf, 0xff, sizeof(fsbuf));
+	printf("Loaded OK\n");
+	return 0;
+}
 
-		printf("Loaded OK\n");
+void SpiffsFileStorage::Print() {
+	spiffs_DIR d;
+	struct spiffs_dirent e;
+	struct spiffs_dirent *pe = &e;
+
+	uint32_t total = 0;
+	uint32_t used = 0;
+	SPIFFS_info(&fs, &total, &used);
+	printf_device("Memory total: %d used: %d\n", total, used);
+
+	SPIFFS_opendir(&fs, "/", &d);
+	while ((pe = SPIFFS_readdir(&d, pe))) {
+		printf_device("  [%4d] %s\n", pe->size, pe->name);
 	}
+	SPIFFS_closedir(&d);
+}
 
-	hw_spiffs_mount();
-#endif
+bool SpiffsFileStorage::FileExist(char* name) {
+	spiffs_DIR d;
+	struct spiffs_dirent e;
+	struct spiffs_dirent *pe = &e;
 
+	SPIFFS_opendir(&fs, "/", &d);
+	while ((pe = SPIFFS_readdir(&d, pe))) {
+		if (0 == strcmp(name, (char *)pe->name)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int SpiffsFileStorage::ReadFile(char* name, uint8_t * buf, size_t max_size, size_t *size) {
+	*size = 0;
+
+	spiffs_file fd = SPIFFS_open(&fs, name, SPIFFS_RDWR, 0);
+	if (fd < 0)
+		return fd;
+
+	int res = SPIFFS_read(&fs, fd, buf, max_size);
+
+	*size = res;
+	int cres = SPIFFS_close(&fs, fd) < 0;
+	if (cres < 0)
+		return cres;
+
+	return (res >= 0) ? 0 : res;
+}
+
+int SpiffsFileStorage::WriteFile(char* name, uint8_t * buf, size_t size) {
+	spiffs_file fd = SPIFFS_open(&fs, name, SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_RDWR, 0);
+	if (fd < 0)
+		return fd;
+
+	int res = SPIFFS_write(&fs, fd, buf, size);
+
+	int cres = SPIFFS_close(&fs, fd) < 0;
+	if (!transaction)
+		spiffsRegion.WriteDone();
+	if (cres < 0)
+		return cres;
+
+	return (res >= 0) ? 0 : res;
+}
+
+int SpiffsFileStorage::DeleteFile(char* name) {
+	int res = SPIFFS_remove(&fs, name);
+	if (!transaction)
+		spiffsRegion.WriteDone();
+	return res;
+}
+
+int SpiffsFileStorage::DeleteFiles(char* name) {
+	spiffs_DIR d;
+	struct spiffs_dirent e;
+	struct spiffs_dirent *pe = &e;
+	int res;
+
+	Print();
+
+	SPIFFS_opendir(&fs, "/", &d);
+	while ((pe = SPIFFS_readdir(&d, pe))) {
+		if ((fnmatch(name, (char *)pe->name, 0)) == 0) {
+			spiffs_file fd = SPIFFS_open_by_dirent(&fs, pe, SPIFFS_RDWR, 0);
+			if (fd < 0)
+				return SPIFFS_errno(&fs);
+			res = SPIFFS_fremove(&fs, fd);
+			if (res < 0)
+				return SPIFFS_errno(&fs);
+		}
+	}
+	SPIFFS_closedir(&d);
+	if (!transaction)
+		spiffsRegion.WriteDone();
+	return 0;
+}
+
+int SpiffsFileStorage::BeginTransaction() {
+	snapshot.assign(spiffsRegion.Data(), spiffsRegion.Data() + spiffsRegion.Size());
+	transaction = true;
+	return 0;
+}
+
+int SpiffsFileStorage::CommitTransaction() {
+	transaction = false;
+	snapshot.clear();
+	spiffsRegion.WriteDone();
+	return 0;
+}
+
+int SpiffsFileStorage::AbortTransaction() {
+	transaction = false;
+
+	// return to the image before the transaction
+	SPIFFS_unmount(&fs);
+	memcpy(spiffsRegion.Data(), snapshot.data(), snapshot.size());
+	spiffsRegion.Sync(0, snapshot.size());
+	snapshot.clear();
+	Mount();
+	return 0;
+}
+
+int SpiffsFileStorage::Flush() {
+	if (!transaction)
+		spiffsRegion.Flush();
+	return 0;
+}
+
+int SpiffsFileStorage::Idle() {
+	if (!transaction)
+		spiffsRegion.Idle();
 	return 0;
 }
 
-int spiffs_save() {
-	return iwritefile(SpiffsFileName, fsbuf, sizeof(fsbuf));
+int pc_select_storage(const char *name, const char *image) {
+	if (strcmp(name, "spiffs") != 0 && strcmp(name, "dir") != 0 && strcmp(name, "ram") != 0 &&
+	    strcmp(name, "mmap") != 0 && strcmp(name, "stm32fs") != 0)
+		return 1;
+
+	storageName = name;
+	storageImage = image;
+	return 0;
+}
+
+int pc_select_layout(const char *name) {
+	if (strcmp(name, "pc") == 0)
+		stm32fsStorage.SetLayout(ImageLayout::PC);
+	else if (strcmp(name, "device") == 0)
+		stm32fsStorage.SetLayout(ImageLayout::Device);
+	else
+		return 1;
+	return 0;
+}
+
+int pc_set_image_size(size_t size) {
+	if (size != 0 && size < DefaultImageSize)
+		return 1;
+
+	imageSize = (size != 0) ? size : DefaultImageSize;
+	return 0;
+}
+
+int pc_select_sync(const char *mode) {
+	if (strcmp(mode, "write") == 0) {
+		syncMode = SyncMode::Write;
+	} else if (strcmp(mode, "command") == 0) {
+		syncMode = SyncMode::Command;
+	} else if (strncmp(mode, "periodic", 8) == 0) {
+		syncMode = SyncMode::Periodic;
+		if (mode[8] == ':')
+			syncPeriodMs = atoi(mode + 9);
+		else if (mode[8] != 0)
+			return 1;
+	} else {
+		return 1;
+	}
+	return 0;
+}
+
+static uint64_t MonotonicNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// latency clock: cycle counter on x86, the monotonic clock in ns on the others
+static uint64_t hw_latency_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return MonotonicNs();
+#endif
+}
+
+// cycle counter is calibrated against the monotonic clock
+static uint32_t hw_latency_ticks_per_us() {
+#if defined(__x86_64__) || defined(__i386__)
+	uint64_t ns = MonotonicNs();
+	uint64_t ticks = __rdtsc();
+	usleep(10000);
+	ns = MonotonicNs() - ns;
+	ticks = __rdtsc() - ticks;
+	return (ns > 0) ? (ticks * 1000 + ns / 2) / ns : 1;
+#else
+	return 1000;
+#endif
+}
+
+int hwinit() {
+	int res = 0;
+	Util::LatencyStatistic::GetLatencyStatistic().SetClock(hw_latency_clock, hw_latency_ticks_per_us());
+
+	if (strcmp(storageName, "dir") == 0) {
+		storage = &dirStorage;
+	} else if (strcmp(storageName, "ram") == 0) {
+		res = memoryStorage.Init(imageSize);
+		storage = &memoryStorage;
+	} else if (strcmp(storageName, "mmap") == 0) {
+		res = memoryStorage.Init(storageImage ? storageImage : "./filesystem.mmap", imageSize);
+		memoryStorage.GetRegion().SetSyncMode(syncMode, syncPeriodMs);
+		storage = &memoryStorage;
+	} else if (strcmp(storageName, "stm32fs") == 0) {
+		// without image it works in the RAM
+		res = storageImage ? stm32fsStorage.Init(storageImage) : stm32fsStorage.Init();
+		stm32fsStorage.GetRegion().SetSyncMode(syncMode, syncPeriodMs);
+		storage = &stm32fsStorage;
+	} else {
+		res = spiffsStorage.Load(storageImage ? storageImage : SpiffsFileName, imageSize);
+		if (res == 0)
+			spiffsStorage.Mount();
+		storage = &spiffsStorage;
+	}
+	printf("Storage: %s %s\n", storageName, res ? "ERROR" : "OK");
+
+	return res;
+}
+
+FileStorage *hwfilestorage() {
+	return storage;
 }
 
 int udp_server()
@@ -211,236 +485,6 @@ void ccid_send(uint8_t * msg, uint32_t sz)
     udp_send(fd, msg, sz);
 }
 
-void make_work_directory(char* dir) {
-	if (access(dir, F_OK) != 0) {
-		mkdir(dir, 0777);
-	}
-}
-
-bool ifileexist(char* name) {
-	char fname[100] = {0};
-	char dir[] = "./data/";
-	make_work_directory(dir);
-
-	strcpy(fname, dir);
-	strcat(fname, name);
-
-	// check if it exist and have read permission
-	if (access(fname, R_OK) != 0)
-		return false;
-
-	return true;
-}
-
-bool sfileexist(char* name) {
-	spiffs_DIR d;
-	struct spiffs_dirent e;
-	struct spiffs_dirent *pe = &e;
-
-	SPIFFS_opendir(&fs, "/", &d);
-	while ((pe = SPIFFS_readdir(&d, pe))) {
-		if (0 == strcmp(name, (char *)pe->name)) {
-			return true;
-		}
-	}
-	return false;
-}
-
-bool fileexist(char* name) {
-#ifdef SPIFFS_MODE
-	return sfileexist(name);
-#else
-	return ifileexist(name);
-#endif
-}
-
-int ireadfile(char* name, uint8_t * buf, size_t max_size, size_t *size) {
-
-	char fname[100] = {0};
-	char dir[] = "./data/";
-	make_work_directory(dir);
-
-	strcpy(fname, dir);
-	strcat(fname, name);
-
-	// check if it exist and have read permission
-	if (access(fname, R_OK) != 0)
-		return 1;
-
-	FILE *f  = fopen(fname, "r");
-	if (f <= 0)
-		return 2;
-
-	*size = fread(buf, 1, max_size, f);
-	fclose(f);
-
-	return 0;
-}
-
-int sreadfile(char* name, uint8_t * buf, size_t max_size, size_t *size) {
-	*size = 0;
-
-	spiffs_file fd = SPIFFS_open(&fs, name, SPIFFS_RDWR, 0);
-	if (fd < 0)
-		return fd;
-
-	int res = SPIFFS_read(&fs, fd, buf, max_size);
-
-	*size = res;
-	int cres = SPIFFS_close(&fs, fd) < 0;
-	if (cres < 0)
-		return cres;
-
-	return (res >= 0) ? 0 : res;
-}
-
-int readfile(char* name, uint8_t * buf, size_t max_size, size_t *size) {
-#ifdef SPIFFS_MODE
-	return sreadfile(name, buf, max_size, size);
-#else
-	return ireadfile(name, buf, max_size, size);
-#endif
-}
-
-int iwritefile(char* name, uint8_t * buf, size_t size) {
-	char fname[100] = {0};
-	char dir[] = "./data/";
-	make_work_directory(dir);
-
-	strcpy(fname, dir);
-	strcat(fname, name);
-
-	FILE *f  = fopen(fname, "w");
-	if (f <= 0)
-		return 2;
-
-	size_t sz = fwrite(buf, 1, size, f);
-	fclose(f);
-
-	if (sz != size)
-		return 3;
-
-	return 0;
-}
-
-int swritefile(char* name, uint8_t * buf, size_t size) {
-	spiffs_file fd = SPIFFS_open(&fs, name, SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_RDWR, 0);
-	if (fd < 0)
-		return fd;
-
-	int res = SPIFFS_write(&fs, fd, buf, size);
-
-	int cres = SPIFFS_close(&fs, fd) < 0;
-	if (cres < 0)
-		return cres;
-
-	// debug only!
-	spiffs_save();
-
-	return (res >= 0) ? 0 : res;
-}
-
-int writefile(char* name, uint8_t * buf, size_t size) {
-#ifdef SPIFFS_MODE
-	return swritefile(name, buf, size);
-#else
-	return iwritefile(name, buf, size);
-#endif
-}
-
-int ideletefile(char* name) {
-	char fname[100] = {0};
-	char dir[] = "./data/";
-	make_work_directory(dir);
-
-	strcpy(fname, dir);
-	strcat(fname, name);
-
-	remove(fname);
-	return 0;
-}
-int deletefile(char* name) {
-#ifdef SPIFFS_MODE
-	return SPIFFS_remove(&fs, name);
-#else
-	return ideletefile(name);
-#endif
-}
-
-int ideletefiles(char* name) {
-	char fname[100] = {0};
-	char dir[] = "./data/";
-	make_work_directory(dir);
-
-    DIR *dirp=opendir(dir);
-    struct dirent entry;
-    struct dirent *dp=&entry;
-    while((dp = readdir(dirp)))
-    {
-	    if((fnmatch(name, dp->d_name,0)) == 0)
-	    {
- 		    strcpy(fname, dir);
-		    strcat(fname, dp->d_name);
-		    remove(fname);
-	    }
-    }
-    closedir(dirp);
-
-    strcpy(fname, dir);
-    strcat(fname, name);
-
-    return 0;
-}
-
-int sprintfs() {
-	spiffs_DIR d;
-	struct spiffs_dirent e;
-	struct spiffs_dirent *pe = &e;
-
-	uint32_t total = 0;
-	uint32_t used = 0;
-	SPIFFS_info(&fs, &total, &used);
-	printf_device("Memory total: %d used: %d\n", total, used);
-
-	SPIFFS_opendir(&fs, "/", &d);
-	while ((pe = SPIFFS_readdir(&d, pe))) {
-		printf_device("  [%4d] %s\n", pe->size, pe->name);
-	}
-	SPIFFS_closedir(&d);
-	return 0;
-}
-
-int sdeletefiles(char* name) {
-	spiffs_DIR d;
-	struct spiffs_dirent e;
-	struct spiffs_dirent *pe = &e;
-	int res;
-
-	sprintfs();
-
-	SPIFFS_opendir(&fs, "/", &d);
-	while ((pe = SPIFFS_readdir(&d, pe))) {
-		if ((fnmatch(name, (char *)pe->name, 0)) == 0) {
-			fd = SPIFFS_open_by_dirent(&fs, pe, SPIFFS_RDWR, 0);
-			if (fd < 0)
-				return SPIFFS_errno(&fs);
-			res = SPIFFS_fremove(&fs, fd);
-			if (res < 0)
-				return SPIFFS_errno(&fs);
-		}
-	}
-	SPIFFS_closedir(&d);
-	return 0;
-}
-
-int deletefiles(char* name) {
-#ifdef SPIFFS_MODE
-	return sdeletefiles(name);
-#else
-	return ideletefiles(name);
-#endif
-}
-
 int hwreboot() {
 
 	return 0;
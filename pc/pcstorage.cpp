@@ -0,0 +1,529 @@
+/*
+ Copyright 2019 SoloKeys Developers
+
+ Licensed under the Apache License, Version 2.0, <LICENSE-APACHE or
+ http://apache.org/licenses/LICENSE-2.0> or the MIT license <LICENSE-MIT or
+ http://opensource.org/licenses/MIT>, at your option. This file may not be
+ copied, modified, or distributed except according to those terms.
+ */
+
+#include "pcstorage.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include "opgpdevice.h"
+
+namespace File {
+
+static const size_t RecordHeaderSize = 5;
+
+static uint64_t NowMs() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// temp file of the write. it is not a file name of the file system.
+static const char *DirTempSuffix = ".tmp";
+
+DirFileStorage::~DirFileStorage() {
+	if (dirfd >= 0)
+		close(dirfd);
+}
+
+int DirFileStorage::DirFd() {
+	if (dirfd >= 0)
+		return dirfd;
+
+	Syscalls++;
+	dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		Syscalls += 2;
+		mkdir(dir, 0777);
+		dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	return dirfd;
+}
+
+bool DirFileStorage::FileExist(char* name) {
+	int dfd = DirFd();
+	if (dfd < 0)
+		return false;
+
+	// check if it exist and have read permission
+	Syscalls++;
+	return faccessat(dfd, name, R_OK, 0) == 0;
+}
+
+int DirFileStorage::ReadFile(char* name, uint8_t* buf, size_t max_size, size_t* size) {
+	int dfd = DirFd();
+	if (dfd < 0)
+		return 1;
+
+	Syscalls++;
+	int fd = openat(dfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+
+	// short read of the regular file is its end. so one read gets all of it.
+	Syscalls += 2;
+	ssize_t len = pread(fd, buf, max_size, 0);
+	close(fd);
+	if (len < 0)
+		return 2;
+
+	*size = len;
+	return 0;
+}
+
+int DirFileStorage::WriteFile(char* name, uint8_t* buf, size_t size) {
+	int dfd = DirFd();
+	if (dfd < 0)
+		return 2;
+
+	char tmpname[100] = {0};
+	if (strlen(name) + strlen(DirTempSuffix) >= sizeof(tmpname))
+		return 2;
+	strcpy(tmpname, name);
+	strcat(tmpname, DirTempSuffix);
+
+	Syscalls++;
+	int fd = openat(dfd, tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return 2;
+
+	size_t len = 0;
+	while (len < size) {
+		Syscalls++;
+		ssize_t res = pwrite(fd, buf + len, size - len, len);
+		if (res <= 0)
+			break;
+		len += res;
+	}
+
+	// data must be on the disk before the rename makes it the file
+	Syscalls += 2;
+	bool res = (len == size && fdatasync(fd) == 0);
+	if (close(fd) != 0)
+		res = false;
+
+	Syscalls++;
+	if (!res || renameat(dfd, tmpname, dfd, name) != 0) {
+		unlinkat(dfd, tmpname, 0);
+		return 3;
+	}
+
+	return 0;
+}
+
+int DirFileStorage::DeleteFile(char* name) {
+	int dfd = DirFd();
+	if (dfd < 0)
+		return 1;
+
+	Syscalls++;
+	unlinkat(dfd, name, 0);
+	return 0;
+}
+
+int DirFileStorage::DeleteFiles(char* name) {
+	int dfd = DirFd();
+	if (dfd < 0)
+		return 1;
+
+	// closedir closes the descriptor. so it gets its own.
+	Syscalls++;
+	int fd = dup(dfd);
+	if (fd < 0)
+		return 1;
+
+	DIR *dirp = fdopendir(fd);
+	if (dirp == nullptr) {
+		close(fd);
+		return 1;
+	}
+
+	// rewinddir: the position of the dup'ed descriptor is shared with dirfd
+	rewinddir(dirp);
+	struct dirent *dp;
+	while ((dp = readdir(dirp))) {
+		if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+			continue;
+		if (fnmatch(name, dp->d_name, 0) == 0) {
+			Syscalls++;
+			unlinkat(dfd, dp->d_name, 0);
+		}
+	}
+	closedir(dirp);
+
+	return 0;
+}
+
+MemoryRegion::~MemoryRegion() {
+	Close();
+}
+
+uint8_t* MemoryRegion::Allocate(size_t size, uint8_t emptyVal) {
+	Close();
+	buffer.assign(size, emptyVal);
+	return buffer.data();
+}
+
+uint8_t* MemoryRegion::Map(const char* fileName, size_t size, uint8_t emptyVal) {
+	Close();
+
+	fd = open(fileName, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		return nullptr;
+
+	struct stat st;
+	bool fresh = (fstat(fd, &st) != 0 || (size_t)st.st_size != size);
+	if (fresh && ftruncate(fd, size) != 0) {
+		Close();
+		return nullptr;
+	}
+
+	void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED) {
+		Close();
+		return nullptr;
+	}
+	mapped = (uint8_t *)ptr;
+	mappedSize = size;
+	pageSize = sysconf(_SC_PAGESIZE);
+	dirty.assign((size + pageSize - 1) / pageSize, false);
+	lastSyncMs = NowMs();
+
+	if (fresh) {
+		memset(mapped, emptyVal, size);
+		MarkDirty(0, size);
+		Flush();
+	}
+	return mapped;
+}
+
+void MemoryRegion::SetSyncMode(SyncMode mode, uint32_t periodMs) {
+	syncMode = mode;
+	syncPeriodMs = periodMs;
+}
+
+void MemoryRegion::MarkDirty(size_t offset, size_t length) {
+	if (!mapped || length == 0)
+		return;
+
+	size_t last = std::min(offset + length, mappedSize) - 1;
+	for (size_t page = offset / pageSize; page <= last / pageSize; page++)
+		dirty[page] = true;
+}
+
+void MemoryRegion::WriteDone() {
+	if (syncMode == SyncMode::Write)
+		Flush();
+	else if (syncMode == SyncMode::Periodic)
+		Idle();
+}
+
+void MemoryRegion::Sync(size_t offset, size_t length) {
+	MarkDirty(offset, length);
+	WriteDone();
+}
+
+void MemoryRegion::Flush() {
+	if (!mapped)
+		return;
+
+	lastSyncMs = NowMs();
+	for (size_t page = 0; page < dirty.size(); page++) {
+		if (!dirty[page])
+			continue;
+
+		size_t first = page;
+		while (page < dirty.size() && dirty[page]) {
+			dirty[page] = false;
+			page++;
+		}
+
+		// msync needs page aligned address
+		size_t end = std::min(page * pageSize, mappedSize);
+		msync(mapped + first * pageSize, end - first * pageSize, MS_SYNC);
+		Syncs++;
+	}
+}
+
+void MemoryRegion::Idle() {
+	if (mapped && NowMs() - lastSyncMs >= syncPeriodMs)
+		Flush();
+}
+
+void MemoryRegion::Close() {
+	if (mapped) {
+		Flush();
+		munmap(mapped, mappedSize);
+		mapped = nullptr;
+		mappedSize = 0;
+		dirty.clear();
+	}
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+	buffer.clear();
+}
+
+uint8_t* MemoryRegion::Data() {
+	return mapped ? mapped : buffer.data();
+}
+
+size_t MemoryRegion::Size() {
+	return mapped ? mappedSize : buffer.size();
+}
+
+int MemoryFileStorage::Init(size_t size) {
+	return region.Allocate(size, 0x00) ? 0 : 1;
+}
+
+int MemoryFileStorage::Init(const char* fileName, size_t size) {
+	return region.Map(fileName, size, 0x00) ? 0 : 1;
+}
+
+static uint32_t RecordFileSize(uint8_t *rec) {
+	uint32_t size;
+	memcpy(&size, rec + 1, sizeof(size));
+	return size;
+}
+
+static size_t RecordSize(uint8_t *rec) {
+	return RecordHeaderSize + rec[0] + RecordFileSize(rec);
+}
+
+uint8_t* MemoryFileStorage::FindRecord(char* name, size_t* size) {
+	uint8_t *data = region.Data();
+	size_t namelen = strlen(name);
+
+	size_t offset = 0;
+	while (offset + RecordHeaderSize <= region.Size() && data[offset] != 0) {
+		uint8_t *rec = data + offset;
+		if (rec[0] == namelen && memcmp(rec + RecordHeaderSize, name, namelen) == 0) {
+			if (size)
+				*size = RecordFileSize(rec);
+			return rec;
+		}
+		offset += RecordSize(rec);
+	}
+	return nullptr;
+}
+
+size_t MemoryFileStorage::UsedSize() {
+	uint8_t *data = region.Data();
+
+	size_t offset = 0;
+	while (offset + RecordHeaderSize <= region.Size() && data[offset] != 0)
+		offset += RecordSize(data + offset);
+	return offset;
+}
+
+void MemoryFileStorage::RemoveRecord(uint8_t* rec) {
+	uint8_t *data = region.Data();
+	size_t used = UsedSize();
+	size_t recsize = RecordSize(rec);
+	size_t tail = used - (rec - data) - recsize;
+
+	memmove(rec, rec + recsize, tail);
+	memset(data + used - recsize, 0x00, recsize);
+}
+
+// transaction gets to the disk on commit
+void MemoryFileStorage::Sync(size_t length) {
+	if (!transaction)
+		region.Sync(0, length);
+}
+
+bool MemoryFileStorage::FileExist(char* name) {
+	return FindRecord(name, nullptr) != nullptr;
+}
+
+int MemoryFileStorage::ReadFile(char* name, uint8_t* buf, size_t max_size, size_t* size) {
+	size_t fsize = 0;
+	uint8_t *rec = FindRecord(name, &fsize);
+	if (!rec)
+		return 1;
+
+	*size = std::min(fsize, max_size);
+	memcpy(buf, rec + RecordHeaderSize + rec[0], *size);
+	return 0;
+}
+
+int MemoryFileStorage::ReadFilePtr(char* name, uint8_t** ptr, size_t* size) {
+	uint8_t *rec = FindRecord(name, size);
+	if (!rec)
+		return 1;
+
+	*ptr = rec + RecordHeaderSize + rec[0];
+	return 0;
+}
+
+int MemoryFileStorage::WriteFile(char* name, uint8_t* buf, size_t size) {
+	size_t namelen = strlen(name);
+	if (namelen == 0 || namelen > 0xff)
+		return 1;
+
+	// data can point to the old version of the file. remove it after check.
+	uint8_t *old = FindRecord(name, nullptr);
+	size_t oldsize = old ? RecordSize(old) : 0;
+	size_t used = UsedSize();
+	size_t prevused = used;
+	if (used - oldsize + RecordHeaderSize + namelen + size > region.Size())
+		return 2;
+
+	std::vector<uint8_t> vbuf(buf, buf + size);
+	if (old) {
+		RemoveRecord(old);
+		used -= oldsize;
+	}
+
+	uint8_t *rec = region.Data() + used;
+	uint32_t size32 = size;
+	rec[0] = namelen;
+	memcpy(rec + 1, &size32, sizeof(size32));
+	memcpy(rec + RecordHeaderSize, name, namelen);
+	memcpy(rec + RecordHeaderSize + namelen, vbuf.data(), size);
+
+	Sync(std::max(prevused, used + RecordHeaderSize + namelen + size));
+	return 0;
+}
+
+int MemoryFileStorage::DeleteFile(char* name) {
+	uint8_t *rec = FindRecord(name, nullptr);
+	if (!rec)
+		return 1;
+
+	size_t used = UsedSize();
+	RemoveRecord(rec);
+	Sync(used);
+	return 0;
+}
+
+int MemoryFileStorage::DeleteFiles(char* name) {
+	uint8_t *data = region.Data();
+	size_t used = UsedSize();
+	char fname[256] = {0};
+
+	size_t offset = 0;
+	while (offset + RecordHeaderSize <= region.Size() && data[offset] != 0) {
+		uint8_t *rec = data + offset;
+		memcpy(fname, rec + RecordHeaderSize, rec[0]);
+		fname[rec[0]] = 0;
+
+		if (fnmatch(name, fname, 0) == 0)
+			RemoveRecord(rec);
+		else
+			offset += RecordSize(rec);
+	}
+
+	Sync(used);
+	return 0;
+}
+
+int MemoryFileStorage::BeginTransaction() {
+	snapshot.assign(region.Data(), region.Data() + UsedSize());
+	transaction = true;
+	return 0;
+}
+
+int MemoryFileStorage::CommitTransaction() {
+	size_t used = std::max(UsedSize(), snapshot.size());
+	transaction = false;
+	snapshot.clear();
+
+	region.Sync(0, used);
+	return 0;
+}
+
+int MemoryFileStorage::AbortTransaction() {
+	size_t used = UsedSize();
+	memset(region.Data(), 0x00, used);
+	memcpy(region.Data(), snapshot.data(), snapshot.size());
+	transaction = false;
+
+	region.Sync(0, std::max(used, snapshot.size()));
+	snapshot.clear();
+	return 0;
+}
+
+int MemoryFileStorage::Flush() {
+	region.Flush();
+	return 0;
+}
+
+int MemoryFileStorage::Idle() {
+	region.Idle();
+	return 0;
+}
+
+int Stm32fsImageStorage::Init(size_t sector) {
+	sectorSize = sector;
+	if (!region.Allocate(ImageSectors() * sectorSize, 0xff))
+		return 1;
+	return Mount();
+}
+
+int Stm32fsImageStorage::Init(const char* fileName, size_t sector) {
+	sectorSize = sector;
+	if (!region.Map(fileName, ImageSectors() * sectorSize, 0xff))
+		return 1;
+	return Mount();
+}
+
+int Stm32fsImageStorage::Mount() {
+	cfg.BaseBlockAddress = (size_t)region.Data();
+	cfg.SectorSize = sectorSize;
+	if (layout == ImageLayout::Device)
+		Stm32fsLayoutDevice(cfg, 0, ImageSectors());
+	else
+		Stm32fsLayoutPC(cfg, 0, ImageSectors());
+	cfg.fnEraseFlashBlock = [this](uint16_t blockNo) {
+		FlashErases++;
+		memset(region.Data() + blockNo * sectorSize, 0xff, sectorSize);
+		region.Sync(blockNo * sectorSize, sectorSize);
+		return true;
+	};
+	cfg.fnWriteFlash = [this](uint32_t address, uint8_t *data, size_t len) {
+		FlashWrites++;
+		memcpy(region.Data() + address, data, len);
+		region.Sync(address, len);
+		return true;
+	};
+	cfg.fnReadFlash = [this](uint32_t address, uint8_t *data, size_t len) {
+		memcpy(data, region.Data() + address, len);
+		return true;
+	};
+
+	stm32fs.reset(new Stm32fs(cfg));
+	SetFs(stm32fs.get());
+	if (!fs->isValid()) {
+		printf_device("stm32fs image error. Is not valid.\n");
+		return 2;
+	}
+
+	return OptimizeIfNeeded() ? 0 : 3;
+}
+
+int Stm32fsImageStorage::Flush() {
+	int res = Stm32fsFileStorage::Flush();
+	region.Flush();
+	return res;
+}
+
+int Stm32fsImageStorage::Idle() {
+	region.Idle();
+	return Stm32fsFileStorage::Idle();
+}
+
+} // namespace File
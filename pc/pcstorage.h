@@ -0,0 +1,189 @@
+/*
+ Copyright 2019 SoloKeys Developers
+
+ Licensed under the Apache License, Version 2.0, <LICENSE-APACHE or
+ http://apache.org/licenses/LICENSE-2.0> or the MIT license <LICENSE-MIT or
+ http://opensource.org/licenses/MIT>, at your option. This file may not be
+ copied, modified, or distributed except according to those terms.
+ */
+
+#ifndef PC_PCSTORAGE_H_
+#define PC_PCSTORAGE_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include "filestorage.h"
+#include "stm32fs.h"
+
+namespace File {
+
+// files in the directory. one file per file.
+// directory is opened once and the files are accessed relative to it. write goes to the
+// temp file that replaces the old one with rename, so the file is never half written.
+class DirFileStorage : public FileStorage {
+private:
+	const char *dir = "./data/";
+	int dirfd = -1;
+
+	// opens the directory on the first call. creates it if needed.
+	int DirFd();
+public:
+	DirFileStorage() {};
+	DirFileStorage(const char *directory) : dir(directory) {};
+	~DirFileStorage();
+
+	// system calls since the start. for the benchmarks.
+	uint32_t Syscalls = 0;
+
+	virtual bool FileExist(char *name);
+	virtual int ReadFile(char *name, uint8_t *buf, size_t max_size, size_t *size);
+	virtual int WriteFile(char *name, uint8_t *buf, size_t size);
+	virtual int DeleteFile(char *name);
+	virtual int DeleteFiles(char *name);
+};
+
+// when the writes to the mmap'd file get to the disk
+enum class SyncMode {
+	Write,		// after every storage write
+	Command,	// at the end of the command (FileStorage::Flush)
+	Periodic,	// at the write or idle when the period has passed since the last sync
+};
+
+// file image in the memory or in the mmap'd file
+class MemoryRegion {
+private:
+	std::vector<uint8_t> buffer;
+	uint8_t *mapped = nullptr;
+	size_t mappedSize = 0;
+	int fd = -1;
+
+	// changed pages of the mapping that are not synced yet
+	std::vector<bool> dirty;
+	size_t pageSize = 4096;
+	SyncMode syncMode = SyncMode::Write;
+	uint32_t syncPeriodMs = 1000;
+	uint64_t lastSyncMs = 0;
+public:
+	~MemoryRegion();
+
+	// msync calls since the start
+	uint32_t Syncs = 0;
+
+	// memory filled with emptyVal
+	uint8_t *Allocate(size_t size, uint8_t emptyVal);
+	// file is created and filled with emptyVal if it has wrong size
+	uint8_t *Map(const char *fileName, size_t size, uint8_t emptyVal);
+	void SetSyncMode(SyncMode mode, uint32_t periodMs = 1000);
+	// range was changed. it is synced later by the mode.
+	void MarkDirty(size_t offset, size_t length);
+	// end of the storage write: syncs if the mode says so
+	void WriteDone();
+	// range was changed by the storage write
+	void Sync(size_t offset, size_t length);
+	// all the dirty pages. contiguous ones with one msync.
+	void Flush();
+	// periodic sync between the commands
+	void Idle();
+	void Close();
+
+	uint8_t *Data();
+	size_t Size();
+	bool isMapped() {
+		return mapped != nullptr;
+	}
+};
+
+// files in one memory region. record: name length(1b), file size(4b), name, data.
+// region is compacted on every write. so it is fast only for small region like ours.
+class MemoryFileStorage : public FileStorage {
+protected:
+	MemoryRegion region;
+	std::vector<uint8_t> snapshot;
+	bool transaction = false;
+
+	uint8_t *FindRecord(char *name, size_t *size);
+	size_t UsedSize();
+	void RemoveRecord(uint8_t *rec);
+	void Sync(size_t length);
+public:
+	// pure RAM storage
+	int Init(size_t size);
+	// storage persists in the file
+	int Init(const char *fileName, size_t size);
+
+	virtual bool FileExist(char *name);
+	virtual int ReadFile(char *name, uint8_t *buf, size_t max_size, size_t *size);
+	virtual int ReadFilePtr(char *name, uint8_t **ptr, size_t *size);
+	virtual int WriteFile(char *name, uint8_t *buf, size_t size);
+	virtual int DeleteFile(char *name);
+	virtual int DeleteFiles(char *name);
+
+	// rollback is made from the memory copy
+	virtual int BeginTransaction();
+	virtual int CommitTransaction();
+	virtual int AbortTransaction();
+
+	virtual int Flush();
+	virtual int Idle();
+
+	MemoryRegion &GetRegion() {
+		return region;
+	}
+};
+
+// sector layout of the stm32fs image
+enum class ImageLayout {
+	PC,		// 2 blocks of 5 sectors and 2 counter sectors
+	Device,	// the same as on the device: 1 block of 4 sectors and 2 counter sectors
+};
+
+// Stm32fs on the flash image. in the RAM or in the mmap'd file.
+class Stm32fsImageStorage : public Stm32fsFileStorage {
+private:
+	MemoryRegion region;
+	Stm32fsConfig_t cfg;
+	size_t sectorSize = BlockSize;
+	ImageLayout layout = ImageLayout::PC;
+	std::unique_ptr<Stm32fs> stm32fs;
+
+	int Mount();
+public:
+	uint32_t FlashWrites = 0;
+	uint32_t FlashErases = 0;
+
+	// before Init
+	void SetLayout(ImageLayout imageLayout) {
+		layout = imageLayout;
+	}
+	size_t ImageSectors() {
+		return (layout == ImageLayout::Device) ? 6 : 12;
+	}
+
+	// bigger sectors make the image bigger and the optimizations rarer
+	int Init(size_t sector = BlockSize);
+	int Init(const char *fileName, size_t sector = BlockSize);
+
+	// image is synced by the mode of the region
+	virtual int Flush();
+	virtual int Idle();
+
+	MemoryRegion &GetRegion() {
+		return region;
+	}
+};
+
+} // namespace File
+
+// storage for hwinit: spiffs (default), dir, ram, mmap, stm32fs.
+// image - file for mmap and stm32fs. stm32fs without image works in the RAM.
+int pc_select_storage(const char *name, const char *image);
+// sector layout of the stm32fs image: pc (default) or device
+int pc_select_layout(const char *name);
+// --image-size for spiffs, ram and mmap. 0 - default.
+int pc_set_image_size(size_t size);
+// sync of the mmap'd images: write (default), command, periodic or periodic:<ms>
+int pc_select_sync(const char *mode);
+
+#endif /* PC_PCSTORAGE_H_ */
@@ -0,0 +1,64 @@
+"""
+io_stat.py - dump per file I/O counters of the token
+
+Reads vendor data object 0x0110 and prints the file presence cache hit
+ratio and the files sorted by the flash bytes they wrote. Entry with file 0
+is the I/O that is not bound to a file: transaction begin/commit with
+optimizations and the files over the table.
+
+    $ python3 io_stat.py
+"""
+
+from struct import unpack
+from card_reader import get_ccid_device
+from openpgp_card import OpenPGP_Card
+
+IO_STAT_DO = 0x0110
+IO_STAT_VERSION = 0x02
+IO_STAT_PRESENCE = ">III"
+IO_STAT_PRESENCE_SIZE = 12
+IO_STAT_RECORD = ">BHBIIIIIHH"
+IO_STAT_RECORD_SIZE = 28
+
+FILE_TYPES = {0: "file", 1: "tlv", 2: "secure"}
+
+
+def parse_io_stat(data):
+    if len(data) < 2 or data[0] != IO_STAT_VERSION:
+        raise ValueError("wrong I/O statistic: %s" % data.hex())
+
+    count = data[1]
+    hits, negative_hits, misses = unpack(IO_STAT_PRESENCE, data[2:2 + IO_STAT_PRESENCE_SIZE])
+    presence = {"hits": hits, "negative_hits": negative_hits, "misses": misses}
+    records = []
+    for i in range(count):
+        offset = 2 + IO_STAT_PRESENCE_SIZE + i * IO_STAT_RECORD_SIZE
+        app, file_id, file_type, reads, writes, data_bytes, flash_writes, flash_bytes, erases, optimizations = \
+            unpack(IO_STAT_RECORD, data[offset:offset + IO_STAT_RECORD_SIZE])
+        records.append({"app": app, "file": file_id, "type": FILE_TYPES.get(file_type, str(file_type)),
+                        "reads": reads, "writes": writes, "bytes": data_bytes,
+                        "flash_writes": flash_writes, "flash_bytes": flash_bytes,
+                        "erases": erases, "optimizations": optimizations})
+    return presence, records
+
+
+def print_io_stat(presence, records):
+    total = presence["hits"] + presence["misses"]
+    print("presence cache: lookups %d hits %d (negative %d) misses %d hit ratio %d%%" %
+          (total, presence["hits"], presence["negative_hits"], presence["misses"],
+           presence["hits"] * 100 // total if total else 0))
+    print("%4s %6s %6s %7s %7s %7s %8s %8s %6s %4s" %
+          ("app", "file", "type", "reads", "writes", "bytes", "fwrites", "fbytes", "erases", "opt"))
+    for r in sorted(records, key=lambda r: r["flash_bytes"], reverse=True):
+        print("%4d %6x %6s %7d %7d %7d %8d %8d %6d %4d" %
+              (r["app"], r["file"], r["type"], r["reads"], r["writes"], r["bytes"],
+               r["flash_writes"], r["flash_bytes"], r["erases"], r["optimizations"]))
+
+
+if __name__ == "__main__":
+    reader = get_ccid_device()
+    card = OpenPGP_Card(reader)
+    card.cmd_select_openpgp()
+    data = card.cmd_get_data(IO_STAT_DO >> 8, IO_STAT_DO & 0xff)
+    print_io_stat(*parse_io_stat(data))
+    reader.ccid_power_off()
@@ -0,0 +1,84 @@
+"""
+latency_stat.py - dump latency histograms of the token
+
+Reads vendor data object 0x0111 and prints p50/p99 of every series: commands
+and their Process by INS, crypto primitives and file system I/O. Bucket 0 is
+0-1 us, bucket i is 2^i..2^(i+1)-1 us. Percentiles are the bucket upper bounds.
+With --reset it clears the histograms after the dump (needs PW3).
+
+    $ python3 latency_stat.py [--reset]
+"""
+
+import sys
+from struct import unpack
+from card_reader import get_ccid_device
+from openpgp_card import OpenPGP_Card
+from card_const import FACTORY_PASSPHRASE_PW3
+
+LATENCY_DO = 0x0111
+LATENCY_VERSION = 0x01
+
+KINDS = {1: "command", 2: "process", 3: "crypto", 4: "file"}
+CRYPTO = {1: "random", 2: "aes enc", 3: "aes dec", 4: "rsa genkey", 5: "rsa sign", 6: "rsa decipher",
+          7: "rsa verify", 8: "ecc genkey", 9: "ecc sign", 10: "ecc verify", 11: "ecdh"}
+FILE = {1: "read", 2: "write", 3: "delete", 4: "delete all", 5: "begin", 6: "commit", 7: "flush"}
+
+
+def parse_latency_stat(data):
+    if len(data) < 5 or data[0] != LATENCY_VERSION:
+        raise ValueError("wrong latency statistic: %s" % data.hex())
+
+    buckets, count, overflows = data[1], data[2], unpack(">H", data[3:5])[0]
+    offset = 5
+    series = []
+    for i in range(count):
+        kind, code, nbuckets = unpack(">BHB", data[offset:offset + 4])
+        offset += 4
+        counts = [0] * buckets
+        for j in range(nbuckets):
+            bucket, value = unpack(">BH", data[offset:offset + 3])
+            counts[bucket] = value
+            offset += 3
+        series.append({"kind": kind, "code": code, "counts": counts})
+    return series, overflows
+
+
+def percentile(counts, percent):
+    total = sum(counts)
+    rank = max((total * percent + 99) // 100, 1)
+    acc = 0
+    for i, value in enumerate(counts):
+        acc += value
+        if acc >= rank:
+            return (2 << i) - 1 if i < len(counts) - 1 else float("inf")
+    return 0
+
+
+def series_name(s):
+    if s["kind"] == 3:
+        return CRYPTO.get(s["code"], "%x" % s["code"])
+    if s["kind"] == 4:
+        return FILE.get(s["code"], "%x" % s["code"])
+    return "ins %02x" % s["code"]
+
+
+def print_latency_stat(series, overflows):
+    print("%-8s %-14s %7s %10s %10s" % ("kind", "series", "count", "p50 us", "p99 us"))
+    for s in sorted(series, key=lambda s: (s["kind"], s["code"])):
+        print("%-8s %-14s %7d %10s %10s" %
+              (KINDS.get(s["kind"], str(s["kind"])), series_name(s), sum(s["counts"]),
+               percentile(s["counts"], 50), percentile(s["counts"], 99)))
+    if overflows:
+        print("measurements over the table: %d" % overflows)
+
+
+if __name__ == "__main__":
+    reader = get_ccid_device()
+    card = OpenPGP_Card(reader)
+    card.cmd_select_openpgp()
+    data = card.cmd_get_data(LATENCY_DO >> 8, LATENCY_DO & 0xff)
+    print_latency_stat(*parse_latency_stat(data))
+    if "--reset" in sys.argv[1:]:
+        card.cmd_verify(3, FACTORY_PASSPHRASE_PW3)
+        card.cmd_put_data(LATENCY_DO >> 8, LATENCY_DO & 0xff, b"")
+    reader.ccid_power_off()
@@ -12,6 +12,8 @@
 #include "applications/apduconst.h"
 #include "applications/application.h"
 #include "solofactory.h"
+#include "latency.h"
+#include "trace.h"
 
 namespace Application {
     
@@ -88,6 +90,8 @@ Util::Error APDUExecutor::Execute(bstr apdu, bstr& result) {
 		return errd;
 
 	decapdu.printEx(32);
+	Util::LatencyScope latency(Util::LatencyKind::Command, decapdu.ins);
+	TRACE_SPAN_ARG("APDUExecutor::Execute", decapdu.ins);
 
     // select application
 	if (decapdu.ins == APDUcommands::Select) {
@@ -153,6 +157,11 @@ Util::Error APDUExecutor::Execute(bstr apdu, bstr& result) {
     	sresult.clear();
 
         Util::Error err = application->APDUExchange(decapdu, sresult);
+
+        // writes of the command are in the flash before the response
+        Util::Error ferr = solo.GetFileSystem().Flush();
+        if (err == Util::Error::NoError)
+        	err = ferr;
     	SetResultError(sresult, err);
     	printf_device("appdu result: %s\n", Util::GetStrError(err));
 
@@ -23,11 +23,13 @@ struct DOAccess_t {
 };
 
 // OpenPGP 3.3.1 page 36
-std::array<DOAccess_t, 49> DOAccess = {{
+std::array<DOAccess_t, 51> DOAccess = {{
 		{0x0101, Password::Any,   Password::PW1},   // Private use
 		{0x0102, Password::Any,   Password::PW3},
 		{0x0103, Password::PW1,   Password::PW1},
 		{0x0104, Password::PW3,   Password::PW3},
+		{0x0110, Password::Any,   Password::Never}, // Vendor: file I/O statistic
+		{0x0111, Password::Any,   Password::PW3},   // Vendor: latency histograms
 		{0x5e,   Password::Any,   Password::PW3},   // Login data
 		{0x5b,   Password::Any,   Password::PW3},   // Name
 		{0x5f2d, Password::Any,   Password::PW3},   // Language preference
@@ -341,6 +343,11 @@ Util::Error Security::SetPasswd(Password passwdId, bstr password) {
 			return Util::Error::WrongAPDUDataLength;
 	}
 
+	// password and its counter must be changed together
+	err = filesystem.BeginTransaction();
+	if (err != Util::Error::NoError)
+		return err;
+
 	switch (passwdId) {
 	case Password::PSOCDS:
 	case Password::PW1:
@@ -349,23 +356,27 @@ Util::Error Security::SetPasswd(Password passwdId, bstr password) {
 				(passwdId == Password::PW3) ? File::SecureFileID::PW3 : File::SecureFileID::PW1,
 				File::Secure,
 				password);
-		if (err != Util::Error::NoError)
-			return err;
 		break;
 	case Password::RC:
 		err = filesystem.WriteFile(File::AppID::OpenPGP,
 				0xd3,
 				File::File,
 				password);
-		if (err != Util::Error::NoError)
-			return err;
 		break;
 	default:
 		break;
 	}
 
 	// clear pw1/pw3/rc access counter
-	return ResetPasswdTryRemains(passwdId);
+	if (err == Util::Error::NoError)
+		err = ResetPasswdTryRemains(passwdId);
+
+	if (err != Util::Error::NoError) {
+		filesystem.AbortTransaction();
+		return err;
+	}
+
+	return filesystem.CommitTransaction();
 }
 
 Util::Error Security::VerifyPasswd(Password passwdId, bstr data, bool passwdCheckFirstPart, size_t *passwdLen) {
@@ -494,26 +505,31 @@ Util::Error Security::ClearAllPasswd() {
 	Factory::SoloFactory &solo = Factory::SoloFactory::GetSoloFactory();
 	File::FileSystem &filesystem = solo.GetFileSystem();
 
-	auto file_err = filesystem.DeleteFile(File::AppID::OpenPGP,
-			File::SecureFileID::PW1,
-			File::Secure);
+	auto file_err = filesystem.BeginTransaction();
 	if (file_err != Util::Error::NoError)
 		return file_err;
 
 	file_err = filesystem.DeleteFile(File::AppID::OpenPGP,
-			File::SecureFileID::PW3,
+			File::SecureFileID::PW1,
 			File::Secure);
-	if (file_err != Util::Error::NoError)
-		return file_err;
+
+	if (file_err == Util::Error::NoError)
+		file_err = filesystem.DeleteFile(File::AppID::OpenPGP,
+				File::SecureFileID::PW3,
+				File::Secure);
 
 	// RC
-	file_err = filesystem.DeleteFile(File::AppID::OpenPGP,
-			0xd3,
-			File::File);
-	if (file_err != Util::Error::NoError)
+	if (file_err == Util::Error::NoError)
+		file_err = filesystem.DeleteFile(File::AppID::OpenPGP,
+				0xd3,
+				File::File);
+
+	if (file_err != Util::Error::NoError) {
+		filesystem.AbortTransaction();
 		return file_err;
+	}
 
-	return Util::Error::NoError;
+	return filesystem.CommitTransaction();
 }
 
 void Security::ClearAuth(Password passwdId) {
@@ -290,13 +290,26 @@ Util::Error APDUPutData::Process(uint8_t cla, uint8_t ins, uint8_t p1,
 			data.length() != 16 && data.length() != 24 && data.length() != 32)
 			return Util::Error::WrongAPDUDataLength;
 
-		auto area = security.DataObjectInSecureArea(object_id) ? File::Secure : File::File;
-		auto err = filesystem.WriteFile(File::AppID::OpenPGP, object_id, area, data);
+		// object and the files that logic changes after it (KDF-DO resets passwords) go together
+		auto err = filesystem.BeginTransaction();
 		if (err != Util::Error::NoError)
 			return err;
 
+		auto area = security.DataObjectInSecureArea(object_id) ? File::Secure : File::File;
+		// the histograms are reset only with PW3
+		bool adminMode = (object_id == File::VendorFileID::LatencyStatistic && security.GetAuth(Password::PW3));
+		err = filesystem.WriteFile(File::AppID::OpenPGP, object_id, area, data, adminMode);
+
 		// refresh objects and some logic after saving data to filesystem
-		err = security.AfterSaveFileLogic(object_id);
+		if (err == Util::Error::NoError)
+			err = security.AfterSaveFileLogic(object_id);
+
+		if (err != Util::Error::NoError) {
+			filesystem.AbortTransaction();
+			return err;
+		}
+
+		err = filesystem.CommitTransaction();
 		if (err != Util::Error::NoError)
 			return err;
 	} else {
@@ -12,6 +12,8 @@
 #include "openpgpapplication.h"
 #include "apduconst.h"
 #include "solofactory.h"
+#include "latency.h"
+#include "trace.h"
 
 namespace Application {
 
@@ -49,6 +51,7 @@ const bstr* OpenPGPApplication::GetAID() {
 }
 
 Util::Error OpenPGPApplication::APDUExchange(APDUStruct &apdu, bstr &result) {
+	TRACE_SPAN_ARG("OpenPGPApplication::APDUExchange", apdu.ins);
 	result.clear();
 
 	if (!selected)
@@ -72,7 +75,11 @@ Util::Error OpenPGPApplication::APDUExchange(APDUStruct &apdu, bstr &result) {
 	auto name = cmd->GetName();
 	printf_device("======== %.*s\n", static_cast<int>(name.size()), name.data());
 
+	Util::LatencyStatistic &latency = Util::LatencyStatistic::GetLatencyStatistic();
+	uint64_t start = latency.Now();
+	TRACE_SPAN(name);
 	auto cmderr = cmd->Process(apdu.cla, apdu.ins, apdu.p1, apdu.p2, apdu.data, apdu.le, result);
+	latency.Add(Util::LatencyKind::Process, apdu.ins, start);
 	if (cmderr != Util::Error::NoError)
 		return cmderr;
 
@@ -17,6 +17,8 @@
 #include "tlv.h"
 #include "solofactory.h"
 #include "filesystem.h"
+#include "latency.h"
+#include "trace.h"
 #include "applications/openpgp/openpgpconst.h"
 
 #include "i15_addon.h"
@@ -32,6 +34,7 @@ PUT_TO_SRAM2 bstr KeyBuffer;
 
 PUT_TO_SRAM2 uint8_t prvData[2049] = {0}; // needs for placing RSA 4096 key
 PUT_TO_SRAM2 bstr prvStr;
+PUT_TO_SRAM2 bstr prvKey;  // loaded key file. points to memory-mapped storage or to prvStr
 
 CryptoLib::CryptoLib(CryptoEngine &_cryptoEngine): cryptoEngine(_cryptoEngine) {
     KeyBuffer = bstr(_KeyBuffer, 0, sizeof(_KeyBuffer));
@@ -44,6 +47,8 @@ void CryptoLib::ClearKeyBuffer() {
 }
 
 Util::Error CryptoLib::GenerateRandom(size_t length, bstr& dataOut) {
+	Util::LatencyScope latency(Util::LatencyCrypto::Random);
+	TRACE_SPAN("CryptoLib::GenerateRandom");
 	if (length > dataOut.max_size())
 		return Util::Error::OutOfMemory;
 
@@ -55,6 +60,8 @@ Util::Error CryptoLib::GenerateRandom(size_t length, bstr& dataOut) {
 
 Util::Error CryptoLib::AESEncrypt(bstr key, bstr dataIn,
 		bstr& dataOut) {
+	Util::LatencyScope latency(Util::LatencyCrypto::AESEncrypt);
+	TRACE_SPAN("CryptoLib::AESEncrypt");
 	dataOut.clear();
 
     if (key.length() != 16 && key.length() != 24 && key.length() != 32)
@@ -74,6 +81,8 @@ Util::Error CryptoLib::AESEncrypt(bstr key, bstr dataIn,
 
 Util::Error CryptoLib::AESDecrypt(bstr key, bstr dataIn,
 		bstr& dataOut) {
+	Util::LatencyScope latency(Util::LatencyCrypto::AESDecrypt);
+	TRACE_SPAN("CryptoLib::AESDecrypt");
 	dataOut.clear();
 
     if (key.length() != 16 && key.length() != 24 && key.length() != 32)
@@ -146,6 +155,8 @@ const br_prng_class br_hw_drbg_vtable = {
 };
 
 Util::Error CryptoLib::RSAGenKey(RSAKey& keyOut, size_t keySize) {
+	Util::LatencyScope latency(Util::LatencyCrypto::RSAGenKey);
+	TRACE_SPAN("CryptoLib::RSAGenKey");
 
 	Util::Error ret = Util::Error::NoError;
 	ClearKeyBuffer();
@@ -223,6 +234,8 @@ Util::Error RSAFillPrivateKey(uint8_t *keybuf, br_rsa_private_key &sk, RSAKey &k
 }
 
 Util::Error CryptoLib::RSASign(RSAKey key, bstr data, bstr& signature) {
+	Util::LatencyScope latency(Util::LatencyCrypto::RSASign);
+	TRACE_SPAN("CryptoLib::RSASign");
 
 	Util::Error ret = Util::Error::NoError;
 
@@ -270,6 +283,8 @@ Util::Error CryptoLib::RSASign(RSAKey key, bstr data, bstr& signature) {
 }
 
 Util::Error CryptoLib::RSADecipher(RSAKey key, bstr data, bstr &dataOut) {
+	Util::LatencyScope latency(Util::LatencyCrypto::RSADecipher);
+	TRACE_SPAN("CryptoLib::RSADecipher");
 	Util::Error ret = Util::Error::NoError;
     dataOut.set_length(0);
 
@@ -337,6 +352,8 @@ Util::Error CryptoLib::RSADecipher(RSAKey key, bstr data, bstr &dataOut) {
 }
 
 Util::Error CryptoLib::RSAVerify(bstr publicKey, bstr data, bstr signature) {
+	Util::LatencyScope latency(Util::LatencyCrypto::RSAVerify);
+	TRACE_SPAN("CryptoLib::RSAVerify");
     (void)publicKey;
     (void)data;
     (void)signature;
@@ -355,6 +372,8 @@ const br_ec_impl *brGetCurrentImpl(ECCaid curveID) {
 }
 
 Util::Error CryptoLib::ECCGenKey(ECCaid curveID, ECCKey& keyOut) {
+	Util::LatencyScope latency(Util::LatencyCrypto::ECCGenKey);
+	TRACE_SPAN("CryptoLib::ECCGenKey");
 	ClearKeyBuffer();
 	keyOut.clear();
 
@@ -445,6 +464,8 @@ Util::Error ECDSAFillPrivateKey(br_ec_private_key &sk, ECCKey &key) {
 }
 
 Util::Error CryptoLib::ECCSign(ECCKey key, bstr data, bstr& signature) {
+	Util::LatencyScope latency(Util::LatencyCrypto::ECCSign);
+	TRACE_SPAN("CryptoLib::ECCSign");
 	signature.clear();
 
     br_ec_private_key sk = {};
@@ -549,6 +570,8 @@ Util::Error CryptoLib::ECCCalcPublicKey(ECCaid curveID, bstr privateKey, bstr &p
 
 Util::Error CryptoLib::ECCVerify(ECCKey key, bstr data,
 		bstr signature) {
+	Util::LatencyScope latency(Util::LatencyCrypto::ECCVerify);
+	TRACE_SPAN("CryptoLib::ECCVerify");
     (void)key;
     (void)data;
     (void)signature;
@@ -556,6 +579,8 @@ Util::Error CryptoLib::ECCVerify(ECCKey key, bstr data,
 }
 
 Util::Error CryptoLib::ECDHComputeShared(ECCKey key, bstr anotherPublicKey, bstr &sharedSecret) {
+	Util::LatencyScope latency(Util::LatencyCrypto::ECDH);
+	TRACE_SPAN("CryptoLib::ECDHComputeShared");
 
     sharedSecret.clear();
 
@@ -639,14 +664,16 @@ ECCaid KeyStorage::GetECCCurveID(AppID_t appID, KeyID_t keyID) {
 }
 
 Util::Error KeyStorage::GetECCKey(AppID_t appID, KeyID_t keyID, ECCKey& key) {
+	TRACE_SPAN("KeyStorage::GetECCKey");
 
 	Factory::SoloFactory &solo = Factory::SoloFactory::GetSoloFactory();
 	File::FileSystem &filesystem = solo.GetFileSystem();
 	CryptoLib &cryptolib = cryptoEngine.getCryptoLib();
 
-	// clear key storage
+	// key storage
 	prvStr.clear();
-	auto err = filesystem.ReadFile(appID, keyID, File::Secure, prvStr);
+	prvKey = prvStr;
+	auto err = filesystem.ReadFileView(appID, keyID, File::Secure, prvKey);
 	if (err != Util::Error::NoError)
 		return err;
 
@@ -665,8 +692,24 @@ Util::Error KeyStorage::GetECCKey(AppID_t appID, KeyID_t keyID, ECCKey& key) {
     if (key.CurveId == ECCaid::none)
 		return Util::Error::StoredKeyParamsError;
 
-    GetKeyPart(prvStr, KeyPartsECC::PublicKey, key.Public);
-    GetKeyPart(prvStr, KeyPartsECC::PrivateKey, key.Private);
+    GetKeyPart(prvKey, KeyPartsECC::PublicKey, key.Public);
+    GetKeyPart(prvKey, KeyPartsECC::PrivateKey, key.Private);
+
+    // public key is calculated or changed below. it needs a copy in ram.
+    bool needsChange = (key.Public.length() == 0 && key.Private.length() > 0) ||
+        ((key.CurveId == ECCaid::curve25519  || key.CurveId == ECCaid::ed25519) && key.Public.length() == 33 && key.Public[0] == 0x04);
+    if (needsChange) {
+        if (prvKey.uint8Data() != prvStr.uint8Data()) {
+            prvStr.clear();
+            prvStr.append(prvKey);
+            prvKey = prvStr;
+            GetKeyPart(prvKey, KeyPartsECC::PublicKey, key.Public);
+            GetKeyPart(prvKey, KeyPartsECC::PrivateKey, key.Private);
+        } else {
+            // file was copied to prvData by the storage
+            prvStr = prvKey;
+        }
+    }
 
 	if (key.Public.length() == 0 && key.Private.length() > 0) {
 		printf_device("Generate public key from private.\n");
@@ -675,6 +718,7 @@ Util::Error KeyStorage::GetECCKey(AppID_t appID, KeyID_t keyID, ECCKey& key) {
 		if (err != Util::Error::NoError)
 			return err;
 		prvStr.set_length(prvStr.length() + key.Public.length());
+		prvKey = prvStr;
 	}
 
     // check 0x04 before curve25519 public key and return key without it
@@ -686,28 +730,31 @@ Util::Error KeyStorage::GetECCKey(AppID_t appID, KeyID_t keyID, ECCKey& key) {
 }
 
 Util::Error KeyStorage::GetAESKey(AppID_t appID, KeyID_t keyID, bstr &key) {
+	TRACE_SPAN("KeyStorage::GetAESKey");
 	key.clear();
 
 	Factory::SoloFactory &solo = Factory::SoloFactory::GetSoloFactory();
 	File::FileSystem &filesystem = solo.GetFileSystem();
 
-	// clear key storage
+	// key storage
 	prvStr.clear();
+	prvKey = prvStr;
 
-	auto err = filesystem.ReadFile(appID, keyID, File::Secure, prvStr);
+	auto err = filesystem.ReadFileView(appID, keyID, File::Secure, prvKey);
 	if (err != Util::Error::NoError)
 		return err;
 
-	if (prvStr.length() == 0 || (prvStr.length() != 16 && prvStr.length() != 24 && prvStr.length() != 32))
+	if (prvKey.length() == 0 || (prvKey.length() != 16 && prvKey.length() != 24 && prvKey.length() != 32))
 		return Util::Error::StoredKeyError;
 
-	key = prvStr;
+	key = prvKey;
 
 	return Util::Error::NoError;
 }
 
 Util::Error KeyStorage::SetKey(AppID_t appID, KeyID_t keyID,
 		KeyType keyType, bstr key) {
+	TRACE_SPAN("KeyStorage::SetKey");
     (void)appID;
     (void)keyID;
     (void)keyType;
@@ -717,6 +764,7 @@ Util::Error KeyStorage::SetKey(AppID_t appID, KeyID_t keyID,
 }
 
 Util::Error KeyStorage::PutRSAFullKey(AppID_t appID, KeyID_t keyID, RSAKey key) {
+	TRACE_SPAN("KeyStorage::PutRSAFullKey");
 
 	Factory::SoloFactory &solo = Factory::SoloFactory::GetSoloFactory();
 	File::FileSystem &filesystem = solo.GetFileSystem();
@@ -773,6 +821,7 @@ Util::Error KeyStorage::PutRSAFullKey(AppID_t appID, KeyID_t keyID, RSAKey key)
 }
 
 Util::Error KeyStorage::PutECCFullKey(AppID_t appID, KeyID_t keyID, ECCKey key) {
+	TRACE_SPAN("KeyStorage::PutECCFullKey");
 
 	Factory::SoloFactory &solo = Factory::SoloFactory::GetSoloFactory();
 	File::FileSystem &filesystem = solo.GetFileSystem();
@@ -860,6 +909,7 @@ Util::Error KeyStorage::GetKeyPart(bstr dataIn, Util::tag_t keyPart,
 
 Util::Error KeyStorage::GetPublicKey(AppID_t appID, KeyID_t keyID, uint8_t AlgoritmID,
 		bstr& pubKey) {
+	TRACE_SPAN("KeyStorage::GetPublicKey");
 
 	pubKey.clear();
 
@@ -889,13 +939,14 @@ Util::Error KeyStorage::GetPublicKey(AppID_t appID, KeyID_t keyID, uint8_t Algor
 		pubKey = ecdsa_key.Public;
 	}
 
-	printf_device("GetPublicKey key %x [%lu] loaded.\n", keyID, prvStr.length());
+	printf_device("GetPublicKey key %x [%lu] loaded.\n", keyID, prvKey.length());
 
 	return Util::Error::NoError;
 }
 
 Util::Error KeyStorage::GetPublicKey7F49(AppID_t appID, KeyID_t keyID,
 		uint8_t AlgoritmID, bstr& tlvKey) {
+	TRACE_SPAN("KeyStorage::GetPublicKey7F49");
 
 	uint8_t _pubKey[1024] = {0};
 	bstr pubKey{_pubKey, 0, sizeof(_pubKey)};
@@ -914,8 +965,8 @@ Util::Error KeyStorage::GetPublicKey7F49(AppID_t appID, KeyID_t keyID,
 
 	if (AlgoritmID == Crypto::AlgoritmID::RSA) {
 		bstr strExp;
-		// prvStr was filled by GetPublicKey
-		err = GetKeyPart(prvStr, KeyPartsRSA::PublicExponent, strExp);
+		// prvKey was filled by GetPublicKey
+		err = GetKeyPart(prvKey, KeyPartsRSA::PublicExponent, strExp);
 		if (err != Util::Error::NoError)
 			return err;
 
@@ -932,27 +983,29 @@ Util::Error KeyStorage::GetPublicKey7F49(AppID_t appID, KeyID_t keyID,
 }
 
 Util::Error KeyStorage::GetRSAKey(AppID_t appID, KeyID_t keyID, RSAKey& key) {
+	TRACE_SPAN("KeyStorage::GetRSAKey");
 
 	key.clear();
 
 	Factory::SoloFactory &solo = Factory::SoloFactory::GetSoloFactory();
 	File::FileSystem &filesystem = solo.GetFileSystem();
 
-	// clear key storage
+	// key storage. RSA 4096 key is read right from the storage if it is memory-mapped
 	prvStr.clear();
-	auto err = filesystem.ReadFile(appID, keyID, File::Secure, prvStr);
+	prvKey = prvStr;
+	auto err = filesystem.ReadFileView(appID, keyID, File::Secure, prvKey);
 	if (err != Util::Error::NoError)
 		return err;
 
-	printf_device("key %x [%lu] loaded.\n", keyID, prvStr.length());
+	printf_device("key %x [%lu] loaded.\n", keyID, prvKey.length());
 
-	GetKeyPart(prvStr, KeyPartsRSA::PublicExponent, key.Exp);
-	GetKeyPart(prvStr, KeyPartsRSA::P, key.P);
-	GetKeyPart(prvStr, KeyPartsRSA::Q, key.Q);
-	GetKeyPart(prvStr, KeyPartsRSA::PQ, key.PQ);
-	GetKeyPart(prvStr, KeyPartsRSA::DP1, key.DP1);
-	GetKeyPart(prvStr, KeyPartsRSA::DQ1, key.DQ1);
-	GetKeyPart(prvStr, KeyPartsRSA::N, key.N);
+	GetKeyPart(prvKey, KeyPartsRSA::PublicExponent, key.Exp);
+	GetKeyPart(prvKey, KeyPartsRSA::P, key.P);
+	GetKeyPart(prvKey, KeyPartsRSA::Q, key.Q);
+	GetKeyPart(prvKey, KeyPartsRSA::PQ, key.PQ);
+	GetKeyPart(prvKey, KeyPartsRSA::DP1, key.DP1);
+	GetKeyPart(prvKey, KeyPartsRSA::DQ1, key.DQ1);
+	GetKeyPart(prvKey, KeyPartsRSA::N, key.N);
 
 	if ((key.P.length() == 0 ||
 		 key.Q.length() == 0) &&
@@ -966,6 +1019,7 @@ Util::Error KeyStorage::GetRSAKey(AppID_t appID, KeyID_t keyID, RSAKey& key) {
 }
 
 Util::Error KeyStorage::SetKeyExtHeader(AppID_t appID, bstr keyData) {
+	TRACE_SPAN("KeyStorage::SetKeyExtHeader");
 	Factory::SoloFactory &solo = Factory::SoloFactory::GetSoloFactory();
 	File::FileSystem &filesystem = solo.GetFileSystem();
 
@@ -995,6 +1049,11 @@ Util::Error KeyStorage::SetKeyExtHeader(AppID_t appID, bstr keyData) {
 	if (type == OpenPGPKeyType::Unknown)
 		return Util::Error::WrongData;
 
+	// key and its counter must be changed together
+	err = filesystem.BeginTransaction();
+	if (err != Util::Error::NoError)
+		return err;
+
 	// Security support template
 	// 93 03 xx xx xx -- DS-Counter
 	// needs to set to 0 after import or generation
@@ -1002,7 +1061,13 @@ Util::Error KeyStorage::SetKeyExtHeader(AppID_t appID, bstr keyData) {
 		filesystem.DeleteFile(appID, 0x7a, File::File);
 
 	printf_device("save key data [%02x] len:%lu\n", type, keyData.length());
-	return filesystem.WriteFile(appID, type, File::Secure, keyData);
+	err = filesystem.WriteFile(appID, type, File::Secure, keyData);
+	if (err != Util::Error::NoError) {
+		filesystem.AbortTransaction();
+		return err;
+	}
+
+	return filesystem.CommitTransaction();
 }
 
 Util::Error CryptoEngine::AESEncrypt(AppID_t appID, KeyID_t keyID,
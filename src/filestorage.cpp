@@ -0,0 +1,225 @@
+/*
+  Copyright 2019 SoloKeys Developers
+
+  Licensed under the Apache License, Version 2.0, <LICENSE-APACHE or
+  http://apache.org/licenses/LICENSE-2.0> or the MIT license <LICENSE-MIT or
+  http://opensource.org/licenses/MIT>, at your option. This file may not be
+  copied, modified, or distributed except according to those terms.
+ */
+
+#include "filestorage.h"
+#include "opgpdevice.h"
+#include "opgputil.h"
+#include "stm32fs.h"
+
+namespace File {
+
+// the biggest transaction is a key import. it needs about one sector.
+static const size_t TxFreeMemoryReserve = BlockSize;
+
+void Stm32fsFileStorage::SetFs(Stm32fs *stm32fs) {
+	fs = stm32fs;
+	if (!fs)
+		return;
+
+	if (fs->GetCurrentFsBlockSerial() == 0)
+		printf_device("ERROR CurrentFs!\n");
+	fs->EnableWriteCombining(true);
+}
+
+bool Stm32fsFileStorage::Optimize() {
+	OptimizationStart();
+	bool res = fs->Optimize();
+	OptimizationEnd(res);
+	stepsFailed = false;
+	return res;
+}
+
+// transaction needs reserveFactor = 1. idle optimization starts earlier.
+bool Stm32fsFileStorage::isSpaceLow(size_t reserveFactor) {
+	return fs->isNeedsOptimization() ||
+	       fs->GetFreeFileDescriptors() < (TxMaxRecords * 2 + 2) * reserveFactor ||
+	       fs->GetFreeMemory() < TxFreeMemoryReserve * reserveFactor;
+}
+
+bool Stm32fsFileStorage::OptimizeIfNeeded() {
+	if (!fs)
+		return false;
+
+	Stm32fsStatistic stat = fs->GetStatistic();
+	stat.Print();
+	if (!stat.OptimizationNeeded())
+		return true;
+
+	bool res = Optimize();
+	printf_device("stm32fs optimization %s\n", res ? "OK" : "ERROR");
+	return res;
+}
+
+bool Stm32fsFileStorage::FileExist(char* name) {
+	if (!fs)
+		return false;
+
+	return fs->FileExist(std::string_view(name));
+}
+
+int OPTIMIZATION_O2 Stm32fsFileStorage::ReadFile(char* name, uint8_t* buf,
+		size_t max_size, size_t* size) {
+	if (!fs) {
+		printf_device("__error read %s %d\n", name, max_size);
+		return 1;
+	}
+
+	return fs->ReadFile(std::string_view(name), buf, size, max_size) ? 0 : 1;
+}
+
+// flash is memory-mapped. so file can be read right from it.
+int OPTIMIZATION_O2 Stm32fsFileStorage::ReadFilePtr(char* name, uint8_t** ptr,
+		size_t* size) {
+	if (!fs)
+		return 1;
+
+	return fs->GetFilePtr(std::string_view(name), ptr, size) ? 0 : 1;
+}
+
+int OPTIMIZATION_O2 Stm32fsFileStorage::WriteFile(char* name, uint8_t* buf,
+		size_t size) {
+	if (!fs)
+		return 1;
+
+	bool res = fs->WriteFile(std::string_view(name), buf, size);
+
+	// maybe we need to optimize
+	if (!res && fs->isNeedsOptimization()) {
+		res = Optimize();
+		printf_device("stm32fs write optimization %s\n", res ? "OK" : "ERROR");
+
+		// try again
+		if (res && fs->GetFreeMemory() >= size && fs->GetFreeFileDescriptors() > 0)
+			res = fs->WriteFile(std::string_view(name), buf, size);
+	}
+	return res ? 0 : 1;
+}
+
+int Stm32fsFileStorage::DeleteFile(char* name) {
+	if (!fs)
+		return 1;
+
+	return fs->DeleteFile(std::string_view(name)) ? 0 : 1;
+}
+
+int Stm32fsFileStorage::DeleteFiles(char* name) {
+	if (!fs)
+		return 1;
+
+	return fs->DeleteFiles(std::string_view(name)) ? 0 : 1;
+}
+
+int Stm32fsFileStorage::BeginTransaction() {
+	if (!fs)
+		return 1;
+
+	// transaction can't be optimized in the middle. so make place for it before.
+	if (isSpaceLow(1)) {
+		bool res = Optimize();
+		printf_device("stm32fs transaction optimization %s\n", res ? "OK" : "ERROR");
+	}
+
+	return fs->BeginTransaction() ? 0 : 1;
+}
+
+int Stm32fsFileStorage::CommitTransaction() {
+	if (!fs)
+		return 1;
+
+	bool res = fs->CommitTransaction();
+
+	// group doesn't fit into the catalog. the transaction is still open.
+	if (!res && fs->isTransactionActive() && fs->isNeedsOptimization()) {
+		res = Optimize();
+		printf_device("stm32fs commit optimization %s\n", res ? "OK" : "ERROR");
+
+		// try again
+		if (res)
+			res = fs->CommitTransaction();
+	}
+
+	// the caller gets the rollback
+	if (!res && fs->isTransactionActive())
+		fs->AbortTransaction();
+	return res ? 0 : 1;
+}
+
+int Stm32fsFileStorage::AbortTransaction() {
+	if (!fs)
+		return 1;
+
+	fs->AbortTransaction();
+	return 0;
+}
+
+int Stm32fsFileStorage::Flush() {
+	if (!fs)
+		return 1;
+
+	return fs->Flush() ? 0 : 1;
+}
+
+int Stm32fsFileStorage::Idle() {
+	if (!fs)
+		return 1;
+
+	// one erase per call. so optimization and counter roll-up don't wait for it.
+	if (fs->PrepareCounters() || fs->PrepareSectors())
+		return 0;
+
+	// checkpoint keeps the mount short. it takes data space, so not before the optimization.
+	if (!isSpaceLow(2) && fs->PrepareCheckpoint())
+		return 0;
+
+	if (!fs->isOptimizeActive()) {
+		if (stepsFailed || fs->isTransactionActive() || !isSpaceLow(2))
+			return 0;
+
+		// single block fs can be optimized only at once
+		if (!fs->OptimizeStart()) {
+			stepsFailed = true;
+			return 0;
+		}
+	}
+
+	if (!fs->OptimizeStep()) {
+		printf_device("stm32fs optimization step ERROR\n");
+		stepsFailed = true;
+		return 1;
+	}
+	return 0;
+}
+
+int Stm32fsFileStorage::ReadCounter(uint16_t counterID, uint32_t* value) {
+	if (!fs || !fs->isCountersEnabled())
+		return -1;
+
+	return fs->ReadCounter(counterID, *value) ? 0 : 1;
+}
+
+int Stm32fsFileStorage::WriteCounter(uint16_t counterID, uint32_t value) {
+	if (!fs || !fs->isCountersEnabled())
+		return -1;
+
+	return fs->WriteCounter(counterID, value) ? 0 : 1;
+}
+
+void Stm32fsFileStorage::GetIOCounters(StorageIOCounters& counters) {
+	counters = {};
+	if (!fs)
+		return;
+
+	Stm32fsIOCounters &io = fs->GetIOCounters();
+	counters.Writes = io.Writes;
+	counters.BytesWritten = io.BytesWritten;
+	counters.Erases = io.Erases;
+	counters.Optimizations = io.Optimizations;
+}
+
+} // namespace File
@@ -0,0 +1,133 @@
+/*
+  Copyright 2019 SoloKeys Developers
+
+  Licensed under the Apache License, Version 2.0, <LICENSE-APACHE or
+  http://apache.org/licenses/LICENSE-2.0> or the MIT license <LICENSE-MIT or
+  http://opensource.org/licenses/MIT>, at your option. This file may not be
+  copied, modified, or distributed except according to those terms.
+ */
+
+#ifndef SRC_FILESTORAGE_H_
+#define SRC_FILESTORAGE_H_
+
+#include <cstdint>
+#include <cstddef>
+
+class Stm32fs;
+
+namespace File {
+
+// flash I/O of the storage since the start. storages without flash leave it zero.
+struct StorageIOCounters {
+	uint32_t Writes;
+	uint32_t BytesWritten;
+	uint32_t Erases;
+	uint32_t Optimizations;
+};
+
+// Storage backend of the generic file system. Device selects it at startup (hwinit).
+// Functions return 0 if OK.
+class FileStorage {
+public:
+	virtual ~FileStorage() {};
+
+	virtual bool FileExist(char *name) = 0;
+	virtual int ReadFile(char *name, uint8_t *buf, size_t max_size, size_t *size) = 0;
+	// pointer to the file in the memory-mapped storage. read only, valid till the next write.
+	// returns -1 if the storage can't do it.
+	virtual int ReadFilePtr(char *name, uint8_t **ptr, size_t *size) {
+		return -1;
+	};
+	virtual int WriteFile(char *name, uint8_t *buf, size_t size) = 0;
+	virtual int DeleteFile(char *name) = 0;
+	virtual int DeleteFiles(char *name) = 0;
+
+	// writes between begin and commit must appear in the storage at once
+	virtual int BeginTransaction() {
+		return 0;
+	};
+	virtual int CommitTransaction() {
+		return 0;
+	};
+	virtual int AbortTransaction() {
+		return 0;
+	};
+
+	// writes kept in RAM by the storage go to the media. called at the end of every command.
+	virtual int Flush() {
+		return 0;
+	};
+
+	// work that can wait for the time between the commands. one call must be short.
+	virtual int Idle() {
+		return 0;
+	};
+
+	// counters that change without the file rewrite. they are not the part of transaction:
+	// FileSystem keeps their writes till the commit.
+	// return -1 if the storage doesn't have them, 1 if the counter was never written.
+	virtual int ReadCounter(uint16_t counterID, uint32_t *value) {
+		return -1;
+	};
+	virtual int WriteCounter(uint16_t counterID, uint32_t value) {
+		return -1;
+	};
+
+	virtual void GetIOCounters(StorageIOCounters &counters) {
+		counters = {};
+	};
+};
+
+// Stm32fs as a storage. The same on the device and on the flash image on PC.
+class Stm32fsFileStorage : public FileStorage {
+protected:
+	Stm32fs *fs = nullptr;
+
+	// device can show optimization with LED
+	virtual void OptimizationStart() {};
+	virtual void OptimizationEnd(bool result) {};
+	bool Optimize();
+	bool isSpaceLow(size_t reserveFactor);
+	// optimization by steps failed. it waits for the full one.
+	bool stepsFailed = false;
+public:
+	Stm32fsFileStorage() {};
+	Stm32fsFileStorage(Stm32fs *stm32fs) {
+		SetFs(stm32fs);
+	};
+
+	// small writes of the command are combined till Flush
+	void SetFs(Stm32fs *stm32fs);
+	Stm32fs *GetFs() {
+		return fs;
+	}
+
+	// optimize if the fs needs it after mount
+	bool OptimizeIfNeeded();
+
+	virtual bool FileExist(char *name);
+	virtual int ReadFile(char *name, uint8_t *buf, size_t max_size, size_t *size);
+	virtual int ReadFilePtr(char *name, uint8_t **ptr, size_t *size);
+	virtual int WriteFile(char *name, uint8_t *buf, size_t size);
+	virtual int DeleteFile(char *name);
+	virtual int DeleteFiles(char *name);
+
+	virtual int BeginTransaction();
+	virtual int CommitTransaction();
+	virtual int AbortTransaction();
+
+	virtual int Flush();
+
+	// optimization by steps
+	virtual int Idle();
+
+	// counter sectors of the fs if they are in the config
+	virtual int ReadCounter(uint16_t counterID, uint32_t *value);
+	virtual int WriteCounter(uint16_t counterID, uint32_t value);
+
+	virtual void GetIOCounters(StorageIOCounters &counters);
+};
+
+} // namespace File
+
+#endif /* SRC_FILESTORAGE_H_ */
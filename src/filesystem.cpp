@@ -9,8 +9,10 @@
 
 #include "filesystem.h"
 #include <array>
+#include <cstring>
 #include "opgpdevice.h"
 #include "tlv.h"
+#include "latency.h"
 #include "applications/openpgp/openpgpconst.h"
 
 namespace File {
@@ -248,6 +250,363 @@ Util::Error ConfigFileSystem::ReadFile(AppID_t AppId, KeyID_t FileID,
 	return Util::Error::FileNotFound;
 }
 
+void FilePresenceStatistic::Clear() {
+	Hits = 0;
+	NegativeHits = 0;
+	Misses = 0;
+}
+
+void FilePresenceStatistic::Print() {
+	uint32_t total = Hits + Misses;
+	printf_device("presence cache: lookups %lu hits %lu (negative %lu) misses %lu",
+			(unsigned long)total, (unsigned long)Hits, (unsigned long)NegativeHits, (unsigned long)Misses);
+	if (total)
+		printf_device(" hit ratio %lu%%", (unsigned long)(Hits * 100 / total));
+	printf_device("\n");
+}
+
+FilePresenceCache::FilePresenceCache() {
+	Clear();
+	statistic.Clear();
+}
+
+FilePresenceCache::CacheEntry_t *FilePresenceCache::GetEntry(AppID_t AppId,
+		KeyID_t FileID, FileType FileType, bool create) {
+
+	// DO tags are dense in the low byte and sparse in the high one (5Fxx, 7Fxx)
+	size_t indx = (FileID + (FileID >> 8) * 3 + AppId * 17 + FileType * 29) % CacheSize;
+	for (size_t i = 0; i < CacheSize; i++) {
+		auto &entry = entries[(indx + i) % CacheSize];
+
+		if (entry.State == Presence::Empty) {
+			if (!create)
+				return nullptr;
+
+			entry.AppId = AppId;
+			entry.FileID = FileID;
+			entry.FileType = FileType;
+			entry.State = Presence::Unknown;
+			return &entry;
+		}
+
+		if (entry.AppId == AppId && entry.FileID == FileID && entry.FileType == FileType)
+			return &entry;
+	}
+
+	return nullptr;
+}
+
+void FilePresenceCache::Set(AppID_t AppId, KeyID_t FileID, FileType FileType,
+		Presence state) {
+
+	auto entry = GetEntry(AppId, FileID, FileType, true);
+	if (entry)
+		entry->State = state;
+}
+
+bool FilePresenceCache::Lookup(AppID_t AppId, KeyID_t FileID,
+		FileType FileType, bool& exist) {
+
+	auto entry = GetEntry(AppId, FileID, FileType, false);
+	if (!entry || entry->State == Presence::Unknown) {
+		statistic.Misses++;
+		return false;
+	}
+
+	exist = (entry->State == Presence::Present);
+	statistic.Hits++;
+	if (!exist)
+		statistic.NegativeHits++;
+	return true;
+}
+
+void FilePresenceCache::SetPresent(AppID_t AppId, KeyID_t FileID,
+		FileType FileType) {
+	Set(AppId, FileID, FileType, Presence::Present);
+}
+
+void FilePresenceCache::SetAbsent(AppID_t AppId, KeyID_t FileID,
+		FileType FileType) {
+	Set(AppId, FileID, FileType, Presence::Absent);
+}
+
+void FilePresenceCache::Invalidate(AppID_t AppId, KeyID_t FileID,
+		FileType FileType) {
+
+	auto entry = GetEntry(AppId, FileID, FileType, false);
+	if (entry)
+		entry->State = Presence::Unknown;
+}
+
+void FilePresenceCache::SetAppAbsent(AppID_t AppId) {
+	for (auto &entry : entries)
+		if (entry.AppId == AppId && entry.State != Presence::Empty)
+			entry.State = Presence::Absent;
+}
+
+void FilePresenceCache::Clear() {
+	for (auto &entry : entries) {
+		entry.AppId = 0;
+		entry.FileID = 0;
+		entry.FileType = 0;
+		entry.State = Presence::Empty;
+	}
+}
+
+FileIOStatistic::FileIOStatistic() {
+	Clear();
+}
+
+FileIOCounter& FileIOStatistic::GetCounter(AppID_t AppId, KeyID_t FileID, FileType FileType) {
+	for (size_t i = 0; i < count; i++) {
+		FileIOCounter &counter = files[i];
+		if (counter.AppId == AppId && counter.FileID == FileID && counter.FileType == FileType)
+			return counter;
+	}
+
+	if (count >= files.size())
+		return other;
+
+	FileIOCounter &counter = files[count++];
+	counter = {};
+	counter.AppId = AppId;
+	counter.FileID = FileID;
+	counter.FileType = FileType;
+	return counter;
+}
+
+void FileIOStatistic::StorageBegin(FileStorage* storage) {
+	start = {};
+	if (storage)
+		storage->GetIOCounters(start);
+}
+
+void FileIOStatistic::StorageEnd(FileStorage* storage, FileIOCounter& counter) {
+	if (!storage)
+		return;
+
+	StorageIOCounters end;
+	storage->GetIOCounters(end);
+	counter.FlashWrites += end.Writes - start.Writes;
+	counter.FlashBytesWritten += end.BytesWritten - start.BytesWritten;
+	counter.Erases += end.Erases - start.Erases;
+	counter.Optimizations += end.Optimizations - start.Optimizations;
+}
+
+void FileIOStatistic::Clear() {
+	count = 0;
+	other = {};
+	start = {};
+}
+
+void FileIOStatistic::Print() {
+	printf_device("---- file I/O ----\n");
+	printf_device(" app  file type   reads  writes   bytes  fwrites  fbytes erases opt\n");
+	for (size_t i = 0; i <= count; i++) {
+		FileIOCounter &c = (i < count) ? files[i] : other;
+		printf_device("%4u %5x %4u %7lu %7lu %7lu %8lu %7lu %6lu %3lu\n",
+				c.AppId, c.FileID, c.FileType,
+				(unsigned long)c.Reads, (unsigned long)c.Writes, (unsigned long)c.BytesWritten,
+				(unsigned long)c.FlashWrites, (unsigned long)c.FlashBytesWritten,
+				(unsigned long)c.Erases, (unsigned long)c.Optimizations);
+	}
+}
+
+void FileIOStatistic::EncodeCounter(FileIOCounter& counter, bstr& data) {
+	size_t indx = data.length();
+	data.set_length(indx + EncodedCounterSize);
+
+	data.set_uint_be(indx +  0, 1, counter.AppId);
+	data.set_uint_be(indx +  1, 2, counter.FileID);
+	data.set_uint_be(indx +  3, 1, counter.FileType);
+	data.set_uint_be(indx +  4, 4, counter.Reads);
+	data.set_uint_be(indx +  8, 4, counter.Writes);
+	data.set_uint_be(indx + 12, 4, counter.BytesWritten);
+	data.set_uint_be(indx + 16, 4, counter.FlashWrites);
+	data.set_uint_be(indx + 20, 4, counter.FlashBytesWritten);
+	data.set_uint_be(indx + 24, 2, counter.Erases);
+	data.set_uint_be(indx + 26, 2, counter.Optimizations);
+}
+
+Util::Error FileIOStatistic::Encode(bstr& data, FilePresenceStatistic &presence) {
+	data.clear();
+	size_t head = 2 + EncodedPresenceSize;
+	if (data.max_length() < head + EncodedCounterSize)
+		return Util::Error::InternalError;
+
+	// `other` always goes first. the files that don't fit to the buffer are skipped.
+	size_t maxcount = (data.max_length() - head) / EncodedCounterSize - 1;
+	size_t ecount = MIN(count, maxcount);
+
+	data.append(EncodingVersion);
+	data.append(ecount + 1);
+	data.set_length(head);
+	data.set_uint_be(2, 4, presence.Hits);
+	data.set_uint_be(6, 4, presence.NegativeHits);
+	data.set_uint_be(10, 4, presence.Misses);
+	EncodeCounter(other, data);
+	for (size_t i = 0; i < ecount; i++)
+		EncodeCounter(files[i], data);
+
+	return Util::Error::NoError;
+}
+
+// files that end with a big endian counter. if the storage has counters, the value is kept there
+// and its change is one small storage write instead of the file rewrite.
+struct CounterFile_t {
+	AppID_t AppId;
+	KeyID_t FileID;
+	uint8_t FileType;
+	uint8_t Length;
+};
+
+static const CounterFile_t CounterFiles[] = {
+	{AppID::OpenPGP, 0x7a, FileType::File, 3}, // DS-Counter. 93 03 xx xx xx
+	// PW Status Bytes. error counters of PW1, RC, PW3 as one 24-bit BE value. it is not monotonic:
+	// a wrong PIN counts down, a reset sets it back. so the counter keeps the last value, not the max.
+	{AppID::OpenPGP, 0xc4, FileType::File, 3},
+};
+
+static const CounterFile_t *FindCounterFile(AppID_t AppId, KeyID_t FileID, FileType FileType) {
+	for (auto &cfile : CounterFiles)
+		if (cfile.AppId == AppId && cfile.FileID == FileID && cfile.FileType == FileType)
+			return &cfile;
+	return nullptr;
+}
+
+static uint16_t CounterID(const CounterFile_t *cfile) {
+	return (cfile->AppId << 12) | (cfile->FileID & 0x0fff);
+}
+
+GenericFileSystem::PendingCounter *GenericFileSystem::FindPendingCounter(uint16_t id) {
+	for (size_t i = 0; i < pendingCount; i++)
+		if (pendingCounters[i].ID == id)
+			return &pendingCounters[i];
+	return nullptr;
+}
+
+// counter is written only when the file is. so it is newer than the value in the file.
+void GenericFileSystem::ReadCounter(const CounterFile_t *cfile, bstr &data) {
+	if (data.length() < cfile->Length)
+		return;
+
+	uint32_t value = 0;
+	PendingCounter *pending = FindPendingCounter(CounterID(cfile));
+	if (pending)
+		value = pending->Value;
+	else if (storage->ReadCounter(CounterID(cfile), &value) != 0)
+		return;
+
+	data.set_uint_be(data.length() - cfile->Length, cfile->Length, value);
+}
+
+GenericFileSystem::StoredCounterFile &GenericFileSystem::GetStoredCounterFile(const CounterFile_t *cfile) {
+	static_assert(sizeof(CounterFiles) / sizeof(CounterFiles[0]) == MaxCounterFiles, "counter files");
+	return storedCounterFiles[cfile - CounterFiles];
+}
+
+void GenericFileSystem::SetStoredCounterFile(const CounterFile_t *cfile, uint8_t *data, size_t len) {
+	StoredCounterFile &stored = GetStoredCounterFile(cfile);
+	stored.Valid = !counterTransaction && len <= sizeof(stored.Data);
+	stored.Length = (len <= sizeof(stored.Data)) ? len : 0;
+	memcpy(stored.Data, data, stored.Length);
+}
+
+int GenericFileSystem::StoreCounterFile(const CounterFile_t *cfile, char *name, bstr &data) {
+	int res = storage->WriteFile(name, data.uint8Data(), data.length());
+	if (res == 0)
+		SetStoredCounterFile(cfile, data.uint8Data(), data.length());
+	else
+		GetStoredCounterFile(cfile).Valid = false;
+	return res;
+}
+
+// counter goes first. so after power loss the file can't be newer than it.
+int GenericFileSystem::WriteCounterFile(const CounterFile_t *cfile, char *name, bstr &data) {
+	if (data.length() < cfile->Length)
+		return StoreCounterFile(cfile, name, data);
+
+	// the file is read once after the mount or a transaction. in a transaction it is read every time.
+	StoredCounterFile &stored = GetStoredCounterFile(cfile);
+	if (!stored.Valid) {
+		size_t len = 0;
+		// no file or bigger than the buffer: the file part is written
+		if (storage->ReadFile(name, stored.Data, sizeof(stored.Data), &len) != 0)
+			len = 0;
+		stored.Length = len;
+		stored.Valid = !counterTransaction;
+	}
+	size_t len = stored.Length;
+	bool storedFile = (len >= cfile->Length);
+	bool sameFile = (storedFile &&
+			len == data.length() &&
+			memcmp(stored.Data, data.uint8Data(), len - cfile->Length) == 0);
+
+	uint16_t id = CounterID(cfile);
+	uint32_t value = data.get_uint_be(data.length() - cfile->Length, cfile->Length);
+	int res = 0;
+	if (counterTransaction) {
+		// value of the transaction begin goes back at rollback: counter or the file one
+		PendingCounter *pending = FindPendingCounter(id);
+		if (!pending) {
+			uint32_t old = 0;
+			res = storage->ReadCounter(id, &old);
+			if (res < 0)
+				return StoreCounterFile(cfile, name, data);
+			if (pendingCount >= pendingCounters.size())
+				return 1;
+			if (res != 0 && storedFile)
+				old = bstr(stored.Data, len, len).get_uint_be(len - cfile->Length, cfile->Length);
+			pending = &pendingCounters[pendingCount++];
+			*pending = {id, value, old, res == 0 || storedFile};
+			res = 0;
+		}
+		pending->Value = value;
+	} else {
+		res = storage->WriteCounter(id, value);
+	}
+	if (res < 0)
+		return StoreCounterFile(cfile, name, data);
+	if (res != 0 || sameFile)
+		return res;
+
+	return StoreCounterFile(cfile, name, data);
+}
+
+void GenericFileSystem::BeginCounters() {
+	counterTransaction = true;
+	pendingCount = 0;
+}
+
+int GenericFileSystem::CommitCounters() {
+	counterTransaction = false;
+	for (size_t i = 0; i < pendingCount; i++)
+		if (storage->WriteCounter(pendingCounters[i].ID, pendingCounters[i].Value) != 0)
+			return 1;
+	return 0;
+}
+
+// after CommitCounters: storage rolled back the files, so the counters go back too
+void GenericFileSystem::RestoreCounters() {
+	for (size_t i = 0; i < pendingCount; i++)
+		if (pendingCounters[i].HasOld)
+			storage->WriteCounter(pendingCounters[i].ID, pendingCounters[i].OldValue);
+	EndCounters();
+}
+
+void GenericFileSystem::EndCounters() {
+	counterTransaction = false;
+	pendingCount = 0;
+}
+
+void GenericFileSystem::SetStorage(FileStorage* fileStorage) {
+	storage = fileStorage;
+	cache.Clear();
+	EndCounters();
+	for (auto &stored : storedCounterFiles)
+		stored.Valid = false;
+}
+
 Util::Error GenericFileSystem::SetFileName(AppID_t AppId, KeyID_t FileID,
 		FileType FileType, char* name) {
 	name[0] = '\0';
@@ -258,38 +617,184 @@ Util::Error GenericFileSystem::SetFileName(AppID_t AppId, KeyID_t FileID,
 }
 
 bool GenericFileSystem::FileExist(AppID_t AppId, KeyID_t FileID, FileType FileType) {
+	if (!storage)
+		return false;
+
+	bool exist = false;
+	if (cache.Lookup(AppId, FileID, FileType, exist))
+		return exist;
+
 	char file_name[100] = {0};
 	SetFileName(AppId, FileID, FileType, file_name);
 
-	return fileexist(file_name);
+	exist = storage->FileExist(file_name);
+	if (exist)
+		cache.SetPresent(AppId, FileID, FileType);
+	else
+		cache.SetAbsent(AppId, FileID, FileType);
+
+	return exist;
 }
 
 Util::Error GenericFileSystem::ReadFile(AppID_t AppId, KeyID_t FileID,
 		FileType FileType, bstr& data) {
+	if (!storage)
+		return Util::Error::FileNotFound;
+	Util::LatencyScope latency(Util::LatencyFile::Read);
+	ioStatistic.GetCounter(AppId, FileID, FileType).Reads++;
+
+	bool exist = false;
+	if (cache.Lookup(AppId, FileID, FileType, exist) && !exist)
+		return Util::Error::FileNotFound;
 
 	// try to read file
 	char file_name[100] = {0};
 	SetFileName(AppId, FileID, FileType, file_name);
 
 	size_t len = 0;
-	int res = readfile(file_name, data.uint8Data(), data.max_length(), &len);
+	int res = storage->ReadFile(file_name, data.uint8Data(), data.max_length(), &len);
 	if (res == 0) {
 		data.set_length(len);
+		auto cfile = FindCounterFile(AppId, FileID, FileType);
+		if (cfile) {
+			SetStoredCounterFile(cfile, data.uint8Data(), len);
+			ReadCounter(cfile, data);
+		}
+		cache.SetPresent(AppId, FileID, FileType);
+		return Util::Error::NoError;
+	}
+
+	// small buffer or the storage error: the file is there
+	if (storage->FileExist(file_name)) {
+		cache.SetPresent(AppId, FileID, FileType);
+		return Util::Error::OutOfMemory;
+	}
+
+	cache.SetAbsent(AppId, FileID, FileType);
+	return Util::Error::FileNotFound;
+}
+
+Util::Error GenericFileSystem::ReadFileView(AppID_t AppId, KeyID_t FileID,
+		FileType FileType, bstr& data) {
+	if (!storage)
+		return Util::Error::FileNotFound;
+
+	// counter is not in the file
+	if (FindCounterFile(AppId, FileID, FileType))
+		return ReadFile(AppId, FileID, FileType, data);
+
+	Util::LatencyScope latency(Util::LatencyFile::Read);
+	ioStatistic.GetCounter(AppId, FileID, FileType).Reads++;
+
+	bool exist = false;
+	if (cache.Lookup(AppId, FileID, FileType, exist) && !exist)
+		return Util::Error::FileNotFound;
+
+	char file_name[100] = {0};
+	SetFileName(AppId, FileID, FileType, file_name);
+
+	uint8_t *ptr = nullptr;
+	size_t len = 0;
+	int res = storage->ReadFilePtr(file_name, &ptr, &len);
+
+	// storage is not memory-mapped
+	if (res == -1)
+		return ReadFile(AppId, FileID, FileType, data);
+
+	if (res == 0) {
+		data = bstr(ptr, len, len);
+		cache.SetPresent(AppId, FileID, FileType);
 		return Util::Error::NoError;
 	}
 
+	if (storage->FileExist(file_name)) {
+		cache.SetPresent(AppId, FileID, FileType);
+		return Util::Error::InternalError;
+	}
+
+	cache.SetAbsent(AppId, FileID, FileType);
 	return Util::Error::FileNotFound;
 }
 
 Util::Error GenericFileSystem::WriteFile(AppID_t AppId, KeyID_t FileID,
 		FileType FileType, bstr& data) {
+	if (!storage)
+		return Util::Error::FileWriteError;
+	Util::LatencyScope latency(Util::LatencyFile::Write);
 
 	char file_name[100] = {0};
 	SetFileName(AppId, FileID, FileType, file_name);
 
-	int res = writefile(file_name, data.uint8Data(), data.length());
-	if (res != 0)
+	FileIOCounter &counter = ioStatistic.GetCounter(AppId, FileID, FileType);
+	counter.Writes++;
+	counter.BytesWritten += data.length();
+
+	ioStatistic.StorageBegin(storage);
+	int res = 0;
+	auto cfile = FindCounterFile(AppId, FileID, FileType);
+	if (cfile)
+		res = WriteCounterFile(cfile, file_name, data);
+	else
+		res = storage->WriteFile(file_name, data.uint8Data(), data.length());
+	ioStatistic.StorageEnd(storage, counter);
+	if (res != 0) {
+		// we don't know what is in the storage now
+		cache.Invalidate(AppId, FileID, FileType);
+		return Util::Error::FileWriteError;
+	}
+
+	cache.SetPresent(AppId, FileID, FileType);
+	return Util::Error::NoError;
+}
+
+Util::Error GenericFileSystem::DeleteFile(AppID_t AppId, KeyID_t FileID,
+		FileType FileType) {
+	if (!storage)
+		return Util::Error::FileWriteError;
+	Util::LatencyScope latency(Util::LatencyFile::Delete);
+
+	char file_name[100] = {0};
+	SetFileName(AppId, FileID, FileType, file_name);
+
+	FileIOCounter &counter = ioStatistic.GetCounter(AppId, FileID, FileType);
+	counter.Writes++;
+
+	auto cfile = FindCounterFile(AppId, FileID, FileType);
+	if (cfile)
+		GetStoredCounterFile(cfile).Valid = false;
+
+	ioStatistic.StorageBegin(storage);
+	int res = storage->DeleteFile(file_name);
+	ioStatistic.StorageEnd(storage, counter);
+
+	if (res == 0)
+		cache.SetAbsent(AppId, FileID, FileType);
+	else
+		cache.Invalidate(AppId, FileID, FileType);
+
+	return Util::Error::NoError;
+}
+
+Util::Error GenericFileSystem::DeleteFiles(AppID_t AppId) {
+	if (!storage)
 		return Util::Error::FileWriteError;
+	Util::LatencyScope latency(Util::LatencyFile::DeleteAll);
+
+	char file_name[100] = {0};
+	sprintf(file_name, "%d_*", AppId);
+
+	for (auto &stored : storedCounterFiles)
+		stored.Valid = false;
+
+	ioStatistic.GetOther().Writes++;
+	ioStatistic.StorageBegin(storage);
+	int res = storage->DeleteFiles(file_name);
+	ioStatistic.StorageEnd(storage, ioStatistic.GetOther());
+
+	if (res == 0)
+		cache.SetAppAbsent(AppId);
+	else
+		cache.Clear();
 
 	return Util::Error::NoError;
 }
@@ -315,9 +820,10 @@ OPTIMIZATION_O2 Util::Error FileSystem::ReadFile(AppID_t AppId, KeyID_t FileID,
 		Util::TLVTree tlv;
 		for(const auto& ctag: CompositeTag) {
 	    	if (ctag.TagGroup == FileID) {
-	    		vdata.clear();
+	    		// elements from the storage are appended right from it
+	    		vdata = bstr(_vdata, 0, sizeof(_vdata));
 
-	    		auto rerr = ReadFile(AppId, ctag.TagElm, FileType, vdata);
+	    		auto rerr = ReadFileView(AppId, ctag.TagElm, FileType, vdata);
 	    		if (rerr != Util::Error::NoError){
 	    			data.clear();
 	    			return rerr;
@@ -354,7 +860,8 @@ OPTIMIZATION_O2 Util::Error FileSystem::ReadFile(AppID_t AppId, KeyID_t FileID,
 	if (err == Util::Error::NoError)
 		return err;
 
-	// from general file system
+	// from general file system. any error falls back to the config default. OutOfMemory of
+	// the file that is there but doesn't fit only keeps it present in the presence cache.
 	err = genFiles.ReadFile(AppId, FileID, FileType, data);
 	if (err == Util::Error::NoError)
 		return err;
@@ -367,9 +874,36 @@ OPTIMIZATION_O2 Util::Error FileSystem::ReadFile(AppID_t AppId, KeyID_t FileID,
 	return Util::Error::FileNotFound;
 }
 
+OPTIMIZATION_O2 Util::Error FileSystem::ReadFileView(AppID_t AppId, KeyID_t FileID,
+		FileType FileType, bstr& data) {
+
+	// composite files and files from settings are built in the buffer
+	if (isTagComposite(FileID))
+		return ReadFile(AppId, FileID, FileType, data);
+
+	data.clear();
+	auto err = settingsFiles.ReadFile(AppId, FileID, FileType, data);
+	if (err == Util::Error::NoError)
+		return err;
+
+	err = genFiles.ReadFileView(AppId, FileID, FileType, data);
+	if (err == Util::Error::NoError)
+		return err;
+
+	err = cfgFiles.ReadFile(AppId, FileID, FileType, data);
+	if (err == Util::Error::NoError)
+		return err;
+
+	return Util::Error::FileNotFound;
+}
+
 OPTIMIZATION_O2 Util::Error FileSystem::WriteFile(AppID_t AppId, KeyID_t FileID,
 		FileType FileType, bstr& data, bool adminMode) {
 
+	// the rest of the aborted transaction
+	if (transactionAborted)
+		return Util::Error::FileWriteError;
+
 	// to settings file system
 	auto err = settingsFiles.WriteFile(AppId, FileID, FileType, data, adminMode);
 	if (err != Util::Error::FileNotFound)
@@ -386,19 +920,125 @@ OPTIMIZATION_O2 Util::Error FileSystem::WriteFile(AppID_t AppId, KeyID_t FileID,
 Util::Error FileSystem::DeleteFile(AppID_t AppId, KeyID_t FileID,
 		FileType FileType) {
 
-	char file_name[100] = {0};
-	genFiles.SetFileName(AppId, FileID, FileType, file_name);
+	if (transactionAborted)
+		return Util::Error::FileWriteError;
+
+	return genFiles.DeleteFile(AppId, FileID, FileType);
+}
+
+Util::Error FileSystem::DeleteFiles(AppID_t AppId) {
+
+	if (transactionAborted)
+		return Util::Error::FileWriteError;
+
+	return genFiles.DeleteFiles(AppId);
+}
 
-	deletefile(file_name);
+Util::Error FileSystem::BeginTransaction() {
+	if (!genFiles.GetStorage())
+		return Util::Error::FileWriteError;
+
+	if (transactionDepth == 0) {
+		Util::LatencyScope latency(Util::LatencyFile::Begin);
+		FileIOStatistic &ioStatistic = genFiles.getIOStatistic();
+		ioStatistic.StorageBegin(genFiles.GetStorage());
+		int res = genFiles.GetStorage()->BeginTransaction();
+		ioStatistic.StorageEnd(genFiles.GetStorage(), ioStatistic.GetOther());
+		if (res != 0)
+			return Util::Error::FileWriteError;
+		genFiles.BeginCounters();
+	}
 
+	transactionDepth++;
 	return Util::Error::NoError;
 }
 
-Util::Error FileSystem::DeleteFiles(AppID_t AppId) {
+Util::Error FileSystem::CommitTransaction() {
 
-	char file_name[100] = {0};
-	sprintf(file_name, "%d_*", AppId);
-	deletefiles(file_name);
+	if (transactionDepth == 0)
+		return Util::Error::InternalError;
+
+	transactionDepth--;
+	if (transactionAborted) {
+		// inner level was aborted: storage rolled back the writes of all the levels
+		transactionAborted = (transactionDepth > 0);
+		return Util::Error::FileWriteError;
+	}
+	if (transactionDepth > 0)
+		return Util::Error::NoError;
+
+	Util::LatencyScope latency(Util::LatencyFile::Commit);
+	FileIOStatistic &ioStatistic = genFiles.getIOStatistic();
+	ioStatistic.StorageBegin(genFiles.GetStorage());
+	// counters go first, the same as without the transaction
+	int res = genFiles.CommitCounters();
+	if (res == 0)
+		res = genFiles.GetStorage()->CommitTransaction();
+	else
+		genFiles.GetStorage()->AbortTransaction();
+	if (res != 0)
+		genFiles.RestoreCounters();
+	else
+		genFiles.EndCounters();
+	ioStatistic.StorageEnd(genFiles.GetStorage(), ioStatistic.GetOther());
+
+	if (res != 0) {
+		// storage rolled back all the writes
+		genFiles.getCache().Clear();
+		return Util::Error::FileWriteError;
+	}
+
+	return Util::Error::NoError;
+}
+
+void FileSystem::AbortTransaction() {
+
+	if (transactionDepth == 0)
+		return;
+
+	// outer levels are closed by their commit or abort
+	transactionDepth--;
+	if (transactionAborted) {
+		transactionAborted = (transactionDepth > 0);
+		return;
+	}
+	transactionAborted = (transactionDepth > 0);
+
+	genFiles.GetStorage()->AbortTransaction();
+	genFiles.EndCounters();
+	genFiles.getCache().Clear();
+}
+
+Util::Error FileSystem::Flush() {
+	if (!genFiles.GetStorage())
+		return Util::Error::NoError;
+
+	Util::LatencyScope latency(Util::LatencyFile::Flush);
+	FileIOStatistic &ioStatistic = genFiles.getIOStatistic();
+	ioStatistic.StorageBegin(genFiles.GetStorage());
+	int res = genFiles.GetStorage()->Flush();
+	ioStatistic.StorageEnd(genFiles.GetStorage(), ioStatistic.GetOther());
+
+	if (res != 0) {
+		// storage dropped the writes
+		genFiles.getCache().Clear();
+		return Util::Error::FileWriteError;
+	}
+
+	return Util::Error::NoError;
+}
+
+Util::Error FileSystem::Idle() {
+	if (!genFiles.GetStorage() || transactionDepth > 0)
+		return Util::Error::NoError;
+
+	FileIOStatistic &ioStatistic = genFiles.getIOStatistic();
+	ioStatistic.StorageBegin(genFiles.GetStorage());
+	int res = genFiles.GetStorage()->Idle();
+	ioStatistic.StorageEnd(genFiles.GetStorage(), ioStatistic.GetOther());
+
+	if (res != 0)
+		return Util::Error::FileWriteError;
 
 	return Util::Error::NoError;
 }
@@ -406,12 +1046,25 @@ Util::Error FileSystem::DeleteFiles(AppID_t AppId) {
 Util::Error SettingsFileSystem::ReadFile(AppID_t AppId, KeyID_t FileID,
 		FileType FileType, bstr& data) {
 
+	if (FileID == VendorFileID::IOStatistic && FileType == FileType::File)
+		return fs.getGenFiles().getIOStatistic().Encode(data, fs.getGenFiles().getCache().GetStatistic());
+	if (FileID == VendorFileID::LatencyStatistic && FileType == FileType::File)
+		return Util::LatencyStatistic::GetLatencyStatistic().Encode(data);
+
 	return Util::Error::FileNotFound;
 }
 
 Util::Error SettingsFileSystem::WriteFile(AppID_t AppId, KeyID_t FileID,
 		FileType FileType, bstr& data, bool adminMode) {
 
+	// any write of the admin (PW3) resets the histograms
+	if (FileID == VendorFileID::LatencyStatistic && FileType == FileType::File) {
+		if (!adminMode)
+			return Util::Error::AccessDenied;
+		Util::LatencyStatistic::GetLatencyStatistic().Clear();
+		return Util::Error::NoError;
+	}
+
 	// PW status Bytes
 	if (FileID == 0xc4 && !(adminMode && data.length() == 7)) {
 		if ((data.length() != 1) && (data.length() != 4))
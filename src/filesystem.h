@@ -14,6 +14,8 @@
 #include <opgputil.h>
 #include <errors.h>
 #include <tlv.h>
+#include <array>
+#include "filestorage.h"
 
 namespace File {
 
@@ -37,6 +39,12 @@ enum SecureFileID {
 	AES              = 0xd5,
 };
 
+// vendor data objects
+enum VendorFileID {
+	IOStatistic = 0x0110, // per file I/O counters and the presence cache statistic. read only.
+	LatencyStatistic = 0x0111, // latency histograms. write in admin mode (PW3) resets them.
+};
+
 enum AppID {
 	All     = 0,
 	Test    = 1,
@@ -67,14 +75,174 @@ public:
 	Util::Error ReadFile(AppID_t AppId, KeyID_t FileID, FileType FileType, bstr &data);
 };
 
+struct FilePresenceStatistic {
+	uint32_t Hits;         // answered from cache
+	uint32_t NegativeHits; // part of hits that said "no file" and skipped the storage
+	uint32_t Misses;       // went to the storage
+
+	void Clear();
+	void Print();
+};
+
+// Presence cache of the generic file system. It is exact: an entry is filled by the
+// first storage lookup and then kept in sync by write and delete, so the default DOs
+// that were never written go straight to the config area.
+// Open addressing table, entries are never evicted. If it is full the new files just
+// are not cached.
+class FilePresenceCache {
+private:
+	static constexpr size_t CacheSize = 64;
+
+	enum class Presence : uint8_t {
+		Empty,   // slot is not used
+		Unknown, // slot belongs to file but the state is unknown (write error)
+		Present,
+		Absent
+	};
+
+	struct CacheEntry_t {
+		AppID_t AppId;
+		KeyID_t FileID;
+		uint8_t FileType;
+		Presence State;
+	};
+
+	std::array<CacheEntry_t, CacheSize> entries;
+	FilePresenceStatistic statistic;
+
+	CacheEntry_t *GetEntry(AppID_t AppId, KeyID_t FileID, FileType FileType, bool create);
+	void Set(AppID_t AppId, KeyID_t FileID, FileType FileType, Presence state);
+public:
+	FilePresenceCache();
+
+	// returns true if the answer is in the cache. `exist` is valid only in this case.
+	bool Lookup(AppID_t AppId, KeyID_t FileID, FileType FileType, bool &exist);
+	void SetPresent(AppID_t AppId, KeyID_t FileID, FileType FileType);
+	void SetAbsent(AppID_t AppId, KeyID_t FileID, FileType FileType);
+	void Invalidate(AppID_t AppId, KeyID_t FileID, FileType FileType);
+	// all the files of application were deleted
+	void SetAppAbsent(AppID_t AppId);
+	void Clear();
+
+	FilePresenceStatistic &GetStatistic() {
+		return statistic;
+	}
+};
+
+struct FileIOCounter {
+	AppID_t AppId;
+	KeyID_t FileID;
+	uint8_t FileType;
+
+	uint32_t Reads;
+	uint32_t Writes;            // writes and deletes
+	uint32_t BytesWritten;      // file data
+	uint32_t FlashWrites;       // storage I/O caused by the writes
+	uint32_t FlashBytesWritten;
+	uint32_t Erases;
+	uint32_t Optimizations;
+};
+
+// Per file I/O counters of the generic file system. Storage I/O between StorageBegin and
+// StorageEnd goes to the file that was written. I/O that is not bound to a file (transaction
+// begin/commit, delete of all the files) and the files that don't fit to the table go to
+// the entry with FileID 0.
+class FileIOStatistic {
+private:
+	static constexpr size_t MaxFiles = 32;
+	// DO: version, count, presence cache statistic and records of EncodedCounterSize bytes
+	static constexpr uint8_t EncodingVersion = 0x02;
+	static constexpr size_t EncodedPresenceSize = 12;
+	static constexpr size_t EncodedCounterSize = 28;
+
+	std::array<FileIOCounter, MaxFiles> files;
+	size_t count = 0;
+	FileIOCounter other;
+	StorageIOCounters start;
+
+	void EncodeCounter(FileIOCounter &counter, bstr &data);
+public:
+	FileIOStatistic();
+
+	FileIOCounter &GetCounter(AppID_t AppId, KeyID_t FileID, FileType FileType);
+	FileIOCounter &GetOther() {
+		return other;
+	}
+
+	void StorageBegin(FileStorage *storage);
+	void StorageEnd(FileStorage *storage, FileIOCounter &counter);
+
+	void Clear();
+	void Print();
+	// vendor DO `IOStatistic`
+	Util::Error Encode(bstr &data, FilePresenceStatistic &presence);
+};
+
+struct CounterFile_t;
+
 class GenericFileSystem {
 private:
+	FileStorage *storage = nullptr;
+	FilePresenceCache cache;
+	FileIOStatistic ioStatistic;
+
+	// counters are not in the storage transaction. their writes wait for the commit.
+	struct PendingCounter {
+		uint16_t ID;
+		uint32_t Value;
+		uint32_t OldValue;
+		bool HasOld;
+	};
+	static constexpr size_t MaxPendingCounters = 2;
+	std::array<PendingCounter, MaxPendingCounters> pendingCounters;
+	size_t pendingCount = 0;
+	bool counterTransaction = false;
+
+	// counter files as they are in the storage. a counter write compares the file part with it
+	// and doesn't read the file. kept only out of the transactions, so a rollback can't make it stale.
+	struct StoredCounterFile {
+		bool Valid;
+		uint8_t Length;  // 0 - no file or it doesn't fit
+		uint8_t Data[16];
+	};
+	static constexpr size_t MaxCounterFiles = 2;
+	std::array<StoredCounterFile, MaxCounterFiles> storedCounterFiles = {};
+
+	PendingCounter *FindPendingCounter(uint16_t id);
+	StoredCounterFile &GetStoredCounterFile(const CounterFile_t *cfile);
+	void SetStoredCounterFile(const CounterFile_t *cfile, uint8_t *data, size_t len);
+	int StoreCounterFile(const CounterFile_t *cfile, char *name, bstr &data);
+	void ReadCounter(const CounterFile_t *cfile, bstr &data);
+	int WriteCounterFile(const CounterFile_t *cfile, char *name, bstr &data);
 public:
+	void SetStorage(FileStorage *fileStorage);
+	FileStorage *GetStorage() {
+		return storage;
+	}
+
 	Util::Error SetFileName(AppID_t AppId, KeyID_t FileID, FileType FileType, char *name);
 
 	bool FileExist(AppID_t AppId, KeyID_t FileID, FileType FileType);
 	Util::Error ReadFile(AppID_t AppId, KeyID_t FileID, FileType FileType, bstr &data);
+	Util::Error ReadFileView(AppID_t AppId, KeyID_t FileID, FileType FileType, bstr &data);
 	Util::Error WriteFile(AppID_t AppId, KeyID_t FileID, FileType FileType, bstr &data);
+	Util::Error DeleteFile(AppID_t AppId, KeyID_t FileID, FileType FileType);
+	Util::Error DeleteFiles(AppID_t AppId);
+
+	// FileSystem transaction: counters are written before the storage commit and
+	// restored if it fails. End drops the pending ones.
+	void BeginCounters();
+	int CommitCounters();
+	void RestoreCounters();
+	void EndCounters();
+
+	FilePresenceCache &getCache() {
+		return cache;
+	}
+
+	FileIOStatistic &getIOStatistic() {
+		return ioStatistic;
+	}
 };
 
 class FileSystem {
@@ -82,16 +250,42 @@ private:
 	ConfigFileSystem cfgFiles;
 	GenericFileSystem genFiles;
 	SettingsFileSystem settingsFiles{*this};
+	int transactionDepth = 0;
+	// inner level was aborted, outer ones are not closed yet
+	bool transactionAborted = false;
 
 	bool isTagComposite(Util::tag_t tag);
 
 public:
 	Util::Error ReadFile(AppID_t AppId, KeyID_t FileID, FileType FileType, bstr &data);
+	// The same as ReadFile but if the storage is memory-mapped `data` points to the file there
+	// (read only and valid till the next write). Otherwise the file is copied to `data` buffer.
+	Util::Error ReadFileView(AppID_t AppId, KeyID_t FileID, FileType FileType, bstr &data);
 	Util::Error WriteFile(AppID_t AppId, KeyID_t FileID, FileType FileType, bstr &data, bool adminMode = false);
 
 	Util::Error DeleteFile(AppID_t AppId, KeyID_t FileID, FileType FileType);
 	Util::Error DeleteFiles(AppID_t AppId);
 
+	// Writes and deletes between begin and commit are applied by the storage at once.
+	// Transactions may be nested, the outer one works. Abort at any level rolls back all of them:
+	// till the outer level is closed writes fail and commits return FileWriteError.
+	Util::Error BeginTransaction();
+	Util::Error CommitTransaction();
+	void AbortTransaction();
+	bool isTransactionActive() {
+		return transactionDepth > 0;
+	}
+
+	// Writes of the command that the storage keeps in RAM go to the media. Called at the end of the command.
+	Util::Error Flush();
+
+	// Storage work that can wait: called by the device between the commands.
+	Util::Error Idle();
+
+	void SetStorage(FileStorage *fileStorage) {
+		genFiles.SetStorage(fileStorage);
+	}
+
 	ConfigFileSystem &getCfgFiles() {
 		return cfgFiles;
 	}
@@ -0,0 +1,160 @@
+/*
+  Copyright 2019 SoloKeys Developers
+
+  Licensed under the Apache License, Version 2.0, <LICENSE-APACHE or
+  http://apache.org/licenses/LICENSE-2.0> or the MIT license <LICENSE-MIT or
+  http://opensource.org/licenses/MIT>, at your option. This file may not be
+  copied, modified, or distributed except according to those terms.
+ */
+
+#include "latency.h"
+#include "opgpdevice.h"
+
+namespace Util {
+
+LatencyStatistic& LatencyStatistic::GetLatencyStatistic() {
+	static LatencyStatistic latencyStatistic;
+	return latencyStatistic;
+}
+
+void LatencyStatistic::SetClock(LatencyClock fnClock, uint32_t clockTicksPerUs) {
+	clock = fnClock;
+	ticksPerUs = MAX(clockTicksPerUs, 1U);
+}
+
+LatencyStatistic::Series* LatencyStatistic::FindSeries(LatencyKind kind, uint16_t code, bool create) {
+	for (size_t i = 0; i < count; i++)
+		if (series[i].Kind == kind && series[i].Code == code)
+			return &series[i];
+
+	if (!create || count >= series.size())
+		return nullptr;
+
+	Series &s = series[count++];
+	s.Kind = kind;
+	s.Code = code;
+	s.Counts.fill(0);
+	return &s;
+}
+
+size_t LatencyStatistic::Bucket(uint32_t us) {
+	if (us < 2)
+		return 0;
+
+	size_t bucket = 31 - __builtin_clz(us);
+	return MIN(bucket, Buckets - 1);
+}
+
+void LatencyStatistic::Add(LatencyKind kind, uint16_t code, uint64_t start) {
+	if (!clock)
+		return;
+
+	uint64_t us = (clock() - start) / ticksPerUs;
+	AddUs(kind, code, MIN(us, (uint64_t)UINT32_MAX));
+}
+
+void LatencyStatistic::AddUs(LatencyKind kind, uint16_t code, uint32_t us) {
+	Series *s = FindSeries(kind, code, true);
+	if (!s) {
+		if (overflows < 0xffff)
+			overflows++;
+		return;
+	}
+
+	uint16_t &counter = s->Counts[Bucket(us)];
+	if (counter < 0xffff)
+		counter++;
+}
+
+uint32_t LatencyStatistic::GetCount(LatencyKind kind, uint16_t code) {
+	Series *s = FindSeries(kind, code, false);
+	if (!s)
+		return 0;
+
+	uint32_t total = 0;
+	for (auto counter : s->Counts)
+		total += counter;
+	return total;
+}
+
+uint32_t LatencyStatistic::Percentile(LatencyKind kind, uint16_t code, uint8_t percent) {
+	Series *s = FindSeries(kind, code, false);
+	uint32_t total = GetCount(kind, code);
+	if (!s || total == 0)
+		return 0;
+
+	// rank of the measurement rounded up
+	uint32_t rank = (total * percent + 99) / 100;
+	uint32_t sum = 0;
+	for (size_t i = 0; i < Buckets; i++) {
+		sum += s->Counts[i];
+		if (sum >= MAX(rank, 1U))
+			return (i == Buckets - 1) ? UINT32_MAX : (2U << i) - 1;
+	}
+	return UINT32_MAX;
+}
+
+void LatencyStatistic::Clear() {
+	count = 0;
+	overflows = 0;
+}
+
+void LatencyStatistic::Print() {
+	printf_device("---- latency ----\n");
+	printf_device("kind code   count      p50 us      p99 us\n");
+	for (size_t i = 0; i < count; i++) {
+		Series &s = series[i];
+		printf_device("%4u %4x %7lu %11lu %11lu\n", (unsigned)s.Kind, s.Code,
+				(unsigned long)GetCount(s.Kind, s.Code),
+				(unsigned long)Percentile(s.Kind, s.Code, 50),
+				(unsigned long)Percentile(s.Kind, s.Code, 99));
+	}
+}
+
+size_t LatencyStatistic::EncodedSeriesSize(Series& s) {
+	size_t size = 4;
+	for (auto counter : s.Counts)
+		if (counter)
+			size += 3;
+	return size;
+}
+
+Util::Error LatencyStatistic::Encode(bstr& data) {
+	data.clear();
+	if (data.max_length() < 5)
+		return Util::Error::InternalError;
+
+	data.append(EncodingVersion);
+	data.append(Buckets);
+	data.append((uint8_t)0);
+	data.append(overflows >> 8);
+	data.append(overflows & 0xff);
+
+	// the series that don't fit to the buffer are skipped
+	uint8_t ecount = 0;
+	for (size_t i = 0; i < count; i++) {
+		Series &s = series[i];
+		if (data.free_space() < EncodedSeriesSize(s))
+			break;
+
+		size_t indx = data.length();
+		data.set_length(indx + 4);
+		data.set_uint_be(indx + 0, 1, static_cast<uint8_t>(s.Kind));
+		data.set_uint_be(indx + 1, 2, s.Code);
+		data.set_uint_be(indx + 3, 1, (EncodedSeriesSize(s) - 4) / 3);
+		for (size_t bucket = 0; bucket < Buckets; bucket++) {
+			if (s.Counts[bucket] == 0)
+				continue;
+			indx = data.length();
+			data.set_length(indx + 3);
+			data.set_uint_be(indx + 0, 1, bucket);
+			data.set_uint_be(indx + 1, 2, s.Counts[bucket]);
+		}
+		ecount++;
+	}
+	data.set_uint_be(2, 1, ecount);
+
+	return Util::Error::NoError;
+}
+
+} // namespace Util
@@ -0,0 +1,127 @@
+/*
+  Copyright 2019 SoloKeys Developers
+
+  Licensed under the Apache License, Version 2.0, <LICENSE-APACHE or
+  http://apache.org/licenses/LICENSE-2.0> or the MIT license <LICENSE-MIT or
+  http://opensource.org/licenses/MIT>, at your option. This file may not be
+  copied, modified, or distributed except according to those terms.
+ */
+
+#ifndef SRC_LATENCY_H_
+#define SRC_LATENCY_H_
+
+#include <opgputil.h>
+#include <errors.h>
+#include <array>
+
+namespace Util {
+
+enum class LatencyKind : uint8_t {
+	Command = 1, // APDUExecutor::Execute by INS
+	Process = 2, // APDUCommand::Process by INS
+	Crypto  = 3, // CryptoLib primitive by LatencyCrypto
+	File    = 4, // FileSystem I/O by LatencyFile
+};
+
+enum class LatencyCrypto : uint16_t {
+	Random      = 1,
+	AESEncrypt  = 2,
+	AESDecrypt  = 3,
+	RSAGenKey   = 4,
+	RSASign     = 5,
+	RSADecipher = 6,
+	RSAVerify   = 7,
+	ECCGenKey   = 8,
+	ECCSign     = 9,
+	ECCVerify   = 10,
+	ECDH        = 11,
+};
+
+enum class LatencyFile : uint16_t {
+	Read        = 1,
+	Write       = 2,
+	Delete      = 3,
+	DeleteAll   = 4,
+	Begin       = 5,
+	Commit      = 6,
+	Flush       = 7,
+};
+
+// free running clock of the device and its ticks in one microsecond
+using LatencyClock = uint64_t (*)();
+
+// Log histograms of the latencies. Bucket 0 is 0-1 us, bucket i is 2^i..2^(i+1)-1 us and
+// the last one takes all the longer ones. Counters stop at 0xffff. Nothing is counted till
+// the device sets the clock.
+class LatencyStatistic {
+private:
+	static constexpr size_t MaxSeries = 40;
+	static constexpr size_t Buckets = 24;
+	// DO: version, buckets, count and the series with the non-zero buckets only
+	static constexpr uint8_t EncodingVersion = 0x01;
+
+	struct Series {
+		LatencyKind Kind;
+		uint16_t Code;
+		std::array<uint16_t, Buckets> Counts;
+	};
+
+	std::array<Series, MaxSeries> series;
+	size_t count = 0;
+	// measurements that didn't get to the table
+	uint16_t overflows = 0;
+
+	LatencyClock clock = nullptr;
+	uint32_t ticksPerUs = 1;
+
+	Series *FindSeries(LatencyKind kind, uint16_t code, bool create);
+	size_t EncodedSeriesSize(Series &s);
+public:
+	static LatencyStatistic &GetLatencyStatistic();
+
+	void SetClock(LatencyClock fnClock, uint32_t clockTicksPerUs);
+	uint64_t Now() {
+		return clock ? clock() : 0;
+	}
+	bool isClockSet() {
+		return clock != nullptr;
+	}
+	uint32_t TicksPerUs() {
+		return ticksPerUs;
+	}
+
+	// time from start (Now) till now
+	void Add(LatencyKind kind, uint16_t code, uint64_t start);
+	void AddUs(LatencyKind kind, uint16_t code, uint32_t us);
+	static size_t Bucket(uint32_t us);
+
+	uint32_t GetCount(LatencyKind kind, uint16_t code);
+	// upper bound of the bucket with the percent of the measurements. us.
+	uint32_t Percentile(LatencyKind kind, uint16_t code, uint8_t percent);
+
+	void Clear();
+	void Print();
+	// vendor DO `LatencyStatistic`
+	Util::Error Encode(bstr &data);
+};
+
+// latency of the scope: one clock read at the start and one at the end
+class LatencyScope {
+private:
+	LatencyKind kind;
+	uint16_t code;
+	uint64_t start;
+public:
+	LatencyScope(LatencyKind latencyKind, uint16_t latencyCode) : kind(latencyKind), code(latencyCode) {
+		start = LatencyStatistic::GetLatencyStatistic().Now();
+	}
+	LatencyScope(LatencyCrypto primitive) : LatencyScope(LatencyKind::Crypto, static_cast<uint16_t>(primitive)) {}
+	LatencyScope(LatencyFile operation) : LatencyScope(LatencyKind::File, static_cast<uint16_t>(operation)) {}
+	~LatencyScope() {
+		LatencyStatistic::GetLatencyStatistic().Add(kind, code, start);
+	}
+};
+
+} // namespace Util
+
+#endif /* SRC_LATENCY_H_ */
@@ -33,11 +33,12 @@ int hwinit();
 int hwreboot();
 int hw_reset_fs_and_reboot(bool reboot);
 
-bool fileexist(char* name);
-int readfile(char* name, uint8_t * buf, size_t max_size, size_t *size);
-int writefile(char* name, uint8_t * buf, size_t size);
-int deletefile(char* name);
-int deletefiles(char* name);
+namespace File {
+class FileStorage;
+}
+
+// storage of the generic file system. hwinit selects it.
+File::FileStorage *hwfilestorage();
 
 int gen_random_device_callback(void *parameters, uint8_t *data, size_t size);
 int gen_random_device(uint8_t * data, size_t size);
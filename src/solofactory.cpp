@@ -8,6 +8,7 @@
  */
 
 #include "solofactory.h"
+#include "opgpdevice.h"
 
 namespace Factory {
 
@@ -36,6 +37,7 @@ Util::Error SoloFactory::Init() {
     apduExecutor = &sapduExecutor;
     cryptoEngine = &scryptoEngine;
     fileSystem = &sfileSystem;
+    fileSystem->SetStorage(hwfilestorage());
 
 	return Util::NoError;
 }
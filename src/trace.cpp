@@ -0,0 +1,101 @@
+/*
+  Copyright 2019 SoloKeys Developers
+
+  Licensed under the Apache License, Version 2.0, <LICENSE-APACHE or
+  http://apache.org/licenses/LICENSE-2.0> or the MIT license <LICENSE-MIT or
+  http://opensource.org/licenses/MIT>, at your option. This file may not be
+  copied, modified, or distributed except according to those terms.
+ */
+
+#include "trace.h"
+
+#ifdef OPGP_TRACE
+
+#include "latency.h"
+
+namespace Util {
+
+Tracer& Tracer::GetTracer() {
+	static Tracer tracer;
+	return tracer;
+}
+
+void Tracer::Add(std::string_view name, uint64_t start, uint32_t arg, bool hasArg) {
+	LatencyStatistic &latency = LatencyStatistic::GetLatencyStatistic();
+	if (!latency.isClockSet())
+		return;
+
+	// full buffer: the oldest event is overwritten
+	events[(head + count) % events.size()] = {name, start, latency.Now(), arg, hasArg};
+	if (count < events.size()) {
+		count++;
+	} else {
+		head = (head + 1) % events.size();
+		dropped++;
+	}
+}
+
+void Tracer::Clear() {
+	head = 0;
+	count = 0;
+	dropped = 0;
+}
+
+bool Tracer::Open(const char* fileName) {
+	Close();
+	output = fopen(fileName, "w");
+	if (!output)
+		return false;
+
+	fprintf(output, "[\n");
+	fflush(output);
+	return true;
+}
+
+void Tracer::Close() {
+	if (!output)
+		return;
+
+	Drain();
+	fclose(output);
+	output = nullptr;
+}
+
+void Tracer::Drain() {
+	if (!output)
+		return;
+
+	WriteEvents(output);
+	fflush(output);
+	head = 0;
+	count = 0;
+}
+
+// spans end in the order children first. the viewer nests them by the time.
+void Tracer::WriteEvents(FILE* f) {
+	double ticksPerUs = LatencyStatistic::GetLatencyStatistic().TicksPerUs();
+	for (size_t i = 0; i < count; i++) {
+		TraceEvent &e = events[(head + i) % events.size()];
+		fprintf(f, "{\"name\":\"%.*s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f",
+				(int)e.Name.size(), e.Name.data(), e.Start / ticksPerUs, (e.End - e.Start) / ticksPerUs);
+		if (e.HasArg)
+			fprintf(f, ",\"args\":{\"arg\":\"0x%02x\"}", (unsigned)e.Arg);
+		fprintf(f, "},\n");
+	}
+}
+
+TraceSpan::TraceSpan(std::string_view spanName) : name(spanName), arg(0), hasArg(false) {
+	start = LatencyStatistic::GetLatencyStatistic().Now();
+}
+
+TraceSpan::TraceSpan(std::string_view spanName, uint32_t spanArg) : name(spanName), arg(spanArg), hasArg(true) {
+	start = LatencyStatistic::GetLatencyStatistic().Now();
+}
+
+TraceSpan::~TraceSpan() {
+	Tracer::GetTracer().Add(name, start, arg, hasArg);
+}
+
+} // namespace Util
+
+#endif
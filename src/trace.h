@@ -0,0 +1,93 @@
+/*
+  Copyright 2019 SoloKeys Developers
+
+  Licensed under the Apache License, Version 2.0, <LICENSE-APACHE or
+  http://apache.org/licenses/LICENSE-2.0> or the MIT license <LICENSE-MIT or
+  http://opensource.org/licenses/MIT>, at your option. This file may not be
+  copied, modified, or distributed except according to those terms.
+ */
+
+#ifndef SRC_TRACE_H_
+#define SRC_TRACE_H_
+
+// Nested span tracing: TRACE_SPAN("name") times the rest of the scope. Spans are built in
+// with OPGP_TRACE (pc build). Without it the macros are empty.
+
+#ifdef OPGP_TRACE
+
+#include <cstdint>
+#include <cstdio>
+#include <array>
+#include <string_view>
+
+namespace Util {
+
+struct TraceEvent {
+	std::string_view Name;
+	uint64_t Start;      // ticks of the latency clock
+	uint64_t End;
+	uint32_t Arg;
+	bool HasArg;
+};
+
+// Ring buffer of the finished spans. The oldest ones are overwritten. Spans use the clock
+// of LatencyStatistic and are not recorded till the device sets it.
+class Tracer {
+private:
+	static constexpr size_t MaxEvents = 1024;
+
+	std::array<TraceEvent, MaxEvents> events;
+	size_t head = 0;
+	size_t count = 0;
+	uint32_t dropped = 0;
+	FILE *output = nullptr;
+public:
+	static Tracer &GetTracer();
+
+	void Add(std::string_view name, uint64_t start, uint32_t arg, bool hasArg);
+	size_t Count() {
+		return count;
+	}
+	// events overwritten before they were written
+	uint32_t Dropped() {
+		return dropped;
+	}
+	void Clear();
+
+	// Chrome trace-event JSON (chrome://tracing, Perfetto). the closing ] is optional
+	// in this format, so the events are appended to the file after every command.
+	bool Open(const char *fileName);
+	void Close();
+	// writes the buffered events to the file and clears the buffer
+	void Drain();
+	void WriteEvents(FILE *f);
+};
+
+class TraceSpan {
+private:
+	std::string_view name;
+	uint64_t start;
+	uint32_t arg;
+	bool hasArg;
+public:
+	TraceSpan(std::string_view spanName);
+	TraceSpan(std::string_view spanName, uint32_t spanArg);
+	~TraceSpan();
+};
+
+} // namespace Util
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(name) Util::TraceSpan TRACE_CONCAT(_traceSpan, __LINE__)(name)
+// span with a number, like INS of the command
+#define TRACE_SPAN_ARG(name, arg) Util::TraceSpan TRACE_CONCAT(_traceSpan, __LINE__)(name, arg)
+
+#else
+
+#define TRACE_SPAN(name) do {} while (0)
+#define TRACE_SPAN_ARG(name, arg) do {} while (0)
+
+#endif
+
+#endif /* SRC_TRACE_H_ */
@@ -10,6 +10,7 @@
 #include "openpgplib.h"
 #include "opgpdevice.h"
 #include "solofactory.h"
+#include "latency.h"
 #include "applications/apduconst.h"
 
 #include "device.h"
@@ -43,6 +44,15 @@ void OpenpgpExchange(uint8_t *datain, size_t datainlen, uint8_t *dataout, uint32
     return;
 }
 
+void OpenpgpIdle() {
+    if (fexecutor == nullptr)
+        return;
+
+    // the latency clock counts the wraps of the cycle counter when it is read
+    Util::LatencyStatistic::GetLatencyStatistic().Now();
+    Factory::SoloFactory::GetSoloFactory().GetFileSystem().Idle();
+}
+
 void OpenpgpInit() {
     printf_device("-------- INIT --------\n");
 
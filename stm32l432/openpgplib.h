@@ -20,6 +20,10 @@ extern "C" {
     
 	void OpenpgpInit();
 	void OpenpgpExchange(uint8_t *datain, size_t datainlen, uint8_t *dataout, uint32_t *outlen);
+	// storage work between the commands, one erase or optimization step per call.
+	// the firmware main loop (not in this tree) calls it when no APDU is pending, like
+	// pc/main.cpp does when ccid_recv gets nothing. not from the USB interrupt.
+	void OpenpgpIdle();
 
 #ifdef __cplusplus
 }
@@ -17,28 +17,46 @@
 #include "flash.h"
 #include "memory_layout.h"
 #include "device.h"
+#include "stm32l4xx.h"
 #include "util.h"
 #include "opgputil.h"
+#include "latency.h"
 
 #include "stm32fs.h"
+#include "filestorage.h"
 #include "uECC.h"
 #include "bearssl.h"
 
 static Stm32fs *fs = nullptr;
 
+// device shows optimization with LED
+class DeviceFileStorage : public File::Stm32fsFileStorage {
+protected:
+    virtual void OptimizationStart() {
+        device_led(COLOR_RED);
+    };
+    virtual void OptimizationEnd(bool result) {
+        device_led(COLOR_GREEN);
+    };
+};
+
+static DeviceFileStorage storage;
+
 void sprintfs();
 
 void OPTIMIZATION_O2 hw_stm32fs_init() {
     static Stm32fsConfig_t cfg;
     cfg.BaseBlockAddress = 0;
     cfg.SectorSize = PAGE_SIZE;
-    cfg.Blocks = {{{OPENPGP_START_PAGE}, {OPENPGP_START_PAGE + 1, OPENPGP_START_PAGE + 2, OPENPGP_START_PAGE + 3}}};
-    cfg.fnEraseFlashBlock = [](uint8_t blockNo){flash_erase_page(blockNo);return true;};
-    cfg.fnWriteFlash = [](uint32_t address, uint8_t *data, size_t len){printf("--write flash\n");flash_write(address, data, len);return true;};
+    // the same layout runs on the pc with --layout=device
+    Stm32fsLayoutDevice(cfg, OPENPGP_START_PAGE, OPENPGP_END_PAGE - OPENPGP_START_PAGE + 1);
+    cfg.fnEraseFlashBlock = [](uint16_t blockNo){flash_erase_page(blockNo);return true;};
+    cfg.fnWriteFlash = [](uint32_t address, uint8_t *data, size_t len){flash_write(address, data, len);return true;};
     cfg.fnReadFlash = [](uint32_t address, uint8_t *data, size_t len){memcpy(data, (uint8_t *)address, len);return true;};
 
     static Stm32fs xfs = Stm32fs(cfg);
     fs = &xfs;
+    storage.SetFs(fs);
 
     if (fs->isValid()) {
         sprintfs();
@@ -48,66 +66,39 @@ void OPTIMIZATION_O2 hw_stm32fs_init() {
     }
 
     // check if it needs to call optimize...
-    Stm32fsStatistic stat = fs->GetStatistic();
-    stat.Print();
-    if (stat.OptimizationNeeded()) {
-        device_led(COLOR_RED);
-        bool res = fs->Optimize();
-        printf_device("stm32fs optimization %s\n", res ? "OK" : "ERROR");
-        device_led(COLOR_GREEN);
-    }
+    storage.OptimizeIfNeeded();
 }
 
-int hwinit() {
-    //hw_reset_fs_and_reboot(false);  // fully erase fs...
-    hw_stm32fs_init();
-
-	return 0;
-}
-
-bool fileexist(char* name) {
-    if (!fs)
-        return false;
+// DWT cycle counter extended to 64 bits. it wraps in 53 s at 80 MHz, so the latency clock
+// has to be read at least once in this time: every command and the idle loop do it.
+static uint64_t hw_latency_clock() {
+    static uint32_t last = 0;
+    static uint64_t high = 0;
 
-    return fs->FileExist(std::string_view(name));
+    uint32_t cycles = DWT->CYCCNT;
+    if (cycles < last)
+        high += 1ULL << 32;
+    last = cycles;
+    return high | cycles;
 }
 
-int OPTIMIZATION_O2 readfile(char* name, uint8_t * buf, size_t max_size, size_t *size) {
-    if (!fs) {
-        printf_device("__error read %s %d\n", name, max_size);
-        return 1;
-    }
-    if (fs->GetCurrentFsBlockSerial() == 0) printf_device("ERROR CurrentFs!\n");
-
-    return fs->ReadFile(std::string_view(name), buf, size, max_size) ? 0 : 1;
+static void hw_latency_init() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    Util::LatencyStatistic::GetLatencyStatistic().SetClock(hw_latency_clock, SystemCoreClock / 1000000);
 }
 
-int OPTIMIZATION_O2 writefile(char* name, uint8_t * buf, size_t size) {
-    if (!fs)
-        return 1;
-    if (fs->GetCurrentFsBlockSerial() == 0) printf_device("ERROR CurrentFs!\n");
-
-    bool res = fs->WriteFile(std::string_view(name), buf, size);
-
-    // maybe we need to optimize
-    if (!res && fs->isNeedsOptimization()) {
-        device_led(COLOR_RED);
-        res = fs->Optimize();
-        printf_device("stm32fs write optimization %s\n", res ? "OK" : "ERROR");
-        device_led(COLOR_GREEN);
+int hwinit() {
+    hw_latency_init();
+    //hw_reset_fs_and_reboot(false);  // fully erase fs...
+    hw_stm32fs_init();
 
-        // try again
-        if (res && fs->GetFreeMemory() >= size && fs->GetFreeFileDescriptors() > 0)
-            res = fs->WriteFile(std::string_view(name), buf, size);
-    }
-    return res ? 0 : 1;
+	return 0;
 }
 
-int deletefile(char* name) {
-    if (!fs)
-        return 1;
-
-    return fs->DeleteFile(std::string_view(name)) ? 0 : 1;
+File::FileStorage *hwfilestorage() {
+    return &storage;
 }
 
 void sprintfs() {
@@ -126,13 +117,6 @@ void sprintfs() {
 	return;
 }
 
-int deletefiles(char* name_filter) {
-    if (!fs)
-        return 1;
-
-    return fs->DeleteFiles(std::string_view(name_filter)) ? 0 : 1;
-}
-
 int hw_reset_fs_and_reboot(bool reboot) {
     for (uint8_t page = OPENPGP_START_PAGE; page <= OPENPGP_END_PAGE; page++)
         flash_erase_page(page);
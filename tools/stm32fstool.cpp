@@ -0,0 +1,626 @@
+/*
+  Copyright 2019 SoloKeys Developers
+
+  Licensed under the Apache License, Version 2.0, <LICENSE-APACHE or
+  http://apache.org/licenses/LICENSE-2.0> or the MIT license <LICENSE-MIT or
+  http://opensource.org/licenses/MIT>, at your option. This file may not be
+  copied, modified, or distributed except according to those terms.
+ */
+
+// offline tool for the stm32fs flash images: dumps from the devices and images of the pc build.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "stm32fs.h"
+
+struct Layout {
+    const char *Name;
+    const char *Description;
+    bool (*fnLayout)(Stm32fsConfig_t &cfg, uint16_t first, size_t sectors);
+};
+
+// the same layouts as the device and the pc build use. sector numbers from the start of the image.
+static const Layout Layouts[] = {
+    {"pc", "image of the pc build: 2 blocks, counters in sectors 10 and 11", Stm32fsLayoutPC},
+    {"device", "OpenPGP pages of the device from the first one: 1 block, counters in sectors 4 and 5",
+     Stm32fsLayoutDevice},
+};
+
+// flash image in RAM. it goes back to the file only after the commands that change the files.
+struct Image {
+    std::vector<uint8_t> mem;
+    size_t sectorSize = BlockSize;
+    Stm32fsConfig_t cfg = {};
+    uint32_t writes = 0;
+    uint32_t erases = 0;
+};
+
+static void Usage() {
+    printf("usage: stm32fstool [--layout=pc|device] [--sector=<bytes>] <image> <command> [args]\n");
+    printf("commands:\n");
+    printf("  ls                       files in force\n");
+    printf("  versions [file]          catalog records of all the files or of one\n");
+    printf("  stat                     descriptors and data usage\n");
+    printf("  fsck                     validate the catalog. exit code 1 if it has errors\n");
+    printf("  optimize                 compact the fs and write the image back\n");
+    printf("  export <file> <out>      copy the file out of the image\n");
+    printf("  import <file> <in>       write the file into the image and write the image back\n");
+    printf("  replay <rounds> [workload]\n");
+    printf("                           run the writes on the copy of the image and print the fragmentation.\n");
+    printf("                           workload lines: write <file> <size>, delete <file>, begin, commit.\n");
+    printf("                           without it every file of the image is rewritten once per round.\n");
+    printf("layouts:\n");
+    for (auto &layout : Layouts)
+        printf("  %-8s %s\n", layout.Name, layout.Description);
+}
+
+static bool LoadFile(const char *fileName, std::vector<uint8_t> &data) {
+    FILE *f = fopen(fileName, "rb");
+    if (f == nullptr)
+        return false;
+
+    data.clear();
+    uint8_t buf[4096];
+    size_t len = 0;
+    while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.insert(data.end(), buf, buf + len);
+    fclose(f);
+    return true;
+}
+
+static bool SaveFile(const char *fileName, uint8_t *data, size_t length) {
+    FILE *f = fopen(fileName, "wb");
+    if (f == nullptr)
+        return false;
+
+    size_t len = fwrite(data, 1, length, f);
+    fclose(f);
+    return len == length;
+}
+
+static bool InitImage(Image &img, const Layout &layout) {
+    size_t sectors = img.mem.size() / img.sectorSize;
+    if (img.mem.size() % img.sectorSize != 0) {
+        printf("image size %zu is not a multiple of the sector size %zu\n", img.mem.size(), img.sectorSize);
+        return false;
+    }
+
+    // dump without the counter pages has no counters
+    if (!layout.fnLayout(img.cfg, 0, sectors)) {
+        printf("image has %zu sectors. it is too small for layout `%s`\n", sectors, layout.Name);
+        return false;
+    }
+
+    img.cfg.BaseBlockAddress = (size_t)img.mem.data();
+    img.cfg.SectorSize = img.sectorSize;
+    img.cfg.fnEraseFlashBlock = [&img](uint16_t sector) {
+        if ((sector + 1) * img.sectorSize > img.mem.size())
+            return false;
+        img.erases++;
+        memset(&img.mem[sector * img.sectorSize], 0xff, img.sectorSize);
+        return true;
+    };
+    img.cfg.fnWriteFlash = [&img](uint32_t address, uint8_t *data, size_t len) {
+        if (address + len > img.mem.size())
+            return false;
+        img.writes++;
+        memcpy(&img.mem[address], data, len);
+        return true;
+    };
+    img.cfg.fnReadFlash = [&img](uint32_t address, uint8_t *data, size_t len) {
+        if (address + len > img.mem.size())
+            return false;
+        memcpy(data, &img.mem[address], len);
+        return true;
+    };
+    return true;
+}
+
+static std::string FileName(Stm32FSFileHeader &header) {
+    return std::string(header.FileName, strnlen(header.FileName, FileNameMaxLen));
+}
+
+// versions in force by file ID
+static std::map<uint16_t, Stm32File_t> FilesInForce(Stm32fs &fs) {
+    std::map<uint16_t, Stm32File_t> files;
+    Stm32File_t srec;
+    Stm32File_t *rc = fs.FindFirst("*", &srec);
+    while (rc != nullptr) {
+        files[rc->FileID] = *rc;
+        files[rc->FileID].FileName = std::string_view(files[rc->FileID].FileNameChr, rc->FileName.size());
+        rc = fs.FindNext(rc);
+    }
+    return files;
+}
+
+static int CmdList(Stm32fs &fs) {
+    auto files = FilesInForce(fs);
+    printf("%-13s %5s %8s %10s\n", "name", "id", "size", "address");
+    uint32_t total = 0;
+    for (auto &it : files) {
+        Stm32File_t &file = it.second;
+        printf("%-13.*s %5u %8u 0x%08x\n", (int)file.FileName.size(), file.FileName.data(),
+               file.FileID, file.FileSize, file.FileAddress);
+        total += file.FileSize;
+    }
+    printf("%zu files, %u bytes\n", files.size(), total);
+    return 0;
+}
+
+static int CmdVersions(Stm32fs &fs, const char *fileName) {
+    auto files = FilesInForce(fs);
+    uint16_t fileID = 0;
+    std::map<uint16_t, std::string> names;
+    fs.ReadCatalog([&](Stm32FSFileRecord &rec, uint32_t) {
+        if (rec.header.FileState == fsFileHeader) {
+            names[rec.header.FileID] = FileName(rec.header);
+            if (fileName != nullptr && names[rec.header.FileID] == fileName)
+                fileID = rec.header.FileID;
+        }
+        return true;
+    });
+    if (fileName != nullptr && fileID == 0) {
+        printf("file `%s` not found\n", fileName);
+        return 1;
+    }
+
+    fs.ReadCatalog([&](Stm32FSFileRecord &rec, uint32_t addr) {
+        uint8_t state = rec.header.FileState;
+        bool fileRecord = (state == fsFileHeader || state == fsFileVersion || state == fsFileInline || state == fsDeleted);
+        if (fileID != 0 && (!fileRecord || rec.header.FileID != fileID))
+            return true;
+
+        auto file = files.find(rec.header.FileID);
+        bool inForce = false;
+        printf("0x%08x ", addr);
+        switch (state) {
+        case fsFileHeader:
+            printf("header     %5u %s\n", rec.header.FileID, FileName(rec.header).c_str());
+            return true;
+        case fsFileVersion:
+            inForce = (file != files.end() && file->second.FileAddress == rec.version.FileAddress);
+            printf("version    %5u %-13s size %u at 0x%08x", rec.version.FileID, names[rec.version.FileID].c_str(),
+                   rec.version.FileSize, rec.version.FileAddress);
+            break;
+        case fsFileInline:
+            inForce = (file != files.end() && file->second.FileAddress == addr + offsetof(Stm32FSFileInline, Data));
+            printf("inline     %5u %-13s size %u", rec.inlineVersion.FileID, names[rec.inlineVersion.FileID].c_str(),
+                   rec.inlineVersion.FileSize);
+            break;
+        case fsDeleted:
+            printf("deleted    %5u %s", rec.version.FileID, names[rec.version.FileID].c_str());
+            break;
+        case fsTxBegin:
+            printf("tx begin         %u records\n", rec.transaction.RecordCount);
+            return true;
+        case fsTxCommit:
+            printf("tx commit        %u records\n", rec.transaction.RecordCount);
+            return true;
+        case fsCheckpoint:
+            printf("checkpoint       %u entries at 0x%08x, next id %u\n", rec.checkpoint.EntryCount,
+                   rec.checkpoint.Address, rec.checkpoint.NextFileID);
+            return true;
+        case fsDeletePrefix:
+            printf("delete prefix    %.*s*\n", rec.deletePrefix.PrefixLength, rec.deletePrefix.Prefix);
+            return true;
+        default:
+            printf("unknown 0x%02x\n", state);
+            return true;
+        }
+        printf("%s%s\n", (rec.version.Flags & fvTransaction) ? " tx" : "", inForce ? " *" : "");
+        return true;
+    });
+    return 0;
+}
+
+static void PrintStatistic(Stm32fs &fs) {
+    printf("fs block serial %u, %zu files\n", fs.GetCurrentFsBlockSerial(), FilesInForce(fs).size());
+    Stm32fsStatistic stat = fs.GetStatistic();
+    stat.Print();
+    printf("optimization %s\n", stat.OptimizationNeeded() ? "needed" : "not needed");
+}
+
+static int CmdStat(Stm32fs &fs) {
+    PrintStatistic(fs);
+    if (fs.isCountersEnabled())
+        printf("counters are on\n");
+    return 0;
+}
+
+static int errors = 0;
+static int warnings = 0;
+
+static void FsckError(uint32_t addr, const char *msg, uint32_t val = 0) {
+    errors++;
+    printf("error   0x%08x: %s %u\n", addr, msg, val);
+}
+
+static void FsckWarning(uint32_t addr, const char *msg, uint32_t val = 0) {
+    warnings++;
+    printf("warning 0x%08x: %s %u\n", addr, msg, val);
+}
+
+static bool SameStatistic(Stm32fsStatistic a, Stm32fsStatistic b) {
+    return a.HeaderFreeDescriptors == b.HeaderFreeDescriptors &&
+           a.HeaderSystemDescriptors == b.HeaderSystemDescriptors &&
+           a.HeaderFileDescriptors == b.HeaderFileDescriptors &&
+           a.HeaderVersionDescriptors == b.HeaderVersionDescriptors &&
+           a.HeaderDeletedFileDescriptors == b.HeaderDeletedFileDescriptors &&
+           a.HeaderDeletedVersionDescriptors == b.HeaderDeletedVersionDescriptors &&
+           a.DataOccupiedSize == b.DataOccupiedSize &&
+           a.DataDeletedSize == b.DataDeletedSize;
+}
+
+static int CmdFsck(Image &img, Stm32fs &fs) {
+    Stm32fsConfigBlock_t *block = fs.GetCurrentFsBlock();
+    Stm32fsFlash &flash = fs.GetFlash();
+    uint32_t dataStart = flash.GetBlockAddress(block->DataSectors[0]);
+    uint32_t dataEnd = dataStart + block->DataSectors.size() * img.sectorSize;
+    auto inData = [&](uint32_t addr, size_t len) {
+        return addr >= dataStart && addr + len <= dataEnd;
+    };
+
+    std::set<uint16_t> ids;
+    std::set<std::string> names;
+    uint16_t maxID = 0;
+    uint32_t records = 0;
+    uint32_t txAddr = 0;
+    uint32_t txCount = 0;
+    uint32_t txRecords = 0;
+    fs.ReadCatalog([&](Stm32FSFileRecord &rec, uint32_t addr) {
+        records++;
+        uint8_t state = rec.header.FileState;
+        bool version = (state == fsFileVersion || state == fsFileInline || state == fsDeleted);
+
+        // group without commit is dropped by the mount
+        if (txAddr != 0 && !version && state != fsTxCommit) {
+            FsckWarning(txAddr, "transaction without commit, records:", txRecords);
+            txAddr = 0;
+        }
+
+        switch (state) {
+        case fsFileHeader: {
+            std::string name = FileName(rec.header);
+            if (rec.header.FileID == 0 || ids.count(rec.header.FileID))
+                FsckError(addr, "wrong or duplicate file id", rec.header.FileID);
+            if (name.empty() || names.count(name))
+                FsckError(addr, "empty or duplicate file name of id", rec.header.FileID);
+            ids.insert(rec.header.FileID);
+            names.insert(name);
+            maxID = std::max(maxID, rec.header.FileID);
+            break;
+        }
+        case fsFileVersion:
+            if (!inData(rec.version.FileAddress, rec.version.FileSize))
+                FsckError(addr, "data out of the data area, size", rec.version.FileSize);
+            break;
+        case fsFileInline:
+            if (rec.inlineVersion.FileSize > InlineMaxSize)
+                FsckError(addr, "inline file is too big", rec.inlineVersion.FileSize);
+            break;
+        case fsDeleted:
+            break;
+        case fsTxBegin:
+            if (rec.transaction.RecordCount == 0 || rec.transaction.RecordCount > TxMaxRecords)
+                FsckError(addr, "wrong transaction size", rec.transaction.RecordCount);
+            txAddr = addr;
+            txCount = rec.transaction.RecordCount;
+            txRecords = 0;
+            break;
+        case fsTxCommit:
+            if (txAddr == 0)
+                FsckError(addr, "commit without the transaction begin");
+            else if (rec.transaction.RecordCount != txCount || txRecords != txCount)
+                FsckError(addr, "commit doesn't match the transaction records", txRecords);
+            txAddr = 0;
+            break;
+        case fsCheckpoint:
+            if (!inData(rec.checkpoint.Address, (rec.checkpoint.EntryCount + 1) * sizeof(Stm32fsIndexEntry)))
+                FsckError(addr, "checkpoint entries out of the data area", rec.checkpoint.EntryCount);
+            if (rec.checkpoint.EntryCount != ids.size())
+                FsckError(addr, "checkpoint entries don't match the files", rec.checkpoint.EntryCount);
+            if (rec.checkpoint.NextFileID <= maxID)
+                FsckError(addr, "checkpoint next file id is used", rec.checkpoint.NextFileID);
+            break;
+        case fsDeletePrefix:
+            if (rec.deletePrefix.PrefixLength > sizeof(rec.deletePrefix.Prefix))
+                FsckError(addr, "delete prefix is too long", rec.deletePrefix.PrefixLength);
+            break;
+        default:
+            FsckError(addr, "unknown record state", state);
+        }
+
+        if (version) {
+            if (!ids.count(rec.version.FileID))
+                FsckError(addr, "version of unknown file id", rec.version.FileID);
+            if ((txAddr != 0) != ((rec.version.Flags & fvTransaction) != 0))
+                FsckError(addr, "transaction flag doesn't match the group, id", rec.version.FileID);
+            if (txAddr != 0)
+                txRecords++;
+        }
+        return true;
+    });
+    if (txAddr != 0)
+        FsckWarning(txAddr, "power loss before the commit, records:", txRecords);
+
+    // catalog ends with the first empty record. the rest must be erased.
+    uint32_t recno = 0;
+    for (size_t i = 0; i < block->HeaderSectors.size(); i++) {
+        uint32_t start = flash.GetBlockAddress(block->HeaderSectors[i]);
+        for (uint32_t addr = start + ((i == 0) ? sizeof(Stm32FSHeader_t) : 0); addr < start + img.sectorSize; addr += 16) {
+            if (recno++ < records)
+                continue;
+            if (std::any_of(&img.mem[addr], &img.mem[addr + 16], [](uint8_t b){return b != 0xff;}))
+                FsckError(addr, "written record after the catalog end");
+        }
+    }
+
+    // data of the files in force doesn't overlap
+    auto files = FilesInForce(fs);
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    for (auto &it : files)
+        if (inData(it.second.FileAddress, 0))
+            ranges.push_back({it.second.FileAddress, it.second.FileAddress + it.second.FileSize});
+    std::sort(ranges.begin(), ranges.end());
+    for (size_t i = 1; i < ranges.size(); i++)
+        if (ranges[i].first < ranges[i - 1].second)
+            FsckError(ranges[i].first, "data of the files overlap, size", ranges[i].second - ranges[i].first);
+
+    // index from the checkpoint and the counted statistic are the same as the full scan
+    Stm32fs scan{img.cfg};
+    scan.EnableIndex(false);
+    auto scanFiles = FilesInForce(scan);
+    if (scanFiles.size() != files.size())
+        FsckError(0, "index and catalog scan have different file count", scanFiles.size());
+    for (auto &it : scanFiles) {
+        auto file = files.find(it.first);
+        if (file == files.end() || file->second.FileAddress != it.second.FileAddress ||
+            file->second.FileSize != it.second.FileSize)
+            FsckError(it.second.HeaderAddress, "index doesn't match the catalog for id", it.first);
+    }
+    if (!SameStatistic(fs.GetStatistic(), scan.GetStatistic()))
+        FsckError(0, "statistic doesn't match the catalog scan");
+
+    printf("%u records, %zu files: %d errors, %d warnings\n", records, files.size(), errors, warnings);
+    return errors ? 1 : 0;
+}
+
+static int CmdOptimize(Stm32fs &fs) {
+    PrintStatistic(fs);
+    if (!fs.Optimize()) {
+        printf("optimization error\n");
+        return 1;
+    }
+    PrintStatistic(fs);
+    return 0;
+}
+
+static int CmdExport(Stm32fs &fs, const char *fileName, const char *outName) {
+    int length = fs.FileLength(fileName);
+    if (length < 0) {
+        printf("file `%s` not found\n", fileName);
+        return 1;
+    }
+
+    std::vector<uint8_t> data(length + 1);
+    size_t len = 0;
+    if (!fs.ReadFile(fileName, data.data(), &len, data.size()) || !SaveFile(outName, data.data(), len)) {
+        printf("export error\n");
+        return 1;
+    }
+    printf("%s: %zu bytes\n", fileName, len);
+    return 0;
+}
+
+static bool WriteWithOptimize(Stm32fs &fs, const std::string &fileName, uint8_t *data, size_t length, uint32_t &optimizations) {
+    if (fs.WriteFile(fileName, data, length))
+        return true;
+    if (!fs.isNeedsOptimization() || !fs.Optimize())
+        return false;
+
+    optimizations++;
+    return fs.WriteFile(fileName, data, length);
+}
+
+static int CmdImport(Stm32fs &fs, const char *fileName, const char *inName) {
+    std::vector<uint8_t> data;
+    if (strlen(fileName) == 0 || strlen(fileName) > FileNameMaxLen || !LoadFile(inName, data)) {
+        printf("wrong file name or input file\n");
+        return 1;
+    }
+
+    uint32_t optimizations = 0;
+    if (!WriteWithOptimize(fs, fileName, data.data(), data.size(), optimizations)) {
+        printf("import error\n");
+        return 1;
+    }
+    printf("%s: %zu bytes, %u optimizations\n", fileName, data.size(), optimizations);
+    return 0;
+}
+
+struct WorkloadOp {
+    std::string Op;
+    std::string FileName;
+    size_t Size;
+};
+
+static bool LoadWorkload(const char *fileName, std::vector<WorkloadOp> &ops) {
+    FILE *f = fopen(fileName, "r");
+    if (f == nullptr)
+        return false;
+
+    char line[256];
+    bool res = true;
+    while (fgets(line, sizeof(line), f)) {
+        char op[32] = {0};
+        char name[64] = {0};
+        unsigned long size = 0;
+        int n = sscanf(line, "%31s %63s %lu", op, name, &size);
+        if (n <= 0 || op[0] == '#')
+            continue;
+
+        std::string sop = op;
+        if ((sop == "write" && n == 3) || (sop == "delete" && n == 2) || sop == "begin" || sop == "commit") {
+            ops.push_back({sop, name, size});
+        } else {
+            printf("wrong workload line: %s", line);
+            res = false;
+        }
+    }
+    fclose(f);
+    return res;
+}
+
+// fragmentation: part of the used descriptors and data that is taken by the old versions
+static void PrintRound(int round, Stm32fs &fs, Image &img, uint32_t optimizations) {
+    Stm32fsStatistic stat = fs.GetStatistic();
+    size_t deletedDesc = stat.HeaderDeletedFileDescriptors + stat.HeaderDeletedVersionDescriptors;
+    size_t usedDesc = stat.HeaderSize / 16 - stat.HeaderFreeDescriptors;
+    size_t usedData = stat.DataOccupiedSize + stat.DataDeletedSize;
+    printf("%6d %8zu %5.1f%% %8zu %5.1f%% %6u %7u %7u\n", round,
+           stat.DataFreeSize, usedData ? 100.0 * stat.DataDeletedSize / usedData : 0.0,
+           stat.HeaderFreeDescriptors, usedDesc ? 100.0 * deletedDesc / usedDesc : 0.0,
+           optimizations, img.writes, img.erases);
+}
+
+static int CmdReplay(Image &img, Stm32fs &fs, int rounds, const char *workloadName) {
+    std::vector<WorkloadOp> ops;
+    if (workloadName != nullptr) {
+        if (!LoadWorkload(workloadName, ops))
+            return 1;
+    } else {
+        for (auto &it : FilesInForce(fs))
+            ops.push_back({"write", std::string(it.second.FileName), it.second.FileSize});
+    }
+    if (ops.empty() || rounds <= 0) {
+        printf("nothing to replay\n");
+        return 1;
+    }
+
+    std::vector<uint8_t> data;
+    uint32_t optimizations = 0;
+    img.writes = 0;
+    img.erases = 0;
+    fs.GetIOCounters().Clear();
+    printf("%6s %8s %6s %8s %6s %6s %7s %7s\n", "round", "freemem", "deldat", "freedesc", "deldsc", "optim", "writes", "erases");
+    int step = std::max(rounds / 20, 1);
+    for (int round = 1; round <= rounds; round++) {
+        for (auto &op : ops) {
+            bool res = true;
+            if (op.Op == "write") {
+                data.assign(op.Size, (uint8_t)round);
+                res = WriteWithOptimize(fs, op.FileName, data.data(), data.size(), optimizations);
+            } else if (op.Op == "delete") {
+                res = fs.DeleteFile(op.FileName);
+            } else if (op.Op == "begin") {
+                // the same as the device storage: transaction can't be optimized in the middle
+                if (fs.GetFreeFileDescriptors() < TxMaxRecords * 2 + 2 || fs.GetFreeMemory() < img.sectorSize) {
+                    res = fs.Optimize();
+                    optimizations++;
+                }
+                res = res && fs.BeginTransaction();
+            } else if (op.Op == "commit") {
+                res = fs.CommitTransaction();
+            }
+            if (!res) {
+                printf("round %d: %s %s error\n", round, op.Op.c_str(), op.FileName.c_str());
+                PrintStatistic(fs);
+                return 1;
+            }
+        }
+        if (round % step == 0 || round == rounds)
+            PrintRound(round, fs, img, optimizations);
+    }
+
+    // 10k erase cycles of STM32L4 flash
+    uint32_t maxErases = 0;
+    for (size_t i = 0; i < img.mem.size() / img.sectorSize; i++)
+        maxErases = std::max(maxErases, fs.GetFlash().GetEraseCount(i));
+    printf("per round: %.1f flash writes %.2f erases. rounds per optimization %.1f. ",
+           (double)img.writes / rounds, (double)img.erases / rounds,
+           optimizations ? (double)rounds / optimizations : 0.0);
+    if (maxErases)
+        printf("wear out after %u rounds\n", 10000U * rounds / maxErases);
+    else
+        printf("no erases\n");
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const Layout *layout = &Layouts[0];
+    Image img;
+
+    int argi = 1;
+    for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+        if (strncmp(argv[argi], "--layout=", 9) == 0) {
+            layout = nullptr;
+            for (auto &l : Layouts)
+                if (strcmp(argv[argi] + 9, l.Name) == 0)
+                    layout = &l;
+        } else if (strncmp(argv[argi], "--sector=", 9) == 0) {
+            img.sectorSize = strtoul(argv[argi] + 9, nullptr, 0);
+        } else {
+            layout = nullptr;
+        }
+    }
+    if (layout == nullptr || img.sectorSize == 0 || argc - argi < 2) {
+        Usage();
+        return 2;
+    }
+
+    const char *imageName = argv[argi];
+    std::string cmd = argv[argi + 1];
+    char **args = &argv[argi + 2];
+    int nargs = argc - argi - 2;
+
+    if (!LoadFile(imageName, img.mem) || img.mem.empty()) {
+        printf("can't read the image `%s`\n", imageName);
+        return 1;
+    }
+    if (!InitImage(img, *layout))
+        return 1;
+
+    // mount can write too: fs header of the counter sectors. the image is written back only by the commands.
+    Stm32fs fs{img.cfg};
+    if (!fs.isValid()) {
+        printf("stm32fs is not found in the image with layout `%s` and sector %zu\n", layout->Name, img.sectorSize);
+        return 1;
+    }
+
+    int res = 2;
+    bool save = false;
+    if (cmd == "ls" && nargs == 0) {
+        res = CmdList(fs);
+    } else if (cmd == "versions" && nargs <= 1) {
+        res = CmdVersions(fs, nargs ? args[0] : nullptr);
+    } else if (cmd == "stat" && nargs == 0) {
+        res = CmdStat(fs);
+    } else if (cmd == "fsck" && nargs == 0) {
+        res = CmdFsck(img, fs);
+    } else if (cmd == "optimize" && nargs == 0) {
+        res = CmdOptimize(fs);
+        save = true;
+    } else if (cmd == "export" && nargs == 2) {
+        res = CmdExport(fs, args[0], args[1]);
+    } else if (cmd == "import" && nargs == 2) {
+        res = CmdImport(fs, args[0], args[1]);
+        save = true;
+    } else if (cmd == "replay" && (nargs == 1 || nargs == 2)) {
+        res = CmdReplay(img, fs, atoi(args[0]), (nargs == 2) ? args[1] : nullptr);
+    } else {
+        Usage();
+    }
+
+    if (res == 0 && save && !SaveFile(imageName, img.mem.data(), img.mem.size())) {
+        printf("can't write the image `%s`\n", imageName);
+        return 1;
+    }
+    return res;
+}